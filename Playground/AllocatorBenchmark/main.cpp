@@ -0,0 +1,778 @@
+#include "Allocator.h"
+#include "BuddyResource.h"
+#include "PacketAllocator.h"
+#include "Pool.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <malloc.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+
+// Replays the same allocation traces of packet buffers on each allocator and prints:
+// - NS: the latency of allocate and deallocate, average and percentiles (rdtsc)
+// - RSS: the peak resident memory that was added while the trace ran
+// - LIVE: the peak of the bytes that were allocated and not freed
+// - FRAG: the part of RSS that did not hold live bytes (free blocks, headers, rounding)
+// - the L1D and LLC misses per operation, from perf_event_open ("n/a" if not permitted)
+//
+// Each run is a forked child, so that it does not get the RSS or the malloc heap of the
+// runs before it. All pages of a block are written after it is allocated, like the NIC
+// writes a packet, otherwise they would not be in the RSS. The writes are not in the
+// latency but they are in the cache misses.
+//
+// "stress" checks ConcurrentPool<T> and BlockPool with several threads instead, and
+// exits with 1 if they lost or duplicated an object.
+//
+// Usage: ./a.out [--ops=N] [--live=N] [fixed] [mixed] [fifo] [bursty] [stress]
+
+
+struct Options
+{
+    uint32_t mNumOps = 2 * 1000 * 1000;
+    uint32_t mNumLive = 4096; // blocks, for the fixed, mixed and fifo traces
+};
+
+
+struct Op
+{
+    uint32_t mSlot;
+    uint32_t mSize; // 0: deallocate the block of mSlot
+};
+
+
+struct Trace
+{
+    std::string mName;
+    bool mFixedSize;   // the pools for one block size can run it
+    bool mCrossThread; // the ops are allocations of a producer thread, a consumer thread frees them in order
+    uint32_t mNumSlots;
+    std::vector<Op> mOps;
+};
+
+
+enum : uint32_t
+{
+    packet_size = 1536,
+    burst_size = 32,
+    page_size = 4096
+};
+
+
+// 40% small packets (ACKs), 20% medium, 30% up to the MTU and 10% jumbo frames.
+struct MixedSizes
+{
+    uint32_t operator()(std::mt19937& rng) const
+    {
+        auto percent = rng() % 100;
+        if (percent < 40) return 64 + rng() % 64;
+        if (percent < 60) return 128 + rng() % 896;
+        if (percent < 90) return 1024 + rng() % 513;
+        return 1537 + rng() % 7464;
+    }
+};
+
+
+struct FixedSizes
+{
+    uint32_t operator()(std::mt19937&) const
+    {
+        return packet_size;
+    }
+};
+
+
+// Allocates num_live blocks, then frees random blocks and allocates new ones in their place.
+template<typename Sizes>
+Trace make_random_trace(const std::string& name, const Options& options)
+{
+    Trace trace{ name, std::is_same<Sizes, FixedSizes>::value, false, options.mNumLive, {} };
+    std::mt19937 rng(1);
+    Sizes sizes;
+
+    for (auto slot = 0u; slot != options.mNumLive && trace.mOps.size() != options.mNumOps; ++slot)
+    {
+        trace.mOps.push_back(Op{ slot, sizes(rng) });
+    }
+
+    while (trace.mOps.size() + 2 <= options.mNumOps)
+    {
+        uint32_t slot = rng() % options.mNumLive;
+        trace.mOps.push_back(Op{ slot, 0 });
+        trace.mOps.push_back(Op{ slot, sizes(rng) });
+    }
+    return trace;
+}
+
+
+// Allocates a burst of blocks, then frees them in the same order, like a burst of
+// packets that is received and then transmitted.
+Trace make_bursty_trace(const Options& options)
+{
+    Trace trace{ "bursty", false, false, burst_size, {} };
+    std::mt19937 rng(1);
+    MixedSizes sizes;
+
+    while (trace.mOps.size() + 2 * burst_size <= options.mNumOps)
+    {
+        for (auto slot = 0u; slot != burst_size; ++slot)
+        {
+            trace.mOps.push_back(Op{ slot, sizes(rng) });
+        }
+        for (auto slot = 0u; slot != burst_size; ++slot)
+        {
+            trace.mOps.push_back(Op{ slot, 0 });
+        }
+    }
+    return trace;
+}
+
+
+// The producer allocates packets and passes them through a ring of num_live slots to
+// the consumer, which frees them. Like an RX thread and a worker.
+Trace make_fifo_trace(const Options& options)
+{
+    Trace trace{ "fifo", true, true, options.mNumLive, {} };
+    for (auto i = 0u; i != options.mNumOps / 2; ++i)
+    {
+        trace.mOps.push_back(Op{ i % options.mNumLive, packet_size });
+    }
+    return trace;
+}
+
+
+// BuddyResource for the sizes of packet buffers: 64 bytes to 16 KB (jumbo frames).
+struct Buddy
+{
+    void* allocate(std::size_t size)
+    {
+        return mResource.allocate(size);
+    }
+
+    void deallocate(void* data, std::size_t size)
+    {
+        mResource.deallocate(data, size);
+    }
+
+    BuddyResource mResource{256 * 1024 * 1024, 64, 16 * 1024};
+};
+
+
+using Buffer = std::unique_ptr<char[]>;
+
+
+// ConcurrentPool, bounded to the live blocks of the traces.
+struct ConcurrentBuffers : ConcurrentPool<Buffer>
+{
+    ConcurrentBuffers() : ConcurrentPool<Buffer>(4096)
+    {
+    }
+};
+
+
+// Pool<T> and ConcurrentPool<T> recycle objects, so this has a pool of buffers per size
+// class (64 bytes to 16 KB).
+template<typename Buffers>
+struct BufferPool
+{
+    enum : uint32_t { num_classes = 9 };
+
+    static uint32_t get_class(std::size_t size)
+    {
+        return size <= 64 ? 0 : 64 - __builtin_clzll(size - 1) - 6;
+    }
+
+    void* allocate(std::size_t size)
+    {
+        auto size_class = get_class(size);
+        assert(size_class < num_classes);
+        Buffer buffer = mPools[size_class].get();
+        if (!buffer)
+        {
+            buffer.reset(new char[std::size_t(64) << size_class]);
+        }
+        return buffer.release();
+    }
+
+    void deallocate(void* data, std::size_t size)
+    {
+        mPools[get_class(size)].recycle(Buffer(static_cast<char*>(data)));
+    }
+
+    std::array<Buffers, num_classes> mPools;
+};
+
+
+// Counts a hardware event in user space, for this thread and the threads it creates.
+struct PerfCounter
+{
+    PerfCounter(uint32_t type, uint64_t config)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        mFd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    PerfCounter(const PerfCounter&) = delete;
+    PerfCounter& operator=(const PerfCounter&) = delete;
+
+    ~PerfCounter()
+    {
+        if (mFd >= 0)
+        {
+            close(mFd);
+        }
+    }
+
+    void start()
+    {
+        if (mFd >= 0)
+        {
+            ioctl(mFd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(mFd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    void stop()
+    {
+        if (mFd >= 0)
+        {
+            ioctl(mFd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+
+    // -1 if the event can't be counted
+    int64_t get() const
+    {
+        uint64_t value = 0;
+        if (mFd < 0 || read(mFd, &value, sizeof(value)) != sizeof(value))
+        {
+            return -1;
+        }
+        return value;
+    }
+
+    int mFd;
+};
+
+
+struct Block
+{
+    void* mData;
+    uint32_t mSize;
+};
+
+
+static uint64_t get_cycles()
+{
+    _mm_lfence();
+    return __rdtsc();
+}
+
+
+// Writes the header and one byte per page.
+static void touch(void* data, uint32_t size)
+{
+    auto bytes = static_cast<char*>(data);
+    std::memset(bytes, 0, std::min<uint32_t>(size, 64));
+    for (uint32_t offset = page_size; offset < size; offset += page_size)
+    {
+        bytes[offset] = 0;
+    }
+    bytes[size - 1] = 0;
+}
+
+
+// VmRSS or VmHWM from /proc/self/status, in KB.
+static uint64_t get_memory_kb(const std::string& field)
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (line.compare(0, field.size() + 1, field + ":") == 0)
+        {
+            return std::stoull(line.substr(field.size() + 1));
+        }
+    }
+    return 0;
+}
+
+
+// Resets VmHWM to VmRSS.
+static void reset_peak_rss()
+{
+    std::ofstream("/proc/self/clear_refs") << "5";
+}
+
+
+static double get_ns_per_cycle()
+{
+    auto start_time = std::chrono::steady_clock::now();
+    auto start_cycles = get_cycles();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    auto cycles = get_cycles() - start_cycles;
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_time).count();
+    return double(ns) / cycles;
+}
+
+
+static double ns_per_cycle = 0;
+
+
+// Returns the peak of the live bytes.
+template<typename Alloc>
+uint64_t replay(Alloc& alloc, const Trace& trace, std::vector<uint32_t>& latencies)
+{
+    std::vector<Block> blocks(trace.mNumSlots);
+    uint64_t live_bytes = 0;
+    uint64_t peak_live_bytes = 0;
+
+    for (auto i = 0u; i != trace.mOps.size(); ++i)
+    {
+        const Op& op = trace.mOps[i];
+        Block& block = blocks[op.mSlot];
+
+        if (op.mSize != 0)
+        {
+            auto start = get_cycles();
+            block.mData = alloc.allocate(op.mSize);
+            latencies[i] = get_cycles() - start;
+
+            block.mSize = op.mSize;
+            touch(block.mData, block.mSize);
+            live_bytes += block.mSize;
+            peak_live_bytes = std::max(peak_live_bytes, live_bytes);
+        }
+        else
+        {
+            auto start = get_cycles();
+            alloc.deallocate(block.mData, block.mSize);
+            latencies[i] = get_cycles() - start;
+
+            live_bytes -= block.mSize;
+        }
+    }
+    return peak_live_bytes;
+}
+
+
+template<typename Alloc>
+uint64_t replay_fifo(Alloc& alloc, const Trace& trace, std::vector<uint32_t>& latencies)
+{
+    std::vector<std::atomic<void*>> ring(trace.mNumSlots);
+    for (auto& slot : ring)
+    {
+        slot.store(nullptr);
+    }
+
+    const auto num_allocations = trace.mOps.size();
+    std::atomic<uint64_t> freed_bytes{0};
+    uint64_t peak_live_bytes = 0;
+
+    std::thread consumer([&]
+    {
+        for (auto i = 0u; i != num_allocations; ++i)
+        {
+            const Op& op = trace.mOps[i];
+            auto& slot = ring[op.mSlot];
+            void* data;
+            while (!(data = slot.load(std::memory_order_acquire)))
+            {
+                std::this_thread::yield();
+            }
+
+            auto start = get_cycles();
+            alloc.deallocate(data, op.mSize);
+            latencies[num_allocations + i] = get_cycles() - start;
+
+            slot.store(nullptr, std::memory_order_release);
+            freed_bytes.fetch_add(op.mSize, std::memory_order_relaxed);
+        }
+    });
+
+    uint64_t allocated_bytes = 0;
+    for (auto i = 0u; i != num_allocations; ++i)
+    {
+        const Op& op = trace.mOps[i];
+        auto& slot = ring[op.mSlot];
+        while (slot.load(std::memory_order_acquire))
+        {
+            std::this_thread::yield();
+        }
+
+        auto start = get_cycles();
+        void* data = alloc.allocate(op.mSize);
+        latencies[i] = get_cycles() - start;
+
+        touch(data, op.mSize);
+        slot.store(data, std::memory_order_release);
+        allocated_bytes += op.mSize;
+        peak_live_bytes = std::max(peak_live_bytes, allocated_bytes - freed_bytes.load(std::memory_order_relaxed));
+    }
+
+    consumer.join();
+    return peak_live_bytes;
+}
+
+
+static std::string format_misses(int64_t misses, std::size_t num_ops)
+{
+    if (misses < 0)
+    {
+        return "n/a";
+    }
+    return std::to_string(int(0.5 + 100.0 * misses / num_ops) / 100.0).substr(0, 5);
+}
+
+
+template<typename Alloc>
+void run_child(const char* name, const Trace& trace)
+{
+    auto num_ops = trace.mCrossThread ? 2 * trace.mOps.size() : trace.mOps.size();
+    std::vector<uint32_t> latencies(num_ops);
+
+    PerfCounter l1d_misses(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    PerfCounter llc_misses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+
+    reset_peak_rss();
+    auto rss_before = get_memory_kb("VmRSS");
+
+    // Not destroyed, the process exits (the pools print their statistics when destroyed).
+    Alloc& alloc = *new Alloc;
+
+    l1d_misses.start();
+    llc_misses.start();
+    auto live_bytes = trace.mCrossThread ? replay_fifo(alloc, trace, latencies) : replay(alloc, trace, latencies);
+    llc_misses.stop();
+    l1d_misses.stop();
+
+    auto rss_kb = get_memory_kb("VmHWM") - rss_before;
+    auto live_kb = live_bytes / 1024;
+
+    uint64_t total_cycles = 0;
+    for (auto cycles : latencies)
+    {
+        total_cycles += cycles;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    auto get_ns = [&](double percentile)
+    {
+        auto cycles = latencies[std::min<std::size_t>(num_ops - 1, percentile * num_ops)];
+        return int(0.5 + cycles * ns_per_cycle);
+    };
+
+    std::cout << std::setw(7) << std::left << trace.mName
+              << std::setw(30) << std::left << name
+              << " NS: AVG=" << std::setw(6) << std::left << int(0.5 + 10 * total_cycles * ns_per_cycle / num_ops) / 10.0
+              << " P50=" << std::setw(4) << std::left << get_ns(0.5)
+              << " P90=" << std::setw(4) << std::left << get_ns(0.9)
+              << " P99=" << std::setw(5) << std::left << get_ns(0.99)
+              << " P99.9=" << std::setw(6) << std::left << get_ns(0.999)
+              << " MAX=" << std::setw(8) << std::left << get_ns(1)
+              << " RSS=" << std::setw(8) << std::left << (std::to_string(rss_kb) + "KB")
+              << " LIVE=" << std::setw(8) << std::left << (std::to_string(live_kb) + "KB")
+              << " FRAG=" << std::setw(4) << std::left << (rss_kb > live_kb ? int(100 - 100.0 * live_kb / rss_kb) : 0) << "%"
+              << " L1D-MISS/OP=" << std::setw(6) << std::left << format_misses(l1d_misses.get(), num_ops)
+              << " LLC-MISS/OP=" << format_misses(llc_misses.get(), num_ops)
+              << std::endl;
+}
+
+
+template<typename Alloc>
+void run(const char* name, const Trace& trace)
+{
+    // The child would reuse the free memory of the parent's heap without adding it to the RSS.
+    malloc_trim(0);
+    std::cout.flush();
+
+    auto pid = fork();
+    if (pid == 0)
+    {
+        run_child<Alloc>(name, trace);
+        std::cout.flush();
+        _exit(0);
+    }
+
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        std::cout << std::setw(7) << std::left << trace.mName << std::setw(30) << std::left << name << " FAILED" << std::endl;
+    }
+}
+
+
+void run(const Trace& trace)
+{
+    if (trace.mCrossThread)
+    {
+        run<Malloc>("malloc", trace);
+        run<WithMutex<SimplePool>>("WithMutex<SimplePool>", trace);
+        run<WithMutex<SmallObjectPool>>("WithMutex<SmallObjectPool>", trace);
+        run<WithMutex<FlexiblePool>>("WithMutex<FlexiblePool>", trace);
+        run<WithThreadCache<FlexiblePool>>("WithThreadCache<FlexiblePool>", trace);
+        run<WithMutex<Buddy>>("WithMutex<BuddyResource>", trace);
+        run<WithMutex<BufferPool<Pool<Buffer>>>>("WithMutex<Pool<T>>", trace);
+        run<BufferPool<ConcurrentBuffers>>("ConcurrentPool<T>", trace);
+    }
+    else
+    {
+        run<Malloc>("malloc", trace);
+        if (trace.mFixedSize)
+        {
+            run<SimplePool>("SimplePool", trace);
+            run<SmallObjectPool>("SmallObjectPool", trace);
+        }
+        run<FlexiblePool>("FlexiblePool", trace);
+        run<Buddy>("BuddyResource", trace);
+        run<BufferPool<Pool<Buffer>>>("Pool<T>", trace);
+        run<BufferPool<ConcurrentBuffers>>("ConcurrentPool<T>", trace);
+    }
+    std::cout << std::endl;
+}
+
+
+// Producers recycle numbered objects into a small ConcurrentPool while consumers get
+// them. Each object must come out exactly once, or be destroyed by a full pool.
+static bool stress_concurrent_pool(OverflowPolicy overflow_policy, const char* name)
+{
+    enum : uint32_t
+    {
+        capacity = 16,
+        num_producers = 3,
+        num_consumers = 2,
+        objects_per_producer = 200 * 1000
+    };
+
+    ConcurrentPool<std::unique_ptr<uint64_t>> pool(capacity, overflow_policy);
+    std::atomic<uint64_t> received_sum{0};
+    std::atomic<uint64_t> destroyed_sum{0};
+    std::atomic<uint32_t> num_done{0}; // received or destroyed
+    const uint32_t num_objects = num_producers * objects_per_producer;
+
+    std::vector<std::thread> threads;
+    for (auto producer = 0u; producer != num_producers; ++producer)
+    {
+        threads.emplace_back([&, producer]
+        {
+            for (auto i = 0u; i != objects_per_producer; ++i)
+            {
+                uint64_t value = producer * objects_per_producer + i;
+                if (!pool.recycle(std::unique_ptr<uint64_t>(new uint64_t(value))))
+                {
+                    destroyed_sum.fetch_add(value, std::memory_order_relaxed);
+                    num_done.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        });
+    }
+
+    for (auto consumer = 0u; consumer != num_consumers; ++consumer)
+    {
+        threads.emplace_back([&]
+        {
+            std::unique_ptr<uint64_t> object;
+            while (num_done.load(std::memory_order_relaxed) != num_objects)
+            {
+                if (pool.get(object))
+                {
+                    received_sum.fetch_add(*object, std::memory_order_relaxed);
+                    num_done.fetch_add(1, std::memory_order_relaxed);
+                    object.reset();
+                }
+                else
+                {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    const uint64_t expected_sum = uint64_t(num_objects) * (num_objects - 1) / 2;
+    bool ok = received_sum + destroyed_sum == expected_sum && !pool.get();
+    std::cout << std::setw(44) << std::left << name << (ok ? "OK" : "FAILED") << std::endl;
+    return ok;
+}
+
+
+// Each thread allocates blocks of a small BlockPool, fills them with its number and swaps
+// them into random slots. It frees the block that it took out, which another thread
+// allocated, after checking that no other thread wrote to it meanwhile.
+static bool stress_block_pool()
+{
+    enum : uint32_t
+    {
+        block_size = 256,
+        capacity = 64,
+        num_slots = 32,
+        num_threads = 4,
+        blocks_per_thread = 200 * 1000
+    };
+
+    BlockPool pool(block_size, capacity);
+    std::vector<std::atomic<uint8_t*>> slots(num_slots);
+    for (auto& slot : slots)
+    {
+        slot.store(nullptr);
+    }
+
+    // The size is part of the block, deallocate needs it for the blocks from operator new.
+    auto is_intact = [](const uint8_t* block)
+    {
+        auto size = block[0] ? 2 * block_size : block_size;
+        return std::all_of(block + 1, block + size, [&](uint8_t b) { return b == block[1]; });
+    };
+
+    std::atomic<bool> ok{true};
+    std::vector<std::thread> threads;
+    for (auto thread_index = 0u; thread_index != num_threads; ++thread_index)
+    {
+        threads.emplace_back([&, thread_index]
+        {
+            std::mt19937 rng(thread_index);
+            for (auto i = 0u; i != blocks_per_thread; ++i)
+            {
+                const bool large = i % 16 == 0;
+                const auto size = large ? 2 * block_size : block_size;
+                auto block = static_cast<uint8_t*>(pool.allocate(size));
+                block[0] = large;
+                std::memset(block + 1, thread_index + 1, size - 1);
+
+                block = slots[rng() % num_slots].exchange(block, std::memory_order_acq_rel);
+                if (block)
+                {
+                    if (!is_intact(block))
+                    {
+                        ok = false;
+                    }
+                    pool.deallocate(block, block[0] ? 2 * block_size : block_size);
+                }
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    for (auto& slot : slots)
+    {
+        if (auto block = slot.load())
+        {
+            if (!is_intact(block))
+            {
+                ok = false;
+            }
+            pool.deallocate(block, block[0] ? 2 * block_size : block_size);
+        }
+    }
+
+    std::cout << std::setw(44) << std::left << "BlockPool" << (ok ? "OK" : "FAILED") << std::endl;
+    return ok;
+}
+
+
+static bool stress()
+{
+    bool ok = stress_concurrent_pool(OverflowPolicy::destroy, "ConcurrentPool<T> OverflowPolicy::destroy");
+    ok = stress_concurrent_pool(OverflowPolicy::block, "ConcurrentPool<T> OverflowPolicy::block") && ok;
+    ok = stress_block_pool() && ok;
+
+    try
+    {
+        ConcurrentPool<int> pool(0, OverflowPolicy::block);
+        std::cout << std::setw(44) << std::left << "ConcurrentPool<T> capacity 0" << "FAILED" << std::endl;
+        ok = false;
+    }
+    catch (const std::invalid_argument&)
+    {
+        std::cout << std::setw(44) << std::left << "ConcurrentPool<T> capacity 0" << "OK" << std::endl;
+    }
+    return ok;
+}
+
+
+int main(int argc, char** argv)
+{
+    Options options;
+    std::vector<std::string> trace_names;
+
+    for (auto i = 1; i != argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg.compare(0, 6, "--ops=") == 0)
+        {
+            options.mNumOps = std::stoul(arg.substr(6));
+        }
+        else if (arg.compare(0, 7, "--live=") == 0)
+        {
+            options.mNumLive = std::stoul(arg.substr(7));
+        }
+        else if (arg == "fixed" || arg == "mixed" || arg == "fifo" || arg == "bursty")
+        {
+            trace_names.push_back(arg);
+        }
+        else if (arg == "stress")
+        {
+            return stress() ? 0 : 1;
+        }
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--ops=N] [--live=N] [fixed] [mixed] [fifo] [bursty] [stress]" << std::endl;
+            return 1;
+        }
+    }
+
+    if (options.mNumOps < 2 * burst_size || options.mNumLive == 0)
+    {
+        std::cerr << "--ops must be at least " << 2 * burst_size << " and --live at least 1" << std::endl;
+        return 1;
+    }
+
+    if (trace_names.empty())
+    {
+        trace_names = { "fixed", "mixed", "fifo", "bursty" };
+    }
+
+    ns_per_cycle = get_ns_per_cycle();
+    std::cout << "OPS=" << options.mNumOps << " LIVE=" << options.mNumLive << std::endl << std::endl;
+
+    for (auto& trace_name : trace_names)
+    {
+        if (trace_name == "fixed") run(make_random_trace<FixedSizes>("fixed", options));
+        if (trace_name == "mixed") run(make_random_trace<MixedSizes>("mixed", options));
+        if (trace_name == "fifo") run(make_fifo_trace(options));
+        if (trace_name == "bursty") run(make_bursty_trace(options));
+    }
+}
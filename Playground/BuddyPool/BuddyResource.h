@@ -0,0 +1,352 @@
+#ifndef BUDDYRESOURCE_H
+#define BUDDYRESOURCE_H
+
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+#include <sys/mman.h>
+
+
+// Bitset of runtime size with summary levels on top of it: bit i of a word on
+// level l + 1 is set if word i of level l has any bit set. The lowest set bit is
+// found with one count-trailing-zeros per level.
+struct SummaryBitset
+{
+    explicit SummaryBitset(std::size_t size) : mSize(size)
+    {
+        auto num_words = size;
+        do
+        {
+            num_words = (num_words + 63) / 64;
+            mLevels.emplace_back(num_words);
+        }
+        while (num_words > 1);
+    }
+
+    std::size_t size() const
+    {
+        return mSize;
+    }
+
+    bool any() const
+    {
+        return mLevels.back()[0] != 0;
+    }
+
+    bool get(std::size_t i) const
+    {
+        assert(i < mSize);
+        return mLevels[0][i / 64] & (uint64_t(1) << (i % 64));
+    }
+
+    void set(std::size_t i)
+    {
+        assert(i < mSize);
+        for (auto& level : mLevels)
+        {
+            auto& word = level[i / 64];
+            auto was_empty = word == 0;
+            word |= uint64_t(1) << (i % 64);
+            if (!was_empty)
+            {
+                return;
+            }
+            i /= 64;
+        }
+    }
+
+    void unset(std::size_t i)
+    {
+        assert(i < mSize);
+        for (auto& level : mLevels)
+        {
+            auto& word = level[i / 64];
+            word &= ~(uint64_t(1) << (i % 64));
+            if (word != 0)
+            {
+                return;
+            }
+            i /= 64;
+        }
+    }
+
+    // Index of the lowest set bit, any() must be true.
+    std::size_t find_first() const
+    {
+        assert(any());
+        std::size_t i = 0;
+        for (auto level = mLevels.size(); level-- != 0; )
+        {
+            i = 64 * i + __builtin_ctzll(mLevels[level][i]);
+        }
+        return i;
+    }
+
+    std::size_t count() const
+    {
+        std::size_t result = 0;
+        for (auto word : mLevels[0])
+        {
+            result += __builtin_popcountll(word);
+        }
+        return result;
+    }
+
+    std::vector<std::vector<uint64_t>> mLevels; // mLevels[0] has the bits, mLevels.back() is one word
+    std::size_t mSize;
+};
+
+
+// Buddy allocator over one mmap'd arena, for buffers of variable size like jumbo frames.
+//
+// The arena is a row of blocks of max_block_size. A block of order k has the size
+// min_block_size << k and splits into two buddies of order k - 1. Each order has a
+// SummaryBitset of its free blocks, and mFreeOrders has the bit k set if order k has a
+// free block, so allocate finds the smallest free block that fits without a search.
+// deallocate merges the block with its buddy for as long as the buddy is free.
+//
+// With huge_pages the arena is mapped with MAP_HUGETLB, or with transparent huge pages
+// if no huge pages are reserved. Allocations larger than max_block_size throw
+// std::bad_alloc, like an exhausted arena. Not thread-safe, like
+// std::pmr::unsynchronized_pool_resource.
+class BuddyResource : public std::pmr::memory_resource
+{
+public:
+    explicit BuddyResource(std::size_t arena_size, std::size_t min_block_size = 64, std::size_t max_block_size = 1 << 20, bool huge_pages = false)
+    {
+        if (!is_pow2(min_block_size) || !is_pow2(max_block_size) || min_block_size < 16 || max_block_size < min_block_size)
+        {
+            throw std::invalid_argument("BuddyResource: the block sizes must be powers of two with 16 <= min_block_size <= max_block_size");
+        }
+
+        mMinShift = log2(min_block_size);
+        mMaxOrder = log2(max_block_size) - mMinShift;
+        mArenaSize = (arena_size + max_block_size - 1) / max_block_size * max_block_size;
+        if (mArenaSize == 0)
+        {
+            mArenaSize = max_block_size;
+        }
+
+        for (auto order = 0u; order <= mMaxOrder; ++order)
+        {
+            mFreeBlocks.emplace_back(mArenaSize >> (mMinShift + order));
+        }
+
+        for (auto index = 0u; index != mFreeBlocks[mMaxOrder].size(); ++index)
+        {
+            release(mMaxOrder, index);
+        }
+        mBytesFree = mArenaSize;
+
+        map_arena(huge_pages);
+    }
+
+    ~BuddyResource()
+    {
+        munmap(mMapping, mMappingSize);
+    }
+
+    BuddyResource(const BuddyResource&) = delete;
+    BuddyResource& operator=(const BuddyResource&) = delete;
+
+    std::size_t arena_size() const
+    {
+        return mArenaSize;
+    }
+
+    std::size_t min_block_size() const
+    {
+        return std::size_t(1) << mMinShift;
+    }
+
+    std::size_t max_block_size() const
+    {
+        return min_block_size() << mMaxOrder;
+    }
+
+    // True if the arena is on reserved huge pages (MAP_HUGETLB).
+    bool huge_pages() const
+    {
+        return mHugeTLB;
+    }
+
+    std::size_t bytes_free() const
+    {
+        return mBytesFree;
+    }
+
+    std::size_t largest_free_block() const
+    {
+        return mFreeOrders ? min_block_size() << (63 - __builtin_clzll(mFreeOrders)) : 0;
+    }
+
+    std::ostream& print(std::ostream& os) const
+    {
+        for (auto order = 0u; order <= mMaxOrder; ++order)
+        {
+            os << "BlockSize(" << (min_block_size() << order) << ") x " << mFreeBlocks[order].size()
+               << ": free=" << mFreeBlocks[order].count() << "\n";
+        }
+        return os;
+    }
+
+private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        auto order = get_order(bytes, alignment);
+
+        auto orders = mFreeOrders >> order;
+        if (orders == 0)
+        {
+            throw std::bad_alloc();
+        }
+
+        // Split the smallest free block that fits down to the order.
+        auto block_order = order + __builtin_ctzll(orders);
+        auto index = mFreeBlocks[block_order].find_first();
+        remove(block_order, index);
+
+        while (block_order != order)
+        {
+            --block_order;
+            index *= 2;
+            release(block_order, index + 1);
+        }
+
+        mBytesFree -= min_block_size() << order;
+        return mArena + (index << (mMinShift + order));
+    }
+
+    void do_deallocate(void* ptr, std::size_t bytes, std::size_t alignment) override
+    {
+        auto order = get_order(bytes, alignment);
+        auto offset = static_cast<std::size_t>(static_cast<char*>(ptr) - mArena);
+        assert(offset < mArenaSize);
+        assert(offset % (min_block_size() << order) == 0);
+
+        auto index = offset >> (mMinShift + order);
+        assert(!mFreeBlocks[order].get(index));
+        mBytesFree += min_block_size() << order;
+
+        while (order != mMaxOrder && mFreeBlocks[order].get(index ^ 1))
+        {
+            remove(order, index ^ 1);
+            index /= 2;
+            ++order;
+        }
+
+        release(order, index);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+
+    static bool is_pow2(std::size_t n)
+    {
+        return n != 0 && (n & (n - 1)) == 0;
+    }
+
+    static uint32_t log2(std::size_t n)
+    {
+        return 63 - __builtin_clzll(n);
+    }
+
+    uint32_t get_order(std::size_t bytes, std::size_t alignment) const
+    {
+        auto size = std::max(bytes, alignment);
+        if (size <= min_block_size())
+        {
+            return 0;
+        }
+
+        auto order = log2(size - 1) + 1 - mMinShift;
+        if (order > mMaxOrder)
+        {
+            throw std::bad_alloc();
+        }
+        return order;
+    }
+
+    void release(uint32_t order, std::size_t index)
+    {
+        mFreeBlocks[order].set(index);
+        mFreeOrders |= uint64_t(1) << order;
+    }
+
+    void remove(uint32_t order, std::size_t index)
+    {
+        auto& free_blocks = mFreeBlocks[order];
+        free_blocks.unset(index);
+        if (!free_blocks.any())
+        {
+            mFreeOrders &= ~(uint64_t(1) << order);
+        }
+    }
+
+    // Maps max_block_size more than the arena, so that the arena can start at a
+    // multiple of max_block_size and each block is aligned to its size. The pages
+    // of the unused part are never touched.
+    void map_arena(bool huge_pages)
+    {
+        enum : std::size_t { huge_page_size = 2 * 1024 * 1024 };
+
+        mMappingSize = mArenaSize + max_block_size();
+        mMapping = MAP_FAILED;
+
+        if (huge_pages)
+        {
+            mMappingSize = (mMappingSize + huge_page_size - 1) / huge_page_size * huge_page_size;
+            // Without MAP_NORESERVE, so that mmap fails instead of a SIGBUS on the first
+            // touch when there are not enough huge pages.
+            mMapping = mmap(nullptr, mMappingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            mHugeTLB = mMapping != MAP_FAILED;
+        }
+
+        if (mMapping == MAP_FAILED)
+        {
+            mMapping = mmap(nullptr, mMappingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (mMapping == MAP_FAILED)
+            {
+                throw std::bad_alloc();
+            }
+
+            if (huge_pages)
+            {
+                madvise(mMapping, mMappingSize, MADV_HUGEPAGE);
+            }
+        }
+
+        auto address = reinterpret_cast<std::uintptr_t>(mMapping);
+        auto alignment = max_block_size();
+        mArena = reinterpret_cast<char*>((address + alignment - 1) / alignment * alignment);
+    }
+
+    uint32_t mMinShift = 0;
+    uint32_t mMaxOrder = 0;
+    std::size_t mArenaSize = 0;
+    std::size_t mBytesFree = 0;
+    uint64_t mFreeOrders = 0;
+    std::vector<SummaryBitset> mFreeBlocks; // by order
+    char* mArena = nullptr;
+    void* mMapping = nullptr;
+    std::size_t mMappingSize = 0;
+    bool mHugeTLB = false;
+};
+
+
+inline std::ostream& operator<<(std::ostream& os, const BuddyResource& resource)
+{
+    return resource.print(os);
+}
+
+
+#endif // BUDDYRESOURCE_H
@@ -1,3 +1,4 @@
+#include "BuddyResource.h"
 #include <array>
 #include <cassert>
 #include <memory>
@@ -383,6 +384,7 @@ struct BuddyPool : BuddyPool<BlockSize * 2, MaxBlockSize, BlockCount / 2>
 
 
 #include <algorithm>
+#include <random>
 #include <vector>
 
 
@@ -528,4 +530,71 @@ int main()
         bp.deallocate(d, 15);
         std::cout << bp << std::endl;
     }
+
+    {
+        std::cout << "TEST BUDDY RESOURCE " << std::endl;
+        BuddyResource resource(64 * 1024 * 1024, 64, 16 * 1024, true);
+        std::cout << "arena=" << resource.arena_size() << " huge_pages=" << resource.huge_pages() << std::endl;
+
+        // Random frames of 64 to 9000 bytes, filled with their size to check that no two overlap.
+        struct Frame { char* data; std::size_t size; };
+        std::vector<Frame> frames;
+        std::mt19937 rng(1);
+        std::uniform_int_distribution<std::size_t> sizes(64, 9000);
+
+        auto check = [](const Frame& frame, char value)
+        {
+            return std::all_of(frame.data, frame.data + frame.size, [=](char c) { return c == value; });
+        };
+
+        enum { num_ops = 1000000, num_live = 4000 };
+
+        for (auto i = 0; i != num_ops; ++i)
+        {
+            if (frames.size() == num_live || (!frames.empty() && rng() % 2))
+            {
+                auto& frame = frames[rng() % frames.size()];
+                assert(check(frame, char(frame.size)));
+                resource.deallocate(frame.data, frame.size);
+                frame = frames.back();
+                frames.pop_back();
+            }
+            else
+            {
+                auto size = sizes(rng);
+                Frame frame{ static_cast<char*>(resource.allocate(size)), size };
+                std::fill(frame.data, frame.data + frame.size, char(frame.size));
+                frames.push_back(frame);
+            }
+        }
+
+        std::cout << "live=" << frames.size() << " free=" << resource.bytes_free() << " largest_free_block=" << resource.largest_free_block() << std::endl;
+        std::cout << resource << std::endl;
+
+        for (auto& frame : frames)
+        {
+            assert(check(frame, char(frame.size)));
+            resource.deallocate(frame.data, frame.size);
+        }
+
+        // Everything is merged again.
+        assert(resource.bytes_free() == resource.arena_size());
+        assert(resource.largest_free_block() == resource.max_block_size());
+
+        // As the memory of a std::pmr container.
+        std::pmr::vector<char> jumbo_frame(5000, 'x', &resource);
+        assert(resource.bytes_free() == resource.arena_size() - 8 * 1024);
+        jumbo_frame.resize(9000);
+        assert(resource.bytes_free() == resource.arena_size() - 16 * 1024);
+
+        try
+        {
+            jumbo_frame.resize(20000);
+            assert(false);
+        }
+        catch (const std::bad_alloc&)
+        {
+            // larger than max_block_size
+        }
+    }
 }
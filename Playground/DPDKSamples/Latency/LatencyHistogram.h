@@ -0,0 +1,217 @@
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+
+
+// Log-linear (HDR) bucket layout for nanosecond values. The first 256 values
+// (sub_bucket_count) are exact, each has its own bucket. Above that, each power of
+// two is split into 128 linear sub-buckets (sub_bucket_half_count), not 256, so a
+// bucket is never wider than 1/128 of its values. Values of 2^40 ns (about
+// 18 minutes) and more are clamped into the last bucket.
+struct HistogramLayout
+{
+    enum : uint32_t
+    {
+        sub_bucket_bits = 8,
+        sub_bucket_count = 1u << sub_bucket_bits,     // exact values
+        sub_bucket_half_count = sub_bucket_count / 2, // sub-buckets per power of two above those
+        max_value_bits = 40,
+        bucket_count = max_value_bits - sub_bucket_bits + 1,
+        size = (bucket_count + 1) * sub_bucket_half_count
+    };
+
+    static uint32_t index_of(uint64_t value)
+    {
+        value = std::min<uint64_t>(value, (uint64_t(1) << max_value_bits) - 1);
+
+        // The power of two the value is in, counted from the first sub_bucket_count values.
+        uint32_t bucket = 63 - __builtin_clzll(value | (sub_bucket_count - 1)) - (sub_bucket_bits - 1);
+        return bucket * sub_bucket_half_count + static_cast<uint32_t>(value >> bucket);
+    }
+
+    static uint64_t lowest_value(uint32_t index)
+    {
+        uint32_t bucket = index < sub_bucket_count ? 0 : index / sub_bucket_half_count - 1;
+        return uint64_t(index - bucket * sub_bucket_half_count) << bucket;
+    }
+
+    static uint64_t highest_value(uint32_t index)
+    {
+        return lowest_value(index + 1) - 1;
+    }
+};
+
+
+// Plain counts. Used to merge the per-lcore histograms and to compute percentiles.
+class Histogram
+{
+public:
+    Histogram()
+    {
+        mCounts.fill(0);
+    }
+
+    void add(uint32_t index, uint64_t count)
+    {
+        mCounts[index] += count;
+    }
+
+    Histogram& operator+=(const Histogram& rhs)
+    {
+        for (auto i = 0u; i != mCounts.size(); ++i)
+        {
+            mCounts[i] += rhs.mCounts[i];
+        }
+        return *this;
+    }
+
+    // For the difference between two snapshots of the same counters.
+    Histogram& operator-=(const Histogram& rhs)
+    {
+        for (auto i = 0u; i != mCounts.size(); ++i)
+        {
+            mCounts[i] -= rhs.mCounts[i];
+        }
+        return *this;
+    }
+
+    uint64_t total() const
+    {
+        uint64_t result = 0;
+        for (auto count : mCounts)
+        {
+            result += count;
+        }
+        return result;
+    }
+
+    // The highest value of the bucket that holds the given percentile (0-100).
+    uint64_t percentile(double percent) const
+    {
+        auto total_count = total();
+        if (total_count == 0)
+        {
+            return 0;
+        }
+
+        auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(percent / 100 * total_count)));
+        uint64_t seen = 0;
+        for (auto i = 0u; i != mCounts.size(); ++i)
+        {
+            seen += mCounts[i];
+            if (seen >= rank)
+            {
+                return HistogramLayout::highest_value(i);
+            }
+        }
+        return max();
+    }
+
+    // Accurate to the bucket width, like the percentiles.
+    uint64_t max() const
+    {
+        for (auto i = mCounts.size(); i != 0; --i)
+        {
+            if (mCounts[i - 1] != 0)
+            {
+                return HistogramLayout::highest_value(i - 1);
+            }
+        }
+        return 0;
+    }
+
+    double mean() const
+    {
+        double sum = 0;
+        uint64_t total_count = 0;
+        for (auto i = 0u; i != mCounts.size(); ++i)
+        {
+            if (mCounts[i] != 0)
+            {
+                // The middle of the bucket
+                sum += mCounts[i] * (HistogramLayout::lowest_value(i) + HistogramLayout::highest_value(i)) / 2.0;
+                total_count += mCounts[i];
+            }
+        }
+        return total_count ? sum / total_count : 0;
+    }
+
+    // One line per non-empty bucket, in the percentile distribution format of
+    // HdrHistogram, so that the output can be fed to its plotter. Values are in ns.
+    void print_percentiles(std::ostream& os) const
+    {
+        auto total_count = total();
+
+        os << std::setw(12) << "Value" << ' ' << std::setw(14) << "Percentile" << ' ' << std::setw(10) << "TotalCount" << ' ' << std::setw(14) << "1/(1-Percentile)" << "\n\n";
+
+        uint64_t seen = 0;
+        for (auto i = 0u; i != mCounts.size(); ++i)
+        {
+            if (mCounts[i] == 0)
+            {
+                continue;
+            }
+
+            seen += mCounts[i];
+            auto fraction = double(seen) / total_count;
+
+            os << std::setw(12) << HistogramLayout::highest_value(i) << ' '
+               << std::fixed << std::setprecision(12) << std::setw(14) << fraction << ' '
+               << std::setw(10) << seen;
+            if (seen != total_count)
+            {
+                os << ' ' << std::setprecision(2) << std::setw(14) << 1 / (1 - fraction);
+            }
+            os << '\n';
+        }
+
+        os << std::setprecision(3)
+           << "#[Mean    = " << std::setw(12) << mean() << "]\n"
+           << "#[Max     = " << std::setw(12) << max() << ", Total count    = " << std::setw(12) << total_count << "]\n"
+           << "#[Buckets = " << std::setw(12) << HistogramLayout::bucket_count << ", SubBuckets     = " << std::setw(12) << HistogramLayout::sub_bucket_count << "]\n";
+    }
+
+private:
+    std::array<uint64_t, HistogramLayout::size> mCounts;
+};
+
+
+// Written by one lcore, read by any thread. As there is a single writer, an increment
+// is a relaxed load and store, without a locked instruction. A reader may see a burst
+// partially recorded, which only matters for the interval it falls into.
+// Zeroed memory is a valid empty histogram, so it can come from rte_zmalloc.
+class LcoreHistogram
+{
+public:
+    void record(uint64_t value)
+    {
+        auto& counter = mCounts[HistogramLayout::index_of(value)];
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    void add_to(Histogram& histogram) const
+    {
+        for (auto i = 0u; i != mCounts.size(); ++i)
+        {
+            auto count = mCounts[i].load(std::memory_order_relaxed);
+            if (count != 0)
+            {
+                histogram.add(i, count);
+            }
+        }
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, HistogramLayout::size> mCounts;
+};
+
+
+#endif // LATENCYHISTOGRAM_H
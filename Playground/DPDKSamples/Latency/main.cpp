@@ -1,17 +1,18 @@
+#include "LatencyHistogram.h"
 #include <array>
-#include <chrono>
+#include <csignal>
+#include <fstream>
 #include <iostream>
 
 
-using Clock = std::chrono::system_clock;
-
-
 #include <stdint.h>
 #include <inttypes.h>
+#include <string.h>
 #include <rte_eal.h>
 #include <rte_ethdev.h>
 #include <rte_cycles.h>
 #include <rte_lcore.h>
+#include <rte_malloc.h>
 #include <rte_mbuf.h>
 
 
@@ -22,6 +23,10 @@ using Clock = std::chrono::system_clock;
 #define MBUF_CACHE_SIZE 250
 #define BURST_SIZE 4
 
+// The TX callback stores the TSC at the start of the UDP payload, so that the
+// headers stay intact on a real NIC or a pcap device.
+#define TIMESTAMP_OFFSET 42
+
 
 static rte_eth_conf get_default_por_config()
 {
@@ -37,26 +42,37 @@ static auto port_conf_default = get_default_por_config();
 static unsigned nb_ports;
 
 
-std::array<uint64_t, 1024> tx_timestamps;
-std::array<uint64_t, 1024> rx_timestamps;
-auto num_latencies = 0ul;
+// Indexed by lcore id, allocated for the enabled lcores.
+static std::array<LcoreHistogram*, RTE_MAX_LCORE> latencies;
 
+// Nanoseconds per TSC cycle as 32.32 fixed point.
+static uint64_t ns_per_cycle;
 
-inline int64_t get_timestamp()
+static volatile bool quit = false;
+
+
+static void on_signal(int)
 {
-    //return rte_rdtsc_precise() / 2.6;
-    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    quit = true;
+}
+
+
+static inline uint64_t cycles_to_ns(uint64_t cycles)
+{
+    return static_cast<uint64_t>((static_cast<unsigned __int128>(cycles) * ns_per_cycle) >> 32);
 }
 
 
 static uint16_t add_timestamps(uint8_t /*port*/, uint16_t /*qidx*/, rte_mbuf **packets, uint16_t num_packets, void*)
 {
-    uint64_t now = get_timestamp();
+    uint64_t now = rte_rdtsc_precise();
 
     for (auto i = 0u; i < num_packets; i++)
     {
-        *reinterpret_cast<uint64_t*>(static_cast<uint8_t*>(packets[i]->buf_addr) + packets[i]->data_off) = now;
-
+        if (rte_pktmbuf_data_len(packets[i]) >= TIMESTAMP_OFFSET + sizeof(now))
+        {
+            memcpy(rte_pktmbuf_mtod_offset(packets[i], uint8_t*, TIMESTAMP_OFFSET), &now, sizeof(now));
+        }
     }
 
     return num_packets;
@@ -66,24 +82,54 @@ static uint16_t add_timestamps(uint8_t /*port*/, uint16_t /*qidx*/, rte_mbuf **p
 
 static uint16_t calc_latency(uint8_t /*port*/, uint16_t /*qidx*/, rte_mbuf **packets, uint16_t num_packets, uint16_t /*max_pkts*/, void*)
 {
-    //std::cout << __FUNCTION__ << std::endl;
-    uint64_t now = get_timestamp();
+    uint64_t now = rte_rdtsc_precise();
+    auto& histogram = *latencies[rte_lcore_id()];
 
     for (auto i = 0; i != num_packets; ++i)
     {
-        tx_timestamps[num_latencies] = *reinterpret_cast<uint64_t*>(static_cast<uint8_t*>(packets[i]->buf_addr) + packets[i]->data_off);
-        rx_timestamps[num_latencies] = now;
-        num_latencies++;
+        if (rte_pktmbuf_data_len(packets[i]) < TIMESTAMP_OFFSET + sizeof(now))
+        {
+            continue;
+        }
+
+        uint64_t sent;
+        memcpy(&sent, rte_pktmbuf_mtod_offset(packets[i], uint8_t*, TIMESTAMP_OFFSET), sizeof(sent));
+
+        // The TSCs of different cores may be slightly apart.
+        histogram.record(now > sent ? cycles_to_ns(now - sent) : 0);
     }
 
+    return num_packets;
+}
+
 
-    if (num_latencies == tx_timestamps.size())
+// Merges the histograms of all lcores.
+static Histogram get_latencies()
+{
+    Histogram result;
+    unsigned lcore;
+    RTE_LCORE_FOREACH(lcore)
     {
-        std::cout << "F=" << rx_timestamps.front() << '-' << tx_timestamps.front() << '=' << rx_timestamps.front() - tx_timestamps.front() << '\n';
-        std::cout << "B=" << rx_timestamps.back () << '-' << tx_timestamps.back () << '=' << rx_timestamps.back () - tx_timestamps.back () << '\n';
-        num_latencies = 0;
-	}
-    return num_packets;
+        latencies[lcore]->add_to(result);
+    }
+    return result;
+}
+
+
+// Prints the latencies since the previous report.
+static void print_report(Histogram& previous)
+{
+    auto current = get_latencies();
+    auto interval = current;
+    interval -= previous;
+    previous = current;
+
+    std::cout << "count=" << interval.total()
+              << " p50=" << interval.percentile(50)
+              << " p99=" << interval.percentile(99)
+              << " p99.9=" << interval.percentile(99.9)
+              << " max=" << interval.max()
+              << " (ns)" << std::endl;
 }
 
 /*
@@ -148,11 +194,10 @@ static inline int port_init(uint8_t port, rte_mempool *mbuf_pool)
 }
 
 /*
- * Main thread that does the work, reading from INPUT_PORT
- * and writing to OUTPUT_PORT
+ * Main thread that does the work, forwarding the packets of each port to its
+ * neighbour (0 <-> 1, 2 <-> 3, ...). Prints the latencies once per second.
  */
-static  __attribute__((noreturn)) void
-lcore_main(void)
+static void lcore_main(void)
 {
 	uint8_t port;
 
@@ -166,19 +211,23 @@ lcore_main(void)
 
     printf("\nCore %u forwarding packets. [Ctrl+C to quit]\n", rte_lcore_id());
 
-    for (;;)
+    Histogram previous;
+    auto report_interval = rte_get_tsc_hz();
+    auto next_report = rte_rdtsc() + report_interval;
+
+    while (!quit)
     {
-        //for (port = 0; port < nb_ports; port++)
+        for (port = 0; port < nb_ports; port++)
         {
             std::array<rte_mbuf*, BURST_SIZE> bufs;
-            auto rx_burst_size = rte_eth_rx_burst(0, 0, bufs.data(), bufs.size());
+            auto rx_burst_size = rte_eth_rx_burst(port, 0, bufs.data(), bufs.size());
 
             if (unlikely(rx_burst_size == 0))
             {
 				continue;
             }
 
-            auto tx_burst_size = rte_eth_tx_burst(1, 0, bufs.data(), rx_burst_size);
+            auto tx_burst_size = rte_eth_tx_burst(port ^ 1, 0, bufs.data(), rx_burst_size);
             if (unlikely(tx_burst_size < rx_burst_size))
             {
                 for (auto buf = tx_burst_size; buf < rx_burst_size; buf++)
@@ -187,6 +236,12 @@ lcore_main(void)
                 }
 			}
 		}
+
+        if (unlikely(rte_rdtsc() >= next_report))
+        {
+            print_report(previous);
+            next_report += report_interval;
+        }
 	}
 }
 
@@ -217,6 +272,19 @@ int main(int argc, char *argv[])
 		rte_exit(EXIT_FAILURE, "Cannot create mbuf pool\n");
     }
 
+    // One histogram per lcore, on its own NUMA node
+    unsigned lcore;
+    RTE_LCORE_FOREACH(lcore)
+    {
+        latencies[lcore] = static_cast<LcoreHistogram*>(rte_zmalloc_socket("latencies", sizeof(LcoreHistogram), RTE_CACHE_LINE_SIZE, rte_lcore_to_socket_id(lcore)));
+        if (latencies[lcore] == NULL)
+        {
+            rte_exit(EXIT_FAILURE, "Cannot allocate latency histogram\n");
+        }
+    }
+
+    ns_per_cycle = (UINT64_C(1000000000) << 32) / rte_get_tsc_hz();
+
     // initialize all ports
     for (auto portid = 0u; portid < nb_ports; portid++)
     {
@@ -242,7 +310,23 @@ int main(int argc, char *argv[])
     }
     rte_eth_tx_burst(1, 0, mbufs.data(), mbufs.size());
 
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
     // call lcore_main on master core only
 	lcore_main();
+
+    // The merged histogram of the whole run, to the file given after the EAL arguments or to stdout.
+    auto total = get_latencies();
+    if (argc > 1)
+    {
+        std::ofstream file(argv[1]);
+        total.print_percentiles(file);
+    }
+    else
+    {
+        std::cout << '\n';
+        total.print_percentiles(std::cout);
+    }
 	return 0;
 }
@@ -0,0 +1,17 @@
+#!/bin/bash
+set -e
+
+[ -z "$RTE_SDK" ] && { echo "RTE_SDK not set." >&2; exit 1; }
+[ -z "$RTE_TARGET" ] && { echo "RTE_TARGET not set." >&2; exit 1; }
+
+rm -f Latency .main.o.d.tmp main.o
+./compile.sh
+
+
+# Two looped back ring ports: the packets bounce between them, each hop is measured.
+# Needs no NIC and no hugepages. The merged histogram is written to latency.hgrm on exit.
+./Latency -c 0x1 -n 1 --no-huge -m 256 --vdev=eth_ring0 --vdev=eth_ring1 -- latency.hgrm
+
+# Through a veth pair instead (ip link add lat0 type veth peer name lat1). The pcap PMD
+# needs CONFIG_RTE_LIBRTE_PMD_PCAP=y and -lrte_pmd_pcap -lpcap in compile.sh.
+#./Latency -c 0x1 -n 1 --no-huge -m 256 --vdev=eth_pcap0,iface=lat0 --vdev=eth_pcap1,iface=lat1 -- latency.hgrm
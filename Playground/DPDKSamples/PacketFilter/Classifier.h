@@ -0,0 +1,157 @@
+#ifndef CLASSIFIER_H
+#define CLASSIFIER_H
+
+
+#include "DecisionDAG.h"
+#include "PacketBurst.h"
+#include "PacketInfo.h"
+#include "ParsedFilter.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <rte_prefetch.h>
+
+
+// Counts the packets that match each filter, for one RX queue.
+// With check, every packet is also matched by both engines and by Expression::match,
+// and get_mismatches counts the packets for which they found different filters.
+class Classifier
+{
+public:
+    enum class Engine
+    {
+        linear, // Expression::match_burst of each filter over the whole burst
+        dag     // DecisionDAG of all filters, packet by packet
+    };
+
+    enum : uint32_t
+    {
+        max_burst_size = PacketBurst::capacity,
+        prefetch_distance = 4
+    };
+
+    Classifier(Engine engine, const std::vector<std::string>& filters, bool check = false) :
+        mEngine(engine),
+        mCheck(check),
+        mMatches(filters.size())
+    {
+        const bool use_dag = mEngine == Engine::dag || mCheck;
+
+        mFilters.reserve(filters.size());
+        for (auto i = 0u; i != filters.size(); ++i)
+        {
+            mFilters.push_back(ParsedFilter(filters[i]));
+            if (use_dag)
+            {
+                mDAG.add_filter(i, mFilters.back().mExpression);
+            }
+        }
+
+        if (use_dag)
+        {
+            mDAG.compile();
+        }
+    }
+
+    // Up to max_burst_size packets.
+    void classify(const uint8_t* const* data, const uint16_t* sizes, uint32_t count)
+    {
+        // Parse all headers of the burst first. The data of packet i + 4 is prefetched
+        // while packet i is parsed.
+        PacketInfo infos[max_burst_size];
+        for (auto i = 0u; i != count; ++i)
+        {
+            if (i + prefetch_distance < count)
+            {
+                rte_prefetch0(data[i + prefetch_distance]);
+            }
+            infos[i] = PacketInfo(data[i], sizes[i]);
+        }
+
+        switch (mEngine)
+        {
+            case Engine::linear:
+            {
+                // The header fields are gathered once, at the offsets of the PacketInfos,
+                // then each filter compares them for all packets at once.
+                PacketBurst burst(data, sizes, infos, count);
+                for (auto f = 0u; f != mFilters.size(); ++f)
+                {
+                    mMatches[f] += __builtin_popcountll(mFilters[f].mExpression.match_burst(burst, burst.all()));
+                }
+                break;
+            }
+            case Engine::dag:
+            {
+                for (auto i = 0u; i != count; ++i)
+                {
+                    mDAG.match(data[i], sizes[i], infos[i], mResult);
+                    for (auto filter_id : mResult)
+                    {
+                        mMatches[filter_id]++;
+                    }
+                }
+                break;
+            }
+        }
+
+        if (mCheck)
+        {
+            check(data, sizes, infos, count);
+        }
+
+        mPackets += count;
+    }
+
+    uint64_t get_packets() const { return mPackets; }
+
+    // Indexed by filter.
+    const std::vector<uint64_t>& get_matches() const { return mMatches; }
+
+    // Packets for which the engines disagree. Only counted with check.
+    uint64_t get_mismatches() const { return mMismatches; }
+
+private:
+    void check(const uint8_t* const* data, const uint16_t* sizes, const PacketInfo* infos, uint32_t count)
+    {
+        PacketBurst burst(data, sizes, infos, count);
+        mBurstMasks.resize(mFilters.size());
+        for (auto f = 0u; f != mFilters.size(); ++f)
+        {
+            mBurstMasks[f] = mFilters[f].mExpression.match_burst(burst, burst.all());
+        }
+
+        for (auto i = 0u; i != count; ++i)
+        {
+            bool mismatch = false;
+            mExpected.clear();
+            for (auto f = 0u; f != mFilters.size(); ++f)
+            {
+                bool match = mFilters[f].mExpression.match(data[i], sizes[i], infos[i]);
+                mismatch |= match != ((mBurstMasks[f] >> i) & 1);
+                if (match)
+                {
+                    mExpected.push_back(f);
+                }
+            }
+
+            mDAG.match(data[i], sizes[i], infos[i], mResult);
+            mMismatches += mismatch || mResult != mExpected;
+        }
+    }
+
+    Engine mEngine;
+    bool mCheck;
+    std::vector<ParsedFilter> mFilters;
+    DecisionDAG mDAG;
+    std::vector<uint64_t> mMatches;
+    std::vector<uint32_t> mResult;
+    std::vector<uint32_t> mExpected;
+    std::vector<uint64_t> mBurstMasks;
+    uint64_t mPackets = 0;
+    uint64_t mMismatches = 0;
+};
+
+
+#endif // CLASSIFIER_H
@@ -1,9 +1,381 @@
+#include "Classifier.h"
+#include "Packet.h"
+#include <array>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
 
 
-// Start Tx and Rx flows in parallel
-// The Rx flow uses the packet filtering
+#include <stdint.h>
+#include <inttypes.h>
+#include <rte_eal.h>
+#include <rte_ethdev.h>
+#include <rte_cycles.h>
+#include <rte_launch.h>
+#include <rte_lcore.h>
+#include <rte_mbuf.h>
 
-int main()
+
+// RX flow: rte_eth_rx_burst -> header pre-parse of the burst -> filters -> per-filter counters.
+// Each lcore polls its own RX queue of port 0 and has its own Classifier, so
+// nothing is shared between the lcores while the packets flow.
+//
+// Replays a pcap file without a NIC, one rx_pcap per lcore (each queue reads the whole file):
+//   ./PacketFilter -c 0x3 -n 1 --no-huge -m 512 --vdev=eth_pcap0,rx_pcap=in.pcap,rx_pcap=in.pcap,tx_pcap=/dev/null -- linear 1 16 256 4096
+// With --check, each packet is matched by both engines, and the run fails if they disagree.
+// The pcap for the synthetic filters can be generated with:
+//   ./PacketFilter -c 0x1 -n 1 --no-huge -m 512 -- --write-pcap in.pcap 1000000
+
+
+#define RX_RING_SIZE 512
+#define TX_RING_SIZE 512
+
+#define NUM_MBUFS 8191
+#define MBUF_CACHE_SIZE 250
+#define BURST_SIZE 32
+
+
+enum
+{
+    max_filters = 4096,
+
+    // The pcap device has no link. It is done when no packet came for this long.
+    idle_timeout_ms = 100,
+    start_timeout_ms = 2000
+};
+
+
+static_assert(BURST_SIZE <= Classifier::max_burst_size, "");
+
+
+struct LcoreResult
+{
+    uint64_t packets = 0;
+    uint64_t cycles = 0;          // from the first to the last packet
+    uint64_t classify_cycles = 0; // pre-parse and filters only
+};
+
+
+// The DAG matched filters that Expression::match rejects before the merged terms were
+// checked for conflicting fields, so the linear engine is the reference.
+static Classifier::Engine engine = Classifier::Engine::linear;
+static bool check = false;
+static std::array<std::unique_ptr<Classifier>, RTE_MAX_LCORE> classifiers;
+static std::array<LcoreResult, RTE_MAX_LCORE> results;
+static std::array<uint16_t, RTE_MAX_LCORE> queue_ids;
+
+
+// Same flows as the PacketProcessing benchmarks: flow i has the ports 1001 + i and 2001 + i.
+static std::vector<std::string> get_filters(uint32_t num_filters)
+{
+    std::vector<std::string> result;
+    for (auto i = 0u; i != num_filters; ++i)
+    {
+        result.push_back(BPFFilter::generate_bpf_filter_string(ProtocolId::TCP, IPv4Address(192, 168, 1, 1), IPv4Address(192, 168, 1, 2), 1001 + i, 2001 + i));
+    }
+    return result;
+}
+
+
+// Writes packets of the max_filters flows, round robin, as a pcap file.
+static void write_pcap(const std::string& file, uint32_t num_packets)
+{
+    std::ofstream os(file, std::ios::binary);
+
+    pcap_file_header header;
+    header.magic = 0xa1b2c3d4;
+    header.version_major = PCAP_VERSION_MAJOR;
+    header.version_minor = PCAP_VERSION_MINOR;
+    header.thiszone = 0;
+    header.sigfigs = 0;
+    header.snaplen = 65535;
+    header.linktype = 1;
+    os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    const uint32_t frame_size = 64 - 4; // without the CRC
+
+    for (auto i = 0u; i != num_packets; ++i)
+    {
+        auto flow = i % max_filters;
+        Packet packet(ProtocolId::TCP, IPv4Address(192, 168, 1, 1), IPv4Address(192, 168, 1, 2), 1001 + flow, 2001 + flow);
+
+        uint32_t record[4] = { i / 1000000, i % 1000000, frame_size, frame_size };
+        os.write(reinterpret_cast<const char*>(record), sizeof(record));
+        os.write(reinterpret_cast<const char*>(packet.data()), frame_size);
+    }
+
+    if (!os)
+    {
+        rte_exit(EXIT_FAILURE, "Cannot write %s\n", file.c_str());
+    }
+}
+
+
+static int port_init(uint8_t port, uint16_t rx_rings, rte_mempool *mbuf_pool)
+{
+    rte_eth_dev_info info;
+    rte_eth_dev_info_get(port, &info);
+    if (info.max_rx_queues < rx_rings)
+    {
+        printf("Port %u has %u RX queues, one per lcore (%u) is needed. For eth_pcap, repeat rx_pcap.\n", (unsigned)port, (unsigned)info.max_rx_queues, (unsigned)rx_rings);
+        return -1;
+    }
+
+    auto port_conf = rte_eth_conf();
+    port_conf.rxmode.max_rx_pkt_len = ETHER_MAX_LEN;
+
+    auto retval = rte_eth_dev_configure(port, rx_rings, 1, &port_conf);
+    if (retval != 0)
+    {
+        return retval;
+    }
+
+    for (auto q = 0; q < rx_rings; q++)
+    {
+        retval = rte_eth_rx_queue_setup(port, q, RX_RING_SIZE, rte_eth_dev_socket_id(port), NULL, mbuf_pool);
+        if (retval < 0)
+        {
+            return retval;
+        }
+    }
+
+    retval = rte_eth_tx_queue_setup(port, 0, TX_RING_SIZE, rte_eth_dev_socket_id(port), NULL);
+    if (retval < 0)
+    {
+        return retval;
+    }
+
+    rte_eth_promiscuous_enable(port);
+    return 0;
+}
+
+
+static int lcore_rx(void*)
+{
+    const uint8_t port = 0;
+    auto lcore = rte_lcore_id();
+    auto queue = queue_ids[lcore];
+    auto& classifier = *classifiers[lcore];
+
+    // Kept local, results of the lcores share cache lines.
+    uint64_t packets = 0;
+    uint64_t classify_cycles = 0;
+
+    auto hz = rte_get_tsc_hz();
+    auto start = rte_rdtsc();
+    uint64_t first = 0;
+    uint64_t last = 0;
+
+    std::array<rte_mbuf*, BURST_SIZE> bufs;
+    std::array<const uint8_t*, BURST_SIZE> data;
+    std::array<uint16_t, BURST_SIZE> sizes;
+
+    for (;;)
+    {
+        auto n = rte_eth_rx_burst(port, queue, bufs.data(), bufs.size());
+        auto now = rte_rdtsc();
+
+        if (unlikely(n == 0))
+        {
+            if (last != 0 ? now - last > hz * idle_timeout_ms / 1000 : now - start > hz * start_timeout_ms / 1000)
+            {
+                break;
+            }
+            continue;
+        }
+
+        if (unlikely(first == 0))
+        {
+            first = now;
+        }
+
+        for (auto i = 0u; i != n; ++i)
+        {
+            data[i] = rte_pktmbuf_mtod(bufs[i], const uint8_t*);
+            sizes[i] = rte_pktmbuf_data_len(bufs[i]);
+        }
+
+        classifier.classify(data.data(), sizes.data(), n);
+
+        for (auto i = 0u; i != n; ++i)
+        {
+            rte_pktmbuf_free(bufs[i]);
+        }
+
+        last = rte_rdtsc();
+        classify_cycles += last - now;
+        packets += n;
+    }
+
+    auto& result = results[lcore];
+    result.packets = packets;
+    result.cycles = last - first;
+    result.classify_cycles = classify_cycles;
+    return 0;
+}
+
+
+// Replays the port once with the given number of filters.
+static void run(uint32_t num_filters)
+{
+    auto filters = get_filters(num_filters);
+
+    unsigned lcore;
+    RTE_LCORE_FOREACH(lcore)
+    {
+        classifiers[lcore].reset(new Classifier(engine, filters, check));
+        results[lcore] = LcoreResult();
+    }
+
+    // Restarting the pcap device reopens the rx_pcap files, so each run sees the same packets.
+    if (rte_eth_dev_start(0) < 0)
+    {
+        rte_exit(EXIT_FAILURE, "Cannot start port 0\n");
+    }
+
+    rte_eal_mp_remote_launch(lcore_rx, NULL, CALL_MASTER);
+    rte_eal_mp_wait_lcore();
+
+    rte_eth_dev_stop(0);
+
+    auto hz = double(rte_get_tsc_hz());
+    uint64_t total_packets = 0;
+    uint64_t total_mismatches = 0;
+    std::vector<uint64_t> total_matches(num_filters);
+
+    RTE_LCORE_FOREACH(lcore)
+    {
+        const auto& result = results[lcore];
+        total_packets += result.packets;
+        total_mismatches += classifiers[lcore]->get_mismatches();
+
+        const auto& matches = classifiers[lcore]->get_matches();
+        for (auto i = 0u; i != num_filters; ++i)
+        {
+            total_matches[i] += matches[i];
+        }
+
+        std::cout << "Filters=" << std::setw(4) << std::left << num_filters
+                  << " Lcore=" << std::setw(3) << lcore
+                  << " Packets=" << std::setw(10) << result.packets
+                  << " Mpps=" << std::setw(8) << (result.cycles ? result.packets * hz / result.cycles / 1e6 : 0)
+                  << " Classify-Mpps=" << std::setw(8) << (result.classify_cycles ? result.packets * hz / result.classify_cycles / 1e6 : 0)
+                  << std::endl;
+    }
+
+    uint64_t matched = 0;
+    for (auto count : total_matches)
+    {
+        matched += count;
+    }
+
+    std::cout << "Filters=" << std::setw(4) << std::left << num_filters
+              << " Matches=" << matched << '/' << total_packets
+              << " (filter 0: " << total_matches[0] << ')' << std::endl;
+
+    if (check)
+    {
+        std::cout << "Filters=" << std::setw(4) << std::left << num_filters
+                  << " Mismatches=" << total_mismatches << '/' << total_packets << std::endl;
+        if (total_mismatches != 0)
+        {
+            rte_exit(EXIT_FAILURE, "The dag and linear engines disagree on %" PRIu64 " packets\n", total_mismatches);
+        }
+    }
+}
+
+
+/* Main function, does initialisation and calls the per-lcore functions */
+int main(int argc, char *argv[])
 {
-    // HELLO WORLD
+    /* init EAL */
+    int ret = rte_eal_init(argc, argv);
+
+    if (ret < 0)
+    {
+        rte_exit(EXIT_FAILURE, "Error with EAL initialization\n");
+    }
+
+    argc -= ret;
+    argv += ret;
+
+    // Application arguments, after "--":
+    //   [--check] [dag|linear] [number of filters...]
+    //   --write-pcap file number_of_packets
+    std::vector<std::string> args(argv + 1, argv + argc);
+
+    if (!args.empty() && args[0] == "--write-pcap")
+    {
+        if (args.size() != 3)
+        {
+            rte_exit(EXIT_FAILURE, "Usage: --write-pcap file number_of_packets\n");
+        }
+        write_pcap(args[1], std::stoul(args[2]));
+        return 0;
+    }
+
+    if (!args.empty() && args[0] == "--check")
+    {
+        check = true;
+        args.erase(args.begin());
+    }
+
+    if (!args.empty() && (args[0] == "dag" || args[0] == "linear"))
+    {
+        engine = args[0] == "dag" ? Classifier::Engine::dag : Classifier::Engine::linear;
+        args.erase(args.begin());
+    }
+
+    std::vector<uint32_t> filter_counts;
+    for (auto& arg : args)
+    {
+        auto count = std::stoul(arg);
+        if (count == 0 || count > max_filters)
+        {
+            rte_exit(EXIT_FAILURE, "Invalid number of filters: %s\n", arg.c_str());
+        }
+        filter_counts.push_back(count);
+    }
+
+    if (filter_counts.empty())
+    {
+        filter_counts = { 1, 16, 256, 4096 };
+    }
+
+    if (rte_eth_dev_count() < 1)
+    {
+        rte_exit(EXIT_FAILURE, "Error: no port (use --vdev=eth_pcap0,rx_pcap=...)\n");
+    }
+
+    // One RX queue per lcore, the master included
+    uint16_t num_queues = 0;
+    unsigned lcore;
+    RTE_LCORE_FOREACH(lcore)
+    {
+        queue_ids[lcore] = num_queues++;
+    }
+
+    auto mbuf_pool = rte_pktmbuf_pool_create("MBUF_POOL", NUM_MBUFS, MBUF_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
+    if (mbuf_pool == NULL)
+    {
+        rte_exit(EXIT_FAILURE, "Cannot create mbuf pool\n");
+    }
+
+    if (port_init(0, num_queues, mbuf_pool) != 0)
+    {
+        rte_exit(EXIT_FAILURE, "Cannot init port 0\n");
+    }
+
+    std::cout << "Engine=" << (engine == Classifier::Engine::dag ? "dag" : "linear") << (check ? " (checked)" : "") << " Lcores=" << num_queues << std::endl;
+
+    for (auto num_filters : filter_counts)
+    {
+        run(num_filters);
+    }
+
+    return 0;
 }
@@ -6,6 +6,7 @@
 #include <iostream>
 #include <iomanip>
 #include <sstream>
+#include <string>
 #include <vector>
 #include <thread>
 #include <future>
@@ -49,10 +50,37 @@ enum
     num_rx_queues = 1,
     num_tx_queues = 4,
     num_mbufs = 1024,
-    mbuf_cache_size = 512
+    mbuf_cache_size = 512,
+    num_flows = 64,
+    burst_size = 32,
+    udp_header_end = 42, // Ethernet, IPv4 and UDP header
+    packet_header_size = udp_header_end + 2 * sizeof(uint64_t) // plus sequence number and timestamp
 };
 
 
+enum class TxMode
+{
+    copy,     // allocates an mbuf per packet and copies the whole packet into it
+    clone,    // sends pre-built template mbufs, taking a reference per packet
+    header    // a small per-packet mbuf with the headers, sequence number and timestamp, chained to a template payload
+};
+
+
+static TxMode tx_mode = TxMode::copy;
+
+
+static const char* get_tx_mode_name(TxMode mode)
+{
+    switch (mode)
+    {
+        case TxMode::copy: return "copy";
+        case TxMode::clone: return "template";
+        case TxMode::header: return "header";
+    }
+    return "";
+}
+
+
 /*
  * RX and TX Prefetch, Host, and Write-back threshold values should be
  * carefully set for optimal performance. Consult the network
@@ -88,16 +116,18 @@ Counters counters[num_ports][num_tx_queues];
 
 struct core_conf
 {
-    core_conf(int port_id, int queue_id, rte_mempool* pool) :
+    core_conf(int port_id, int queue_id, rte_mempool* pool, rte_mempool* header_pool = nullptr) :
         port_id(port_id),
         queue_id(queue_id),
-        pool(pool)
+        pool(pool),
+        header_pool(header_pool)
     {
     }
 
     int port_id;
     int queue_id;
     rte_mempool* pool;
+    rte_mempool* header_pool; // for TxMode::header
 };
 
 
@@ -144,33 +174,22 @@ static inline int local_rte_pktmbuf_alloc_bulk(struct rte_mempool *pool, struct
 
 
 
-/*
- * Main thread that does the work, reading from INPUT_PORT
- * and writing to OUTPUT_PORT
- */
-std::atomic<int> tx_cores_started{0};
-static int tx_core(void* p)
+static void send_burst(const core_conf& conf, rte_mbuf** data, uint16_t size)
 {
-    auto conf = *static_cast<core_conf*>(p);
-    for (auto i = 0u; i < num_ports; i++)
+    while (size > 0)
     {
-        if (rte_eth_dev_socket_id(i) > 0 && rte_eth_dev_socket_id(i) != (int)rte_socket_id())
-        {
-            Log() << "WARNING, port " << i << " is on remote NUMA node to polling thread.\n\tPerformance will not be optimal.";
-        }
+        auto n = rte_eth_tx_burst(conf.port_id, conf.queue_id, data, size);
+        size -= n;
+        data += n;
+        counters[conf.port_id][conf.queue_id].tx += n;
     }
+}
 
-    Log() << "TX Core: Port=" << conf.port_id << " Queue=" << conf.queue_id << " Core=" << rte_lcore_id() << ": Forwarding packets.";
-
-    std::vector<uint8_t> udp_packet = { 0x00, 0xff, 0x23, 0x00, 0x00, 0x20, 0x00, 0xff, 0x23, 0x00, 0x00, 0x10, 0x08, 0x00, 0x45, 0x00, 0x00, 0x32, 0x5f, 0x8f, 0x00, 0x00, 0x40, 0x11, 0x17, 0x0d, 0x01, 0x01, 0x01, 0x0a, 0x01, 0x01, 0x01, 0x14, 0x03, 0xf2, 0x03, 0xfc, 0x00, 0x1e, 0xf3, 0xa4, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
-    enum {  udp_packet_size = packet_size - 4 };
-    udp_packet.resize(udp_packet_size);
-
-
-    tx_cores_started++;
-    while (tx_cores_started < num_tx_queues) {}
 
+static void tx_copy(const core_conf& conf, const std::vector<uint8_t>& udp_packet)
+{
     rte_mempool* pool = conf.pool;
+    auto udp_packet_size = udp_packet.size();
 
     for (;;)
     {
@@ -179,7 +198,7 @@ static int tx_core(void* p)
 
         while (0 != local_rte_pktmbuf_alloc_bulk(pool, mbufs.data(), size))
         {
-            if (size > 32)
+            if (size > burst_size)
             {
                 size = size / 2;
             }
@@ -194,24 +213,156 @@ static int tx_core(void* p)
         while (size != 0)
         {
             assert(size <= mbufs.size());
-            for (auto i = 0; i != 32; ++i)
+            for (auto i = 0; i != burst_size; ++i)
             {
                 auto& mbuf = data[i];
                 auto payload_buffer = rte_pktmbuf_append(mbuf, udp_packet_size);
                 memcpy(payload_buffer, udp_packet.data(), udp_packet_size);
             }
 
-            auto burst_size = 32;
-            while (burst_size > 0)
-            {
-                auto n = rte_eth_tx_burst(conf.port_id, conf.queue_id, data, burst_size);
-                burst_size -= n;
-                data += n;
-                counters[conf.port_id][conf.queue_id].tx += n;
-            }
+            send_burst(conf, data, burst_size);
+            data += burst_size;
+            size -= burst_size;
+        }
+    }
+}
 
-            size -= 32;
+
+// One packet per flow: the flows differ in the UDP source port.
+static std::vector<std::vector<uint8_t>> get_flow_packets(const std::vector<uint8_t>& udp_packet)
+{
+    std::vector<std::vector<uint8_t>> result(num_flows, udp_packet);
+    for (auto flow = 0u; flow != num_flows; ++flow)
+    {
+        uint16_t source_port = 1010 + flow;
+        result[flow][34] = source_port >> 8;
+        result[flow][35] = source_port & 0xff;
+    }
+    return result;
+}
+
+
+// Builds an mbuf per flow holding the flow packet from the given offset on.
+// The templates are never freed: each one keeps a reference of its own, a
+// transmission takes another one and the PMD drops it when it is done.
+static std::vector<rte_mbuf*> get_templates(rte_mempool* pool, const std::vector<std::vector<uint8_t>>& flow_packets, uint16_t offset)
+{
+    std::vector<rte_mbuf*> result;
+    for (auto& packet : flow_packets)
+    {
+        auto mbuf = rte_pktmbuf_alloc(pool);
+        auto size = packet.size() - offset;
+        auto buffer = mbuf ? rte_pktmbuf_append(mbuf, size) : NULL;
+        if (buffer == NULL)
+        {
+            rte_exit(EXIT_FAILURE, "Cannot allocate template mbuf\n");
         }
+        memcpy(buffer, packet.data() + offset, size);
+        result.push_back(mbuf);
+    }
+    return result;
+}
+
+
+// Only touches the mbuf headers, for the reference counts.
+static void tx_template(const core_conf& conf, const std::vector<rte_mbuf*>& templates)
+{
+    std::array<rte_mbuf*, burst_size> burst;
+    auto flow = 0u;
+
+    for (;;)
+    {
+        for (auto& mbuf : burst)
+        {
+            mbuf = templates[flow];
+            rte_mbuf_refcnt_update(mbuf, 1);
+            flow = (flow + 1) % num_flows;
+        }
+
+        send_burst(conf, burst.data(), burst.size());
+    }
+}
+
+
+// Writes packet_header_size bytes per packet. The payload segment is shared, so the
+// PMD must support multi-segment packets.
+static void tx_header(const core_conf& conf, const std::vector<std::vector<uint8_t>>& flow_packets, const std::vector<rte_mbuf*>& payloads)
+{
+    std::array<rte_mbuf*, burst_size> burst;
+    auto flow = 0u;
+    uint64_t sequence = 0;
+
+    for (;;)
+    {
+        while (0 != local_rte_pktmbuf_alloc_bulk(conf.header_pool, burst.data(), burst.size()))
+        {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(1));
+        }
+
+        uint64_t now = rte_rdtsc();
+
+        for (auto header : burst)
+        {
+            auto buffer = rte_pktmbuf_append(header, packet_header_size);
+            memcpy(buffer, flow_packets[flow].data(), udp_header_end);
+            memcpy(buffer + udp_header_end, &sequence, sizeof(sequence));
+            memcpy(buffer + udp_header_end + sizeof(sequence), &now, sizeof(now));
+
+            auto payload = payloads[flow];
+            rte_mbuf_refcnt_update(payload, 1);
+            header->next = payload;
+            header->nb_segs = 2;
+            header->pkt_len += payload->data_len;
+
+            ++sequence;
+            flow = (flow + 1) % num_flows;
+        }
+
+        send_burst(conf, burst.data(), burst.size());
+    }
+}
+
+
+/*
+ * Main thread that does the work, reading from INPUT_PORT
+ * and writing to OUTPUT_PORT
+ */
+std::atomic<int> tx_cores_started{0};
+static int tx_core(void* p)
+{
+    auto conf = *static_cast<core_conf*>(p);
+    for (auto i = 0u; i < num_ports; i++)
+    {
+        if (rte_eth_dev_socket_id(i) > 0 && rte_eth_dev_socket_id(i) != (int)rte_socket_id())
+        {
+            Log() << "WARNING, port " << i << " is on remote NUMA node to polling thread.\n\tPerformance will not be optimal.";
+        }
+    }
+
+    Log() << "TX Core: Port=" << conf.port_id << " Queue=" << conf.queue_id << " Core=" << rte_lcore_id() << " Mode=" << get_tx_mode_name(tx_mode) << ": Forwarding packets.";
+
+    std::vector<uint8_t> udp_packet = { 0x00, 0xff, 0x23, 0x00, 0x00, 0x20, 0x00, 0xff, 0x23, 0x00, 0x00, 0x10, 0x08, 0x00, 0x45, 0x00, 0x00, 0x32, 0x5f, 0x8f, 0x00, 0x00, 0x40, 0x11, 0x17, 0x0d, 0x01, 0x01, 0x01, 0x0a, 0x01, 0x01, 0x01, 0x14, 0x03, 0xf2, 0x03, 0xfc, 0x00, 0x1e, 0xf3, 0xa4, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    enum {  udp_packet_size = packet_size - 4 };
+    udp_packet.resize(udp_packet_size);
+
+    auto flow_packets = get_flow_packets(udp_packet);
+    std::vector<rte_mbuf*> templates;
+    switch (tx_mode)
+    {
+        case TxMode::copy: break;
+        case TxMode::clone: templates = get_templates(conf.pool, flow_packets, 0); break;
+        case TxMode::header: templates = get_templates(conf.pool, flow_packets, packet_header_size); break;
+    }
+
+
+    tx_cores_started++;
+    while (tx_cores_started < num_tx_queues) {}
+
+    switch (tx_mode)
+    {
+        case TxMode::copy: tx_copy(conf, udp_packet); break;
+        case TxMode::clone: tx_template(conf, templates); break;
+        case TxMode::header: tx_header(conf, flow_packets, templates); break;
     }
 
     return 0;
@@ -366,6 +517,28 @@ int main(int argc, char *argv[])
     argc -= ret;
     argv += ret;
 
+    // Application arguments, after "--": copy, template or header
+    if (argc > 1)
+    {
+        std::string mode = argv[1];
+        if (mode == "copy")
+        {
+            tx_mode = TxMode::copy;
+        }
+        else if (mode == "template")
+        {
+            tx_mode = TxMode::clone;
+        }
+        else if (mode == "header")
+        {
+            tx_mode = TxMode::header;
+        }
+        else
+        {
+            rte_exit(EXIT_FAILURE, "Invalid mode: %s (expected copy, template or header)\n", argv[1]);
+        }
+    }
+
     Log() << "rte_eth_dev_count=" << (int)rte_eth_dev_count();
 
     assert(num_ports == rte_eth_dev_count());
@@ -413,7 +586,20 @@ int main(int argc, char *argv[])
         for (auto queue_id = 0; queue_id != num_tx_queues; ++queue_id)
         {
             auto pool = rte_pktmbuf_pool_create(std::to_string(queue_id).c_str(), num_mbufs, mbuf_cache_size, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
-            rte_eal_remote_launch(&tx_core, new core_conf(0, queue_id, pool), core_id++);
+
+            rte_mempool* header_pool = nullptr;
+            if (tx_mode == TxMode::header)
+            {
+                auto name = std::to_string(queue_id) + ".header";
+                header_pool = rte_pktmbuf_pool_create(name.c_str(), num_mbufs, mbuf_cache_size, 0, RTE_PKTMBUF_HEADROOM + packet_header_size, rte_socket_id());
+            }
+
+            if (pool == NULL || (tx_mode == TxMode::header && header_pool == NULL))
+            {
+                rte_exit(EXIT_FAILURE, "Cannot create TX mbuf pool\n");
+            }
+
+            rte_eal_remote_launch(&tx_core, new core_conf(0, queue_id, pool, header_pool), core_id++);
         }
     }
 
@@ -421,9 +607,17 @@ int main(int argc, char *argv[])
 
     while (tx_cores_started < num_tx_queues) {}
 
+    // The TX cores never wait, so all their cycles go to the packets.
+    auto last_tsc = rte_rdtsc();
+
     for (;;)
     {
         std::this_thread::sleep_for(std::chrono::seconds(4));
+
+        auto tsc = rte_rdtsc();
+        auto elapsed_cycles = tsc - last_tsc;
+        last_tsc = tsc;
+
         for (auto port_id = 0u; port_id != num_ports; ++port_id)
         {
             uint64_t rx = 0;
@@ -431,9 +625,12 @@ int main(int argc, char *argv[])
 
             for (auto queue_id = 0u; queue_id != num_tx_queues; ++queue_id)
             {
-                rx += counters[port_id][queue_id].tx.exchange(0);
+                rx += counters[port_id][queue_id].rx.exchange(0);
                 tx += counters[port_id][queue_id].tx.exchange(0);
             }
+
+            auto cycles_per_packet = tx > 0 ? double(elapsed_cycles) * num_tx_queues / tx : 0;
+
             rx /= 4;
             tx /= 4;
 
@@ -444,6 +641,7 @@ int main(int argc, char *argv[])
                 if (tx > 0)
                 {
                     std::cout << " TX: PPS=" << std::left << tx << " " << (tx * 8 * (packet_size + 20) / 1e9) << "Gbps";
+                    std::cout << " Mode=" << get_tx_mode_name(tx_mode) << " Cycles/packet=" << cycles_per_packet;
                 }
                 if (rx > 0)
                 {
@@ -25,6 +25,9 @@ make
 
 #./Transmit -m 4096 "$@"
 
+# Without a NIC, for the cycles per packet of the TX modes (copy, template or header):
+#./Transmit -c 0xf01 -n 1 --no-huge -m 512 --vdev=eth_null0,size=1276 --vdev=eth_null1,size=1276 -- template
+
 
 # Mellanox
 ./Transmit -m 4096  -w 0000:83:00.0 -w 0000:84:00.0 -c 0xffffffff  -n 4
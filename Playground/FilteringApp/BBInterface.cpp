@@ -1,4 +1,5 @@
 #include "BBInterface.h"
+#include <algorithm>
 
 
 BBInterface::BBInterface()
@@ -10,5 +11,38 @@ BBInterface::BBInterface()
 BBPort& BBInterface::addPort(MACAddress localMAC)
 {
     mBBPorts.push_back(std::make_unique<BBPort>(localMAC));
+    mMACs.push_back(LocalMAC(localMAC).mValue);
+    update_mac_index();
     return *mBBPorts.back();
 }
+
+
+void BBInterface::update_mac_index()
+{
+    auto sorted_macs = mMACs;
+    std::sort(sorted_macs.begin(), sorted_macs.end());
+    mUniqueMACs = std::adjacent_find(sorted_macs.begin(), sorted_macs.end()) == sorted_macs.end();
+
+    if (mUniqueMACs)
+    {
+        mMACIndex.build(mMACs);
+    }
+}
+
+
+BBInterface BBInterface::clone() const
+{
+    BBInterface result;
+    for (const std::unique_ptr<BBPort>& port : mBBPorts)
+    {
+        result.mBBPorts.push_back(port->clone());
+    }
+    for (const RxTrigger& rxTrigger : mRxTriggers)
+    {
+        result.mRxTriggers.push_back(rxTrigger.clone());
+    }
+    result.mMACIndex = mMACIndex;
+    result.mMACs = mMACs;
+    result.mUniqueMACs = mUniqueMACs;
+    return result;
+}
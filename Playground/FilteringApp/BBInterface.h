@@ -2,6 +2,7 @@
 
 
 #include "BBPort.h"
+#include "MACIndex.h"
 #include "RxPacket.h"
 #include <vector>
 
@@ -11,12 +12,34 @@ struct BBInterface
     BBInterface();
     BBPort& addPort(MACAddress localMAC);
     BBPort& getBBPort(uint32_t i) { return *mBBPorts[i]; }
+    const BBPort& getBBPort(uint32_t i) const { return *mBBPorts[i]; }
+
+    // Interface with the same ports and triggers, but with zeroed counters.
+    BBInterface clone() const;
 
     void pop(const RxPacket& packet)
     {
-        for (std::unique_ptr<BBPort>& port : mBBPorts)
+        auto ports_begin = mBBPorts.data();
+        auto ports_end = ports_begin + mBBPorts.size();
+
+        // A unicast packet can only be accepted by the port with that MAC.
+        // Broadcast and multicast packets are counted by all ports.
+        // With a few ports, trying them all is faster than the index lookup.
+        if (mBBPorts.size() > max_scanned_ports && !(packet[0] & 0x01) && mUniqueMACs)
+        {
+            auto port_index = mMACIndex.find(Decode<uint64_t>(packet.data()) & 0x0000FFFFFFFFFFFF);
+            if (port_index == MACIndex::not_found)
+            {
+                return;
+            }
+            ports_begin += port_index;
+            ports_end = ports_begin + 1;
+        }
+
+        // Single call site, so that BBPort::pop is inlined.
+        for (auto port = ports_begin; port != ports_end; ++port)
         {
-            BBPort& bbPort = *port;
+            BBPort& bbPort = **port;
             bbPort.pop(packet);
         }
     }
@@ -24,4 +47,13 @@ struct BBInterface
     std::vector<std::unique_ptr<BBPort>> mBBPorts;
     std::vector<RxPacket> mPacketBatch;
     std::vector<RxTrigger> mRxTriggers;
+
+private:
+    enum : uint32_t { max_scanned_ports = 4 };
+
+    void update_mac_index();
+
+    MACIndex mMACIndex;
+    std::vector<uint64_t> mMACs;
+    bool mUniqueMACs = true; // otherwise the index is not used
 };
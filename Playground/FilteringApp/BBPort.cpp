@@ -5,11 +5,25 @@ BBPort::BBPort(MACAddress local_mac) :
     mLocalMAC(local_mac),
     mLocalIP(1, 1, 1, local_mac[5])
 {
-    mStack.mPackets.reserve(1024);
 }
 
 
 void BBPort::addUDPFlow(uint16_t dst_port)
 {
+    mFlowIndex.insert(FlowIndex::make_key(mLocalIP.toInteger(), Net16(dst_port).mValue), mUDPFlows.size());
     mUDPFlows.push_back(std::make_unique<UDPFlow>(IPv4Address(1, 1, 1, 1), mLocalIP, 1, dst_port));
 }
+
+
+std::unique_ptr<BBPort> BBPort::clone() const
+{
+    auto result = std::make_unique<BBPort>(mLocalMAC.mMAC);
+    result->mLocalIP = mLocalIP;
+    result->mLayer3Offset = mLayer3Offset;
+    for (const auto& udp_flow : mUDPFlows)
+    {
+        result->mUDPFlows.push_back(std::make_unique<UDPFlow>(udp_flow->clone()));
+    }
+    result->mFlowIndex = mFlowIndex;
+    return result;
+}
@@ -2,6 +2,7 @@
 
 
 #include "Decode.h"
+#include "FlowIndex.h"
 #include "Likely.h"
 #include "MACAddress.h"
 #include "RxPacket.h"
@@ -16,6 +17,8 @@ struct BBPort
     BBPort(MACAddress local_mac);
 
     UDPFlow& getUDPFlow(uint32_t index) { return *mUDPFlows[index]; }
+    const UDPFlow& getUDPFlow(uint32_t index) const { return *mUDPFlows[index]; }
+    uint32_t getUDPFlowCount() const { return mUDPFlows.size(); }
 
     void addUDPFlow(uint16_t dst_port);
 
@@ -40,15 +43,9 @@ struct BBPort
 
         if (is_ipv4(packet))
         {
-            for (auto& udp_flow_ptr : mUDPFlows)
+            if (accept_udp_flow(packet))
             {
-                UDPFlow& udp_flow = *udp_flow_ptr;
-                if (udp_flow.match(packet, mLayer3Offset))
-                {
-                    udp_flow.accept(packet);
-                    mStats.mUDPAccepted++;
-                    return;
-                }
+                return;
             }
 
             // If we didn't match any UDP flows then the IP may wrong. So we still need to check it.
@@ -71,11 +68,65 @@ struct BBPort
         uint64_t mBroadcastCounter = 0;
         uint64_t mMulticastCounter = 0;
         uint64_t mUDPAccepted = 0;
+        uint64_t mStackQueued = 0;
+        uint64_t mStackDropped = 0;
+
+        Stats& operator+=(const Stats& rhs)
+        {
+            mUnicastCounter += rhs.mUnicastCounter;
+            mBroadcastCounter += rhs.mBroadcastCounter;
+            mMulticastCounter += rhs.mMulticastCounter;
+            mUDPAccepted += rhs.mUDPAccepted;
+            mStackQueued += rhs.mStackQueued;
+            mStackDropped += rhs.mStackDropped;
+            return *this;
+        }
     };
 
     const Stats& stats() const { return mStats; }
 
+    // The stack thread polls it.
+    Stack& getStack() { return mStack; }
+
+    // Port with the same configuration and flows, but with zeroed counters and its own stack.
+    std::unique_ptr<BBPort> clone() const;
+
 private:
+    enum : uint32_t { max_scanned_flows = 4 };
+
+    bool accept_udp_flow(const RxPacket& packet)
+    {
+        auto try_accept = [&](uint32_t flow_index)
+        {
+            UDPFlow& udp_flow = *mUDPFlows[flow_index];
+            if (!udp_flow.match(packet, mLayer3Offset))
+            {
+                return false;
+            }
+            udp_flow.accept(packet);
+            mStats.mUDPAccepted++;
+            return true;
+        };
+
+        // With a few flows, trying them all is faster than the index lookup.
+        if (mUDPFlows.size() <= max_scanned_flows)
+        {
+            for (auto i = 0u; i != mUDPFlows.size(); ++i)
+            {
+                if (try_accept(i))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // The index only narrows the flows down to the ones with this destination, the flow checks the rest.
+        auto dst_ip = Decode<IPv4Header>(packet.data() + mLayer3Offset).mDestinationIP;
+        auto dst_port = Decode<Net16>(packet.data() + mLayer3Offset + sizeof(IPv4Header) + offsetof(UDPHeader, mDestinationPort));
+        return mFlowIndex.find(FlowIndex::make_key(dst_ip.toInteger(), dst_port.mValue), try_accept);
+    }
+
     bool is_ipv4(const RxPacket& packet) const { return Decode<EthernetHeader>(packet.data()).mEtherType == Net16(0x0800); }
     bool is_local_mac(const RxPacket& packet) { return mLocalMAC.equals(packet.data()); }
     bool is_broadcast(const RxPacket& packet) { return 0x0000FFFFFFFFFFFF == (Decode<uint64_t>(packet.data()) & 0x0000FFFFFFFFFFFF); }
@@ -83,7 +134,14 @@ private:
 
     void handle_other(const RxPacket& packet)
     {
-        mStack.add_to_queue(packet);
+        if (mStack.add_to_queue(packet))
+        {
+            mStats.mStackQueued++;
+        }
+        else
+        {
+            mStats.mStackDropped++;
+        }
     }
 
     LocalMAC mLocalMAC;
@@ -91,5 +149,6 @@ private:
     uint16_t mLayer3Offset = sizeof(EthernetHeader); // default
     Stats mStats;
     std::vector<std::unique_ptr<UDPFlow>> mUDPFlows;
+    FlowIndex mFlowIndex;
     Stack mStack;
 };
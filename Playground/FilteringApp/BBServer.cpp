@@ -1,5 +1,48 @@
 #include "BBServer.h"
+#include "RSS.h"
 #include "RxPacket.h"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <pthread.h>
+#include <thread>
+
+
+namespace {
+
+
+void run_packets(PhysicalInterface& physicalInterface, const std::vector<RxPacket>& rxPackets, uint32_t num_repeats)
+{
+    for (auto i = 0u; i != num_repeats; ++i)
+    {
+        const RxPacket* packets_ptr = rxPackets.data();
+        uint32_t packets_len = rxPackets.size();
+
+        // Single call site, so that the packet processing is inlined here.
+        while (packets_len > 0)
+        {
+            auto burst_size = std::min<uint32_t>(packets_len, 32);
+            physicalInterface.pop(packets_ptr, burst_size);
+            packets_len -= burst_size;
+            packets_ptr += burst_size;
+        }
+    }
+}
+
+
+void pin_to_core(uint32_t core)
+{
+    auto num_cores = std::max(1u, std::thread::hardware_concurrency());
+
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(core % num_cores, &cpu_set);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+}
+
+
+} // namespace
 
 
 BBServer::BBServer()
@@ -9,23 +52,122 @@ BBServer::BBServer()
 
 void BBServer::run(const std::vector<RxPacket>& rxPackets, uint32_t num_repeats)
 {
-    PhysicalInterface& physicalInterface = mPhysicalInterfaces[0];
+    run_packets(mPhysicalInterfaces[0], rxPackets, num_repeats);
+}
 
-    for (auto i = 0u; i != num_repeats; ++i)
+
+void BBServer::setDemuxMode(DemuxMode demuxMode)
+{
+    mPhysicalInterfaces[0].setDemuxMode(demuxMode);
+    for (auto& replica : mReplicas)
     {
-        const RxPacket* packets_ptr = rxPackets.data();
-        uint32_t packets_len = rxPackets.size();
+        replica->setDemuxMode(demuxMode);
+    }
+}
+
+
+int64_t BBServer::run_sharded(const std::vector<RxPacket>& rxPackets, uint32_t num_repeats, uint32_t num_workers)
+{
+    using Clock = std::chrono::steady_clock;
+
+    assert(num_workers > 0);
+
+    while (mReplicas.size() < num_workers)
+    {
+        mReplicas.push_back(mPhysicalInterfaces[0].clone());
+    }
 
-        while (packets_len >= 32)
+    // This is the work of the NIC: one RX queue per worker.
+    RSS rss(num_workers);
+    std::vector<std::vector<RxPacket>> rx_queues(num_workers);
+    for (const RxPacket& packet : rxPackets)
+    {
+        rx_queues[rss.get_queue(packet)].push_back(packet);
+    }
+
+    // The workers wait until all of them are pinned, then the clock starts.
+    std::atomic<uint32_t> num_ready{0};
+    std::atomic<bool> go{false};
+    std::vector<Clock::time_point> end_times(num_workers);
+
+    std::vector<std::thread> workers;
+    workers.reserve(num_workers);
+
+    for (auto i = 0u; i != num_workers; ++i)
+    {
+        workers.emplace_back([this, &rx_queues, &num_ready, &go, &end_times, num_repeats, i]
         {
-            physicalInterface.pop(packets_ptr, 32);
-            packets_len -= 32;
-            packets_ptr += 32;
-        }
+            pin_to_core(i);
+            num_ready.fetch_add(1, std::memory_order_release);
+            while (!go.load(std::memory_order_acquire))
+            {
+                std::this_thread::yield();
+            }
+
+            run_packets(*mReplicas[i], rx_queues[i], num_repeats);
+            end_times[i] = Clock::now();
+        });
+    }
+
+    while (num_ready.load(std::memory_order_acquire) != num_workers)
+    {
+        std::this_thread::yield();
+    }
+
+    auto start_time = Clock::now();
+    go.store(true, std::memory_order_release);
+
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+
+    auto end_time = *std::max_element(end_times.begin(), end_times.end());
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - start_time).count();
+}
 
-        if (packets_len > 0)
+
+BBPort::Stats BBServer::getBBPortStats(uint32_t interface_index, uint32_t port_index) const
+{
+    BBPort::Stats result = mPhysicalInterfaces[0].getBBInterface(interface_index).getBBPort(port_index).stats();
+    for (const auto& replica : mReplicas)
+    {
+        result += replica->getBBInterface(interface_index).getBBPort(port_index).stats();
+    }
+    return result;
+}
+
+
+uint64_t BBServer::getUDPPacketsReceived(uint32_t interface_index, uint32_t port_index, uint32_t flow_index) const
+{
+    auto result = mPhysicalInterfaces[0].getBBInterface(interface_index).getBBPort(port_index).getUDPFlow(flow_index).mPacketsReceived;
+    for (const auto& replica : mReplicas)
+    {
+        result += replica->getBBInterface(interface_index).getBBPort(port_index).getUDPFlow(flow_index).mPacketsReceived;
+    }
+    return result;
+}
+
+
+std::vector<Stack*> BBServer::getStacks()
+{
+    std::vector<Stack*> result;
+
+    auto add_stacks = [&result](PhysicalInterface& physicalInterface)
+    {
+        for (BBInterface& bbInterface : physicalInterface.mBBInterfaces)
         {
-            physicalInterface.pop(packets_ptr, packets_len);
+            for (auto& bbPort : bbInterface.mBBPorts)
+            {
+                result.push_back(&bbPort->getStack());
+            }
         }
+    };
+
+    add_stacks(mPhysicalInterfaces[0]);
+    for (auto& replica : mReplicas)
+    {
+        add_stacks(*replica);
     }
+    return result;
 }
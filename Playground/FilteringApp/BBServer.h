@@ -3,6 +3,8 @@
 
 #include "PhysicalInterface.h"
 #include "Array.h"
+#include <memory>
+#include <vector>
 
 
 struct BBServer
@@ -16,5 +18,25 @@ struct BBServer
 
     void run(const std::vector<RxPacket>& rxPackets, uint32_t num_repeats);
 
+    // Sets the demux mode of physical interface 0 and of its replicas.
+    void setDemuxMode(DemuxMode demuxMode);
+
+    // Sharded mode: the packets are distributed over num_workers threads by RSS hash,
+    // so all packets of a flow are handled by the same worker. Each worker is pinned
+    // to a core and has a private replica of physical interface 0, so the workers
+    // don't share any counters. The replicas are created on the first sharded run,
+    // so the configuration must be complete by then.
+    // Returns the nanoseconds from releasing the workers until the last one is done.
+    // Distributing the packets and starting the threads happen before that.
+    int64_t run_sharded(const std::vector<RxPacket>& rxPackets, uint32_t num_repeats, uint32_t num_workers);
+
+    // Counters of physical interface 0, summed over the replicas of the sharded mode.
+    BBPort::Stats getBBPortStats(uint32_t interface_index, uint32_t port_index) const;
+    uint64_t getUDPPacketsReceived(uint32_t interface_index, uint32_t port_index, uint32_t flow_index) const;
+
+    // The stacks of all ports of physical interface 0 and its replicas, for a StackThread.
+    std::vector<Stack*> getStacks();
+
     Array<PhysicalInterface, 4> mPhysicalInterfaces;
+    std::vector<std::unique_ptr<PhysicalInterface>> mReplicas;
 };
@@ -0,0 +1,42 @@
+#include "FlowIndex.h"
+
+
+FlowIndex::FlowIndex() :
+    mEntries(2),
+    mMask(1)
+{
+}
+
+
+void FlowIndex::insert(uint64_t key, uint32_t index)
+{
+    mKeys.emplace_back(key, index);
+
+    // Keep the load factor at most 50%, so there is always an empty entry that ends the probing.
+    if (2 * mKeys.size() > mEntries.size())
+    {
+        mEntries.assign(2 * mEntries.size(), Entry());
+        mMask = mEntries.size() - 1;
+
+        for (const auto& k : mKeys)
+        {
+            insert_impl(k.first, k.second);
+        }
+        return;
+    }
+
+    insert_impl(key, index);
+}
+
+
+void FlowIndex::insert_impl(uint64_t key, uint32_t index)
+{
+    auto i = hash(key);
+    while (mEntries[i].mKey != empty_key)
+    {
+        i = (i + 1) & mMask;
+    }
+
+    mEntries[i].mKey = key;
+    mEntries[i].mIndex = index;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+
+// Open addressing hash table (linear probing) that maps a (destination IP, destination port)
+// key to the indexes of the flows with that key. Flows with the same key are visited in the
+// order they were added, because an entry is never placed before an older entry of its probe sequence.
+struct FlowIndex
+{
+    FlowIndex();
+
+    // The key holds the destination IP and port in network byte order.
+    static uint64_t make_key(uint32_t dst_ip, uint16_t dst_port)
+    {
+        return (uint64_t(dst_ip) << 16) | dst_port;
+    }
+
+    void insert(uint64_t key, uint32_t index);
+
+    // Calls f(index) for the flows with the key until it returns true.
+    // Returns false if it never returned true.
+    template<typename F>
+    bool find(uint64_t key, F&& f) const
+    {
+        for (auto i = hash(key); ; i = (i + 1) & mMask)
+        {
+            const Entry& entry = mEntries[i];
+            if (entry.mKey == key && f(entry.mIndex))
+            {
+                return true;
+            }
+            if (entry.mKey == empty_key)
+            {
+                return false;
+            }
+        }
+    }
+
+private:
+    static const uint64_t empty_key = UINT64_MAX; // keys only use 48 bits
+
+    struct Entry
+    {
+        uint64_t mKey = empty_key;
+        uint32_t mIndex = 0;
+    };
+
+    uint32_t hash(uint64_t key) const
+    {
+        return ((key * 0x9E3779B97F4A7C15) >> 32) & mMask;
+    }
+
+    void insert_impl(uint64_t key, uint32_t index);
+
+    std::vector<Entry> mEntries;
+    std::vector<std::pair<uint64_t, uint32_t>> mKeys; // in insertion order, for rehashing
+    uint32_t mMask = 0;
+};
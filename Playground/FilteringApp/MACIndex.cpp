@@ -0,0 +1,71 @@
+#include "MACIndex.h"
+
+
+namespace {
+
+
+// Number of multipliers to try before doubling the table size.
+const uint32_t max_attempts = 64;
+
+
+} // namespace
+
+
+MACIndex::MACIndex() :
+    mEntries(2)
+{
+}
+
+
+void MACIndex::build(const std::vector<uint64_t>& mac_values)
+{
+    // Start at a load factor of at most 50%.
+    auto size_log2 = 1u;
+    while ((1u << size_log2) < 2 * mac_values.size())
+    {
+        size_log2++;
+    }
+
+    uint64_t random = 0x9E3779B97F4A7C15;
+
+    for (;;)
+    {
+        for (auto i = 0u; i != max_attempts; ++i)
+        {
+            // xorshift, the multiplier must be odd
+            random ^= random << 13;
+            random ^= random >> 7;
+            random ^= random << 17;
+
+            if (try_build(mac_values, size_log2, random | 1))
+            {
+                return;
+            }
+        }
+
+        size_log2++;
+    }
+}
+
+
+bool MACIndex::try_build(const std::vector<uint64_t>& mac_values, uint32_t size_log2, uint64_t multiplier)
+{
+    std::vector<Entry> entries(1u << size_log2);
+    auto shift = 64 - size_log2;
+
+    for (auto i = 0u; i != mac_values.size(); ++i)
+    {
+        Entry& entry = entries[(mac_values[i] * multiplier) >> shift];
+        if (entry.mIndex != not_found)
+        {
+            return false;
+        }
+        entry.mMAC = mac_values[i];
+        entry.mIndex = i;
+    }
+
+    mEntries = std::move(entries);
+    mMultiplier = multiplier;
+    mShift = shift;
+    return true;
+}
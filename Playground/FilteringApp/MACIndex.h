@@ -0,0 +1,39 @@
+#pragma once
+
+
+#include <cstdint>
+#include <vector>
+
+
+// Perfect hash table that maps the MAC addresses of the ports of an interface to the port index.
+// Built once at configuration time by searching a multiplier for which the multiplicative
+// hash has no collisions, so a lookup is a single multiply, load and compare.
+struct MACIndex
+{
+    enum : uint32_t { not_found = 0xFFFFFFFF };
+
+    MACIndex();
+
+    // The MACs are in the lower 48 bits, as stored by LocalMAC. mac_values[i] maps to i.
+    // The values must be unique.
+    void build(const std::vector<uint64_t>& mac_values);
+
+    uint32_t find(uint64_t mac_value) const
+    {
+        const Entry& entry = mEntries[(mac_value * mMultiplier) >> mShift];
+        return entry.mMAC == mac_value ? entry.mIndex : not_found;
+    }
+
+private:
+    struct Entry
+    {
+        uint64_t mMAC = UINT64_MAX; // never equal to a 48-bit value
+        uint32_t mIndex = not_found;
+    };
+
+    bool try_build(const std::vector<uint64_t>& mac_values, uint32_t size_log2, uint64_t multiplier);
+
+    std::vector<Entry> mEntries;
+    uint64_t mMultiplier = 0;
+    uint32_t mShift = 63;
+};
@@ -7,4 +7,88 @@ PhysicalInterface::PhysicalInterface()
 }
 
 
+std::unique_ptr<PhysicalInterface> PhysicalInterface::clone() const
+{
+    auto result = std::make_unique<PhysicalInterface>();
+    for (auto i = 0u; i != mBBInterfaces.size(); ++i)
+    {
+        result->mBBInterfaces[i] = mBBInterfaces[i].clone();
+    }
+    result->mDemuxMode = mDemuxMode;
+    return result;
+}
+
+
+__attribute__((flatten)) void PhysicalInterface::pop_burst(const RxPacket* packets, uint32_t size)
+{
+    assert(size <= max_burst_size);
+
+    // Only the VLANs that occur in the burst are visited, so the cost
+    // does not depend on the number of interfaces.
+    std::array<uint8_t, max_burst_size> vlans;
+    uint32_t num_vlans = 0;
+
+    for (auto i = 0u; i != size; ++i)
+    {
+        const RxPacket& packet = packets[i];
+
+        // The ports will read the headers after the sort.
+        __builtin_prefetch(packet.data());
 
+        if (packet.mVlanId >= mBBInterfaces.size())
+        {
+            continue;
+        }
+
+        if (mCounts[packet.mVlanId]++ == 0)
+        {
+            vlans[num_vlans++] = packet.mVlanId;
+            __builtin_prefetch(&mBBInterfaces[packet.mVlanId]);
+        }
+    }
+
+    // With about one packet per VLAN (e.g. 32 packets over 48 shuffled VLANs) the sort
+    // groups almost nothing and costs more than it saves, so then the packets go to
+    // their interfaces in arrival order. The headers are prefetched either way.
+    std::array<RxPacket, max_burst_size> sorted;
+    const RxPacket* ordered = packets;
+    if (2 * num_vlans <= size)
+    {
+        // Counts become the start offsets of the sub-bursts.
+        uint32_t offset = 0;
+        for (auto i = 0u; i != num_vlans; ++i)
+        {
+            auto count = mCounts[vlans[i]];
+            mCounts[vlans[i]] = offset;
+            offset += count;
+        }
+
+        for (auto i = 0u; i != size; ++i)
+        {
+            const RxPacket& packet = packets[i];
+            if (packet.mVlanId < mBBInterfaces.size())
+            {
+                sorted[mCounts[packet.mVlanId]++] = packet;
+            }
+        }
+
+        ordered = sorted.data();
+        size = offset;
+    }
+
+    for (auto i = 0u; i != num_vlans; ++i)
+    {
+        mCounts[vlans[i]] = 0;
+    }
+
+    // Single call site, so that BBInterface::pop is inlined. After the sort the
+    // packets of a VLAN follow each other, so its interface stays in the L1 cache.
+    for (auto i = 0u; i != size; ++i)
+    {
+        const RxPacket& packet = ordered[i];
+        if (packet.mVlanId < mBBInterfaces.size())
+        {
+            mBBInterfaces[packet.mVlanId].pop(packet);
+        }
+    }
+}
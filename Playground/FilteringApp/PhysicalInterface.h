@@ -7,16 +7,37 @@
 #include <algorithm>
 #include <array>
 #include <cassert>
+#include <memory>
 #include <vector>
 
 
 
+enum class DemuxMode
+{
+    PerPacket, // each packet is passed to its interface in arrival order
+    Burst      // the burst is sorted by VLAN first, see pop_burst
+};
+
+
 struct PhysicalInterface
 {
+    enum : uint32_t { max_burst_size = 32 };
+
     PhysicalInterface();
 
+    void setDemuxMode(DemuxMode demuxMode) { mDemuxMode = demuxMode; }
+
     void pop(const RxPacket* packets, uint32_t size)
     {
+        if (mDemuxMode == DemuxMode::Burst)
+        {
+            for (auto offset = 0u; offset < size; offset += max_burst_size)
+            {
+                pop_burst(packets + offset, std::min<uint32_t>(size - offset, max_burst_size));
+            }
+            return;
+        }
+
         for (auto i = 0u; i != size; ++i)
         {
             const RxPacket& packet = packets[i];
@@ -34,5 +55,24 @@ struct PhysicalInterface
         return mBBInterfaces[i];
     }
 
+    const BBInterface& getBBInterface(uint32_t i) const
+    {
+        return mBBInterfaces[i];
+    }
+
+    // Interface with the same configuration, but with zeroed counters.
+    std::unique_ptr<PhysicalInterface> clone() const;
+
     std::vector<BBInterface> mBBInterfaces;
+    DemuxMode mDemuxMode = DemuxMode::PerPacket;
+
+private:
+    // Counting sort of the burst by VLAN id (stable, so each VLAN keeps the arrival order),
+    // then the packets of each VLAN in a row. This way the ports and counters of an
+    // interface are loaded once per burst instead of once per packet of a shuffled burst.
+    // If most VLANs of the burst have a single packet, it keeps the arrival order.
+    void pop_burst(const RxPacket* packets, uint32_t size);
+
+    // Zero between bursts. One entry per possible VLAN id of RxPacket.
+    std::array<uint8_t, 256> mCounts{};
 };
@@ -0,0 +1,88 @@
+#include "RSS.h"
+#include "Networking.h"
+#include <cassert>
+#include <cstring>
+
+
+const Toeplitz::Key Toeplitz::default_key = {{
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa
+}};
+
+
+Toeplitz::Toeplitz(const Key& key)
+{
+    // Each input bit that is set xors the 32 key bits starting at its own position.
+    auto get_window = [&](uint32_t bit)
+    {
+        uint32_t result = 0;
+        for (auto i = 0u; i != 32; ++i)
+        {
+            auto key_bit = bit + i;
+            result = (result << 1) | ((key[key_bit / 8] >> (7 - key_bit % 8)) & 1u);
+        }
+        return result;
+    };
+
+    for (auto byte_index = 0u; byte_index != max_input_size; ++byte_index)
+    {
+        for (auto value = 0u; value != 256; ++value)
+        {
+            uint32_t result = 0;
+            for (auto bit = 0u; bit != 8; ++bit)
+            {
+                if (value & (0x80u >> bit))
+                {
+                    result ^= get_window(8 * byte_index + bit);
+                }
+            }
+            mTable[byte_index][value] = result;
+        }
+    }
+}
+
+
+RSS::RSS(uint32_t num_queues)
+{
+    assert(num_queues > 0 && num_queues <= 256);
+
+    for (auto i = 0u; i != mIndirectionTable.size(); ++i)
+    {
+        mIndirectionTable[i] = i % num_queues;
+    }
+}
+
+
+uint32_t RSS::get_queue(const RxPacket& packet) const
+{
+    enum : uint32_t { l3_offset = sizeof(EthernetHeader) };
+
+    if (packet.size() < l3_offset + sizeof(IPv4Header) || !(Decode<EthernetHeader>(packet.data()).mEtherType == Net16(0x0800)))
+    {
+        return 0;
+    }
+
+    const auto& ip4_header = Decode<IPv4Header>(packet.data() + l3_offset);
+
+    // Hash input: source IP, destination IP, source port, destination port.
+    uint8_t input[Toeplitz::max_input_size];
+    memcpy(input, &ip4_header.mSourceIP, 4);
+    memcpy(input + 4, &ip4_header.mDestinationIP, 4);
+    auto input_size = 8u;
+
+    // Like NICs, only hash the ports if the packet is not fragmented. (More fragments flag or offset.)
+    auto l4_offset = l3_offset + 4u * (ip4_header.mVersionAndIHL & 0xF);
+    auto has_ports = (ip4_header.mProtocolId == ProtocolId::UDP || ip4_header.mProtocolId == ProtocolId::TCP)
+        && (ip4_header.mFlagsAndFragmentOffset.hostValue() & 0x3FFF) == 0;
+
+    if (has_ports && packet.size() >= l4_offset + 4)
+    {
+        memcpy(input + 8, packet.data() + l4_offset, 4);
+        input_size = 12;
+    }
+
+    return mIndirectionTable[mToeplitz.hash(input, input_size) % indirection_table_size];
+}
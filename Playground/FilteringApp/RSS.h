@@ -0,0 +1,53 @@
+#pragma once
+
+
+#include "RxPacket.h"
+#include <array>
+#include <cstdint>
+
+
+// Toeplitz hash as computed by NICs for receive side scaling.
+// Uses one lookup table per input byte, so hashing the 12 bytes of an
+// IPv4 4-tuple takes 12 lookups instead of 96 shift and xor steps.
+struct Toeplitz
+{
+    enum : uint32_t { key_size = 40, max_input_size = 12 };
+
+    using Key = std::array<uint8_t, key_size>;
+
+    // The key from the Microsoft RSS specification that most NIC drivers use by default.
+    static const Key default_key;
+
+    explicit Toeplitz(const Key& key = default_key);
+
+    uint32_t hash(const uint8_t* data, uint32_t size) const
+    {
+        uint32_t result = 0;
+        for (auto i = 0u; i != size; ++i)
+        {
+            result ^= mTable[i][data[i]];
+        }
+        return result;
+    }
+
+private:
+    std::array<std::array<uint32_t, 256>, max_input_size> mTable;
+};
+
+
+// Selects the RX queue of a packet like a NIC does: the Toeplitz hash of the
+// IPv4 addresses and UDP/TCP ports indexes an indirection table that spreads
+// the hash values round-robin over the queues.
+// All packets of a flow go to the same queue. Non-IPv4 packets go to queue 0.
+struct RSS
+{
+    enum : uint32_t { indirection_table_size = 128 };
+
+    explicit RSS(uint32_t num_queues);
+
+    uint32_t get_queue(const RxPacket& packet) const;
+
+private:
+    Toeplitz mToeplitz;
+    std::array<uint8_t, indirection_table_size> mIndirectionTable;
+};
@@ -10,6 +10,15 @@ struct RxTrigger
 {
     RxTrigger(const std::string& filter);
 
+    // Same filter with zeroed counters.
+    RxTrigger clone() const
+    {
+        RxTrigger result = *this;
+        result.mPackets = 0;
+        result.mBytes = 0;
+        return result;
+    }
+
     void process(const RxPacket& packet)
     {
         if (mBPFFilter.match(packet.data(), packet.size()))
@@ -0,0 +1,64 @@
+#pragma once
+
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+
+// Bounded lock-free queue for one producer thread and one consumer thread.
+// push and pop never block: they fail if the ring is full or empty.
+template<typename T, uint32_t Capacity>
+struct SPSCRing
+{
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+    // Producer
+    bool push(const T& value)
+    {
+        auto head = mHead.load(std::memory_order_relaxed);
+        if (head - mCachedTail == Capacity)
+        {
+            // Only reload the consumer's index when the ring looks full.
+            mCachedTail = mTail.load(std::memory_order_acquire);
+            if (head - mCachedTail == Capacity)
+            {
+                return false;
+            }
+        }
+
+        mItems[head % Capacity] = value;
+        mHead.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer
+    bool pop(T& value)
+    {
+        auto tail = mTail.load(std::memory_order_relaxed);
+        if (tail == mCachedHead)
+        {
+            mCachedHead = mHead.load(std::memory_order_acquire);
+            if (tail == mCachedHead)
+            {
+                return false;
+            }
+        }
+
+        value = mItems[tail % Capacity];
+        mTail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    // The producer and consumer fields are on different cache lines.
+    // (alignas would need the C++17 aligned new, the rings are members of heap objects.)
+    std::array<T, Capacity> mItems;
+    char mProducerPadding[64];
+    std::atomic<uint32_t> mHead{0};
+    uint32_t mCachedTail = 0;
+    char mConsumerPadding[64];
+    std::atomic<uint32_t> mTail{0};
+    uint32_t mCachedHead = 0;
+    char mEndPadding[64];
+};
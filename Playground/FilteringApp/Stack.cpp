@@ -1,22 +1,67 @@
 #include "Stack.h"
-#include <cstring>
+#include <chrono>
 
 
-Stack::Stack()
+Stack::Stack() :
+    mBuffers(new PacketBuffer[num_buffers])
 {
-    mFreeBuffers.resize(128);
-    for (PacketBuffer*& buf : mFreeBuffers)
+    mFreeBuffers.reserve(num_buffers);
+    for (auto i = 0u; i != num_buffers; ++i)
     {
-        buf = new PacketBuffer();
+        mFreeBuffers.push_back(&mBuffers[i]);
     }
 }
 
 
-void Stack::flush()
+bool Stack::reclaim_buffers()
 {
-    mFreeBuffers.insert(mFreeBuffers.end(), mPackets.begin(), mPackets.end());
-    mPackets.clear();
+    PacketBuffer* buffer;
+    while (mReturnedBuffers.pop(buffer))
+    {
+        mFreeBuffers.push_back(buffer);
+    }
+    return !mFreeBuffers.empty();
+}
+
+
+StackThread::StackThread(std::vector<Stack*> stacks, Handler handler) :
+    mStacks(std::move(stacks)),
+    mHandler(std::move(handler)),
+    mThread([this]{ run(); })
+{
+}
+
+
+StackThread::~StackThread()
+{
+    mStop.store(true, std::memory_order_release);
+    mThread.join();
 }
 
 
+void StackThread::run()
+{
+    for (;;)
+    {
+        // Read before polling, so that a last round is done after the stop.
+        auto stop = mStop.load(std::memory_order_acquire);
+
+        uint64_t count = 0;
+        for (Stack* stack : mStacks)
+        {
+            count += stack->poll(mHandler);
+        }
+        mProcessed.store(mProcessed.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+
+        if (stop)
+        {
+            return;
+        }
 
+        if (count == 0)
+        {
+            // ARP and ICMP can wait a little, a core that spins can't do fast path work.
+            std::this_thread::sleep_for(std::chrono::microseconds(20));
+        }
+    }
+}
@@ -1,27 +1,109 @@
 #pragma once
 
 
+#include "Likely.h"
 #include "RxPacket.h"
+#include "SPSCRing.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <thread>
 #include <vector>
 
 
 struct PacketBuffer
 {
+    uint16_t mSize;
+    uint8_t mVlanId;
     uint8_t mBuffer[1536];
 };
 
 
+// Slow path for the frames that the fast path does not handle (ARP, ICMP, unknown UDP, ...).
+//
+// The fast path (BBPort::pop) copies the frame into a free buffer and queues it. A stack
+// thread handles the queued buffers and hands them back through a second ring. Both rings
+// are single producer, single consumer, so neither side blocks and nothing is allocated
+// after construction. If all buffers are in use, the frame is dropped.
 struct Stack
 {
+    enum : uint32_t { num_buffers = 128 };
+
     Stack();
 
-    void add_to_queue(const RxPacket&)
+    Stack(const Stack&) = delete;
+    Stack& operator=(const Stack&) = delete;
+
+    // Fast path. Returns false if the frame was dropped.
+    bool add_to_queue(const RxPacket& packet)
+    {
+        if (UNLIKELY(mFreeBuffers.empty()) && !reclaim_buffers())
+        {
+            return false;
+        }
+
+        PacketBuffer* buffer = mFreeBuffers.back();
+        auto size = std::min<uint32_t>(packet.size(), sizeof(buffer->mBuffer));
+        memcpy(buffer->mBuffer, packet.data(), size);
+        buffer->mSize = size;
+        buffer->mVlanId = packet.mVlanId;
+
+        // Can't be full, the ring has room for all buffers.
+        if (UNLIKELY(!mQueue.push(buffer)))
+        {
+            return false;
+        }
+
+        mFreeBuffers.pop_back();
+        return true;
+    }
+
+    // Stack thread. Calls the handler for each queued frame and returns the buffers.
+    template<typename Handler>
+    uint32_t poll(Handler&& handler)
     {
-        // TODO
+        uint32_t count = 0;
+        PacketBuffer* buffer;
+        while (mQueue.pop(buffer))
+        {
+            handler(*buffer);
+            mReturnedBuffers.push(buffer);
+            ++count;
+        }
+        return count;
     }
 
-    void flush();
+private:
+    // Fast path. Takes back the buffers that the stack thread is done with.
+    bool reclaim_buffers();
+
+    SPSCRing<PacketBuffer*, num_buffers> mQueue;           // fast path -> stack thread
+    SPSCRing<PacketBuffer*, num_buffers> mReturnedBuffers; // stack thread -> fast path
+    std::vector<PacketBuffer*> mFreeBuffers;               // fast path only
+    std::unique_ptr<PacketBuffer[]> mBuffers;
+};
+
+
+// Polls the stacks on its own thread until it is destroyed. The stacks must outlive it.
+// When stopped, the frames that were queued before are still handled.
+struct StackThread
+{
+    using Handler = std::function<void(const PacketBuffer&)>;
+
+    StackThread(std::vector<Stack*> stacks, Handler handler);
+    ~StackThread();
+
+    // Number of frames handled so far.
+    uint64_t processed() const { return mProcessed.load(std::memory_order_relaxed); }
+
+private:
+    void run();
 
-    std::vector<PacketBuffer*> mPackets;
-    std::vector<PacketBuffer*> mFreeBuffers;
+    std::vector<Stack*> mStacks;
+    Handler mHandler;
+    std::atomic<uint64_t> mProcessed{0};
+    std::atomic<bool> mStop{false};
+    std::thread mThread;
 };
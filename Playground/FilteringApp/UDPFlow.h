@@ -15,6 +15,15 @@ struct UDPFlow
         return mFilter.match(packet.data() + l3_offset);
     }
 
+    // Same filter with zeroed counters.
+    UDPFlow clone() const
+    {
+        UDPFlow result = *this;
+        result.mPacketsReceived = 0;
+        result.mBytesReceived = 0;
+        return result;
+    }
+
     void accept(const RxPacket& packet)
     {
         mPacketsReceived++;
@@ -24,71 +24,126 @@ void append(std::vector<uint8_t>& vec, T value)
 }
 
 
-MACAddress generate_mac(uint32_t i)
+// Unicast MAC of a port. The last byte is also the last byte of the port's IP.
+MACAddress generate_mac(uint32_t interface_index, uint32_t port_index)
 {
-    MACAddress mac{{ 0x01, 0x02, 0x03, 0x04, 0x05, 0x00}};
-    mac.data()[5] = i;
+    MACAddress mac{{ 0x02, 0x02, 0x03, 0x04, 0x00, 0x00}};
+    mac.data()[4] = interface_index;
+    mac.data()[5] = port_index + 1;
     return mac;
 }
 
 
-std::vector<uint8_t> make_udp_packet(uint16_t dst_port)
+std::vector<uint8_t> make_udp_packet(MACAddress dst_mac, uint16_t dst_port)
 {
     std::vector<uint8_t> result;
     result.reserve(64);
-    append(result, EthernetHeader::Create(generate_mac(dst_port)));
-    append(result, IPv4Header::Create(ProtocolId::UDP, IPv4Address::Create(1), IPv4Address::Create(dst_port)));
+    append(result, EthernetHeader::Create(dst_mac));
+    append(result, IPv4Header::Create(ProtocolId::UDP, IPv4Address::Create(1), IPv4Address::Create(dst_mac[5])));
     append(result, UDPHeader::Create(1, dst_port));
     return result;
 }
 
-std::vector<uint8_t> make_tcp_packet(uint16_t dst_port)
+std::vector<uint8_t> make_tcp_packet(MACAddress dst_mac, uint16_t dst_port)
 {
     std::vector<uint8_t> result;
     result.reserve(64);
-    append(result, EthernetHeader::Create(generate_mac(dst_port)));
-    append(result, IPv4Header::Create(ProtocolId::TCP, IPv4Address::Create(1), IPv4Address::Create(dst_port)));
+    append(result, EthernetHeader::Create(dst_mac));
+    append(result, IPv4Header::Create(ProtocolId::TCP, IPv4Address::Create(1), IPv4Address::Create(dst_mac[5])));
     append(result, TCPHeader::Create(1, dst_port));
     return result;
 }
 
+std::vector<uint8_t> make_arp_packet()
+{
+    auto eth_header = EthernetHeader::Create(MACAddress{{ 0xff, 0xff, 0xff, 0xff, 0xff, 0xff }});
+    eth_header.mEtherType = Net16(0x0806);
+
+    std::vector<uint8_t> result;
+    result.reserve(64);
+    append(result, eth_header);
+    result.resize(sizeof(eth_header) + 28); // ARP request for IPv4
+    return result;
+}
+
+std::vector<uint8_t> make_icmp_packet(MACAddress dst_mac)
+{
+    std::vector<uint8_t> result;
+    result.reserve(64);
+    append(result, EthernetHeader::Create(dst_mac));
+    append(result, IPv4Header::Create(ProtocolId::ICMP, IPv4Address::Create(1), IPv4Address::Create(dst_mac[5])));
+    result.resize(result.size() + 8); // echo request
+    return result;
+}
+
 enum : uint64_t
 {
-    num_flows = 48,
-    num_packets = num_flows * (2U * 1000UL * 1000UL / num_flows),
+    num_packets = 2U * 1000UL * 1000UL,
+    num_interfaces = 48,
+    max_ports_per_interface = 16,
     burst_size = 32
 };
 
 
-static_assert(num_packets % num_flows == 0, "");
+// Flows are spread over the interfaces first, then over the ports of each interface.
+// Each port has flows with destination port 1, 2, ...
+struct FlowLayout
+{
+    explicit FlowLayout(uint32_t num_flows) :
+        mNumFlows(num_flows),
+        mNumInterfaces(std::min<uint32_t>(num_flows, num_interfaces)),
+        mNumPorts(std::min<uint32_t>((num_flows + mNumInterfaces - 1) / mNumInterfaces, max_ports_per_interface))
+    {
+    }
 
+    uint32_t interface_index(uint32_t flow_index) const { return flow_index % mNumInterfaces; }
+    uint32_t port_index(uint32_t flow_index) const { return (flow_index / mNumInterfaces) % mNumPorts; }
+    uint16_t dst_port(uint32_t flow_index) const { return 1 + flow_index / (mNumInterfaces * mNumPorts); }
+
+    uint32_t mNumFlows;
+    uint32_t mNumInterfaces;
+    uint32_t mNumPorts;
+};
 
 
-int64_t run_test(BBServer& bbServer, const std::vector<RxPacket>& rxPackets)
+// num_workers=0 runs without sharding on the current thread. Returns cycles.
+int64_t run_test(BBServer& bbServer, const std::vector<RxPacket>& rxPackets, uint32_t num_repeats, uint32_t num_workers)
 {
+    if (num_workers != 0)
+    {
+        // Only the matching is timed, not the distribution of the packets or the thread start.
+        auto elapsed_ns = bbServer.run_sharded(rxPackets, num_repeats, num_workers);
+        return static_cast<int64_t>(1e-9 * elapsed_ns * cpu_hz);
+    }
+
     auto start_time = Benchmark::start();
-    bbServer.run(rxPackets, num_packets / rxPackets.size());
+    bbServer.run(rxPackets, num_repeats);
     auto elapsed_time = Benchmark::stop() - start_time;
     return elapsed_time;
 }
 
 
-void run(BBServer& bbServer, const std::vector<RxPacket>& rxPackets)
+enum : uint32_t { num_tests = 64 };
+
+
+void run(BBServer& bbServer, const std::vector<RxPacket>& rxPackets, uint32_t num_repeats, uint32_t num_workers = 0)
 {
-    std::array<int64_t, 64> tests;
+    std::array<int64_t, num_tests> tests;
 
     for (auto& ns : tests)
     {
-        ns = run_test(bbServer, rxPackets);
+        ns = run_test(bbServer, rxPackets, num_repeats, num_workers);
     }
 
     std::sort(tests.begin(), tests.end());
 
-    auto print_cycles = [](const char* message, int64_t cycles)
+    auto packets_per_test = 1.0 * num_repeats * rxPackets.size();
+
+    auto print_cycles = [&](const char* message, int64_t cycles)
 
     {
-        auto cycles_per_packet = 1.0 * cycles / num_packets;
-        auto ns_per_packet = 1e9 * cycles / cpu_hz / num_packets;
+        auto cycles_per_packet = cycles / packets_per_test;
+        auto ns_per_packet = 1e9 * cycles / cpu_hz / packets_per_test;
         std::cout
             << message
             << " ns_per_packet=" << int(0.5 + 100 * ns_per_packet)/100.0
@@ -103,67 +158,207 @@ void run(BBServer& bbServer, const std::vector<RxPacket>& rxPackets)
 }
 
 
-int main()
+void benchmark(uint32_t num_flows)
 {
-#define PRINT_SIZE(x) std::cout << "sizeof(" << #x << ")=" << sizeof(x) << std::endl;
-    PRINT_SIZE(PhysicalInterface);
-    PRINT_SIZE(BBInterface);
-    //PRINT_SIZE(RxTrigger);
-    PRINT_SIZE(BBPort);
-    //PRINT_SIZE(UDPFlow);
-    //PRINT_SIZE(const RxPacket&);
+    FlowLayout layout(num_flows);
+
     auto bbServerPtr = std::make_unique<BBServer>();
     BBServer& bbServer = *bbServerPtr;
+    PhysicalInterface& physicalInterface = bbServer.getPhysicalInterface(0);
 
-    // Create UDP flows
-    for (auto flow_index = 0; flow_index != num_flows; ++flow_index)
+    // Create ports and UDP flows
+    for (auto interface_index = 0u; interface_index != layout.mNumInterfaces; ++interface_index)
     {
-        bbServer.getPhysicalInterface(0).getBBInterface(flow_index).addPort(generate_mac(flow_index + 1)).addUDPFlow(flow_index + 1);
+        for (auto port_index = 0u; port_index != layout.mNumPorts; ++port_index)
+        {
+            physicalInterface.getBBInterface(interface_index).addPort(generate_mac(interface_index, port_index));
+        }
     }
 
-    std::cout << "num_packets=" << num_packets << std::endl;
+    for (auto flow_index = 0u; flow_index != num_flows; ++flow_index)
+    {
+        auto& bbInterface = physicalInterface.getBBInterface(layout.interface_index(flow_index));
+        bbInterface.getBBPort(layout.port_index(flow_index)).addUDPFlow(layout.dst_port(flow_index));
+    }
+
+    // At least one packet per flow, and at least burst_size packets per flow for the smallest sweep.
+    auto packets_per_flow = std::max<uint32_t>(1, num_interfaces * burst_size / num_flows);
+
+    std::cout << "num_flows=" << num_flows
+        << " interfaces=" << layout.mNumInterfaces
+        << " ports_per_interface=" << layout.mNumPorts
+        << " packets_per_flow=" << packets_per_flow
+        << std::endl;
 
 
     // Create packet buffers and fill them with UDP data
     std::vector<std::vector<uint8_t>> packet_buffers;
-    packet_buffers.reserve(num_flows * burst_size);
+    std::vector<uint8_t> vlan_ids;
+    packet_buffers.reserve(num_flows * packets_per_flow);
+    vlan_ids.reserve(num_flows * packets_per_flow);
 
-    for (auto flow_index = 0; flow_index != num_flows; ++flow_index)
+    for (auto flow_index = 0u; flow_index != num_flows; ++flow_index)
     {
-        for (auto i = 0u; i != burst_size; ++i)
+        auto interface_index = layout.interface_index(flow_index);
+        auto dst_mac = generate_mac(interface_index, layout.port_index(flow_index));
+
+        for (auto i = 0u; i != packets_per_flow; ++i)
         {
-            packet_buffers.push_back(make_udp_packet(flow_index + 1));
+            packet_buffers.push_back(make_udp_packet(dst_mac, layout.dst_port(flow_index)));
+            vlan_ids.push_back(interface_index);
         }
     }
 
-    // Shuffling makes it harder to efficiently demultiplex packet batches.
-    // However, it does not seem to affect speed of per-packet demultiplexing.
-    srand(time(0));
-    std::random_shuffle(packet_buffers.begin(), packet_buffers.end());
-
     // Convert to list of RxPacket objects.
     std::vector<RxPacket> rxPackets;
     rxPackets.resize(packet_buffers.size());
     for (RxPacket& rxPacket : rxPackets)
     {
         auto i = &rxPacket - rxPackets.data();
-        rxPacket = RxPacket(packet_buffers[i].data(), packet_buffers[i].size(), packet_buffers[i][5] - 1);
+        rxPacket = RxPacket(packet_buffers[i].data(), packet_buffers[i].size(), vlan_ids[i]);
     }
 
-    // Run the benchmark a couple of times.
-    for (auto i = 0; i != 4; ++i)
+    // Shuffling makes it harder to efficiently demultiplex packet batches.
+    // However, it does not seem to affect speed of per-packet demultiplexing.
+    // The burst demux mode sorts the bursts by VLAN to get the batches back.
+    std::random_shuffle(rxPackets.begin(), rxPackets.end());
+
+    auto num_repeats = std::max<uint32_t>(1, num_packets / rxPackets.size());
+    auto num_runs = 2u;
+
+    std::cout << "demux=per_packet" << std::endl;
+    run(bbServer, rxPackets, num_repeats);
+
+    // Burst demux is measured for comparison only: with about one packet per VLAN
+    // in a shuffled burst it is slower than per-packet demux, see pop_burst.
+    std::cout << "demux=burst" << std::endl;
+    bbServer.setDemuxMode(DemuxMode::Burst);
+    run(bbServer, rxPackets, num_repeats);
+    bbServer.setDemuxMode(DemuxMode::PerPacket);
+
+    // Sharded mode with the default per-packet demux, from one core up to all cores.
+    auto num_cores = std::max(1u, std::thread::hardware_concurrency());
+    for (auto num_workers = 1u; ; num_workers = std::min(2 * num_workers, num_cores))
     {
-        run(bbServer, rxPackets);
+        std::cout << "num_workers=" << num_workers << " demux=per_packet" << std::endl;
+        run(bbServer, rxPackets, num_repeats, num_workers);
+        num_runs++;
+
+        if (num_workers == num_cores)
+        {
+            break;
+        }
+    }
+
+    // Verify the counters, summed over the shards.
+    uint64_t expected_packets = uint64_t(packets_per_flow) * num_repeats * num_tests * num_runs;
+    for (auto flow_index = 0u; flow_index != num_flows; ++flow_index)
+    {
+        auto interface_index = layout.interface_index(flow_index);
+        auto port_index = layout.port_index(flow_index);
+        auto udp_flow_index = layout.dst_port(flow_index) - 1;
+
+        ASSERT_EQ(bbServer.getUDPPacketsReceived(interface_index, port_index, udp_flow_index), expected_packets);
+    }
+
+    for (auto interface_index = 0u; interface_index != layout.mNumInterfaces; ++interface_index)
+    {
+        for (auto port_index = 0u; port_index != layout.mNumPorts; ++port_index)
+        {
+            auto stats = bbServer.getBBPortStats(interface_index, port_index);
+            ASSERT_EQ(stats.mUnicastCounter, stats.mUDPAccepted);
+            ASSERT_EQ(stats.mMulticastCounter, 0u);
+        }
+    }
+}
+
+
+// ARP, ICMP and UDP to an unknown port go to the stacks of the ports, while a stack
+// thread drains them. Every frame must be either handled by the stack thread or
+// counted as dropped.
+void test_stack()
+{
+    enum : uint32_t { num_ports = 4, num_repeats = 10000 };
+
+    BBServer bbServer;
+    BBInterface& bbInterface = bbServer.getPhysicalInterface(0).getBBInterface(0);
+    for (auto port_index = 0u; port_index != num_ports; ++port_index)
+    {
+        bbInterface.addPort(generate_mac(0, port_index)).addUDPFlow(1);
+    }
+
+    // Per repeat: one UDP packet per port and per stack frame type.
+    // The ARP broadcast goes to every port.
+    std::vector<std::vector<uint8_t>> packet_buffers;
+    packet_buffers.push_back(make_arp_packet());
+    for (auto port_index = 0u; port_index != num_ports; ++port_index)
+    {
+        auto dst_mac = generate_mac(0, port_index);
+        packet_buffers.push_back(make_udp_packet(dst_mac, 1));
+        packet_buffers.push_back(make_icmp_packet(dst_mac));
+        packet_buffers.push_back(make_udp_packet(dst_mac, 2));
+    }
+    auto stack_frames_per_repeat = num_ports + 2 * num_ports;
+
+    std::vector<RxPacket> rxPackets;
+    for (const auto& buffer : packet_buffers)
+    {
+        rxPackets.push_back(RxPacket(buffer.data(), buffer.size(), 0));
     }
 
-    // Verify the counters.
-    for (auto i = 0; i != num_flows; ++i)
+    std::array<uint64_t, 2> handled{}; // ARP, other
+    auto stackThread = std::make_unique<StackThread>(bbServer.getStacks(), [&handled](const PacketBuffer& buffer)
     {
-        BBPort& bbPort = bbServer.getPhysicalInterface(0).getBBInterface(i).getBBPort(0);
-        std::cout << "Flow " << (i + 1)
-        << " MAC=" << bbPort.stats().mUnicastCounter << " "
-        << " UDP=" << bbPort.stats().mUDPAccepted << " "
-        << " InvalidDestination=" << bbPort.stats().mMulticastCounter << " "
+        auto ethertype = Decode<EthernetHeader>(buffer.mBuffer).mEtherType;
+        handled[ethertype == Net16(0x0806) ? 0 : 1]++;
+    });
+
+    auto start_time = Clock::now();
+    bbServer.run(rxPackets, num_repeats);
+    auto elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start_time).count();
+
+    // Stopping the thread handles the frames that are still queued.
+    stackThread.reset();
+    auto processed = handled[0] + handled[1];
+
+    BBPort::Stats stats;
+    for (auto port_index = 0u; port_index != num_ports; ++port_index)
+    {
+        stats += bbServer.getBBPortStats(0, port_index);
+    }
+
+    std::cout << "stack:"
+        << " queued=" << stats.mStackQueued
+        << " dropped=" << stats.mStackDropped
+        << " handled_arp=" << handled[0]
+        << " handled_other=" << handled[1]
+        << " ns_per_packet=" << int(0.5 + 100.0 * elapsed_ns / (num_repeats * rxPackets.size())) / 100.0
         << std::endl;
+
+    ASSERT_EQ(stats.mStackQueued + stats.mStackDropped, uint64_t(stack_frames_per_repeat) * num_repeats);
+    ASSERT_EQ(stats.mStackQueued, processed);
+    ASSERT_EQ(stats.mUDPAccepted, uint64_t(num_ports) * num_repeats);
+}
+
+
+int main()
+{
+#define PRINT_SIZE(x) std::cout << "sizeof(" << #x << ")=" << sizeof(x) << std::endl;
+    PRINT_SIZE(PhysicalInterface);
+    PRINT_SIZE(BBInterface);
+    //PRINT_SIZE(RxTrigger);
+    PRINT_SIZE(BBPort);
+    //PRINT_SIZE(UDPFlow);
+    //PRINT_SIZE(const RxPacket&);
+
+    std::cout << "num_packets=" << num_packets << std::endl;
+
+    srand(time(0));
+
+    test_stack();
+
+    for (auto num_flows : { 48u, 256u, 1024u, 4096u, 16384u, 65536u })
+    {
+        benchmark(num_flows);
     }
 }
@@ -0,0 +1,304 @@
+#include "TxBackend.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+namespace {
+
+
+std::runtime_error system_error(const std::string& message)
+{
+    return std::runtime_error(message + ": " + strerror(errno));
+}
+
+
+class NullBackend : public TxBackend
+{
+public:
+    std::size_t send(const iovec*, std::size_t count) override
+    {
+        return count;
+    }
+
+    const char* name() const override
+    {
+        return "null";
+    }
+};
+
+
+// Raw AF_PACKET socket bound to the interface. Protocol 0, so that it does not receive.
+class PacketSocket
+{
+public:
+    explicit PacketSocket(const std::string& interface)
+    {
+        auto ifindex = if_nametoindex(interface.c_str());
+        if (ifindex == 0)
+        {
+            throw system_error("Unknown interface " + interface);
+        }
+
+        mFD = socket(AF_PACKET, SOCK_RAW, 0);
+        if (mFD < 0)
+        {
+            throw system_error("Failed to create packet socket");
+        }
+
+        // Hands the frames straight to the driver. We do our own shaping, and
+        // the qdisc would only add a lock and a queue.
+        int one = 1;
+        setsockopt(mFD, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+
+        memset(&mAddress, 0, sizeof(mAddress));
+        mAddress.sll_family = AF_PACKET;
+        mAddress.sll_ifindex = ifindex;
+    }
+
+    ~PacketSocket()
+    {
+        close(mFD);
+    }
+
+    PacketSocket(const PacketSocket&) = delete;
+    PacketSocket& operator=(const PacketSocket&) = delete;
+
+    // After the ring setup, if any.
+    void bind()
+    {
+        if (::bind(mFD, reinterpret_cast<const sockaddr*>(&mAddress), sizeof(mAddress)) != 0)
+        {
+            throw system_error("Failed to bind packet socket");
+        }
+    }
+
+    int fd() const { return mFD; }
+
+private:
+    int mFD = -1;
+    sockaddr_ll mAddress;
+};
+
+
+class SendmmsgBackend : public TxBackend
+{
+public:
+    explicit SendmmsgBackend(const std::string& interface) :
+        mSocket(interface)
+    {
+        mSocket.bind();
+
+        memset(mMessages, 0, sizeof(mMessages));
+    }
+
+    std::size_t send(const iovec* frames, std::size_t count) override
+    {
+        count = std::min<std::size_t>(count, max_batch_size);
+
+        for (auto i = 0u; i != count; ++i)
+        {
+            mMessages[i].msg_hdr.msg_iov = const_cast<iovec*>(&frames[i]);
+            mMessages[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        // sendmmsg stops at the first frame that does not fit in the socket buffer.
+        std::size_t sent = 0;
+        while (sent != count)
+        {
+            ++mSyscalls;
+            auto result = sendmmsg(mSocket.fd(), mMessages + sent, count - sent, MSG_DONTWAIT);
+            if (result <= 0)
+            {
+                break;
+            }
+            sent += result;
+        }
+
+        return sent;
+    }
+
+    const char* name() const override
+    {
+        return "sendmmsg";
+    }
+
+private:
+    PacketSocket mSocket;
+    mmsghdr mMessages[max_batch_size];
+};
+
+
+// TPACKET_V3 transmit ring. For transmission, V3 uses fixed size frames like V2.
+// The kernel builds the skbs from the ring pages, so the frames are copied once,
+// from the packet templates into the mapping.
+class TxRingBackend : public TxBackend
+{
+public:
+    enum : uint32_t
+    {
+        frame_size = 2048,
+        block_size = 64 * 1024,
+        block_count = 64, // 2048 frames, 4 MB
+        frame_count = block_size / frame_size * block_count,
+        data_offset = TPACKET3_HDRLEN - sizeof(sockaddr_ll)
+    };
+
+    explicit TxRingBackend(const std::string& interface) :
+        mSocket(interface)
+    {
+        int version = TPACKET_V3;
+        if (setsockopt(mSocket.fd(), SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0)
+        {
+            throw system_error("Failed to set TPACKET_V3");
+        }
+
+        // Frames with a bad format are skipped instead of stopping the ring.
+        int one = 1;
+        setsockopt(mSocket.fd(), SOL_PACKET, PACKET_LOSS, &one, sizeof(one));
+
+        tpacket_req3 request;
+        memset(&request, 0, sizeof(request));
+        request.tp_block_size = block_size;
+        request.tp_block_nr = block_count;
+        request.tp_frame_size = frame_size;
+        request.tp_frame_nr = frame_count;
+        if (setsockopt(mSocket.fd(), SOL_PACKET, PACKET_TX_RING, &request, sizeof(request)) != 0)
+        {
+            throw system_error("Failed to set up PACKET_TX_RING");
+        }
+
+        auto ring = mmap(nullptr, std::size_t(block_size) * block_count, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED | MAP_POPULATE, mSocket.fd(), 0);
+        if (ring == MAP_FAILED)
+        {
+            // MAP_LOCKED fails without CAP_IPC_LOCK or a high enough RLIMIT_MEMLOCK.
+            ring = mmap(nullptr, std::size_t(block_size) * block_count, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mSocket.fd(), 0);
+        }
+        if (ring == MAP_FAILED)
+        {
+            throw system_error("Failed to mmap PACKET_TX_RING");
+        }
+        mRing = static_cast<uint8_t*>(ring);
+
+        mSocket.bind();
+    }
+
+    ~TxRingBackend()
+    {
+        munmap(mRing, std::size_t(block_size) * block_count);
+    }
+
+    std::size_t send(const iovec* frames, std::size_t count) override
+    {
+        std::size_t queued = 0;
+        bool kicked = false;
+
+        while (queued != count)
+        {
+            auto header = frame(mIndex);
+            auto status = __atomic_load_n(&header->tp_status, __ATOMIC_ACQUIRE);
+
+            if (status & TP_STATUS_WRONG_FORMAT)
+            {
+                status = TP_STATUS_AVAILABLE;
+            }
+
+            if (status != TP_STATUS_AVAILABLE)
+            {
+                // The ring is full. Let the kernel send what is queued, then try once more.
+                if (kicked)
+                {
+                    break;
+                }
+                kick();
+                kicked = true;
+                continue;
+            }
+
+            auto size = std::min<std::size_t>(frames[queued].iov_len, frame_size - data_offset);
+            memcpy(reinterpret_cast<uint8_t*>(header) + data_offset, frames[queued].iov_base, size);
+            header->tp_len = size;
+            header->tp_snaplen = size;
+            header->tp_next_offset = 0;
+            __atomic_store_n(&header->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+            mIndex = (mIndex + 1) % frame_count;
+            ++queued;
+            mPending = true;
+        }
+
+        if (mPending)
+        {
+            kick();
+        }
+
+        return queued;
+    }
+
+    const char* name() const override
+    {
+        return "tx_ring";
+    }
+
+private:
+    tpacket3_hdr* frame(uint32_t index)
+    {
+        return reinterpret_cast<tpacket3_hdr*>(mRing + std::size_t(index) * frame_size);
+    }
+
+    // Sends the frames with TP_STATUS_SEND_REQUEST.
+    void kick()
+    {
+        ++mSyscalls;
+        if (::send(mSocket.fd(), nullptr, 0, MSG_DONTWAIT) >= 0 || errno != EAGAIN)
+        {
+            mPending = false;
+        }
+    }
+
+    PacketSocket mSocket;
+    uint8_t* mRing = nullptr;
+    uint32_t mIndex = 0;
+    bool mPending = false;
+};
+
+
+} // namespace
+
+
+std::unique_ptr<TxBackend> create_tx_backend(const std::string& spec)
+{
+    auto colon = spec.find(':');
+    auto type = spec.substr(0, colon);
+    auto interface = colon == std::string::npos ? std::string() : spec.substr(colon + 1);
+
+    if (type == "null")
+    {
+        return std::unique_ptr<TxBackend>(new NullBackend);
+    }
+
+    if (interface.empty())
+    {
+        throw std::runtime_error("Invalid backend: " + spec + " (expected null, sendmmsg:<interface> or tx_ring:<interface>)");
+    }
+
+    if (type == "sendmmsg")
+    {
+        return std::unique_ptr<TxBackend>(new SendmmsgBackend(interface));
+    }
+
+    if (type == "tx_ring")
+    {
+        return std::unique_ptr<TxBackend>(new TxRingBackend(interface));
+    }
+
+    throw std::runtime_error("Invalid backend: " + spec + " (expected null, sendmmsg:<interface> or tx_ring:<interface>)");
+}
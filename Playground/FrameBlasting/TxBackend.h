@@ -0,0 +1,42 @@
+#ifndef TXBACKEND_H
+#define TXBACKEND_H
+
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <sys/uio.h>
+
+
+// Transmits batches of Ethernet frames (without FCS).
+class TxBackend
+{
+public:
+    enum { max_batch_size = 64 };
+
+    virtual ~TxBackend() {}
+
+    // Hands up to max_batch_size frames to the kernel. Never blocks: returns the
+    // number of frames that were accepted, the others are dropped.
+    virtual std::size_t send(const iovec* frames, std::size_t count) = 0;
+
+    virtual const char* name() const = 0;
+
+    uint64_t get_syscalls() const { return mSyscalls; }
+
+protected:
+    uint64_t mSyscalls = 0;
+};
+
+
+// Creates a backend from a spec:
+// - "null": counts the frames, does not send them
+// - "sendmmsg:<interface>": one sendmmsg call per batch on a raw AF_PACKET socket
+// - "tx_ring:<interface>": copies the frames into a PACKET_TX_RING (TPACKET_V3)
+//   mapping, then one send call per batch
+// Throws std::runtime_error if the spec is invalid or the socket cannot be set up.
+// The raw sockets need CAP_NET_RAW.
+std::unique_ptr<TxBackend> create_tx_backend(const std::string& spec);
+
+
+#endif // TXBACKEND_H
@@ -1,12 +1,19 @@
+#include "TxBackend.h"
 #include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <chrono>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <map>
+#include <memory>
+#include <stdexcept>
 #include <string>
 #include <thread>
 #include <vector>
+#include <pthread.h>
 
 
 // How can we do Frame Blasting at 100 Gbit/s?
@@ -31,38 +38,105 @@
 // Simplifications:
 // - no size or timing modifiers
 // - only have one frame per stream/flow
-// - fake packet, fake socket
+// - fake packet: all packets are the same broadcast frame, only the size differs
+// - the socket is the null sink, unless a TX backend is chosen on the command line
 // - no Rx
 
 
 using Clock = std::chrono::steady_clock;
 
-int64_t mCounters[1025];
 
 struct Packet
 {
+    enum { max_size = 1514 };
+
     std::size_t size() const { return mSize; }
 
+    const uint8_t* data() const { return get_frame(); }
+
     void set_size(std::size_t n)
     {
+        assert(n <= max_size);
         mSize = n;
     }
 
 private:
+    // Broadcast from a locally administered address, with the local experimental EtherType.
+    static const uint8_t* get_frame()
+    {
+        struct Frame
+        {
+            Frame()
+            {
+                memset(mData, 0, sizeof(mData));
+                memset(mData, 0xFF, 6);
+                mData[6] = 0x02;
+                mData[11] = 0x01;
+                mData[12] = 0x88;
+                mData[13] = 0xB5;
+            }
+
+            uint8_t mData[max_size];
+        };
+
+        static const Frame frame;
+        return frame.mData;
+    }
+
     std::size_t mSize = 0;
 };
 
 
 struct Socket
 {
+    Socket(int id, std::unique_ptr<TxBackend> backend) :
+        mId(id),
+        mBackend(std::move(backend))
+    {
+    }
+
     void send_batch(Clock::time_point ts, const std::vector<Packet*>& packets);
 
+    int mId;
+    std::unique_ptr<TxBackend> mBackend;
     uint64_t mTxBytes = 0;
+    uint64_t mTxPackets = 0;
+    uint64_t mDropped = 0;
+    uint64_t mSyscalls = 0; // of the backend, at mStartTime
     Clock::time_point mStartTime = Clock::time_point();
+    int64_t mCounters[1025] = {};
+};
+
+
+// Counts how late the packets are pulled. Bucket i has the packets that
+// were pulled at most 2^i ns after their transmission time.
+struct LatenessHistogram
+{
+    enum { num_buckets = 32 };
+
+    void add(std::chrono::nanoseconds lateness)
+    {
+        auto ns = static_cast<uint64_t>(lateness.count());
+        auto i = ns <= 1 ? 0 : 64 - __builtin_clzll(ns - 1);
+        mCounts[std::min(i, int(num_buckets) - 1)]++;
+    }
+
+    LatenessHistogram& operator+=(const LatenessHistogram& rhs)
+    {
+        for (auto i = 0; i != num_buckets; ++i)
+        {
+            mCounts[i] += rhs.mCounts[i];
+        }
+        return *this;
+    }
+
+    void print() const;
+
+    int64_t mCounts[num_buckets] = {};
 };
 
 
-struct BBInterface;
+struct InterfaceShaper;
 
 
 // Simplified implementation for a BB flow.
@@ -85,24 +159,61 @@ struct Flow
         mNextTransmission = start_time;
     }
 
+    Clock::time_point next_transmission() const
+    {
+        return mNextTransmission;
+    }
+
+    // Mbit/s
+    double get_bitrate() const
+    {
+        return 8 * mBytesPerSecond / 1e6;
+    }
+
+    std::size_t get_packet_size() const
+    {
+        return mPacket.size();
+    }
+
+    int64_t get_sent_bytes() const
+    {
+        return mSentBytes;
+    }
+
+    // Shaper of the interface on the TX core that owns the flow.
+    void set_shaper(InterfaceShaper& shaper)
+    {
+        mShaper = &shaper;
+    }
+
+    InterfaceShaper& get_shaper() const
+    {
+        return *mShaper;
+    }
+
+    bool is_due(Clock::time_point current_time) const
+    {
+        return current_time >= mNextTransmission;
+    }
 
     template<typename F>
     void pull(F f, Clock::time_point current_time)
     {
-        for (auto i = 0; i != 3; ++i) // allow getting multiple packets at once (catch-up)
+        for (auto i = 0; i != 3 && is_due(current_time); ++i) // allow getting multiple packets at once (catch-up)
         {
-            if (current_time >= mNextTransmission)
-            {
-                f(mPacket);
-                mNextTransmission += mFrameInterval;
-            }
-            else
-            {
-                break;
-            }
+            pull_packet(f);
         }
     }
 
+    // Sends the next packet without checking whether it is due.
+    template<typename F>
+    void pull_packet(F f)
+    {
+        f(mPacket, mNextTransmission);
+        mSentBytes += mPacket.size();
+        mNextTransmission += mFrameInterval;
+    }
+
 private:
     void update_frame_interval()
     {
@@ -113,43 +224,340 @@ private:
     double mBytesPerSecond = 1e9 / 8;
     Clock::time_point mNextTransmission{};
     std::chrono::nanoseconds mFrameInterval{};
+    int64_t mSentBytes = 0;
+    InterfaceShaper* mShaper = nullptr;
 };
 
 
-struct BBInterface
+// Calendar queue of the flows, keyed on their next transmission time.
+// - level 0 has one slot per tick of 256 ns, for the next 1024 ticks (~260 us)
+// - level 1 has one slot per level 0 rotation, for the next 1024 rotations (~270 ms)
+// - flows that are even further away wait in the overflow list
+// A level 1 slot is moved to level 0 when its rotation starts, and the overflow
+// list is redistributed when level 1 wraps around. So advance() only visits the
+// slots that elapsed and the flows in them, no matter how many flows are idle.
+struct TimingWheel
 {
-    template<typename F>
-    void pull(F send_function, Clock::time_point current_time)
+    explicit TimingWheel(Clock::time_point current_time) :
+        mCurrentTick(to_tick(current_time)),
+        mLevel0(num_slots),
+        mLevel1(num_slots)
+    {
+    }
+
+    TimingWheel(const TimingWheel&) = delete;
+    TimingWheel& operator=(const TimingWheel&) = delete;
+
+    void insert(Flow& flow)
+    {
+        auto tick = to_tick(flow.next_transmission());
+        if (tick - mCurrentTick < num_slots)
+        {
+            // Flows that are already due go to the current slot.
+            push_back(mLevel0[std::max(tick, mCurrentTick) & slot_mask], flow);
+        }
+        else if ((tick >> level_bits) - (mCurrentTick >> level_bits) < num_slots)
+        {
+            push_back(mLevel1[(tick >> level_bits) & slot_mask], flow);
+        }
+        else
+        {
+            push_back(mOverflow, flow);
+        }
+    }
+
+    // Appends the flows of the slots that elapsed before current_time to due_flows.
+    // So a flow is pulled at most one tick after it is due, and the flows of the
+    // current tick are not visited over and over.
+    void advance(Clock::time_point current_time, std::vector<Flow*>& due_flows)
     {
-        // Pull a packet from each ready-to-transmit flow.
-        if (check_token_bucket(current_time))
+        auto current_tick = to_tick(current_time);
+
+        while (mCurrentTick < current_tick)
         {
-            for (Flow& flow : mFlows)
+            Block* block = take(mLevel0[mCurrentTick & slot_mask]);
+            while (block)
             {
-                flow.pull([this, send_function](Packet& packet) {
-                    mBucketSize -= packet.size();
-                    send_function(packet);
-                }, current_time);
+                due_flows.insert(due_flows.end(), block->mFlows, block->mFlows + block->mSize);
+                block = release(block);
+            }
+
+            ++mCurrentTick;
+
+            if ((mCurrentTick & slot_mask) == 0)
+            {
+                if (((mCurrentTick >> level_bits) & slot_mask) == 0)
+                {
+                    reinsert(mOverflow);
+                }
+                reinsert(mLevel1[(mCurrentTick >> level_bits) & slot_mask]);
             }
         }
     }
 
-    bool is_rate_limited() const
+private:
+    enum : int64_t
+    {
+        tick_shift = 8, // 256 ns
+        level_bits = 10,
+        num_slots = int64_t(1) << level_bits,
+        slot_mask = num_slots - 1
+    };
+
+    // The slots are lists of blocks from a shared free list. Vectors per slot would
+    // each keep the capacity of the largest burst they ever had, which adds up to
+    // gigabytes when many flows have the same interval. The free list is LIFO, so
+    // a new block is usually still in the cache.
+    struct Block
+    {
+        enum { capacity = 30 }; // 256 bytes
+
+        Block* mNext;
+        uint32_t mSize;
+        Flow* mFlows[capacity];
+    };
+
+    struct Slot
+    {
+        Block* mHead = nullptr;
+        Block* mTail = nullptr;
+    };
+
+    static int64_t to_tick(Clock::time_point time)
     {
-        return mBytesPerFourNanoseconds != 0;
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count() >> tick_shift;
     }
 
-    Flow& add_flow()
+    void push_back(Slot& slot, Flow& flow)
     {
-        mFlows.resize(mFlows.size() + 1);
-        mFlows.shrink_to_fit();
-        return mFlows.back();
+        if (!slot.mTail || slot.mTail->mSize == Block::capacity)
+        {
+            Block* block = allocate();
+            if (slot.mTail)
+            {
+                slot.mTail->mNext = block;
+            }
+            else
+            {
+                slot.mHead = block;
+            }
+            slot.mTail = block;
+        }
+
+        slot.mTail->mFlows[slot.mTail->mSize++] = &flow;
+    }
+
+    static Block* take(Slot& slot)
+    {
+        Block* result = slot.mHead;
+        slot.mHead = slot.mTail = nullptr;
+        return result;
+    }
+
+    void reinsert(Slot& slot)
+    {
+        // The overflow flows may go back to the overflow list, so take them first.
+        Block* block = take(slot);
+        while (block)
+        {
+            for (auto i = 0u; i != block->mSize; ++i)
+            {
+                insert(*block->mFlows[i]);
+            }
+            block = release(block);
+        }
+    }
+
+    Block* allocate()
+    {
+        Block* block = mFreeBlocks;
+        if (block)
+        {
+            mFreeBlocks = block->mNext;
+        }
+        else
+        {
+            mBlocks.emplace_back(new Block);
+            block = mBlocks.back().get();
+        }
+
+        block->mNext = nullptr;
+        block->mSize = 0;
+        return block;
+    }
+
+    // Returns the next block of the list.
+    Block* release(Block* block)
+    {
+        Block* next = block->mNext;
+        block->mNext = mFreeBlocks;
+        mFreeBlocks = block;
+        return next;
+    }
+
+    int64_t mCurrentTick; // earlier slots have been processed
+    std::vector<Slot> mLevel0;
+    std::vector<Slot> mLevel1;
+    Slot mOverflow;
+    Block* mFreeBlocks = nullptr;
+    std::vector<std::unique_ptr<Block>> mBlocks;
+};
+
+
+// The part of a BBInterface token bucket on one TX core.
+// It refills with a share of the interface rate, which the rate accountant
+// adjusts periodically. The core only reads its share when the bucket runs
+// empty, so nothing shared is written per packet: the offered bytes and the
+// backlog are single-writer counters that the accountant reads once per period.
+//
+// While the bucket is empty, the due flows wait and are served by deficit
+// round robin: each turn a flow may send up to quantum bytes, so all flows
+// get the same byte rate (at most their own), whatever their packet size.
+struct InterfaceShaper
+{
+    // Bytes per flow and turn, at least one packet of any size.
+    enum : int64_t { quantum = Packet::max_size };
+
+    // Pulls a flow that is due and hands it to reschedule_function afterwards.
+    // If the token bucket is empty, the flow joins the round of the waiting
+    // flows. Returns true if it is the first one, then the caller must call
+    // pull_waiting() until that succeeds.
+    template<typename F, typename G>
+    bool pull(Flow& flow, F send_function, G reschedule_function, Clock::time_point current_time)
+    {
+        update_backlog(current_time);
+        if (mNumWaiting != 0 || !check_token_bucket(current_time))
+        {
+            // Also counts as demand, otherwise a core with a small share could not get a larger one.
+            add_offered_bytes(flow.get_packet_size());
+            push_waiting(flow, quantum);
+            return mNumWaiting == 1;
+        }
+
+        pull_flow(flow, send_function, current_time);
+        reschedule_function(flow);
+        return false;
+    }
+
+    // Serves the waiting flows until they have caught up. A flow that is no
+    // longer due leaves the round and goes back to reschedule_function.
+    // Returns false if the token bucket ran empty first.
+    template<typename F, typename G>
+    bool pull_waiting(F send_function, G reschedule_function, Clock::time_point current_time)
+    {
+        update_backlog(current_time);
+        while (mNumWaiting != 0)
+        {
+            WaitingFlow& waiting = mWaitingFlows[mFirstWaiting];
+            Flow& flow = *waiting.mFlow;
+
+            if (!flow.is_due(current_time))
+            {
+                pop_waiting();
+                reschedule_function(flow);
+                continue;
+            }
+
+            auto packet_size = static_cast<int64_t>(flow.get_packet_size());
+            if (waiting.mDeficit < packet_size)
+            {
+                // End of its turn, the next one starts at the back of the round.
+                auto deficit = waiting.mDeficit + quantum;
+                pop_waiting();
+                push_waiting(flow, deficit);
+                continue;
+            }
+
+            if (!check_token_bucket(current_time))
+            {
+                return false;
+            }
+
+            waiting.mDeficit -= packet_size;
+            flow.pull_packet([this, send_function](Packet& packet, Clock::time_point transmission_time) {
+                mBucketSize -= packet.size();
+                add_offered_bytes(packet.size());
+                send_function(packet, transmission_time);
+            });
+        }
+
+        return true;
+    }
+
+    void add_flow(Flow& flow)
+    {
+        // Each flow waits at most once.
+        mWaitingFlows.resize(++mNumFlows);
+        flow.set_shaper(*this);
+    }
+
+    // Accountant side
+    void set_share(int64_t bytes_per_65536_ns, int64_t max_bucket_size)
+    {
+        mBytesPer65536Nanoseconds.store(bytes_per_65536_ns, std::memory_order_relaxed);
+        mMaxBucketSize.store(max_bucket_size, std::memory_order_relaxed);
+    }
+
+    int64_t get_offered_bytes() const
+    {
+        return mOfferedBytes.load(std::memory_order_relaxed);
+    }
+
+    // Sum over the waiting flows of the time they waited, in ns.
+    int64_t get_backlog() const
+    {
+        return mBacklog.load(std::memory_order_relaxed);
     }
 
 private:
+    struct WaitingFlow
+    {
+        Flow* mFlow;
+        int64_t mDeficit; // bytes that the flow may still send in this turn
+    };
+
+    void push_waiting(Flow& flow, int64_t deficit)
+    {
+        auto& waiting = mWaitingFlows[(mFirstWaiting + mNumWaiting++) % mWaitingFlows.size()];
+        waiting.mFlow = &flow;
+        waiting.mDeficit = deficit;
+    }
+
+    void pop_waiting()
+    {
+        mFirstWaiting = (mFirstWaiting + 1) % mWaitingFlows.size();
+        mNumWaiting--;
+    }
+
+    template<typename F>
+    void pull_flow(Flow& flow, F send_function, Clock::time_point current_time)
+    {
+        flow.pull([this, send_function](Packet& packet, Clock::time_point transmission_time) {
+            mBucketSize -= packet.size();
+            add_offered_bytes(packet.size());
+            send_function(packet, transmission_time);
+        }, current_time);
+    }
+
+    void add_offered_bytes(std::size_t n)
+    {
+        // Only this core writes, so no read-modify-write is needed.
+        mOfferedBytes.store(mOfferedBytes.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    void update_backlog(Clock::time_point current_time)
+    {
+        if (mNumWaiting != 0)
+        {
+            auto elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(current_time - mLastBacklogUpdate).count();
+            mBacklog.store(mBacklog.load(std::memory_order_relaxed) + int64_t(mNumWaiting) * elapsed_ns, std::memory_order_relaxed);
+        }
+        mLastBacklogUpdate = current_time;
+    }
+
     bool check_token_bucket(Clock::time_point current_time)
     {
-        if (mBytesPerFourNanoseconds != 0 && mBucketSize >= 0)
+        if (mBucketSize >= 0)
         {
             return true;
         }
@@ -159,10 +567,11 @@ private:
 
     bool update_bucket(Clock::time_point current_time)
     {
-        std::chrono::nanoseconds elapsed_ns = current_time - mLastUpdate;
+        // Limited, so that the product fits in 64 bits. The bucket is full by then anyway.
+        auto elapsed_ns = std::min<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(current_time - mLastUpdate).count(), 1000000000);
 
-        auto bucket_increment = 4 * elapsed_ns.count() * mBytesPerFourNanoseconds;
-        auto new_bucket = std::min(mBucketSize + bucket_increment, mMaxBucketSize);
+        auto increment = elapsed_ns * mBytesPer65536Nanoseconds.load(std::memory_order_relaxed) + mRemainder;
+        auto new_bucket = std::min(mBucketSize + (increment >> 16), mMaxBucketSize.load(std::memory_order_relaxed));
         if (new_bucket < 0)
         {
             // We must wait a little longer.
@@ -170,55 +579,203 @@ private:
         }
 
         mBucketSize = new_bucket;
+        mRemainder = increment & 0xFFFF;
         mLastUpdate = current_time;
         return true;
     }
 
-    int64_t mBytesPerFourNanoseconds = 1;
-    int64_t mMaxBucketSize = 32 * 1024;
-    int64_t mBucketSize = mMaxBucketSize;
+    int64_t mBucketSize = 0;
+    int64_t mRemainder = 0; // fraction of a byte, in 1/65536
     Clock::time_point mLastUpdate = Clock::time_point();
+    std::atomic<int64_t> mOfferedBytes{0};
+    std::atomic<int64_t> mBacklog{0};
+    Clock::time_point mLastBacklogUpdate = Clock::time_point();
+    std::vector<WaitingFlow> mWaitingFlows; // ring of the flows in the round, due but out of tokens
+    std::size_t mFirstWaiting = 0;
+    std::size_t mNumWaiting = 0;
+    std::size_t mNumFlows = 0;
+
+    // Written by the accountant
+    std::atomic<int64_t> mBytesPer65536Nanoseconds{0};
+    std::atomic<int64_t> mMaxBucketSize{0};
+};
+
+
+struct BBInterface
+{
+    void set_bitrate(int64_t mbps)
+    {
+        mBytesPer65536Nanoseconds = mbps * 65536 / 8000;
+    }
+
+    // Mbit/s
+    double get_bitrate() const
+    {
+        return mBytesPer65536Nanoseconds * 8000.0 / 65536;
+    }
+
+    bool is_rate_limited() const
+    {
+        return mBytesPer65536Nanoseconds != 0;
+    }
+
+    Flow& add_flow()
+    {
+        mFlows.resize(mFlows.size() + 1);
+        mFlows.shrink_to_fit();
+        return mFlows.back();
+    }
+
+    std::vector<Flow>& getFlows()
+    {
+        return mFlows;
+    }
+
+    const std::vector<Flow>& getFlows() const
+    {
+        return mFlows;
+    }
+
+    // Shaper of a TX core that has flows of this interface.
+    void add_shaper(InterfaceShaper& shaper)
+    {
+        mShapers.push_back(&shaper);
+        mLastOfferedBytes.push_back(shaper.get_offered_bytes());
+        mDemands.push_back(0);
+        mLastBacklogs.push_back(shaper.get_backlog());
+        mBacklogs.push_back(0);
+    }
+
+    // Splits the rate and the bucket size over the shapers, in proportion to
+    // their backlog: the number of flows that wait for tokens, integrated over
+    // the period. Under saturation that is the number of flows of each core,
+    // so all flows get the same rate, whichever core they are on. Offered bytes
+    // would not do, those follow the share that a core already has. If no flow
+    // waited, the split follows the offered bytes instead.
+    // Both are moving averages over about 8 calls, so that a core that was not
+    // scheduled for a moment does not lose its share. Each shaper keeps at
+    // least 1/8 of an equal share, so that a core whose flows were idle can
+    // start sending right away.
+    // Called by the rate accountant only.
+    void redistribute()
+    {
+        auto num_shapers = mShapers.size();
+        if (num_shapers == 0)
+        {
+            return;
+        }
+
+        int64_t total_demand = 0;
+        int64_t total_backlog = 0;
+        for (auto i = 0u; i != num_shapers; ++i)
+        {
+            auto offered_bytes = mShapers[i]->get_offered_bytes();
+            mDemands[i] += offered_bytes - mLastOfferedBytes[i] - mDemands[i] / 8;
+            mLastOfferedBytes[i] = offered_bytes;
+            total_demand += mDemands[i];
+
+            auto backlog = mShapers[i]->get_backlog();
+            mBacklogs[i] += backlog - mLastBacklogs[i] - mBacklogs[i] / 8;
+            mLastBacklogs[i] = backlog;
+            total_backlog += mBacklogs[i];
+        }
+
+        const auto& weights = total_backlog != 0 ? mBacklogs : mDemands;
+        auto total = total_backlog != 0 ? total_backlog : total_demand;
+        auto min_weight = 1.0 / (8 * num_shapers);
+
+        // The minimum raises the sum above 1, so normalize.
+        auto sum = 0.0;
+        for (auto i = 0u; i != num_shapers; ++i)
+        {
+            sum += total == 0 ? 1.0 / num_shapers : std::max(min_weight, double(weights[i]) / total);
+        }
+
+        for (auto i = 0u; i != num_shapers; ++i)
+        {
+            auto weight = (total == 0 ? 1.0 / num_shapers : std::max(min_weight, double(weights[i]) / total)) / sum;
+            mShapers[i]->set_share(int64_t(weight * mBytesPer65536Nanoseconds), int64_t(weight * mMaxBucketSize));
+        }
+    }
+
+private:
+    int64_t mBytesPer65536Nanoseconds = 4 * 65536; // 32 Gbit/s
+    int64_t mMaxBucketSize = 32 * 1024;
     std::vector<Flow> mFlows;
+    std::vector<InterfaceShaper*> mShapers; // one per TX core with flows of this interface
+    std::vector<int64_t> mLastOfferedBytes;
+    std::vector<int64_t> mDemands;
+    std::vector<int64_t> mLastBacklogs;
+    std::vector<int64_t> mBacklogs;
 };
 
 
-struct PhysicalInterface
+// TX thread with its own timing wheel, shapers, batch and socket.
+struct TxCore
 {
-    PhysicalInterface(std::size_t num_interfaces) :
-        mBBInterfaces(num_interfaces),
-        mThread()
+    TxCore(int id, std::size_t num_interfaces, std::unique_ptr<TxBackend> backend) :
+        mTimingWheel(Clock::now()),
+        mShapers(num_interfaces),
+        mSocket(id, std::move(backend)),
+        mId(id)
     {
+        mWaitingShapers.reserve(num_interfaces);
     }
 
-    PhysicalInterface(const PhysicalInterface&) = delete;
-    PhysicalInterface& operator=(const PhysicalInterface&) = delete;
+    TxCore(const TxCore&) = delete;
+    TxCore& operator=(const TxCore&) = delete;
 
-    ~PhysicalInterface()
+    ~TxCore()
     {
         stop();
     }
 
+    void add_flow(Flow& flow, BBInterface& bbinterface, std::size_t interface_index)
+    {
+        if (!mShapers[interface_index])
+        {
+            mShapers[interface_index].reset(new InterfaceShaper);
+            bbinterface.add_shaper(*mShapers[interface_index]);
+        }
+
+        mShapers[interface_index]->add_flow(flow);
+        mTimingWheel.insert(flow);
+    }
+
     void start()
     {
-        mThread = std::thread(&PhysicalInterface::run_thread, this);
+        mThread = std::thread(&TxCore::run_thread, this);
     }
 
     void stop()
     {
-        if (!mQuit.exchange(true))
+        if (!mQuit.exchange(true) && mThread.joinable())
         {
             mThread.join();
         }
     }
 
-    std::vector<BBInterface>& getBBInterfaces()
+    // Only valid after stop().
+    const LatenessHistogram& get_lateness() const
     {
-        return mBBInterfaces;
+        return mLateness;
     }
 
 private:
+    void pin_thread()
+    {
+        auto num_cpus = std::max(1u, std::thread::hardware_concurrency());
+
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(mId % num_cpus, &cpu_set);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+    }
+
     void run_thread()
     {
+        pin_thread();
+
         std::vector<Packet*> packets; // memory is reused every time
         packets.reserve(32);
 
@@ -226,17 +783,44 @@ private:
         {
             auto now = Clock::now();
 
-            for (BBInterface& bbinterface : mBBInterfaces)
+            auto send_function = [&](Packet& packet, Clock::time_point transmission_time) {
+                mLateness.add(now - transmission_time);
+                packets.push_back(&packet);
+                if (packets.size() == packets.capacity()) {
+                    mSocket.send_batch(now, packets);
+                    packets.clear();
+                }
+            };
+
+            auto reschedule_function = [this](Flow& flow) {
+                mTimingWheel.insert(flow);
+            };
+
+            // First the shapers that ran out of tokens earlier, they keep their order.
+            auto num_waiting = 0u;
+            for (auto i = 0u; i != mWaitingShapers.size(); ++i)
+            {
+                InterfaceShaper& shaper = *mWaitingShapers[i];
+                if (!shaper.pull_waiting(send_function, reschedule_function, now))
+                {
+                    mWaitingShapers[num_waiting++] = &shaper;
+                }
+            }
+            mWaitingShapers.resize(num_waiting);
+
+            // Only the flows that are due are visited.
+            mTimingWheel.advance(now, mDueFlows);
+
+            for (auto i = 0u; i != mDueFlows.size(); ++i)
             {
-                bbinterface.pull([&](Packet& packet) {
-                    packets.push_back(&packet);
-                    mCounters[packet.size()]++;
-                    if (packets.size() == packets.capacity()) {
-                        mSocket.send_batch(now, packets);
-                        packets.clear();
-                    }
-                }, now);
+                Flow& flow = *mDueFlows[i];
+                InterfaceShaper& shaper = flow.get_shaper();
+                if (shaper.pull(flow, send_function, reschedule_function, now))
+                {
+                    mWaitingShapers.push_back(&shaper);
+                }
             }
+            mDueFlows.clear();
 
             if (!packets.empty())
             {
@@ -247,33 +831,170 @@ private:
     }
 
     std::atomic<bool> mQuit{false};
-    std::vector<BBInterface> mBBInterfaces;
+    TimingWheel mTimingWheel;
+    std::vector<Flow*> mDueFlows; // memory is reused every time
+    std::vector<std::unique_ptr<InterfaceShaper>> mShapers; // per BBInterface, if it has flows here
+    std::vector<InterfaceShaper*> mWaitingShapers; // out of tokens, with waiting flows
+    LatenessHistogram mLateness;
     Socket mSocket;
+    int mId;
     std::thread mThread;
 };
 
 
+struct PhysicalInterface
+{
+    // Each core gets its own backend, see create_tx_backend.
+    PhysicalInterface(std::size_t num_interfaces, std::size_t num_cores = 1, const std::string& backend = "null") :
+        mBBInterfaces(num_interfaces)
+    {
+        for (auto i = 0u; i != num_cores; ++i)
+        {
+            mTxCores.emplace_back(new TxCore(i, num_interfaces, create_tx_backend(backend)));
+        }
+    }
+
+    PhysicalInterface(const PhysicalInterface&) = delete;
+    PhysicalInterface& operator=(const PhysicalInterface&) = delete;
+
+    ~PhysicalInterface()
+    {
+        stop();
+    }
+
+    void start()
+    {
+        // Round robin over all flows, so that the flows of an interface are spread over the cores.
+        auto flow_index = 0u;
+        for (auto i = 0u; i != mBBInterfaces.size(); ++i)
+        {
+            BBInterface& bbinterface = mBBInterfaces[i];
+            for (Flow& flow : bbinterface.getFlows())
+            {
+                mTxCores[flow_index++ % mTxCores.size()]->add_flow(flow, bbinterface, i);
+            }
+            bbinterface.redistribute();
+        }
+
+        for (auto& tx_core : mTxCores)
+        {
+            tx_core->start();
+        }
+
+        // With one core, each shaper has the full rate of its interface.
+        if (mTxCores.size() > 1)
+        {
+            mAccountantThread = std::thread(&PhysicalInterface::run_accountant, this);
+        }
+    }
+
+    void stop()
+    {
+        if (mQuit.exchange(true))
+        {
+            return;
+        }
+
+        for (auto& tx_core : mTxCores)
+        {
+            tx_core->stop();
+        }
+
+        if (mAccountantThread.joinable())
+        {
+            mAccountantThread.join();
+        }
+    }
+
+    std::vector<BBInterface>& getBBInterfaces()
+    {
+        return mBBInterfaces;
+    }
+
+    // Only valid after stop().
+    LatenessHistogram get_lateness() const
+    {
+        LatenessHistogram result;
+        for (auto& tx_core : mTxCores)
+        {
+            result += tx_core->get_lateness();
+        }
+        return result;
+    }
+
+private:
+    // Global rate accountant: moves the tokens of each interface to the cores
+    // whose flows use them. The TX cores never wait for it.
+    void run_accountant()
+    {
+        while (!mQuit)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(250));
+
+            for (BBInterface& bbinterface : mBBInterfaces)
+            {
+                bbinterface.redistribute();
+            }
+        }
+    }
+
+    std::atomic<bool> mQuit{false};
+    std::vector<BBInterface> mBBInterfaces;
+    std::vector<std::unique_ptr<TxCore>> mTxCores;
+    std::thread mAccountantThread;
+};
+
+
 void Socket::send_batch(std::chrono::steady_clock::time_point ts, const std::vector<Packet*>& packets)
 {
-    for (auto& p : packets)
+    for (std::size_t offset = 0; offset < packets.size(); offset += TxBackend::max_batch_size)
     {
-        mTxBytes += p->size();
-        //++*p->counter;
-        //mCounters[p->size()]++;
+        auto count = std::min<std::size_t>(packets.size() - offset, TxBackend::max_batch_size);
+
+        iovec frames[TxBackend::max_batch_size];
+        for (auto i = 0u; i != count; ++i)
+        {
+            Packet& packet = *packets[offset + i];
+            frames[i].iov_base = const_cast<uint8_t*>(packet.data());
+            frames[i].iov_len = packet.size();
+        }
+
+        auto sent = mBackend->send(frames, count);
+
+        for (auto i = 0u; i != sent; ++i)
+        {
+            mTxBytes += frames[i].iov_len;
+            mCounters[frames[i].iov_len]++;
+        }
+        mTxPackets += sent;
+        mDropped += count - sent;
     }
 
     if (mStartTime == Clock::time_point())
     {
         mStartTime = Clock::now();
+        mSyscalls = mBackend->get_syscalls();
     }
 
     std::chrono::nanoseconds elapsed_ns = ts - mStartTime;
 
     if (elapsed_ns >= std::chrono::seconds(1))
     {
-        printf("\n=== Stats ===\nelapsed_ns=%ld TxBytes=%ld Rate=%f Gbit/s\nCounters:\n", long(elapsed_ns.count()), long(mTxBytes), 8.0 * mTxBytes / elapsed_ns.count());
+        auto syscalls = mBackend->get_syscalls() - mSyscalls;
+
+        // One printf, so that the stats of different cores do not interleave.
+        char buffer[768];
+        auto n = snprintf(buffer, sizeof(buffer),
+            "\n=== Stats core %d (%s) ===\nelapsed_ns=%ld TxPackets=%ld TxBytes=%ld Dropped=%ld\n"
+            "Rate=%f Mpps %f Gbit/s Syscalls=%ld (%f per packet)\nCounters:\n",
+            mId, mBackend->name(), long(elapsed_ns.count()), long(mTxPackets), long(mTxBytes), long(mDropped),
+            1e3 * mTxPackets / elapsed_ns.count(), 8.0 * mTxBytes / elapsed_ns.count(),
+            long(syscalls), mTxPackets ? double(syscalls) / mTxPackets : 0.0);
 
         mTxBytes = 0;
+        mTxPackets = 0;
+        mDropped = 0;
+        mSyscalls += syscalls;
         mStartTime = ts;
 
         int sizes[5] = {   64, 128, 256, 512, 1024 };
@@ -283,32 +1004,151 @@ void Socket::send_batch(std::chrono::steady_clock::time_point ts, const std::vec
             auto packet_rate = mCounters[packet_size];
             mCounters[packet_size] = 0;
             auto bitrate = packet_size * packet_rate * 8;
-            printf("  %d bytes * %d => %d Gbit/s\n", (int)packet_size, (int)packet_rate, (int)(0.5 + bitrate/1e9));
+            n += snprintf(buffer + n, sizeof(buffer) - n, "  %d bytes * %d => %d Gbit/s\n", (int)packet_size, (int)packet_rate, (int)(0.5 + bitrate/1e9));
         }
+
+        fputs(buffer, stdout);
     }
 }
 
 
-int main()
+void LatenessHistogram::print() const
+{
+    int64_t total = 0;
+    for (auto count : mCounts)
+    {
+        total += count;
+    }
+
+    printf("Lateness (time between the transmission time and the pull) of %ld packets:\n", long(total));
+    for (auto i = 0; i != num_buckets; ++i)
+    {
+        if (mCounts[i] != 0)
+        {
+            printf("  <= %11lld ns: %8.4f%%\n", 1LL << i, 100.0 * mCounts[i] / total);
+        }
+    }
+}
+
+
+// Achieved vs configured bitrate of the flows, per packet size, and of the interfaces.
+// All flows of an interface have the same configured rate, so with several cores
+// it also compares the average flow rate of each core with the other cores.
+void print_report(const std::vector<BBInterface>& bbInterfaces, std::chrono::nanoseconds duration)
+{
+    struct Summary
+    {
+        double mConfigured = 0;
+        double mMin = 1e300;
+        double mMax = 0;
+        double mSum = 0;
+        int mCount = 0;
+
+        void add(double configured, double achieved)
+        {
+            mConfigured = configured;
+            mMin = std::min(mMin, achieved);
+            mMax = std::max(mMax, achieved);
+            mSum += achieved;
+            mCount++;
+        }
+
+        void print(const char* name) const
+        {
+            printf("  %-18s configured=%8.4f achieved min=%8.4f avg=%8.4f max=%8.4f Gbit/s\n", name, mConfigured, mMin, mSum / mCount, mMax);
+        }
+    };
+
+    std::map<std::size_t, Summary> flows; // by packet size
+    Summary interfaces;
+    Summary interfaces_limit;
+    Summary core_ratios; // slowest vs fastest core of each interface
+
+    for (const BBInterface& bbinterface : bbInterfaces)
+    {
+        double configured = 0;
+        double achieved = 0;
+        std::map<const InterfaceShaper*, Summary> cores;
+        for (const Flow& flow : bbinterface.getFlows())
+        {
+            auto flow_achieved = 8.0 * flow.get_sent_bytes() / duration.count();
+            flows[flow.get_packet_size()].add(flow.get_bitrate() / 1000, flow_achieved);
+            cores[&flow.get_shaper()].add(flow.get_bitrate() / 1000, flow_achieved);
+            configured += flow.get_bitrate() / 1000;
+            achieved += flow_achieved;
+        }
+        interfaces.add(configured, achieved);
+        interfaces_limit.add(bbinterface.get_bitrate() / 1000, achieved);
+
+        if (cores.size() > 1)
+        {
+            Summary averages;
+            for (auto& entry : cores)
+            {
+                averages.add(0, entry.second.mSum / entry.second.mCount);
+            }
+            core_ratios.add(1, averages.mMax == 0 ? 1 : averages.mMin / averages.mMax);
+        }
+    }
+
+    printf("\n=== Report over %ld ms ===\n", long(duration.count() / 1000000));
+    for (auto& entry : flows)
+    {
+        entry.second.print(("flow " + std::to_string(entry.first) + " bytes").c_str());
+    }
+    interfaces.print("interface");
+    interfaces_limit.print("interface limit");
+    if (core_ratios.mCount != 0)
+    {
+        printf("Per-flow rate of the slowest vs the fastest core: min=%.4f avg=%.4f\n", core_ratios.mMin, core_ratios.mSum / core_ratios.mCount);
+    }
+}
+
+
+// Usage: FrameBlasting [num_interfaces [mbps_per_flow [seconds [num_cores [interface_mbps [backend]]]]]]
+// For example 100K flows with 100 Gbit/s in total: FrameBlasting 20000 1
+// Or on a veth pair (see VETH/setup.sh): FrameBlasting 100 10 10 1 0 tx_ring:veth0
+int main(int argc, char** argv)
 {
     enum
     {
-        num_interfaces = 100,
         num_flows = 5
     };
 
+    int num_interfaces = argc > 1 ? atoi(argv[1]) : 100;
+    int mbps = argc > 2 ? atoi(argv[2]) : 600;
+    int seconds = argc > 3 ? atoi(argv[3]) : 20;
+    int num_cores = argc > 4 ? atoi(argv[4]) : 1;
+    int interface_mbps = argc > 5 ? atoi(argv[5]) : 0; // 0: default limit
+    std::string backend = argc > 6 ? argv[6] : "null";
+
     int sizes[num_flows] = {   64, 128, 256, 512, 1024 };
-    int rates[num_flows] = {  600, 600, 600, 600,  600 }; // Mbit/s
+    int rates[num_flows] = { mbps, mbps, mbps, mbps, mbps }; // Mbit/s
 
     static_assert(sizeof(sizes) == sizeof(sizes[0]) * num_flows, "");
     static_assert(sizeof(rates) == sizeof(rates[0]) * num_flows, "");
 
     auto start_time = Clock::now() + std::chrono::milliseconds(100);
 
-    PhysicalInterface physicalInterface(num_interfaces);
+    std::unique_ptr<PhysicalInterface> physicalInterfacePtr;
+    try
+    {
+        physicalInterfacePtr.reset(new PhysicalInterface(num_interfaces, num_cores, backend));
+    }
+    catch (const std::exception& e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    PhysicalInterface& physicalInterface = *physicalInterfacePtr;
 
     for (BBInterface& bbInterface : physicalInterface.getBBInterfaces())
     {
+        if (interface_mbps != 0)
+        {
+            bbInterface.set_bitrate(interface_mbps);
+        }
+
         for (auto i = 0; i != num_flows; ++i)
         {
             Flow& flow = bbInterface.add_flow();
@@ -320,8 +1160,14 @@ int main()
 
     printf("Number of interfaces: %d\n", int(num_interfaces));
     printf("Total number of flows: %d\n", int(num_interfaces * num_flows));
+    printf("Number of TX cores: %d\n", int(num_cores));
+    printf("TX backend: %s\n", backend.c_str());
 
 
     physicalInterface.start();
-    std::this_thread::sleep_for(std::chrono::seconds(20));
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    physicalInterface.stop();
+
+    print_report(physicalInterface.getBBInterfaces(), Clock::now() - start_time);
+    physicalInterface.get_lateness().print();
 }
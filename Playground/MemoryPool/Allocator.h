@@ -0,0 +1,124 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+
+#include "Pool.h"
+#include <cstddef>
+#include <memory>
+#include <new>
+
+
+/**
+ * Memory blocks of one size, recycled through a ConcurrentPool, so a block can be
+ * freed by another thread than the one that allocated it. Requests larger than the
+ * block size use operator new and delete. Throws std::invalid_argument if capacity is 0.
+ */
+struct BlockPool
+{
+    BlockPool(std::size_t block_size, std::size_t capacity, OverflowPolicy overflow_policy = OverflowPolicy::destroy) :
+        mBlockSize(block_size),
+        mBlocks(capacity, overflow_policy)
+    {
+    }
+
+    void* allocate(std::size_t n)
+    {
+        if (n > mBlockSize)
+        {
+            return ::operator new(n);
+        }
+
+        Block block = mBlocks.get();
+        return block ? block.release() : ::operator new(mBlockSize);
+    }
+
+    void deallocate(void* data, std::size_t n)
+    {
+        if (n > mBlockSize)
+        {
+            ::operator delete(data);
+            return;
+        }
+
+        mBlocks.recycle(Block(data));
+    }
+
+    std::size_t block_size() const
+    {
+        return mBlockSize;
+    }
+
+private:
+    BlockPool(const BlockPool&);
+    BlockPool& operator=(const BlockPool&);
+
+    struct Delete
+    {
+        void operator()(void* data) const
+        {
+            ::operator delete(data);
+        }
+    };
+
+    using Block = std::unique_ptr<void, Delete>;
+
+    std::size_t mBlockSize;
+    ConcurrentPool<Block> mBlocks;
+};
+
+
+/**
+ * STL allocator on top of a BlockPool, e.g. for the nodes of a std::list or for
+ * std::allocate_shared. The rebound allocators share the pool.
+ */
+template<typename T>
+struct Allocator
+{
+    typedef T value_type;
+
+    template<typename U>
+    struct rebind
+    {
+        typedef Allocator<U> other;
+    };
+
+    explicit Allocator(BlockPool& pool) :
+        mPool(&pool)
+    {
+    }
+
+    template<typename U>
+    Allocator(const Allocator<U>& rhs) :
+        mPool(rhs.mPool)
+    {
+    }
+
+    T* allocate(std::size_t n)
+    {
+        return static_cast<T*>(mPool->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        mPool->deallocate(p, n * sizeof(T));
+    }
+
+    BlockPool* mPool;
+};
+
+
+template<typename T, typename U>
+bool operator==(const Allocator<T>& lhs, const Allocator<U>& rhs)
+{
+    return lhs.mPool == rhs.mPool;
+}
+
+
+template<typename T, typename U>
+bool operator!=(const Allocator<T>& lhs, const Allocator<U>& rhs)
+{
+    return !(lhs == rhs);
+}
+
+
+#endif // ALLOCATOR_H
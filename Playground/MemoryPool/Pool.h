@@ -2,7 +2,12 @@
 #define POOL_H
 
 
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <thread>
 #include <vector>
 
 
@@ -44,4 +49,155 @@ private:
 };
 
 
+enum class OverflowPolicy
+{
+    destroy, // recycle destroys the object if the pool is full
+    block    // recycle waits until get makes room
+};
+
+
+/**
+ * Thread-safe Pool: get and recycle can be called from any thread, e.g. objects that are
+ * created on the I/O thread and recycled by the workers.
+ *
+ * The recycled objects are in nodes on a lock-free stack (Treiber stack), the empty nodes
+ * are on a second one. The nodes are allocated once, so recycle never reallocates and
+ * the pool keeps at most capacity objects. A stack head has the index of the top node and
+ * a tag that each push and pop changes, so a compare-exchange fails if the top node was
+ * popped and pushed again in between (ABA).
+ */
+template<typename T>
+struct ConcurrentPool
+{
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the stack heads must be lock-free");
+
+    // Throws std::invalid_argument if capacity is 0, recycle could never store an object
+    // (and would wait forever with OverflowPolicy::block).
+    explicit ConcurrentPool(std::size_t capacity = 100, OverflowPolicy overflow_policy = OverflowPolicy::destroy) :
+        mNodes(),
+        mCapacity(capacity),
+        mOverflowPolicy(overflow_policy),
+        mObjects(null_index),
+        mEmptyNodes(null_index)
+    {
+        if (capacity == 0 || capacity >= null_index)
+        {
+            throw std::invalid_argument("ConcurrentPool: the capacity must be at least 1 and less than 2^32 - 1");
+        }
+
+        mNodes.reset(new Node[capacity]);
+        for (auto i = 0u; i != capacity; ++i)
+        {
+            push(mEmptyNodes, i);
+        }
+    }
+
+    inline T get()
+    {
+        T t;
+        get(t);
+        return t;
+    }
+
+    // Leaves t unchanged and returns false if the pool is empty.
+    inline bool get(T& t)
+    {
+        auto index = pop(mObjects);
+        if (index == null_index)
+        {
+            return false;
+        }
+
+        t = std::move(mNodes[index].mValue);
+        push(mEmptyNodes, index);
+        return true;
+    }
+
+    // Returns false if the pool was full and the object was destroyed.
+    inline bool recycle(T&& t)
+    {
+        auto index = pop(mEmptyNodes);
+        while (index == null_index)
+        {
+            if (mOverflowPolicy == OverflowPolicy::destroy)
+            {
+                T discarded(std::move(t));
+                static_cast<void>(discarded);
+                return false;
+            }
+            std::this_thread::yield();
+            index = pop(mEmptyNodes);
+        }
+
+        mNodes[index].mValue = std::move(t);
+        push(mObjects, index);
+        return true;
+    }
+
+    std::size_t capacity() const
+    {
+        return mCapacity;
+    }
+
+private:
+    ConcurrentPool(const ConcurrentPool&);
+    ConcurrentPool& operator=(const ConcurrentPool&);
+
+    enum : uint32_t { null_index = 0xFFFFFFFF };
+
+    struct Node
+    {
+        T mValue;
+        std::atomic<uint32_t> mNext; // read by pop while another thread may push the node
+    };
+
+    // A stack head: the tag in the high 32 bits, the index of the top node in the low 32 bits.
+    static uint64_t make_head(uint64_t old_head, uint32_t index)
+    {
+        return ((old_head >> 32) + 1) << 32 | index;
+    }
+
+    void push(std::atomic<uint64_t>& head, uint32_t index)
+    {
+        auto old_head = head.load(std::memory_order_relaxed);
+        do
+        {
+            mNodes[index].mNext.store(uint32_t(old_head), std::memory_order_relaxed);
+        }
+        while (!head.compare_exchange_weak(old_head, make_head(old_head, index), std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    uint32_t pop(std::atomic<uint64_t>& head)
+    {
+        auto old_head = head.load(std::memory_order_acquire);
+        for (;;)
+        {
+            uint32_t index = uint32_t(old_head);
+            if (index == null_index)
+            {
+                return null_index;
+            }
+
+            // Can be outdated if the node was popped meanwhile, then the tag differs.
+            auto next = mNodes[index].mNext.load(std::memory_order_relaxed);
+            if (head.compare_exchange_weak(old_head, make_head(old_head, next), std::memory_order_acquire, std::memory_order_acquire))
+            {
+                return index;
+            }
+        }
+    }
+
+    std::unique_ptr<Node[]> mNodes;
+    std::size_t mCapacity;
+    OverflowPolicy mOverflowPolicy;
+
+    // The heads are on different cache lines than each other and the fields above.
+    char mObjectsPadding[64];
+    std::atomic<uint64_t> mObjects; // nodes with a recycled object
+    char mEmptyNodesPadding[64];
+    std::atomic<uint64_t> mEmptyNodes;
+    char mEndPadding[64];
+};
+
+
 #endif // POOL_H
@@ -0,0 +1,446 @@
+#include "PCAPReader.h"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace {
+
+
+const uint32_t pcap_magic = 0xa1b2c3d4;
+const uint32_t pcap_magic_nanoseconds = 0xa1b23c4d;
+
+const uint32_t pcapng_byte_order_magic = 0x1A2B3C4D;
+
+enum BlockType : uint32_t
+{
+    BlockType_InterfaceDescription = 0x00000001,
+    BlockType_SimplePacket         = 0x00000003,
+    BlockType_EnhancedPacket       = 0x00000006,
+    BlockType_SectionHeader        = 0x0A0D0D0A  // same in both byte orders
+};
+
+
+const uint32_t pcap_file_header_size = 24;
+const uint32_t pcap_record_header_size = 16;
+const uint32_t pcapng_block_overhead = 12;          // type, length and trailing length
+const uint32_t pcapng_section_header_size = 28;
+const uint32_t pcapng_enhanced_packet_header_size = 20;
+
+const uint16_t option_end = 0;
+const uint16_t option_if_tsresol = 9;
+
+
+std::runtime_error system_error(const std::string& message)
+{
+    return std::runtime_error(message + ": " + strerror(errno));
+}
+
+
+} // namespace
+
+
+PCAPReader::PCAPReader(const std::string& path)
+{
+    mFD = open(path.c_str(), O_RDONLY);
+    if (mFD < 0)
+    {
+        throw system_error("Failed to open " + path);
+    }
+
+    struct stat st;
+    if (fstat(mFD, &st) != 0)
+    {
+        auto error = system_error("Failed to stat " + path);
+        unmap();
+        throw error;
+    }
+
+    mMappingSize = st.st_size;
+
+    // An empty file has no packets.
+    if (mMappingSize == 0)
+    {
+        return;
+    }
+
+    auto addr = mmap(nullptr, mMappingSize, PROT_READ, MAP_PRIVATE, mFD, 0);
+    if (addr == MAP_FAILED)
+    {
+        auto error = system_error("Failed to mmap " + path);
+        mMappingSize = 0;
+        unmap();
+        throw error;
+    }
+
+    // Hints only, so errors are ignored. Sequential access means more readahead and
+    // the kernel may drop the pages soon after they were read.
+    madvise(addr, mMappingSize, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    // Only has an effect if the kernel supports huge pages in the page cache.
+    madvise(addr, mMappingSize, MADV_HUGEPAGE);
+#endif
+
+    mBegin = static_cast<const uint8_t*>(addr);
+    mEnd = mBegin + mMappingSize;
+    mPosition = mBegin;
+
+    try
+    {
+        if (mMappingSize >= 4 && read32(mBegin) == BlockType_SectionHeader)
+        {
+            mPCAPNG = true;
+            parse_section_header();
+
+            // The interface descriptions come before the first packet. Read them for linktype().
+            auto position = mPosition;
+            uint32_t type;
+            const uint8_t* body;
+            uint32_t body_size;
+            while (next_block(type, body, body_size) && type == BlockType_InterfaceDescription)
+            {
+                parse_interface_description(body, body_size);
+                position = mPosition;
+            }
+            mPosition = position;
+
+            if (!mInterfaces.empty())
+            {
+                mLinkType = mInterfaces.front().mLinkType;
+            }
+        }
+        else
+        {
+            parse_pcap_header();
+        }
+    }
+    catch (...)
+    {
+        unmap();
+        throw;
+    }
+}
+
+
+PCAPReader::~PCAPReader()
+{
+    unmap();
+}
+
+
+void PCAPReader::unmap()
+{
+    if (mBegin)
+    {
+        munmap(const_cast<uint8_t*>(mBegin), mMappingSize);
+        mBegin = mEnd = mPosition = nullptr;
+    }
+
+    if (mFD >= 0)
+    {
+        close(mFD);
+        mFD = -1;
+    }
+}
+
+
+void PCAPReader::parse_pcap_header()
+{
+    if (mMappingSize < pcap_file_header_size)
+    {
+        throw std::runtime_error("Invalid pcap file: too short");
+    }
+
+    uint32_t magic;
+    memcpy(&magic, mBegin, sizeof(magic));
+
+    if (magic == pcap_magic || magic == pcap_magic_nanoseconds)
+    {
+        mSwapped = false;
+    }
+    else if (magic == __builtin_bswap32(pcap_magic) || magic == __builtin_bswap32(pcap_magic_nanoseconds))
+    {
+        mSwapped = true;
+    }
+    else
+    {
+        throw std::runtime_error("Invalid magic: " + std::to_string(magic));
+    }
+
+    mNanoseconds = read32(mBegin) == pcap_magic_nanoseconds;
+    mLinkType = read32(mBegin + 20);
+    mPosition = mBegin + pcap_file_header_size;
+}
+
+
+void PCAPReader::parse_section_header()
+{
+    if (mEnd - mPosition < pcapng_section_header_size)
+    {
+        // Truncated
+        mPosition = mEnd;
+        return;
+    }
+
+    uint32_t byte_order_magic;
+    memcpy(&byte_order_magic, mPosition + 8, sizeof(byte_order_magic));
+
+    if (byte_order_magic == pcapng_byte_order_magic)
+    {
+        mSwapped = false;
+    }
+    else if (byte_order_magic == __builtin_bswap32(pcapng_byte_order_magic))
+    {
+        mSwapped = true;
+    }
+    else
+    {
+        throw std::runtime_error("Invalid pcapng byte order magic: " + std::to_string(byte_order_magic));
+    }
+
+    auto length = read32(mPosition + 4);
+    if (length < pcapng_section_header_size || length > uint64_t(mEnd - mPosition))
+    {
+        mPosition = mEnd;
+        return;
+    }
+
+    // Interface ids are per section.
+    mInterfaces.clear();
+    mPosition += length;
+}
+
+
+void PCAPReader::parse_interface_description(const uint8_t* body, uint32_t body_size)
+{
+    Interface interface;
+
+    if (body_size >= 8)
+    {
+        interface.mLinkType = read16(body);
+        interface.mSnapLength = read32(body + 4);
+    }
+
+    // Options: code, length and the value padded to 4 bytes.
+    for (uint32_t offset = 8; offset + 4 <= body_size; )
+    {
+        auto code = read16(body + offset);
+        auto length = read16(body + offset + 2);
+        if (code == option_end || offset + 4 + length > body_size)
+        {
+            break;
+        }
+
+        if (code == option_if_tsresol && length >= 1)
+        {
+            auto tsresol = body[offset + 4];
+            auto exponent = tsresol & 0x7Fu;
+
+            if (tsresol & 0x80)
+            {
+                interface.mBase2 = true;
+                interface.mShift = exponent;
+            }
+            else
+            {
+                interface.mMultiplier = 1;
+                interface.mDivisor = 1;
+                for (auto i = exponent; i < 9; ++i)
+                {
+                    interface.mMultiplier *= 10;
+                }
+                for (auto i = 9u; i < std::min(exponent, 28u); ++i)
+                {
+                    interface.mDivisor *= 10;
+                }
+            }
+        }
+
+        offset += 4 + ((length + 3u) & ~3u);
+    }
+
+    mInterfaces.push_back(interface);
+}
+
+
+uint64_t PCAPReader::Interface::to_nanoseconds(uint64_t timestamp) const
+{
+    if (!mBase2)
+    {
+        return timestamp * mMultiplier / mDivisor;
+    }
+
+    if (mShift >= 64)
+    {
+        return 0;
+    }
+
+    auto seconds = timestamp >> mShift;
+    auto fraction = timestamp - (seconds << mShift);
+
+    // fraction * 10^9 fits in 64 bits if the fraction has at most 34 bits.
+    auto fraction_ns = mShift <= 34
+        ? (fraction * 1000000000ULL) >> mShift
+        : static_cast<uint64_t>(std::ldexp(static_cast<long double>(fraction), -static_cast<int>(mShift)) * 1e9L);
+
+    return seconds * 1000000000ULL + fraction_ns;
+}
+
+
+bool PCAPReader::next_block(uint32_t& type, const uint8_t*& body, uint32_t& body_size)
+{
+    if (mEnd - mPosition < pcapng_block_overhead)
+    {
+        mPosition = mEnd;
+        return false;
+    }
+
+    type = read32(mPosition);
+
+    if (type == BlockType_SectionHeader)
+    {
+        // May change the byte order.
+        parse_section_header();
+        body = nullptr;
+        body_size = 0;
+        return true;
+    }
+
+    auto length = read32(mPosition + 4);
+    if (length < pcapng_block_overhead || length > uint64_t(mEnd - mPosition))
+    {
+        mPosition = mEnd;
+        return false;
+    }
+
+    body = mPosition + 8;
+    body_size = length - pcapng_block_overhead;
+
+    // The length is a multiple of 4. Round up anyway, in case a writer forgot the padding.
+    mPosition += std::min<uint64_t>((length + 3u) & ~3u, mEnd - mPosition);
+    return true;
+}
+
+
+uint32_t PCAPReader::read_burst(PCAPPacket* packets, uint32_t size)
+{
+    if (mPosition == mEnd)
+    {
+        return 0;
+    }
+
+    return mPCAPNG ? read_pcapng_burst(packets, size) : read_pcap_burst(packets, size);
+}
+
+
+uint32_t PCAPReader::read_pcap_burst(PCAPPacket* packets, uint32_t size)
+{
+    auto count = 0u;
+
+    while (count != size && mEnd - mPosition >= pcap_record_header_size)
+    {
+        auto caplen = read32(mPosition + 8);
+        if (caplen > uint64_t(mEnd - mPosition - pcap_record_header_size))
+        {
+            // Truncated record
+            mPosition = mEnd;
+            break;
+        }
+
+        auto seconds = read32(mPosition);
+        auto fraction = read32(mPosition + 4);
+
+        PCAPPacket& packet = packets[count++];
+        packet.mData = mPosition + pcap_record_header_size;
+        packet.mOriginalSize = read32(mPosition + 12);
+        packet.mSize = std::min(caplen, packet.mOriginalSize);
+        packet.mTimestamp = seconds * 1000000000ULL + (mNanoseconds ? fraction : fraction * 1000ULL);
+
+        mPosition += pcap_record_header_size + caplen;
+    }
+
+    if (mEnd - mPosition < pcap_record_header_size)
+    {
+        mPosition = mEnd;
+    }
+
+    return count;
+}
+
+
+uint32_t PCAPReader::read_pcapng_burst(PCAPPacket* packets, uint32_t size)
+{
+    auto count = 0u;
+
+    uint32_t type;
+    const uint8_t* body;
+    uint32_t body_size;
+
+    while (count != size && next_block(type, body, body_size))
+    {
+        switch (type)
+        {
+            case BlockType_InterfaceDescription:
+            {
+                parse_interface_description(body, body_size);
+                break;
+            }
+            case BlockType_EnhancedPacket:
+            {
+                if (body_size < pcapng_enhanced_packet_header_size)
+                {
+                    break;
+                }
+
+                auto interface_id = read32(body);
+                auto caplen = read32(body + 12);
+                if (interface_id >= mInterfaces.size() || caplen > body_size - pcapng_enhanced_packet_header_size)
+                {
+                    break;
+                }
+
+                auto timestamp = (uint64_t(read32(body + 4)) << 32) | read32(body + 8);
+
+                PCAPPacket& packet = packets[count++];
+                packet.mData = body + pcapng_enhanced_packet_header_size;
+                packet.mOriginalSize = read32(body + 16);
+                packet.mSize = std::min(caplen, packet.mOriginalSize);
+                packet.mTimestamp = mInterfaces[interface_id].to_nanoseconds(timestamp);
+                break;
+            }
+            case BlockType_SimplePacket:
+            {
+                // Belongs to the first interface. Has no timestamp and no captured length.
+                if (body_size < 4 || mInterfaces.empty())
+                {
+                    break;
+                }
+
+                auto snap_length = mInterfaces.front().mSnapLength;
+
+                PCAPPacket& packet = packets[count++];
+                packet.mData = body + 4;
+                packet.mOriginalSize = read32(body);
+                packet.mSize = std::min(packet.mOriginalSize, body_size - 4);
+                if (snap_length != 0)
+                {
+                    packet.mSize = std::min(packet.mSize, snap_length);
+                }
+                packet.mTimestamp = 0;
+                break;
+            }
+            default:
+            {
+                // Other blocks (statistics, name resolution, custom, ...) are skipped.
+                break;
+            }
+        }
+    }
+
+    return count;
+}
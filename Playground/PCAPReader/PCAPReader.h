@@ -0,0 +1,124 @@
+#ifndef PCAPREADER_H
+#define PCAPREADER_H
+
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+
+// View of a captured packet. Points into the mapped file, so it is only
+// valid as long as the PCAPReader exists.
+struct PCAPPacket
+{
+    const uint8_t* data() const { return mData; }
+    uint32_t size() const { return mSize; }
+
+    const uint8_t* mData;
+    uint32_t mSize;           // captured length
+    uint32_t mOriginalSize;   // length on the wire
+    uint64_t mTimestamp;      // nanoseconds since the epoch
+};
+
+
+/**
+ * Reads a pcap or pcapng file without copying the packets.
+ *
+ * The file is memory mapped with sequential access hints, and the packets are
+ * returned in bursts of views into the mapping. Supported formats:
+ * - pcap with microsecond or nanosecond timestamps, in either byte order
+ * - pcapng with enhanced and simple packet blocks, in either byte order,
+ *   with multiple sections and interfaces and the if_tsresol option
+ *
+ * A truncated record at the end of the file ends the iteration.
+ */
+class PCAPReader
+{
+public:
+    enum : uint32_t { burst_size = 32 };
+
+    explicit PCAPReader(const std::string& path);
+
+    ~PCAPReader();
+
+    PCAPReader(const PCAPReader&) = delete;
+    PCAPReader& operator=(const PCAPReader&) = delete;
+
+    // Stores up to size packets. Returns 0 at the end of the file.
+    uint32_t read_burst(PCAPPacket* packets, uint32_t size = burst_size);
+
+    // Calls f(const PCAPPacket* packets, uint32_t size) for each burst.
+    template<typename F>
+    void for_each_burst(F&& f)
+    {
+        PCAPPacket packets[burst_size];
+        while (auto size = read_burst(packets, burst_size))
+        {
+            f(static_cast<const PCAPPacket*>(packets), size);
+        }
+    }
+
+    // Link type of the file (pcap) or of the first interface (pcapng).
+    uint32_t linktype() const { return mLinkType; }
+
+    bool is_pcapng() const { return mPCAPNG; }
+
+private:
+    struct Interface
+    {
+        uint32_t mLinkType = 0;
+        uint32_t mSnapLength = 0;
+
+        // Converts the timestamp units to nanoseconds: either timestamp * mMultiplier / mDivisor
+        // for a power of 10 units per second, or shifted by mShift for a power of 2.
+        uint64_t mMultiplier = 1000; // default resolution is microseconds
+        uint64_t mDivisor = 1;
+        uint32_t mShift = 0;
+        bool mBase2 = false;
+
+        uint64_t to_nanoseconds(uint64_t timestamp) const;
+    };
+
+    uint16_t read16(const uint8_t* data) const
+    {
+        uint16_t result;
+        memcpy(&result, data, sizeof(result));
+        return mSwapped ? __builtin_bswap16(result) : result;
+    }
+
+    uint32_t read32(const uint8_t* data) const
+    {
+        uint32_t result;
+        memcpy(&result, data, sizeof(result));
+        return mSwapped ? __builtin_bswap32(result) : result;
+    }
+
+    void unmap();
+
+    void parse_pcap_header();
+    void parse_section_header();
+    void parse_interface_description(const uint8_t* body, uint32_t body_size);
+
+    // Consumes the next pcapng block. A section header block is parsed here and has no body.
+    // Returns false at the end of the file or at a truncated block.
+    bool next_block(uint32_t& type, const uint8_t*& body, uint32_t& body_size);
+
+    uint32_t read_pcap_burst(PCAPPacket* packets, uint32_t size);
+    uint32_t read_pcapng_burst(PCAPPacket* packets, uint32_t size);
+
+    const uint8_t* mBegin = nullptr;
+    const uint8_t* mEnd = nullptr;
+    const uint8_t* mPosition = nullptr;
+    uint64_t mMappingSize = 0;
+    int mFD = -1;
+
+    bool mPCAPNG = false;
+    bool mSwapped = false;     // file byte order differs from the host
+    bool mNanoseconds = false; // pcap only
+    uint32_t mLinkType = 0;
+    std::vector<Interface> mInterfaces; // pcapng only, of the current section
+};
+
+
+#endif // PCAPREADER_H
@@ -1,139 +1,54 @@
-#include <string>
+#include "PCAPReader.h"
+#include <chrono>
 #include <iostream>
-#include <iomanip>
-#include <fstream>
-#include <pcap.h>
-#include <arpa/inet.h>
+#include <stdexcept>
 
 
-
-struct PCAPFileHeader
-{
-    uint32_t magic;
-    uint16_t version_major; // 2
-    uint16_t version_minor; // 4
-    uint32_t thiszone;	/* gmt to local correction */
-    uint32_t sigfigs;	/* accuracy of timestamps */
-    uint32_t snaplen;	/* max length saved portion of each pkt */
-    uint32_t linktype;	/* data link type (LINKTYPE_*) */
-};
-
-
-
-struct PCAPHeader
-{
-    uint32_t sec;
-    uint32_t usec;
-    uint32_t caplen;
-    uint32_t len;
-};
-
-
-template<typename F>
-void pcap_for_each(std::string pcap, F&& f)
+int main(int argc, char** argv)
 {
-    std::ifstream input(pcap);
-
-    if (!input)
+    if (argc != 2)
     {
-        throw std::runtime_error("Failed to open " + pcap);
+        std::cerr << "Usage: " << argv[0] << " PCAPFile" << std::endl;
+        return 1;
     }
 
-
-    auto file_header = PCAPFileHeader();
-
-    if (!input.read(reinterpret_cast<char*>(&file_header), sizeof(file_header)))
+    try
     {
-        if (input.eof()) return;
-        std::cout << "errno=" << errno << " strerror=" << strerror(errno) << std::endl;
-        throw std::runtime_error("read failed.");
-    }
-
-
-
-//    std::cout << "fileHeader.magic=" << std::hex << std::setw(2) << std::setfill('0') << file_header.magic << std::dec << std::endl;
-//    std::cout << "fileHeader.version_major=" << file_header.version_major << std::endl;
-//    std::cout << "fileHeader.version_minor=" << file_header.version_minor << std::endl;
-//    std::cout << "fileHeader.thiszone=" << file_header.thiszone << std::endl;
-//    std::cout << "fileHeader.sigfigs=" << file_header.sigfigs << std::endl;
-//    std::cout << "fileHeader.snaplen=" << file_header.snaplen << std::endl;
-//    std::cout << "fileHeader.linktype=" << file_header.linktype << std::endl;
+        auto start_time = std::chrono::steady_clock::now();
 
-    bool bigendian = false;
+        PCAPReader reader(argv[1]);
 
-    if (file_header.magic == 0xa1b2c3d4)
-    {
-        bigendian = false;
-    }
-    else if (file_header.magic == htonl(0xa1b2c3d4))
-    {
-        bigendian = true;
-    }
-    else
-    {
-        throw std::runtime_error("Invalid magic: " + std::to_string(file_header.magic));
-    }
+        if (reader.linktype() != 1 /*DLT_EN10MB*/)
+        {
+            std::cout << "Invalid linktype: " << reader.linktype() << std::endl;
+        }
 
-    if (file_header.linktype != 1 /*DLT_EN10MB*/)
-    {
-        std::cout << "Invalid linktype: " << file_header.linktype << std::endl;
-        //throw std::runtime_error("Invalid linktype: " + std::to_string(file_header.linktype));
-    }
+        auto count = 0UL;
+        auto byte_count = 0UL;
+        auto checksum = 0UL;
 
-    for (;;)
-    {
-        PCAPHeader h;
-        if (!input.read(reinterpret_cast<char*>(&h), sizeof(h)))
-        {
-            if (input.eof())
+        reader.for_each_burst([&](const PCAPPacket* packets, uint32_t size) {
+            count += size;
+            for (auto i = 0u; i != size; ++i)
             {
-                //std::cout << "EOF" << std::endl;
-                return;
-            }
+                byte_count += packets[i].size();
 
-            std::cout << "errno=" << errno << " strerror=" << strerror(errno) << std::endl;
-            throw std::runtime_error("read failed.");
-        }
+                // Touch the data, like a filter would.
+                checksum += packets[i].size() ? packets[i].data()[0] : 0;
+            }
+        });
 
-        if (bigendian)
-        {
-            h.sec    = ntohl(h.sec);
-            h.usec   = ntohl(h.usec);
-            h.caplen = ntohl(h.caplen);
-            h.len    = ntohl(h.len);
-        }
+        auto elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_time).count();
 
-        char buffer[128 * 1024];
-        if (h.caplen > sizeof(buffer))
-        {
-            std::cout << "Skip huge buffer of size caplen=" << h.caplen << std::endl;
-            continue;
-        }
-        input.read(&buffer[0], h.caplen);
-        f(h, buffer, buffer + std::min(h.len, h.caplen));
+        std::cout << "count=" << count << " byte_count=" << byte_count << " checksum=" << checksum << std::endl;
+        std::cout << "elapsed_ms=" << elapsed_ns / 1000000
+            << " Mpps=" << (elapsed_ns ? 1e3 * count / elapsed_ns : 0)
+            << " MB/s=" << (elapsed_ns ? 1e3 * byte_count / elapsed_ns : 0)
+            << std::endl;
     }
-}
-
-
-int main(int argc, char** argv)
-{
-    if (argc != 2)
+    catch (const std::exception& e)
     {
-        std::cerr << "Usage: " << argv[0] << " PCAPFile" << std::endl;
+        std::cerr << e.what() << std::endl;
         return 1;
     }
-    auto count = 0UL;
-    auto byte_count = 0UL;
-    pcap_for_each(argv[1], [&](PCAPHeader h, char* b, char* e) {
-        count++;
-        byte_count += e - b;
-
-        (void)h;
-        //std::cout << h.sec << "." << h.usec << ": caplen=" << h.caplen << " len=" << h.len << " (e-b)=" << (e-b) << '\n';
-    });
-
-    std::cout << "count=" << count << " byte_count=" << byte_count << std::endl;
 }
-
-
-
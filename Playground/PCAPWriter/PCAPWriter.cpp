@@ -1,67 +1,202 @@
 #include "PCAPWriter.h"
-#include "tbb/concurrent_queue.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
 #include <cstdint>
-#include <fstream>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <stdexcept>
 #include <thread>
-#include <sys/time.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #include "pcap.h"
 
 
 struct PCAPWriter::Impl
 {
-    Impl(const std::string& file) :
-        mOutput(file, std::ios::out | std::ios::binary),
-        mThread([this]{ consumer_thread(); })
+    enum : uint32_t
     {
+        segment_size = 1024 * 1024,
+        num_segments = 64, // 64 MB, about 50 ms of 10 Gbit/s traffic
+        max_batch = 16     // segments per writev call
+    };
+
+    struct PCAPHeader
+    {
+        uint32_t sec;
+        uint32_t usec;
+        uint32_t cap_len;
+        uint32_t len;
+    };
+
+    Impl(const std::string& file, uint32_t snaplen) :
+        mSnapLength(std::min<uint32_t>(snaplen, segment_size - sizeof(PCAPHeader)))
+    {
+        mFD = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (mFD < 0)
+        {
+            throw std::runtime_error("Failed to open " + file + ": " + strerror(errno));
+        }
+
+        void* memory = nullptr;
+        if (posix_memalign(&memory, 4096, std::size_t(segment_size) * num_segments) != 0)
+        {
+            ::close(mFD);
+            throw std::bad_alloc();
+        }
+        mMemory = static_cast<uint8_t*>(memory);
+
+        // Touch all pages now, so that the producer does not take page faults.
+        memset(mMemory, 0, std::size_t(segment_size) * num_segments);
+
+        write_pcap_file_header();
+
+        mThread = std::thread([this]{ consumer_thread(); });
     }
 
     ~Impl()
     {
-        mQueue.push(""); // stop-flag for the consumer thread
+        publish();
+        mStop.store(true, std::memory_order_release);
         mThread.join();
+
+        ::close(mFD);
+        free(mMemory);
     }
 
     void push_back(const uint8_t* bytes, uint32_t len)
     {
-        struct PCAPHeader
+        auto cap_len = std::min(len, mSnapLength);
+        auto record_size = static_cast<uint32_t>(sizeof(PCAPHeader)) + cap_len;
+
+        if (mOffset + record_size > segment_size)
+        {
+            publish();
+        }
+
+        if (!acquire())
         {
-            uint32_t sec;
-            uint32_t usec;
-            uint32_t cap_len;
-            uint32_t len;
-        };
-
-        timeval tv = to_timeval(std::chrono::system_clock::now());
-
-        PCAPHeader header{};
-        header.sec = tv.tv_sec;
-        header.usec = tv.tv_usec;
-        header.cap_len = len;
+            mDropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+        PCAPHeader header;
+        header.sec = ns / 1000000000;
+        header.usec = (ns % 1000000000) / 1000;
+        header.cap_len = cap_len;
         header.len = len;
 
-        std::string str;
-        str.reserve(sizeof(header) + len);
-        str.append(cstr(&header), sizeof(header));
-        str.append(cstr(bytes), len);
-        mQueue.push(str);
+        auto segment = mMemory + std::size_t(mHead.load(std::memory_order_relaxed) % num_segments) * segment_size;
+        memcpy(segment + mOffset, &header, sizeof(header));
+        memcpy(segment + mOffset + sizeof(header), bytes, cap_len);
+        mOffset += record_size;
     }
 
-    void consumer_thread()
+    // Producer: hands the current segment to the consumer.
+    void publish()
     {
-        write_pcap_file_header();
+        if (!mHasSegment || mOffset == 0)
+        {
+            return;
+        }
+
+        auto head = mHead.load(std::memory_order_relaxed);
+        mSizes[head % num_segments] = mOffset;
+        mHead.store(head + 1, std::memory_order_release);
+        mHasSegment = false;
+    }
+
+    // Producer: takes the next segment if the consumer has written it.
+    bool acquire()
+    {
+        if (mHasSegment)
+        {
+            return true;
+        }
+
+        if (mHead.load(std::memory_order_relaxed) - mTail.load(std::memory_order_acquire) == num_segments)
+        {
+            return false;
+        }
+
+        mHasSegment = true;
+        mOffset = 0;
+        return true;
+    }
 
+    void consumer_thread()
+    {
         for (;;)
         {
-            std::string pcap_string;
-            mQueue.pop(pcap_string);
+            auto tail = mTail.load(std::memory_order_relaxed);
+            auto head = mHead.load(std::memory_order_acquire);
+
+            if (head == tail)
+            {
+                // The producer publishes the last segment before setting the stop flag.
+                if (mStop.load(std::memory_order_acquire) && mHead.load(std::memory_order_acquire) == tail)
+                {
+                    return;
+                }
+
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+
+            auto count = static_cast<uint32_t>(std::min<uint64_t>(head - tail, max_batch));
+
+            iovec iov[max_batch];
+            for (auto i = 0u; i != count; ++i)
+            {
+                auto index = (tail + i) % num_segments;
+                iov[i].iov_base = mMemory + std::size_t(index) * segment_size;
+                iov[i].iov_len = mSizes[index];
+            }
+
+            write_all(iov, count);
 
-            if (pcap_string.empty())
+            mTail.store(tail + count, std::memory_order_release);
+        }
+    }
+
+    void write_all(iovec* iov, uint32_t count)
+    {
+        while (count != 0 && !mWriteFailed)
+        {
+            auto written = ::writev(mFD, iov, count);
+            if (written < 0)
             {
-                // empty string is stop-flag
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                // Keep consuming so that the producer is not blocked, but stop writing.
+                std::cerr << "PCAPWriter: writev failed: " << strerror(errno) << std::endl;
+                mWriteFailed = true;
                 return;
             }
 
-            mOutput.write(pcap_string.data(), pcap_string.size());
+            // Skip what was written and retry the rest.
+            auto remaining = static_cast<std::size_t>(written);
+            while (count != 0 && remaining >= iov->iov_len)
+            {
+                remaining -= iov->iov_len;
+                ++iov;
+                --count;
+            }
+
+            if (count != 0)
+            {
+                iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + remaining;
+                iov->iov_len -= remaining;
+            }
         }
     }
 
@@ -74,38 +209,42 @@ struct PCAPWriter::Impl
         header.version_minor = PCAP_VERSION_MINOR;
         header.thiszone = 0;
         header.sigfigs = 0;
-        header.snaplen = 65535;
+        header.snaplen = mSnapLength;
         header.linktype = 1;
 
-        mOutput.write(cstr(&header), sizeof(header));
+        iovec iov;
+        iov.iov_base = &header;
+        iov.iov_len = sizeof(header);
+        write_all(&iov, 1);
     }
 
-    static const char* cstr(const void* bytes)
-    {
-        return reinterpret_cast<const char*>(bytes);
-    }
+    uint32_t mSnapLength;
+    int mFD = -1;
+    bool mWriteFailed = false;
+    uint8_t* mMemory = nullptr;
+    uint32_t mSizes[num_segments];
 
-    static timeval to_timeval(std::chrono::system_clock::time_point tp)
-    {
-        using namespace std::chrono;
-        auto s = time_point_cast<seconds>(tp);
-        if (s > tp)
-            s = s - seconds{1};
-        auto us = duration_cast<microseconds>(tp - s);
-        timeval tv;
-        tv.tv_sec = s.time_since_epoch().count();
-        tv.tv_usec = us.count();
-        return tv;
-    }
+    // Producer state. The producer fills segment mHead while mHasSegment is set.
+    uint32_t mOffset = 0;
+    bool mHasSegment = true;
+
+    // Segments [mTail, mHead) are published and not yet written.
+    // The padding keeps the producer and consumer counters on different cache lines.
+    // (alignas would need the C++17 aligned new.)
+    char mHeadPadding[64];
+    std::atomic<uint64_t> mHead{0};
+    char mTailPadding[64];
+    std::atomic<uint64_t> mTail{0};
+    char mDroppedPadding[64];
+    std::atomic<uint64_t> mDropped{0};
+    std::atomic<bool> mStop{false};
 
-    std::ofstream mOutput;
-    tbb::concurrent_bounded_queue<std::string> mQueue;
     std::thread mThread;
 };
 
 
-PCAPWriter::PCAPWriter(const std::string& file) :
-    mImpl(new Impl(file))
+PCAPWriter::PCAPWriter(const std::string& file, uint32_t snaplen) :
+    mImpl(new Impl(file, snaplen))
 {
 }
 
@@ -120,3 +259,14 @@ void PCAPWriter::push_back(const uint8_t* bytes, uint32_t len)
     mImpl->push_back(bytes, len);
 }
 
+
+void PCAPWriter::flush()
+{
+    mImpl->publish();
+}
+
+
+uint64_t PCAPWriter::dropped() const
+{
+    return mImpl->mDropped.load(std::memory_order_relaxed);
+}
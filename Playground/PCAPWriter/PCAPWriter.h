@@ -3,18 +3,35 @@
 
 
 #include <boost/scoped_ptr.hpp>
+#include <cstdint>
 #include <string>
 
 
+/**
+ * Writes packets to a pcap file from one producer thread.
+ *
+ * push_back copies the record header and the packet (truncated to snaplen)
+ * into large pre-allocated segments of a single-producer single-consumer ring.
+ * A background thread writes the full segments with one writev call per batch.
+ * push_back never allocates, locks or blocks: if the ring is full the packet
+ * is dropped and counted.
+ */
 class PCAPWriter
 {
 public:
-    PCAPWriter(const std::string & inOutputFile);
+    PCAPWriter(const std::string & inOutputFile, uint32_t inSnapLength = 65535);
 
     ~PCAPWriter();
 
     void push_back(const uint8_t* bytes, uint32_t len);
 
+    // Hands the partially filled segment to the writer thread.
+    // Call it when the producer is idle, otherwise the data is written when the segment is full.
+    void flush();
+
+    // Number of packets dropped because the ring was full. May be called from any thread.
+    uint64_t dropped() const;
+
 private:
     struct Impl;
     boost::scoped_ptr<Impl> mImpl;
@@ -1,13 +1,38 @@
 #include "PCAPWriter.h"
+#include <chrono>
+#include <iostream>
 
 
 uint8_t buf[1514]; // standard ethernet size backet
 
+
+int64_t elapsed_ns(std::chrono::steady_clock::time_point start_time)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+
 int main()
 {
-    PCAPWriter pcap("pcap.pcap");
-    for (auto i = 0;  i != 1e6; ++i)
+    const auto num_packets = 1000000;
+
+    auto start_time = std::chrono::steady_clock::now();
+    int64_t push_ns = 0;
+    uint64_t dropped = 0;
     {
-        pcap.push_back(buf, sizeof(buf));
+        PCAPWriter pcap("pcap.pcap");
+        auto push_start_time = std::chrono::steady_clock::now();
+        for (auto i = 0;  i != num_packets; ++i)
+        {
+            pcap.push_back(buf, sizeof(buf));
+        }
+        push_ns = elapsed_ns(push_start_time);
+        dropped = pcap.dropped();
     }
+    auto total_ns = elapsed_ns(start_time);
+
+    // The total includes the allocation of the ring and writing the rest of it to the file.
+    std::cout << "packets=" << num_packets << " dropped=" << dropped
+        << " push_ns_per_packet=" << 1.0 * push_ns / num_packets
+        << " total_ms=" << total_ns / 1000000 << std::endl;
 }
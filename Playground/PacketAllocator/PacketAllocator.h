@@ -0,0 +1,820 @@
+#ifndef PACKETALLOCATOR_H
+#define PACKETALLOCATOR_H
+
+
+#include <boost/container/flat_map.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <deque>
+#include <memory>
+#include <new>
+#include <mutex>
+#include <scoped_allocator>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <sys/mman.h>
+
+
+// Create STL-compatible allocator for objects of type T using custom storage type.
+namespace Detail {
+namespace Inner {
+
+
+template<typename Storage, typename T>
+struct Allocator
+{
+    typedef T * pointer;
+    typedef const T * const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef T value_type;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    template<typename U>
+    struct rebind
+    {
+        typedef Allocator<Storage, U> other;
+    };
+
+    Allocator() = delete;
+
+    Allocator(Storage& inStorage) :
+        mStorage(&inStorage)
+    {
+        assert(mStorage);
+    }
+
+    Allocator(const Allocator& rhs) :
+        mStorage(rhs.mStorage)
+    {
+        assert(mStorage);
+    }
+
+    template <typename U>
+    Allocator(const Allocator<Storage, U>& rhs) : mStorage(rhs.mStorage)
+    {
+        assert(mStorage);
+    }
+
+    Allocator& operator=(const Allocator& rhs)
+    {
+        assert(mStorage);
+        mStorage = rhs.mStorage;
+        return *this;
+    }
+
+    ~Allocator()
+    {
+    }
+
+    const T * address(const T& s) const { return &s; }
+    T * address(T& r) const { return &r; }
+
+    size_t max_size() const { return std::size_t(-1); }
+
+    bool operator==(const Allocator&) const { return true; }
+    bool operator!=(const Allocator& other) const { return !(*this == other); }
+
+    template<typename U, typename ...Args>
+    void construct(U* u, Args&& ...args)
+    {
+        new ((void*)u) U(std::forward<Args>(args)...);
+    }
+
+    void destroy(T * const p) const { p->~T(); }
+
+    T * allocate(size_t n) const
+    {
+        assert(n);
+        return static_cast<T*>(mStorage->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T * const p, const size_t n) const
+    {
+        assert(mStorage);
+        mStorage->deallocate(p, n * sizeof(T));
+    }
+
+    template <typename U>
+    T * allocate(const size_t n, const U*) const { return this->allocate(n); }
+
+    Storage* mStorage;
+};
+
+
+} // namespace Inner
+
+
+template<typename Storage, typename T>
+using Allocator = std::scoped_allocator_adaptor<Inner::Allocator<Storage, T>>;
+
+
+} // namespace Detail
+
+
+/**
+ * Decorator that adds mutex locking.
+ */
+template<typename Pool>
+struct WithMutex
+{
+    void* allocate(std::size_t block_size)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mPool.allocate(block_size);
+    }
+
+    void deallocate(void* data, std::size_t block_size)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mPool.deallocate(data, block_size);
+    }
+
+private:
+    std::mutex mMutex;
+    Pool mPool;
+};
+
+
+/**
+ * Decorator that adds a per-thread cache of free blocks (magazines, like in tcmalloc).
+ *
+ * Each thread has a bounded stack of free blocks per block size. allocate and deallocate
+ * only use the stack of the calling thread. If it is empty, allocate takes batch_size
+ * blocks from the shared free list (or from the pool). If it is full, deallocate moves
+ * batch_size blocks to the shared free list. The mutex is taken once per batch.
+ *
+ * Blocks can be freed by another thread than the one that allocated them, e.g. packets
+ * allocated on the RX thread and freed on a worker. They go through the cache of the
+ * freeing thread to the shared free list, where the RX thread gets them back.
+ *
+ * The blocks that a thread has cached go back to the shared free list when it exits.
+ */
+template<typename Pool>
+struct WithThreadCache
+{
+    enum : uint32_t
+    {
+        capacity = 64,
+        batch_size = 32,
+        max_shared_blocks = 64 * batch_size // per block size, the others go back to the pool
+    };
+
+    WithThreadCache() :
+        mShared(std::make_shared<Shared>()),
+        mId(next_id++)
+    {
+    }
+
+    WithThreadCache(const WithThreadCache&) = delete;
+    WithThreadCache& operator=(const WithThreadCache&) = delete;
+
+    void* allocate(std::size_t block_size)
+    {
+        Magazine& magazine = get_cache().get_magazine(block_size);
+        if (magazine.mCount == 0)
+        {
+            mShared->refill(magazine);
+        }
+        return magazine.mBlocks[--magazine.mCount];
+    }
+
+    void deallocate(void* data, std::size_t block_size)
+    {
+        Magazine& magazine = get_cache().get_magazine(block_size);
+        if (magazine.mCount == capacity)
+        {
+            mShared->spill(magazine, batch_size);
+        }
+        magazine.mBlocks[magazine.mCount++] = data;
+    }
+
+    uint64_t lock_count() const
+    {
+        std::lock_guard<std::mutex> lock(mShared->mMutex);
+        return mShared->mLockCount;
+    }
+
+private:
+    struct Magazine
+    {
+        std::size_t mBlockSize;
+        uint32_t mCount;
+        void* mBlocks[capacity];
+    };
+
+    // The magazines of one thread, one per block size.
+    struct Cache
+    {
+        Magazine& get_magazine(std::size_t block_size)
+        {
+            if (mLast && mLast->mBlockSize == block_size)
+            {
+                return *mLast;
+            }
+
+            for (Magazine& magazine : mMagazines)
+            {
+                if (magazine.mBlockSize == block_size)
+                {
+                    mLast = &magazine;
+                    return magazine;
+                }
+            }
+
+            // deque: push_back does not move the other magazines.
+            mMagazines.push_back(Magazine());
+            mLast = &mMagazines.back();
+            mLast->mBlockSize = block_size;
+            mLast->mCount = 0;
+            return *mLast;
+        }
+
+        std::deque<Magazine> mMagazines;
+        Magazine* mLast = nullptr;
+    };
+
+    // Owned by the pool and by the exit handlers of the threads that used it.
+    struct Shared
+    {
+        ~Shared()
+        {
+            for (auto& cache : mCaches)
+            {
+                for (Magazine& magazine : cache->mMagazines)
+                {
+                    while (magazine.mCount != 0)
+                    {
+                        mPool.deallocate(magazine.mBlocks[--magazine.mCount], magazine.mBlockSize);
+                    }
+                }
+            }
+
+            for (auto& entry : mFreeBlocks)
+            {
+                for (void* block : entry.second)
+                {
+                    mPool.deallocate(block, entry.first);
+                }
+            }
+        }
+
+        void refill(Magazine& magazine)
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            ++mLockCount;
+
+            auto& blocks = mFreeBlocks[magazine.mBlockSize];
+            while (magazine.mCount != batch_size && !blocks.empty())
+            {
+                magazine.mBlocks[magazine.mCount++] = blocks.back();
+                blocks.pop_back();
+            }
+
+            while (magazine.mCount != batch_size)
+            {
+                magazine.mBlocks[magazine.mCount++] = mPool.allocate(magazine.mBlockSize);
+            }
+        }
+
+        void spill(Magazine& magazine, uint32_t count)
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            ++mLockCount;
+            spill_locked(magazine, count);
+        }
+
+        void spill_locked(Magazine& magazine, uint32_t count)
+        {
+            auto& blocks = mFreeBlocks[magazine.mBlockSize];
+            for (auto i = 0u; i != count; ++i)
+            {
+                void* block = magazine.mBlocks[--magazine.mCount];
+                if (blocks.size() < max_shared_blocks)
+                {
+                    blocks.push_back(block);
+                }
+                else
+                {
+                    mPool.deallocate(block, magazine.mBlockSize);
+                }
+            }
+        }
+
+        Cache* add_cache()
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mCaches.push_back(std::unique_ptr<Cache>(new Cache));
+            return mCaches.back().get();
+        }
+
+        // When the thread of the cache exits.
+        void remove_cache(Cache* cache)
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            for (Magazine& magazine : cache->mMagazines)
+            {
+                spill_locked(magazine, magazine.mCount);
+            }
+
+            for (auto& c : mCaches)
+            {
+                if (c.get() == cache)
+                {
+                    c = std::move(mCaches.back());
+                    mCaches.pop_back();
+                    break;
+                }
+            }
+        }
+
+        std::mutex mMutex;
+        Pool mPool;
+        boost::container::flat_map<std::size_t, std::vector<void*>> mFreeBlocks;
+        std::vector<std::unique_ptr<Cache>> mCaches;
+        uint64_t mLockCount = 0;
+    };
+
+    // The caches of a thread, indexed by the id of the pool.
+    struct ThreadCaches
+    {
+        struct Entry
+        {
+            std::weak_ptr<Shared> mShared;
+            Cache* mCache;
+        };
+
+        ~ThreadCaches()
+        {
+            for (Entry& entry : mEntries)
+            {
+                if (auto shared = entry.mShared.lock())
+                {
+                    shared->remove_cache(entry.mCache);
+                }
+            }
+        }
+
+        std::vector<Entry> mEntries;
+    };
+
+    Cache& get_cache()
+    {
+        auto& entries = thread_caches.mEntries;
+        if (mId < entries.size() && entries[mId].mCache)
+        {
+            return *entries[mId].mCache;
+        }
+
+        if (mId >= entries.size())
+        {
+            entries.resize(mId + 1);
+        }
+        entries[mId].mShared = mShared;
+        entries[mId].mCache = mShared->add_cache();
+        return *entries[mId].mCache;
+    }
+
+    static std::atomic<uint32_t> next_id;
+    static thread_local ThreadCaches thread_caches;
+
+    std::shared_ptr<Shared> mShared;
+    uint32_t mId;
+};
+
+
+template<typename Pool>
+std::atomic<uint32_t> WithThreadCache<Pool>::next_id{0};
+
+
+template<typename Pool>
+thread_local typename WithThreadCache<Pool>::ThreadCaches WithThreadCache<Pool>::thread_caches;
+
+
+/**
+ * FixedFreeListPool is a pool that allocates fixed-size segments.
+ * - allocate pops a block from the free-list (or uses malloc if empty)
+ * - deallocate pushes the block on the free-list
+ *
+ * Requires less CPU than other pools but also makes no effort to have good memory locality.
+ *
+ * Recommended for large block sizes.
+ */
+struct SimplePool
+{
+    template<typename T>
+    using Allocator = Detail::Allocator<SimplePool, T>;
+
+    SimplePool() : mAllocs(), mPreviousMax()
+    {
+    }
+
+    SimplePool(const SimplePool&) {}
+    SimplePool& operator=(const SimplePool&) { return *this; }
+
+    SimplePool(SimplePool&&) noexcept = default;
+    SimplePool& operator=(SimplePool&&) noexcept = default;
+
+    ~SimplePool()
+    {
+        if (!mSegments.empty())
+        {
+            std::cout << "SimplePool: Got " << mSegments.size() << " fixed-size blocks" << std::endl;
+        }
+        while (!mSegments.empty())
+        {
+            free(mSegments.back());
+            mSegments.pop_back();
+        }
+    }
+
+    void* allocate(std::size_t n)
+    {
+        if (mSegments.empty())
+        {
+            mAllocs += n;
+            if (mAllocs >= 2 * mPreviousMax)
+            {
+                mPreviousMax = mAllocs;
+                // LOG(Critical) << "FixedFreeListPool(" << this <<  ") is currently managing " << (mAllocs / n) << " blocks of size " << n << ". Total managed size: " << mAllocs << " bytes";
+            }
+            return malloc(n);
+        }
+
+        auto result = mSegments.back();
+        mSegments.pop_back();
+        return result;
+    }
+
+    void deallocate(void* data, std::size_t = 0)
+    {
+        mSegments.push_back(data);
+    }
+
+    //Mutex mMutex;
+    std::vector<void*> mSegments;
+    uint32_t mAllocs;
+    uint32_t mPreviousMax;
+};
+
+
+/**
+ * SmallObjectPool is a pool that allocates blocks grouped in chunks.
+ * It requires more CPU than FixedFreeListPool but provides better memory locality.
+ *
+ * Chunks are aligned to their size (a power of two), so the chunk of a block is found
+ * by masking its address. The chunks that have free blocks are on an intrusive list,
+ * so neither allocate nor deallocate search the chunks. One empty chunk is kept for
+ * reuse, the other empty chunks are released.
+ *
+ * Chunks are mapped with mmap, not posix_memalign. A chunk that is released on another
+ * thread than the one that allocated it went back to the glibc heap, which raised the
+ * mmap threshold, and the next chunks were carved out of a heap that kept growing
+ * (65 MB of RSS for 6 MB of packets in the fifo trace of AllocatorBenchmark).
+ *
+ * This is recommended for small block sizes.
+ */
+struct SmallObjectPool
+{
+    template<typename T>
+    using Allocator = Detail::Allocator<SmallObjectPool, T>;
+
+    enum : uint32_t { default_blocks_per_chunk = 255 };
+
+    SmallObjectPool() : SmallObjectPool(default_blocks_per_chunk)
+    {
+    }
+
+    // A chunk has room for at least min_blocks_per_chunk blocks. Its size is rounded up
+    // to a power of two, the rest is used for more blocks.
+    explicit SmallObjectPool(uint32_t min_blocks_per_chunk) :
+        mMinBlocksPerChunk(min_blocks_per_chunk),
+        mBlockSize(),
+        mBlocksPerChunk(),
+        mChunkSize(),
+        mAvailable(),
+        mEmptyChunk()
+    {
+        assert(min_blocks_per_chunk != 0);
+    }
+
+    SmallObjectPool(SmallObjectPool&& rhs) noexcept : SmallObjectPool(rhs.mMinBlocksPerChunk)
+    {
+        swap(rhs);
+    }
+
+    SmallObjectPool& operator=(SmallObjectPool&& rhs) noexcept
+    {
+        swap(rhs);
+        return *this;
+    }
+
+    SmallObjectPool(const SmallObjectPool&) = delete;
+    SmallObjectPool& operator=(const SmallObjectPool&) = delete;
+
+    ~SmallObjectPool()
+    {
+        if (!mChunks.empty())
+        {
+            std::cout << "SmallObjectPool: Got " << mChunks.size() << " chunks (containing " << mBlocksPerChunk << " blocks each)." << std::endl;
+            for (Chunk* chunk : mChunks)
+            {
+                munmap(chunk, mChunkSize);
+            }
+        }
+    }
+
+    void* allocate(std::size_t block_size)
+    {
+        if (!mAvailable)
+        {
+            if (mChunks.empty()) init(block_size);
+            add_chunk();
+        }
+
+        assert(get_block_size(block_size) == mBlockSize);
+
+        Chunk* chunk = mAvailable;
+        if (chunk == mEmptyChunk)
+        {
+            mEmptyChunk = nullptr;
+        }
+
+        void* result = chunk->allocate(mBlockSize);
+        if (chunk->isFull())
+        {
+            remove_available(chunk);
+        }
+        return result;
+    }
+
+    void deallocate(void* data, std::size_t block_size)
+    {
+        assert(!mChunks.empty());
+        assert(get_block_size(block_size) == mBlockSize);
+        static_cast<void>(block_size);
+
+        Chunk* chunk = reinterpret_cast<Chunk*>(reinterpret_cast<std::uintptr_t>(data) & ~std::uintptr_t(mChunkSize - 1));
+        assert(chunk->mIndex < mChunks.size() && mChunks[chunk->mIndex] == chunk);
+
+        if (chunk->isFull())
+        {
+            push_available(chunk);
+        }
+
+        chunk->deallocate(data);
+
+        if (chunk->mNumFree == mBlocksPerChunk)
+        {
+            if (mEmptyChunk)
+            {
+                release_chunk(mEmptyChunk);
+            }
+            mEmptyChunk = chunk;
+        }
+    }
+
+    uint32_t blocks_per_chunk() const
+    {
+        return mBlocksPerChunk;
+    }
+
+private:
+    // Header at the start of each chunk, the blocks follow it.
+    struct Chunk
+    {
+        void init(uint32_t index, uint32_t num_blocks)
+        {
+            mPrev = nullptr;
+            mNext = nullptr;
+            mFreeList = nullptr;
+            mIndex = index;
+            mNumFree = num_blocks;
+            mNumUsed = 0;
+        }
+
+        void* allocate(std::size_t block_size)
+        {
+            assert(mNumFree);
+            --mNumFree;
+
+            if (mFreeList)
+            {
+                void* result = mFreeList;
+                mFreeList = *static_cast<void**>(result);
+                return result;
+            }
+
+            // Blocks that were never used are not on the free list, so a new chunk
+            // does not have to touch all its blocks.
+            return reinterpret_cast<std::uint8_t*>(this) + header_size + block_size * mNumUsed++;
+        }
+
+        void deallocate(void* data)
+        {
+            *static_cast<void**>(data) = mFreeList;
+            mFreeList = data;
+            ++mNumFree;
+        }
+
+        bool isFull() const
+        {
+            return mNumFree == 0;
+        }
+
+        Chunk* mPrev; // list of the chunks with free blocks
+        Chunk* mNext;
+        void* mFreeList;
+        uint32_t mIndex; // in mChunks
+        uint32_t mNumFree;
+        uint32_t mNumUsed; // blocks that were allocated at least once
+    };
+
+    enum : uint32_t { header_size = 64, page_size = 4096 };
+    static_assert(sizeof(Chunk) <= header_size, "");
+
+    // The blocks hold the free list pointer.
+    static std::size_t get_block_size(std::size_t block_size)
+    {
+        return (std::max(block_size, sizeof(void*)) + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*);
+    }
+
+    void init(std::size_t block_size)
+    {
+        mBlockSize = get_block_size(block_size);
+        mChunkSize = page_size; // the chunks are mapped
+        while (mChunkSize < header_size + mMinBlocksPerChunk * mBlockSize)
+        {
+            mChunkSize *= 2;
+        }
+        mBlocksPerChunk = (mChunkSize - header_size) / mBlockSize;
+    }
+
+    void add_chunk()
+    {
+        Chunk* chunk = static_cast<Chunk*>(map_chunk());
+        chunk->init(mChunks.size(), mBlocksPerChunk);
+        mChunks.push_back(chunk);
+        push_available(chunk);
+    }
+
+    // Maps twice the chunk size and unmaps the parts before and after the aligned chunk.
+    void* map_chunk()
+    {
+        auto mapped_size = 2 * mChunkSize;
+        void* mapped = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED)
+        {
+            throw std::bad_alloc();
+        }
+
+        auto begin = reinterpret_cast<std::uintptr_t>(mapped);
+        auto chunk = (begin + mChunkSize - 1) & ~std::uintptr_t(mChunkSize - 1);
+        if (chunk != begin)
+        {
+            munmap(mapped, chunk - begin);
+        }
+        munmap(reinterpret_cast<void*>(chunk + mChunkSize), begin + mapped_size - chunk - mChunkSize);
+        return reinterpret_cast<void*>(chunk);
+    }
+
+    void release_chunk(Chunk* chunk)
+    {
+        remove_available(chunk);
+
+        Chunk* last = mChunks.back();
+        last->mIndex = chunk->mIndex;
+        mChunks[chunk->mIndex] = last;
+        mChunks.pop_back();
+
+        munmap(chunk, mChunkSize);
+    }
+
+    void push_available(Chunk* chunk)
+    {
+        chunk->mPrev = nullptr;
+        chunk->mNext = mAvailable;
+        if (mAvailable)
+        {
+            mAvailable->mPrev = chunk;
+        }
+        mAvailable = chunk;
+    }
+
+    void remove_available(Chunk* chunk)
+    {
+        if (chunk->mPrev)
+        {
+            chunk->mPrev->mNext = chunk->mNext;
+        }
+        else
+        {
+            mAvailable = chunk->mNext;
+        }
+
+        if (chunk->mNext)
+        {
+            chunk->mNext->mPrev = chunk->mPrev;
+        }
+
+        chunk->mPrev = nullptr;
+        chunk->mNext = nullptr;
+    }
+
+    void swap(SmallObjectPool& rhs)
+    {
+        std::swap(mMinBlocksPerChunk, rhs.mMinBlocksPerChunk);
+        std::swap(mBlockSize, rhs.mBlockSize);
+        std::swap(mBlocksPerChunk, rhs.mBlocksPerChunk);
+        std::swap(mChunkSize, rhs.mChunkSize);
+        std::swap(mChunks, rhs.mChunks);
+        std::swap(mAvailable, rhs.mAvailable);
+        std::swap(mEmptyChunk, rhs.mEmptyChunk);
+    }
+
+    uint32_t mMinBlocksPerChunk;
+    std::size_t mBlockSize;
+    uint32_t mBlocksPerChunk;
+    std::size_t mChunkSize;
+    std::vector<Chunk*> mChunks;
+    Chunk* mAvailable;   // chunks with free blocks
+    Chunk* mEmptyChunk;  // kept when it becomes empty, until another one does
+};
+
+
+struct FlexiblePool
+{
+    template<typename T>
+    using Allocator = Detail::Allocator<FlexiblePool, T>;
+
+    FlexiblePool()
+    {
+    }
+
+    FlexiblePool(const FlexiblePool&) = delete;
+    FlexiblePool& operator=(const FlexiblePool&) = delete;
+
+    FlexiblePool(FlexiblePool&&) = default;
+    FlexiblePool& operator=(FlexiblePool&&) = default;
+
+    ~FlexiblePool()
+    {
+    }
+
+    void* allocate(std::size_t block_size)
+    {
+        //// LOG(Critical) << "Allocate " << n;
+        if (block_size <= 256)
+        {
+            SmallObjectPool& pool = mFixedChunkingPools[block_size];
+            return pool.allocate(block_size);
+        }
+        else
+        {
+            SimplePool& pool = mFixedFreeListPools[block_size];
+            return pool.allocate(block_size);
+        }
+    }
+
+    void deallocate(void* data, std::size_t block_size)
+    {
+        //// LOG(Critical) << "Deallocate " << n;
+
+        if (block_size <= 256)
+        {
+            SmallObjectPool& pool = mFixedChunkingPools[block_size];
+            pool.deallocate(data, block_size);
+        }
+        else
+        {
+            SimplePool& pool = mFixedFreeListPools[block_size];
+            return pool.deallocate(data, block_size);
+        }
+    }
+
+    boost::container::flat_map<int, SimplePool> mFixedFreeListPools;
+    boost::container::flat_map<int, SmallObjectPool> mFixedChunkingPools;
+};
+
+
+
+struct Malloc
+{
+    void* allocate(std::size_t block_size)
+    {
+        return malloc(block_size);
+    }
+
+    void deallocate(void* data, std::size_t)
+    {
+        free(data);
+    }
+};
+
+
+#endif // PACKETALLOCATOR_H
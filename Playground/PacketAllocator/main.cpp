@@ -1,474 +1,215 @@
+#include "PacketAllocator.h"
 #include <boost/optional.hpp>
-#include <boost/container/flat_map.hpp>
-#include <mutex>
-#include <scoped_allocator>
+#include <chrono>
+#include <iomanip>
 #include <string>
-#include <vector>
-#include <cstddef>
+#include <thread>
 #include <vector>
 #include <iostream>
 
 
-// Create STL-compatible allocator for objects of type T using custom storage type.
-namespace Detail {
-namespace Inner {
-
-
-template<typename Storage, typename T>
-struct Allocator
-{
-    typedef T * pointer;
-    typedef const T * const_pointer;
-    typedef T& reference;
-    typedef const T& const_reference;
-    typedef T value_type;
-    typedef std::size_t size_type;
-    typedef std::ptrdiff_t difference_type;
-
-    template<typename U>
-    struct rebind
-    {
-        typedef Allocator<Storage, U> other;
-    };
-
-    Allocator() = delete;
-
-    Allocator(Storage& inStorage) :
-        mStorage(&inStorage)
-    {
-        assert(mStorage);
-    }
-
-    Allocator(const Allocator& rhs) :
-        mStorage(rhs.mStorage)
-    {
-        assert(mStorage);
-    }
-
-    template <typename U>
-    Allocator(const Allocator<Storage, U>& rhs) : mStorage(rhs.mStorage)
-    {
-        assert(mStorage);
-    }
-
-    Allocator& operator=(const Allocator& rhs)
-    {
-        assert(mStorage);
-        mStorage = rhs.mStorage;
-        return *this;
-    }
-
-    ~Allocator()
-    {
-    }
-
-    const T * address(const T& s) const { return &s; }
-    T * address(T& r) const { return &r; }
-
-    size_t max_size() const { return std::size_t(-1); }
-
-    bool operator==(const Allocator&) const { return true; }
-    bool operator!=(const Allocator& other) const { return !(*this == other); }
-
-    template<typename U, typename ...Args>
-    void construct(U* u, Args&& ...args)
-    {
-        new ((void*)u) U(std::forward<Args>(args)...);
-    }
-
-    void destroy(T * const p) const { p->~T(); }
-
-    T * allocate(size_t n) const
-    {
-        assert(n);
-        return static_cast<T*>(mStorage->allocate(n * sizeof(T)));
-    }
+template<typename T, typename Base = std::vector<T, FlexiblePool::Allocator<T>>>
+using Vector = std::vector<T, FlexiblePool::Allocator<T>>;
 
-    void deallocate(T * const p, const size_t n) const
-    {
-        assert(mStorage);
-        mStorage->deallocate(p, n * sizeof(T));
-    }
+using String = std::basic_string<char, std::char_traits<char>, FlexiblePool::Allocator<char>>;
 
-    template <typename U>
-    T * allocate(const size_t n, const U*) const { return this->allocate(n); }
 
-    Storage* mStorage;
-};
 
+template<typename Alloc>
+void test(Alloc&& alloc)
+{
 
-} // namespace Inner
+    Vector<String> vec{alloc};
+    vec.resize(1);
+    vec.back() = "abcabcabcabcabcabcabcabcabcabcabcabcabcabcabc";
+    vec.push_back(String("defdefdefdefdefdefdefdefdefdefdefdefdefdefdefdefdefdefdefdefdefdefdef", alloc));
+    vec.emplace_back("ghighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighi");
 
+    auto copy = vec;
+    vec.insert(vec.begin(), copy.begin(), copy.end());
+}
 
-template<typename Storage, typename T>
-using Allocator = std::scoped_allocator_adaptor<Inner::Allocator<Storage, T>>;
 
 
-} // namespace Detail
+template<typename Alloc>
+std::string get_details(const Alloc&)
+{
+    return "";
+}
 
 
-/**
- * Decorator that adds mutex locking.
- */
 template<typename Pool>
-struct WithMutex
+std::string get_details(const WithThreadCache<Pool>& alloc)
 {
-    void* allocate(std::size_t block_size)
-    {
-        std::lock_guard<std::mutex> lock(mMutex);
-        return mPool.allocate(block_size);
-    }
+    return " (mutex taken " + std::to_string(alloc.lock_count()) + " times)";
+}
 
-    void deallocate(void* data, std::size_t block_size)
-    {
-        std::lock_guard<std::mutex> lock(mMutex);
-        mPool.deallocate(data, block_size);
-    }
 
-private:
-    std::mutex mMutex;
-    Pool mPool;
-};
-
-
-/**
- * FixedFreeListPool is a pool that allocates fixed-size segments.
- * - allocate pops a block from the free-list (or uses malloc if empty)
- * - deallocate pushes the block on the free-list
- *
- * Requires less CPU than other pools but also makes no effort to have good memory locality.
- *
- * Recommended for large block sizes.
- */
-struct SimplePool
+// Half of the threads allocate batches of packet buffers (1536 bytes) and descriptors
+// (64 bytes) and hand them to the next thread, which frees them. Like RX threads that
+// pass their packets to workers. With one thread, it frees its own batches.
+template<typename Alloc>
+void benchmark(const char* name, uint32_t num_threads)
 {
-    template<typename T>
-    using Allocator = Detail::Allocator<SimplePool, T>;
-
-    SimplePool() : mAllocs(), mPreviousMax()
-    {
-    }
-
-    SimplePool(const SimplePool&) {}
-    SimplePool& operator=(const SimplePool&) { return *this; }
-
-    SimplePool(SimplePool&&) noexcept = default;
-    SimplePool& operator=(SimplePool&&) noexcept = default;
-
-    ~SimplePool()
+    enum : uint32_t
     {
-        if (!mSegments.empty())
-        {
-            std::cout << "SimplePool: Got " << mSegments.size() << " fixed-size blocks" << std::endl;
-        }
-        while (!mSegments.empty())
-        {
-            free(mSegments.back());
-            mSegments.pop_back();
-        }
-    }
-
-    void* allocate(std::size_t n)
-    {
-        if (mSegments.empty())
-        {
-            mAllocs += n;
-            if (mAllocs >= 2 * mPreviousMax)
-            {
-                mPreviousMax = mAllocs;
-                // LOG(Critical) << "FixedFreeListPool(" << this <<  ") is currently managing " << (mAllocs / n) << " blocks of size " << n << ". Total managed size: " << mAllocs << " bytes";
-            }
-            return malloc(n);
-        }
-
-        auto result = mSegments.back();
-        mSegments.pop_back();
-        return result;
-    }
+        batch_size = 32,
+        batches_per_producer = 40000,
+        packet_size = 1536,
+        descriptor_size = 64
+    };
 
-    void deallocate(void* data, std::size_t = 0)
+    struct Batch
     {
-        mSegments.push_back(data);
-    }
-
-    //Mutex mMutex;
-    std::vector<void*> mSegments;
-    uint32_t mAllocs;
-    uint32_t mPreviousMax;
-};
-
+        void* mBlocks[batch_size];
+    };
 
-/**
- * SmallObjectPool is a pool that allocates blocks grouped in chunks.
- * It requires more CPU than FixedFreeListPool but provides better memory locality.
- *
- * This is recommended for small block sizes.
- */
-struct SmallObjectPool
-{
-    template<typename T>
-    using Allocator = Detail::Allocator<SmallObjectPool, T>;
+    Alloc alloc;
 
-    SmallObjectPool() : mPreviousChunkCount()
+    // mailboxes[i] has the batch for thread i, or nullptr. The receiver sets it back to
+    // nullptr when it has freed the blocks, then the sender may reuse its batch.
+    std::unique_ptr<std::atomic<Batch*>[]> mailboxes(new std::atomic<Batch*>[num_threads]);
+    for (auto i = 0u; i != num_threads; ++i)
     {
+        mailboxes[i].store(nullptr);
     }
 
-    SmallObjectPool(SmallObjectPool&&) = default;
-    SmallObjectPool& operator=(SmallObjectPool&&) = default;
-
-    SmallObjectPool(const SmallObjectPool&) = delete;
-    SmallObjectPool& operator=(const SmallObjectPool&) = delete;
-
-    ~SmallObjectPool()
-    {
-        if (!mChunks.empty())
-        {
-            std::cout << "SmallObjectPool: Got " << mChunks.size() << " chunks (containing 255 blocks each)." << std::endl;
-            // LOG(Critical) << "FixedPool: destroying " << mChunks.size() << " chunks.";
-            while (!mChunks.empty())
-            {
-                Chunk& chunk = mChunks.back();
-                chunk.cleanup();
-                mChunks.pop_back();
-            }
-        }
-    }
+    const uint32_t num_producers = (num_threads + 1) / 2;
+    const uint32_t total_batches = num_producers * batches_per_producer;
+    std::atomic<uint32_t> consumed{0};
 
-    void* allocate(std::size_t block_size)
+    auto run = [&](uint32_t thread_index)
     {
-        //std::lock_guard<Mutex> lock(mMutex);
+        const bool producer = thread_index % 2 == 0;
+        const bool consumer = num_threads == 1 || thread_index % 2 == 1;
+        auto& inbox = mailboxes[thread_index];
+        auto& outbox = mailboxes[(thread_index + 1) % num_threads];
+        Batch batch;
+        uint32_t produced = producer ? 0 : batches_per_producer;
 
-        if (mChunks.empty()) init(block_size);
-        Chunk* chunk = findAvailableChunk();
-        if (!chunk)
+        // A producer waits until its last batch is freed, the batch is on its stack.
+        while (produced != batches_per_producer
+               || (producer && outbox.load(std::memory_order_acquire) != nullptr)
+               || (consumer && consumed.load(std::memory_order_relaxed) != total_batches))
         {
-            mChunks.resize(mChunks.size() + 1);
+            bool progress = false;
 
-            mLastFree = nullptr;
-            chunk = &mChunks.back();
-            chunk->init(block_size);
-
-            if (mChunks.size() >= 2 * mPreviousChunkCount)
+            Batch* received = consumer ? inbox.load(std::memory_order_acquire) : nullptr;
+            if (received)
             {
-                mPreviousChunkCount = mChunks.size();
-                // LOG(Critical) << "FixedChunkingPool(" << this << ") is currently managing " << mPreviousChunkCount << " chunks each containing 255 blocks of " << block_size << " bytes. Total managed size=" << (mPreviousChunkCount * 255);
+                for (auto i = 0u; i != batch_size; ++i)
+                {
+                    alloc.deallocate(received->mBlocks[i], i % 2 ? descriptor_size : packet_size);
+                }
+                inbox.store(nullptr, std::memory_order_release);
+                consumed.fetch_add(1, std::memory_order_relaxed);
+                progress = true;
             }
-        }
-        mLastAlloc = chunk;
-        return chunk->allocate(block_size);
-    }
-
-    void deallocate(void* data, std::size_t block_size)
-    {
-        //std::lock_guard<Mutex> lock(mMutex);
 
-        assert(!mChunks.empty());
-        if (!mLastFree || !mLastFree->contains(data, block_size))
-        {
-            for (Chunk& chunk : mChunks)
+            if (produced != batches_per_producer && outbox.load(std::memory_order_acquire) == nullptr)
             {
-                if (chunk.contains(data, block_size))
+                for (auto i = 0u; i != batch_size; ++i)
                 {
-                    mLastFree = &chunk;
-                    goto resume;
+                    batch.mBlocks[i] = alloc.allocate(i % 2 ? descriptor_size : packet_size);
                 }
+                outbox.store(&batch, std::memory_order_release);
+                ++produced;
+                progress = true;
             }
-            // LOG(Critical) << "ChunkBasedFixedPool::deallocate: there no parent chunk for ptr=" << data << " size=" << block_size;
-            assert(!"Invalid free");
-        }
 
-        resume:
-        mLastFree->deallocate(data, block_size);
-    }
-
-private:
-    struct Chunk
-    {
-        void init(std::size_t block_size)
-        {
-            auto chunk_size = block_size * std::uint8_t(-1);
-            //// LOG(Critical) << "Chunk was allocated with size " << chunk_size << " for " << (chunk_size / block_size) << " objects of size " << block_size;
-            mData = static_cast<uint8_t*>(malloc(chunk_size));
-            mFirstFreeBlock = 0;
-            mNumFreeBlocks = std::uint8_t(-1);
-
-            for (std::uint8_t i = 0; i != std::uint8_t(-1); ++i)
+            if (!progress)
             {
-                getByIndex(block_size, i)[0] = i + 1;
+                std::this_thread::yield();
             }
         }
-
-        void cleanup()
-        {
-            free(mData);
-            mData = nullptr;
-        }
-
-        void* allocate(std::size_t block_size)
-        {
-            assert(mNumFreeBlocks);
-            if (!mNumFreeBlocks) return nullptr;
-            auto result = getByIndex(block_size, mFirstFreeBlock);
-            mFirstFreeBlock = result[0];
-            --mNumFreeBlocks;
-            return result;
-        }
-
-        void deallocate(void* data, std::size_t block_size)
-        {
-            assert(mData <= data && data <= mData + block_size * std::uint8_t(-1));
-            auto block = static_cast<std::uint8_t*>(data);
-            block[0] = mFirstFreeBlock;
-            mFirstFreeBlock = getIndexOf(block_size, block);
-            ++mNumFreeBlocks;
-        }
-
-        bool contains(void* data, std::size_t block_size)
-        {
-            return mData <= data && data < mData + std::uint8_t(-1) * block_size;
-        }
-
-        bool isFull() const
-        {
-            return mNumFreeBlocks == 0;
-        }
-
-        std::uint8_t* getByIndex(std::size_t block_size, std::size_t object_index)
-        {
-            assert(object_index <= std::uint8_t(-1));
-            return mData + block_size * object_index;
-        }
-
-        std::size_t getIndexOf(std::size_t block_size, std::uint8_t* block)
-        {
-            auto difference = block - mData;
-            assert(difference % block_size == 0);
-            auto result = difference / block_size;
-            assert(result <= std::uint8_t(-1));
-            return result;
-        }
-
-        std::uint8_t* mData;
-        std::uint8_t mFirstFreeBlock;
-        std::uint8_t mNumFreeBlocks;
     };
 
-    Chunk* findAvailableChunk()
-    {
-        if (!mLastAlloc->isFull())
-        {
-            return mLastAlloc;
-        }
+    auto start_time = std::chrono::steady_clock::now();
 
-        for (Chunk& chunk : mChunks)
-        {
-            if (!chunk.isFull())
-            {
-                return &chunk;
-            }
-        }
-
-        return nullptr;
+    std::vector<std::thread> threads;
+    for (auto i = 0u; i != num_threads; ++i)
+    {
+        threads.emplace_back(run, i);
     }
 
-    void init(std::size_t block_size)
+    for (auto& thread : threads)
     {
-        mChunks.resize(1);
-        for (Chunk& chunk : mChunks)
-        {
-            chunk.init(block_size);
-        }
-        mLastAlloc = &mChunks.front();
-        mLastFree = &mChunks.front();
-        mChunkSize = block_size * uint8_t(-1);
-
-        // LOG(Critical) << "FixedPool was created for objects of size " << block_size;
+        thread.join();
     }
 
-    //Mutex mMutex;
-    std::vector<Chunk> mChunks;
-    Chunk* mLastAlloc;
-    Chunk* mLastFree;
-    uint32_t mChunkSize;
-    uint32_t mPreviousChunkCount;
-};
+    auto elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_time).count();
+    auto num_operations = 2.0 * total_batches * batch_size; // allocate + deallocate
 
+    std::cout << std::setw(34) << std::left << name
+              << " THREADS=" << num_threads
+              << " MOPS=" << std::setw(8) << std::left << int(0.5 + 100 * num_operations * 1e3 / elapsed_ns) / 100.0
+              << " NS/OP=" << std::setw(8) << std::left << int(0.5 + 100 * elapsed_ns / num_operations) / 100.0
+              << get_details(alloc) << std::endl;
+}
 
-struct FlexiblePool
-{
-    template<typename T>
-    using Allocator = Detail::Allocator<FlexiblePool, T>;
 
-    FlexiblePool()
+// Keeps num_live packet descriptors (64 bytes) allocated and replaces random ones,
+// so the freed blocks are spread over all chunks.
+template<typename Alloc>
+void benchmark_live_blocks(const char* name, uint32_t num_live)
+{
+    enum : uint32_t
     {
-    }
-
-    FlexiblePool(const FlexiblePool&) = delete;
-    FlexiblePool& operator=(const FlexiblePool&) = delete;
-
-    FlexiblePool(FlexiblePool&&) = default;
-    FlexiblePool& operator=(FlexiblePool&&) = default;
+        num_replacements = 1000 * 1000,
+        descriptor_size = 64
+    };
 
-    ~FlexiblePool()
+    Alloc alloc;
+    std::vector<void*> blocks(num_live);
+    for (auto& block : blocks)
     {
+        block = alloc.allocate(descriptor_size);
     }
 
-    void* allocate(std::size_t block_size)
-    {
-        //// LOG(Critical) << "Allocate " << n;
-        if (block_size <= 256)
-        {
-            SmallObjectPool& pool = mFixedChunkingPools[block_size];
-            return pool.allocate(block_size);
-        }
-        else
-        {
-            SimplePool& pool = mFixedFreeListPools[block_size];
-            return pool.allocate(block_size);
-        }
-    }
+    uint32_t random = 12345;
+    auto start_time = std::chrono::steady_clock::now();
 
-    void deallocate(void* data, std::size_t block_size)
+    for (auto i = 0u; i != num_replacements; ++i)
     {
-        //// LOG(Critical) << "Deallocate " << n;
+        // xorshift32
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
 
-        if (block_size <= 256)
-        {
-            SmallObjectPool& pool = mFixedChunkingPools[block_size];
-            pool.deallocate(data, block_size);
-        }
-        else
-        {
-            SimplePool& pool = mFixedFreeListPools[block_size];
-            return pool.deallocate(data, block_size);
-        }
+        auto& block = blocks[random % num_live];
+        alloc.deallocate(block, descriptor_size);
+        block = alloc.allocate(descriptor_size);
     }
 
-    boost::container::flat_map<int, SimplePool> mFixedFreeListPools;
-    boost::container::flat_map<int, SmallObjectPool> mFixedChunkingPools;
-};
-
-
+    auto elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_time).count();
 
-template<typename T, typename Base = std::vector<T, FlexiblePool::Allocator<T>>>
-using Vector = std::vector<T, FlexiblePool::Allocator<T>>;
-
-using String = std::basic_string<char, std::char_traits<char>, FlexiblePool::Allocator<char>>;
+    for (auto block : blocks)
+    {
+        alloc.deallocate(block, descriptor_size);
+    }
 
+    std::cout << std::setw(34) << std::left << name
+              << " LIVE=" << std::setw(7) << std::left << num_live
+              << " NS/OP=" << int(0.5 + 100.0 * elapsed_ns / (2 * num_replacements)) / 100.0 << std::endl;
+}
 
 
-template<typename Alloc>
-void test(Alloc&& alloc)
+void benchmark()
 {
+    for (uint32_t num_threads : { 1, 2, 4, 8 })
+    {
+        benchmark<Malloc>("malloc", num_threads);
+        benchmark<WithMutex<FlexiblePool>>("WithMutex<FlexiblePool>", num_threads);
+        benchmark<WithThreadCache<FlexiblePool>>("WithThreadCache<FlexiblePool>", num_threads);
+        std::cout << std::endl;
+    }
 
-    Vector<String> vec{alloc};
-    vec.resize(1);
-    vec.back() = "abcabcabcabcabcabcabcabcabcabcabcabcabcabcabc";
-    vec.push_back(String("defdefdefdefdefdefdefdefdefdefdefdefdefdefdefdefdefdefdefdefdefdefdef", alloc));
-    vec.emplace_back("ghighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighighi");
-
-    auto copy = vec;
-    vec.insert(vec.begin(), copy.begin(), copy.end());
+    for (uint32_t num_live : { 1000, 10000, 100000 })
+    {
+        benchmark_live_blocks<Malloc>("malloc", num_live);
+        benchmark_live_blocks<SmallObjectPool>("SmallObjectPool", num_live);
+    }
+    std::cout << std::endl;
 }
 
 
@@ -485,5 +226,7 @@ int main()
         }
     }
 
+    benchmark();
+
     std::cout << "End of program" << std::endl;
 }
@@ -1,8 +1,74 @@
 #include "BPFCompositeExpression.h"
+#include "PacketBurst.h"
+#include "vectorclass/instrset.h"
+#if INSTRSET >= 8
+#include "vectorclass/vectori256.h"
+#else
+#include "vectorclass/vectori256e.h"
+#endif
 #include <iostream>
 #include <sstream>
 
 
+namespace {
+
+
+// Returns a bitmask of the lanes that equal value.
+uint64_t compare_lanes(const uint32_t (&lanes)[PacketBurst::capacity], uint32_t value)
+{
+    using vec::Vec8ui;
+    uint64_t result = 0;
+    for (auto i = 0u; i != PacketBurst::capacity; i += 8)
+    {
+        result |= uint64_t(to_bits(Vec8ui().load_a(&lanes[i]) == Vec8ui(value))) << i;
+    }
+    return result;
+}
+
+
+uint64_t compare_lanes(const uint16_t (&lanes)[PacketBurst::capacity], uint16_t value)
+{
+    using vec::Vec16us;
+    uint64_t result = 0;
+    for (auto i = 0u; i != PacketBurst::capacity; i += 16)
+    {
+        result |= uint64_t(to_bits(Vec16us().load_a(&lanes[i]) == Vec16us(value))) << i;
+    }
+    return result;
+}
+
+
+// Returns a bitmask of the lanes that have all the bits of flags (all = true) or any of them.
+uint64_t compare_lanes_flags(const uint16_t (&lanes)[PacketBurst::capacity], uint16_t flags, bool all)
+{
+    using vec::Vec16us;
+    uint64_t result = 0;
+    for (auto i = 0u; i != PacketBurst::capacity; i += 16)
+    {
+        auto values = Vec16us().load_a(&lanes[i]) & Vec16us(flags);
+        result |= uint64_t(to_bits(all ? values == Vec16us(flags) : values != Vec16us(0))) << i;
+    }
+    return result;
+}
+
+
+// Returns a bitmask of the lanes in [min, max].
+uint64_t compare_lanes_in_range(const uint16_t (&lanes)[PacketBurst::capacity], uint16_t min, uint16_t max)
+{
+    using vec::Vec16us;
+    uint64_t result = 0;
+    for (auto i = 0u; i != PacketBurst::capacity; i += 16)
+    {
+        auto values = Vec16us().load_a(&lanes[i]);
+        result |= uint64_t(to_bits((values >= Vec16us(min)) & (values <= Vec16us(max)))) << i;
+    }
+    return result;
+}
+
+
+} // namespace
+
+
 BPFCompositeExpression::BPFCompositeExpression()
 {
 }
@@ -10,14 +76,29 @@ BPFCompositeExpression::BPFCompositeExpression()
 
 void BPFCompositeExpression::merge_and(BPFCompositeExpression& rhs)
 {
-    // TODO: FR: We must check for conflicts (in which case the filter always returns false)
+    auto both = [&](int flag) { return has_flag(flag) && rhs.has_flag(flag); };
+
+    if (both(FilterFlags_UDPPayload) && (mUDPPayloadOffset != rhs.mUDPPayloadOffset || mUDPPayloadSize != rhs.mUDPPayloadSize))
+    {
+        throw std::runtime_error("TODO: two UDP payload checks at different offsets");
+    }
+
+    if ((both(FilterFlags_SrcIPv4) && mSourceIP != rhs.mSourceIP)
+            || (both(FilterFlags_DstIPv4) && mDestinationIP != rhs.mDestinationIP)
+            || (both(FilterFlags_SrcPort) && mSourcePort != rhs.mSourcePort)
+            || (both(FilterFlags_DstPort) && mDestinationPort != rhs.mDestinationPort)
+            || (both(FilterFlags_UDPPayload) && mUDPPayloadValue != rhs.mUDPPayloadValue))
+    {
+        mFilterFlags |= FilterFlags_Conflict;
+    }
 
     mFilterFlags |= rhs.mFilterFlags;
     mPacketFlags |= rhs.mPacketFlags;
 
     if (rhs.has_flag(FilterFlags_Length))
     {
-        mLength = rhs.mLength;
+        // Default Lengths accepts all lengths, so this also works if we had no length yet.
+        mLengths.intersect(rhs.mLengths);
     }
 
     if (rhs.has_flag(FilterFlags_SrcIPv4))
@@ -92,11 +173,9 @@ bool BPFCompositeExpression::merge_or(BPFCompositeExpression& rhs)
         return false;
     }
 
-    if (has_flag(FilterFlags_Length) && !match_length(rhs))
+    if (has_flag(FilterFlags_Length))
     {
-        mLengths.push_back(rhs.mLength);
-        mLengths.insert(mLengths.end(), rhs.mLengths.begin(), rhs.mLengths.end());
-        return true;
+        return mLengths.unite(rhs.mLengths);
     }
 
     // Filters are identical.
@@ -120,9 +199,14 @@ bool BPFCompositeExpression::match(const uint8_t* data, uint32_t size, uint32_t
         return true;
     }
 
+    if (mFilterFlags & FilterFlags_Conflict)
+    {
+        return false;
+    }
+
     if (mFilterFlags & FilterFlags_Length)
     {
-        if (!match_length(size))
+        if (!mLengths.match(size))
         {
             return false;
         }
@@ -178,12 +262,96 @@ bool BPFCompositeExpression::match(const uint8_t* data, uint32_t size, uint32_t
 }
 
 
+uint64_t BPFCompositeExpression::match_burst(const PacketBurst& burst, uint64_t mask) const
+{
+    if (mFilterFlags == 0)
+    {
+        return mask;
+    }
+
+    if (mFilterFlags & FilterFlags_Conflict)
+    {
+        return 0;
+    }
+
+    // The same type checks as match() with a PacketInfo.
+    auto required = mPacketFlags | ((mFilterFlags & (FilterFlags_SrcIPv4 | FilterFlags_DstIPv4)) ? PacketFlags_IPv4 : 0);
+    if (required)
+    {
+        mask &= compare_lanes_flags(burst.mPacketFlags, required, true);
+    }
+
+    if (mFilterFlags & (FilterFlags_SrcPort | FilterFlags_DstPort | FilterFlags_UDPPayload))
+    {
+        mask &= compare_lanes_flags(burst.mPacketFlags, PacketFlags_UDP | PacketFlags_TCP, false);
+    }
+
+    if (mFilterFlags & FilterFlags_Length)
+    {
+        mask &= compare_lanes_in_range(burst.mLengths, mLengths.mMin, mLengths.mMax);
+
+        if (!mLengths.mBits.empty())
+        {
+            for (auto bits = mask; bits; bits &= bits - 1)
+            {
+                auto i = __builtin_ctzll(bits);
+                if (!mLengths.match(burst.mLengths[i]))
+                {
+                    mask &= ~(uint64_t(1) << i);
+                }
+            }
+        }
+    }
+
+    if (mFilterFlags & FilterFlags_SrcIPv4)
+    {
+        mask &= compare_lanes(burst.mSourceIPs, mSourceIP.mValue.mValue);
+    }
+
+    if (mFilterFlags & FilterFlags_DstIPv4)
+    {
+        mask &= compare_lanes(burst.mDestinationIPs, mDestinationIP.mValue.mValue);
+    }
+
+    if (mFilterFlags & FilterFlags_SrcPort)
+    {
+        mask &= compare_lanes(burst.mSourcePorts, mSourcePort.mValue);
+    }
+
+    if (mFilterFlags & FilterFlags_DstPort)
+    {
+        mask &= compare_lanes(burst.mDestinationPorts, mDestinationPort.mValue);
+    }
+
+    if (mFilterFlags & FilterFlags_UDPPayload)
+    {
+        // The payload byte must be loaded from each packet, so check the remaining packets one by one.
+        for (auto bits = mask; bits; bits &= bits - 1)
+        {
+            auto i = __builtin_ctzll(bits);
+            auto payload_index = burst.mL4Offsets[i] + mUDPPayloadOffset;
+            if (payload_index + mUDPPayloadSize >= burst.mLengths[i] || burst.mData[i][payload_index] != mUDPPayloadValue.hostValue())
+            {
+                mask &= ~(uint64_t(1) << i);
+            }
+        }
+    }
+
+    return mask;
+}
+
+
 std::string BPFCompositeExpression::toString() const
 {
     std::stringstream ss;
 
     int count = 0;
 
+    if (has_flag(FilterFlags_Conflict))
+    {
+        ss << "false and ";
+    }
+
     if (has_flag(FilterFlags_L3Type))
     {
         ss << (count == 0 ? "" : " and ") << ((mPacketFlags & PacketFlags_IPv4) ? "ip" : (mPacketFlags & PacketFlags_IPv6) ? "ip6" : "(NO IP?)");
@@ -222,20 +390,7 @@ std::string BPFCompositeExpression::toString() const
 
     if (has_flag(FilterFlags_Length))
     {
-        ss << (count == 0 ? "" : " and ");
-        if (mLengths.empty())
-        {
-            ss << "len=" << mLength;
-        }
-        else
-        {
-            ss << "(len=" << mLength;
-            for (auto value : mLengths)
-            {
-                ss << " or len=" << value;
-            }
-            ss << ")";
-        }
+        ss << (count == 0 ? "" : " and ") << mLengths.toString();
         count++;
     }
 
@@ -3,17 +3,12 @@
 
 
 #include "BPFExpression.h"
-#include <algorithm>
+#include "PacketInfo.h"
+#include <stdexcept>
 #include <vector>
 
 
-enum PacketFlags
-{
-    PacketFlags_IPv4 = (1 << 0),
-    PacketFlags_IPv6 = (1 << 1),
-    PacketFlags_UDP  = (1 << 2),
-    PacketFlags_TCP  = (1 << 3)
-};
+struct PacketBurst;
 
 
 enum FilterFlags
@@ -25,7 +20,8 @@ enum FilterFlags
     FilterFlags_DstIPv4    = (1 << 4),
     FilterFlags_SrcPort    = (1 << 5),
     FilterFlags_DstPort    = (1 << 6),
-    FilterFlags_UDPPayload = (1 << 7)
+    FilterFlags_UDPPayload = (1 << 7),
+    FilterFlags_Conflict   = (1 << 8)  // merge_and found two different values for a field, nothing matches
 };
 
 
@@ -40,42 +36,20 @@ struct BPFCompositeExpression
 
     void add_impl(Length len)
     {
-        mLength = len.mValue;
+        mLengths = Lengths(len.mValue);
         mFilterFlags |= FilterFlags_Length;
     }
 
-    void merge_and(BPFCompositeExpression& rhs);
-
-    bool merge_or(BPFCompositeExpression& rhs);
-
-    bool match_length(const BPFCompositeExpression& rhs) const
+    void add_impl(Lengths lengths)
     {
-        if (match_length(rhs.mLength))
-        {
-            return true;
-        }
-
-        for (auto length : rhs.mLengths)
-        {
-            if (match_length(length))
-            {
-                return true;
-            }
-        }
-
-        return false;
+        mLengths = std::move(lengths);
+        mFilterFlags |= FilterFlags_Length;
     }
 
-    bool match_length(uint16_t value) const
-    {
-        if (value == mLength)
-        {
-            return true;
-        }
+    // Sets FilterFlags_Conflict if both check a field for different values.
+    void merge_and(BPFCompositeExpression& rhs);
 
-        return !mLengths.empty()
-            && std::find(mLengths.begin(), mLengths.end(), value) != mLengths.end();
-    }
+    bool merge_or(BPFCompositeExpression& rhs);
 
     void add_impl(L3Type l3type)
     {
@@ -157,12 +131,34 @@ struct BPFCompositeExpression
 
     bool match(const uint8_t* data, uint32_t size, uint32_t l3_offset, uint32_t l4_offset) const;
 
+    // Also checks the L3 and L4 types, which the offset-based match can't know.
+    bool match(const uint8_t* data, uint32_t size, const PacketInfo& info) const
+    {
+        // Checking an IPv4 address implies IPv4, but add_impl doesn't set the packet flag for it.
+        auto required = mPacketFlags | ((mFilterFlags & (FilterFlags_SrcIPv4 | FilterFlags_DstIPv4)) ? PacketFlags_IPv4 : 0);
+        if ((info.mPacketFlags & required) != required)
+        {
+            return false;
+        }
+
+        // Ports and payload need a TCP or UDP header.
+        if ((mFilterFlags & (FilterFlags_SrcPort | FilterFlags_DstPort | FilterFlags_UDPPayload))
+                && !(info.mPacketFlags & (PacketFlags_UDP | PacketFlags_TCP)))
+        {
+            return false;
+        }
+
+        return match(data, size, info.mL3Offset, info.mL4Offset);
+    }
+
+    // Returns the subset of the packets in mask that match. Same semantics as match() with a PacketInfo.
+    uint64_t match_burst(const PacketBurst& burst, uint64_t mask) const;
+
     std::string toString() const;
 
 
     uint16_t mFilterFlags = 0;
     uint16_t mPacketFlags = 0;
-    uint16_t mLength = 0;
     IPv4Address mSourceIP{};
     IPv4Address mDestinationIP{};
     Net16 mSourcePort{};
@@ -170,7 +166,7 @@ struct BPFCompositeExpression
     uint16_t mUDPPayloadOffset = 0;
     uint16_t mUDPPayloadSize = 0;
     Net32 mUDPPayloadValue{};
-    std::vector<uint16_t> mLengths;
+    Lengths mLengths;
 };
 
 
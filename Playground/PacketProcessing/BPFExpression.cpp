@@ -1,4 +1,6 @@
 #include "BPFExpression.h"
+#include <algorithm>
+#include <sstream>
 
 
 std::string Length::toString() const
@@ -7,6 +9,139 @@ std::string Length::toString() const
 }
 
 
+uint32_t Lengths::last() const
+{
+    if (mBits.empty())
+    {
+        return mMax;
+    }
+    return std::min<uint32_t>(mMax, 64 * mBits.size() - 1);
+}
+
+
+bool Lengths::empty() const
+{
+    for (uint32_t i = mMin, end = last(); i <= end; ++i)
+    {
+        if (match(i))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+std::vector<uint64_t> Lengths::to_bitmap() const
+{
+    std::vector<uint64_t> result(last() / 64 + 1);
+    for (uint32_t i = mMin, end = last(); i <= end; ++i)
+    {
+        if (match(i))
+        {
+            result[i / 64] |= uint64_t(1) << (i % 64);
+        }
+    }
+    return result;
+}
+
+
+bool Lengths::unite(const Lengths& rhs)
+{
+    if (rhs.empty())
+    {
+        return true;
+    }
+
+    if (empty())
+    {
+        *this = rhs;
+        return true;
+    }
+
+    // Overlapping or adjacent ranges remain a range.
+    if (mBits.empty() && rhs.mBits.empty() && mMin <= rhs.mMax + 1u && rhs.mMin <= mMax + 1u)
+    {
+        mMin = std::min(mMin, rhs.mMin);
+        mMax = std::max(mMax, rhs.mMax);
+        return true;
+    }
+
+    if (last() > max_bitmap_length || rhs.last() > max_bitmap_length)
+    {
+        return false;
+    }
+
+    auto bits = to_bitmap();
+    auto rhs_bits = rhs.to_bitmap();
+    if (bits.size() < rhs_bits.size())
+    {
+        bits.swap(rhs_bits);
+    }
+
+    for (auto i = 0u; i != rhs_bits.size(); ++i)
+    {
+        bits[i] |= rhs_bits[i];
+    }
+
+    mMin = std::min(mMin, rhs.mMin);
+    mMax = std::max(mMax, rhs.mMax);
+    mBits = std::move(bits);
+    return true;
+}
+
+
+void Lengths::intersect(const Lengths& rhs)
+{
+    mMin = std::max(mMin, rhs.mMin);
+    mMax = std::min(mMax, rhs.mMax);
+
+    if (rhs.mBits.empty())
+    {
+        return;
+    }
+
+    if (mBits.empty())
+    {
+        mBits = rhs.mBits;
+        return;
+    }
+
+    mBits.resize(std::min(mBits.size(), rhs.mBits.size()));
+    for (auto i = 0u; i != mBits.size(); ++i)
+    {
+        mBits[i] &= rhs.mBits[i];
+    }
+}
+
+
+std::string Lengths::toString() const
+{
+    if (mBits.empty())
+    {
+        if (mMin == mMax)
+        {
+            return "len=" + std::to_string(mMin);
+        }
+        return "len >= " + std::to_string(mMin) + " and len <= " + std::to_string(mMax);
+    }
+
+    std::stringstream ss;
+    ss << "len in {";
+    const char* separator = "";
+    for (uint32_t i = mMin, end = last(); i <= end; ++i)
+    {
+        if (match(i))
+        {
+            ss << separator << i;
+            separator = ", ";
+        }
+    }
+    ss << "}";
+    return ss.str();
+}
+
+
 std::string L3Type::toString() const
 {
     switch (EtherType(mValue.hostValue()))
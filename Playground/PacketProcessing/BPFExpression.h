@@ -3,9 +3,10 @@
 
 
 #include "Networking.h"
-#include "vectorclass/vectori128.h"
 #include <cstdint>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
 
 struct Length
@@ -19,46 +20,68 @@ struct Length
 
 
 /**
- * For BPF filters like: "len=128 or len=256 or len=400 ..."
- * Compares a given length to all values and returns true if one of them matches.
- * This can hold up to 8 length values. TODO: support any number of values.
+ * For BPF filters like: "len=128 or len=256 or len=400 ...", "len in {128, 256, 400}"
+ * and "len >= 64 and len <= 128".
+ *
+ * Holds a range [mMin, mMax] that is optionally restricted by a bitmap of lengths.
+ * The bitmap only goes up to the largest length in the set (24 words for Ethernet
+ * frames, 145 words for 9216-byte jumbo frames), so match is a range check and a
+ * single bit test regardless of the number of values.
  */
 struct Lengths
 {
-    Lengths() :
-        mLengths(0)
+    // Longest open-ended range that can be converted to a bitmap.
+    enum : uint32_t { max_bitmap_length = 9216 };
+
+    // All lengths
+    Lengths() = default;
+
+    explicit Lengths(uint16_t length) : mMin(length), mMax(length) {}
+
+    static Lengths Range(uint16_t min, uint16_t max)
     {
+        Lengths result;
+        result.mMin = min;
+        result.mMax = max;
+        return result;
     }
 
-    // Very slow. Only do this during configuration time.
-    void add(uint16_t length)
+    bool match(uint16_t length) const
     {
-        for (auto i = 0; i != mLengths.size(); ++i)
+        if (length < mMin || length > mMax)
         {
-            if (mLengths[i] == 0)
-            {
-                mLengths.insert(i, length);
-                return;
-            }
+            return false;
         }
 
-        throw std::runtime_error("Lengths is full.");
+        if (mBits.empty())
+        {
+            return true;
+        }
+
+        auto word = length / 64u;
+        return word < mBits.size() && ((mBits[word] >> (length % 64u)) & 1);
     }
 
-	// Creates the vector and calls match_vector
-	// Avoid using this method.
-	bool match(uint16_t length)
-	{
-        return match_vector(vec::Vec8us(length));
-	}
+    bool empty() const;
 
-    // Create the Vec8us from the call-site and then reuse it by calling match_vector on multiple methods.
-    bool match_vector(vec::Vec8us length) const
-    {
-        return horizontal_or(mLengths == length);
-    }
+    // Adds the lengths of rhs to this set.
+    // Returns false (and leaves this set unchanged) if the result can't be represented.
+    bool unite(const Lengths& rhs);
+
+    // Removes the lengths that are not in rhs.
+    void intersect(const Lengths& rhs);
+
+    std::string toString() const;
+
+    uint16_t mMin = 0;
+    uint16_t mMax = 0xFFFF;
+    std::vector<uint64_t> mBits; // empty means all lengths in [mMin, mMax]
+
+private:
+    // Last length that may match.
+    uint32_t last() const;
 
-    vec::Vec8us mLengths;
+    std::vector<uint64_t> to_bitmap() const;
 };
 
 
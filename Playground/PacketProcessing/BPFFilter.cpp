@@ -293,7 +293,7 @@ u_int BPFFilter::match_bpf(const bpf_insn* pc, const u_char* p, u_int wirelen, u
 }
 
 
-BPFFilter::BPFFilter(std::string bpf_filter)
+bpf_program BPFFilter::compile(const std::string& bpf_filter)
 {
     using DummyInterface = std::unique_ptr<pcap_t, decltype(&pcap_close)>;
 
@@ -304,11 +304,20 @@ BPFFilter::BPFFilter(std::string bpf_filter)
         throw std::runtime_error("Failed to open pcap dummy interface");
     }
 
-    auto result = pcap_compile(dummy_interface.get(), &mProgram, bpf_filter.c_str(), 1, 0xff000000);
+    bpf_program program;
+    auto result = pcap_compile(dummy_interface.get(), &program, bpf_filter.c_str(), 1, 0xff000000);
     if (result != 0)
     {
         throw std::runtime_error("pcap_compile failed. Filter=" + bpf_filter);
     }
+
+    return program;
+}
+
+
+BPFFilter::BPFFilter(std::string bpf_filter) :
+    mProgram(compile(bpf_filter))
+{
 }
 
 
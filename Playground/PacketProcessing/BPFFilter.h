@@ -14,23 +14,32 @@ struct BPFFilter
 {
     static std::string generate_bpf_filter_string(ProtocolId protocol, IPv4Address src_ip, IPv4Address dst_ip, uint16_t src_port, uint16_t dst_port);
 
+    // Compiles the filter for DLT_RAW (the program starts at the IP header).
+    static bpf_program compile(const std::string& bpf_filter);
+
     BPFFilter(std::string match_bpf);
 
     BPFFilter(ProtocolId protocol, IPv4Address src_ip, IPv4Address dst_ip, uint16_t src_port, uint16_t dst_port);
 
-    bool match(const uint8_t* data, uint32_t size, uint32_t /*l3_offset*/, uint32_t /*l4_offset*/) const
+    // l3_offset is PacketInfo::mL3Offset, 0 for a runt frame without an Ethernet header.
+    bool match(const uint8_t* data, uint32_t size, uint32_t l3_offset, uint32_t /*l4_offset*/) const
     {
-        auto ip_data = data + sizeof(EthernetHeader);
-        auto ip_size = size - sizeof(EthernetHeader);
+        if (l3_offset == 0 || l3_offset > size)
+        {
+            return false;
+        }
+        auto ip_data = data + l3_offset;
+        auto ip_size = size - l3_offset;
         return match_bpf(mProgram.bf_insns, ip_data, ip_size, ip_size) != 0;
     }
 
+    // Interprets the program. JITBPFFilter::execute returns the same.
+    static u_int match_bpf(const struct bpf_insn* pc, const u_char* p, u_int wirelen, u_int buflen);
+
 private:
     #define BPFFILTER_EXTRACT_SHORT(p)  ((u_short)ntohs(*(u_short *)p))
     #define BPFFILTER_EXTRACT_LONG(p) (ntohl(*(uint32_t *)p))
 
-    static u_int match_bpf(const struct bpf_insn* pc, const u_char* p, u_int wirelen, u_int buflen);
-
     bpf_program mProgram;
 };
 
@@ -0,0 +1,211 @@
+#include "CuckooFlowTable.h"
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+
+namespace {
+
+
+// Number of evictions before an insert gives up and the table grows.
+const uint32_t max_kicks = 500;
+
+// Grow before the table gets so full that inserts need long eviction chains.
+const double max_load_factor = 0.9;
+
+// Entries that are left over after max_kicks evictions. Usually empty, a lookup only
+// checks the stash if it misses in both buckets.
+const uint32_t max_stash_size = 8;
+
+// Doublings in a row after which a rehash gives up. Only entries that share their
+// buckets, e.g. with the same hash, fail that often.
+const uint32_t max_rehashes = 4;
+
+
+uint32_t next_power_of_two(uint32_t n)
+{
+    uint32_t result = 1;
+    while (result < n)
+    {
+        result *= 2;
+    }
+    return result;
+}
+
+
+} // namespace
+
+
+FlowKey FlowKey::Create(ProtocolId protocol, IPv4Address src_ip, IPv4Address dst_ip, uint16_t src_port, uint16_t dst_port)
+{
+    // Composite of IPv4 + TCP/UDP header fields from TTL to DestinationPort.
+    struct TransportHeader
+    {
+        uint8_t ttl;
+        ProtocolId protocol;
+        uint16_t checksum;
+        IPv4Address src_ip = IPv4Address();
+        IPv4Address dst_ip = IPv4Address();
+        Net16 src_port;
+        Net16 dst_port;
+    };
+
+    auto h = TransportHeader();
+    h.protocol = protocol;
+    h.src_ip = src_ip;
+    h.dst_ip = dst_ip;
+    h.src_port = Net16(src_port);
+    h.dst_port = Net16(dst_port);
+
+    static_assert(sizeof(FlowKey) == sizeof(h), "");
+
+    FlowKey result;
+    memcpy(&result.mWords[0], &h, sizeof(result.mWords));
+    result.mWords[0] &= static_mask[0];
+    result.mWords[1] &= static_mask[1];
+    return result;
+}
+
+
+std::array<uint64_t, 2> FlowKey::GetMask()
+{
+    static const uint8_t mask_bytes[16] = {
+        0x00, 0xff, 0x00, 0x00, // ttl, protocol and checksum
+        0xff, 0xff, 0xff, 0xff, // source ip
+        0xff, 0xff, 0xff, 0xff, // destination ip
+        0xff, 0xff, 0xff, 0xff  // source and destination ports
+    };
+
+    return ::Decode<std::array<uint64_t, 2>>(&mask_bytes[0]);
+}
+
+
+std::array<uint64_t, 2> FlowKey::static_mask = FlowKey::GetMask();
+
+
+CuckooFlowTable::CuckooFlowTable(uint32_t expected_flows)
+{
+    auto min_buckets = static_cast<uint32_t>(expected_flows / (slots_per_bucket * max_load_factor)) + 1;
+    rehash(next_power_of_two(min_buckets));
+    mEntries.reserve(expected_flows);
+}
+
+
+void CuckooFlowTable::insert(uint64_t hash, uint32_t flow_index)
+{
+    mEntries.emplace_back(hash, flow_index);
+
+    if (load_factor() > max_load_factor || !insert_impl(hash, flow_index))
+    {
+        // Rehashing also inserts the new entry.
+        auto old_num_buckets = num_buckets();
+        try
+        {
+            rehash(2 * old_num_buckets);
+        }
+        catch (const std::length_error&)
+        {
+            // The evictions may have dropped another entry, so rebuild without the new one.
+            mEntries.pop_back();
+            rehash(old_num_buckets);
+            throw;
+        }
+    }
+}
+
+
+bool CuckooFlowTable::try_insert(uint32_t bucket_index, uint16_t fingerprint, uint32_t flow_index)
+{
+    Bucket& bucket = mBuckets[bucket_index];
+    for (auto i = 0u; i != slots_per_bucket; ++i)
+    {
+        if (bucket.mFingerprints[i] == 0)
+        {
+            bucket.mFingerprints[i] = fingerprint;
+            bucket.mFlowIndexes[i] = flow_index;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+bool CuckooFlowTable::insert_impl(uint64_t hash, uint32_t flow_index)
+{
+    auto fingerprint = get_fingerprint(hash);
+    auto bucket_index = get_bucket_index(hash);
+
+    if (try_insert(bucket_index, fingerprint, flow_index))
+    {
+        return true;
+    }
+
+    bucket_index = get_alternate_bucket_index(bucket_index, fingerprint);
+
+    for (auto kick = 0u; kick != max_kicks; ++kick)
+    {
+        if (try_insert(bucket_index, fingerprint, flow_index))
+        {
+            return true;
+        }
+
+        // Evict a random slot and move the evicted entry to its other bucket.
+        mRandom = mRandom * 1103515245u + 12345u;
+        auto slot = (mRandom >> 16) % slots_per_bucket;
+
+        Bucket& bucket = mBuckets[bucket_index];
+        std::swap(fingerprint, bucket.mFingerprints[slot]);
+        std::swap(flow_index, bucket.mFlowIndexes[slot]);
+
+        bucket_index = get_alternate_bucket_index(bucket_index, fingerprint);
+    }
+
+    // The last evicted entry has no place. The caller must rehash if the stash is full.
+    if (mStash.size() == max_stash_size)
+    {
+        return false;
+    }
+
+    mStash.push_back(StashEntry{fingerprint, bucket_index, flow_index});
+    return true;
+}
+
+
+void CuckooFlowTable::rehash(uint32_t num_buckets)
+{
+    for (auto attempt = 0u; ; ++attempt)
+    {
+        if (attempt == max_rehashes)
+        {
+            throw std::length_error("CuckooFlowTable: too many flows with the same hash");
+        }
+
+        auto buckets = static_cast<Bucket*>(aligned_alloc(alignof(Bucket), num_buckets * sizeof(Bucket)));
+        if (!buckets)
+        {
+            throw std::bad_alloc();
+        }
+        memset(buckets, 0, num_buckets * sizeof(Bucket));
+
+        mBuckets.reset(buckets);
+        mMask = num_buckets - 1;
+        mStash.clear();
+
+        bool success = true;
+        for (const auto& entry : mEntries)
+        {
+            if (!insert_impl(entry.first, entry.second))
+            {
+                success = false;
+                break;
+            }
+        }
+
+        if (success)
+        {
+            return;
+        }
+
+        num_buckets *= 2;
+    }
+}
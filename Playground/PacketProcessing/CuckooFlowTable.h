@@ -0,0 +1,218 @@
+#ifndef CUCKOOFLOWTABLE_H
+#define CUCKOOFLOWTABLE_H
+
+
+#include "Networking.h"
+#include "vectorclass/vectori128.h"
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <utility>
+#include <vector>
+
+
+/**
+ * Protocol, addresses and ports of an IPv4 + TCP/UDP packet.
+ * Uses the same 16-byte masked header window as MaskFilter.
+ */
+struct FlowKey
+{
+    static FlowKey Create(ProtocolId protocol, IPv4Address src_ip, IPv4Address dst_ip, uint16_t src_port, uint16_t dst_port);
+
+    static FlowKey Decode(const uint8_t* packet_data, uint32_t l3_offset, uint32_t l4_offset)
+    {
+        auto u64_data = DecodeFiveTuple<std::array<uint64_t, 2>>(packet_data, l3_offset, l4_offset);
+
+        FlowKey result;
+        result.mWords[0] = static_mask[0] & u64_data[0];
+        result.mWords[1] = static_mask[1] & u64_data[1];
+        return result;
+    }
+
+    uint64_t hash() const
+    {
+        // murmur3 finalizer
+        uint64_t h = mWords[0] * 0x9E3779B97F4A7C15ull + mWords[1];
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    friend bool operator==(const FlowKey& lhs, const FlowKey& rhs)
+    {
+        return lhs.mWords == rhs.mWords;
+    }
+
+    std::array<uint64_t, 2> mWords;
+
+private:
+    static std::array<uint64_t, 2> GetMask();
+
+    static std::array<uint64_t, 2> static_mask;
+};
+
+
+/**
+ * Bucketized cuckoo hash table that maps a flow hash to a flow index.
+ *
+ * Each 64-byte bucket holds 8 slots of a 16-bit fingerprint and a 32-bit flow index.
+ * Every hash has two candidate buckets (partial-key cuckoo hashing: the second bucket
+ * is derived from the first one and the fingerprint), so a lookup reads at most two
+ * cache lines and compares all fingerprints of a bucket with one vector compare.
+ * If an insert fails, the homeless entry goes to a small stash that lookups check
+ * after the buckets. When the stash is full the table doubles and rehashes. Entries
+ * with the same hash share their two buckets, so more of them than fit in the buckets
+ * and the stash throw std::length_error after a few rehashes.
+ *
+ * Fingerprints can collide, so lookups take a callback that verifies the candidate.
+ */
+struct CuckooFlowTable
+{
+    enum : uint32_t { not_found = uint32_t(-1) };
+
+    explicit CuckooFlowTable(uint32_t expected_flows = 0);
+
+    void insert(uint64_t hash, uint32_t flow_index);
+
+    // Inserts the flow unless there is one with the same key, that is, one for which
+    // same_key(flow_index) returns true. Returns false for such a duplicate.
+    template<typename SameKey>
+    bool insert(uint64_t hash, uint32_t flow_index, SameKey&& same_key)
+    {
+        if (find(hash, same_key) != not_found)
+        {
+            return false;
+        }
+
+        insert(hash, flow_index);
+        return true;
+    }
+
+    // Returns the flow index for which verify(flow_index) returns true, or not_found.
+    template<typename Verify>
+    uint32_t find(uint64_t hash, Verify&& verify) const
+    {
+        auto fingerprint = get_fingerprint(hash);
+        auto bucket_index = get_bucket_index(hash);
+
+        auto result = find(mBuckets[bucket_index], fingerprint, verify);
+        if (result != not_found)
+        {
+            return result;
+        }
+
+        auto alternate_bucket_index = get_alternate_bucket_index(bucket_index, fingerprint);
+        result = find(mBuckets[alternate_bucket_index], fingerprint, verify);
+        if (result != not_found || mStash.empty())
+        {
+            return result;
+        }
+
+        for (const auto& entry : mStash)
+        {
+            if (entry.mFingerprint == fingerprint
+                && (entry.mBucketIndex == bucket_index || entry.mBucketIndex == alternate_bucket_index)
+                && verify(entry.mFlowIndex))
+            {
+                return entry.mFlowIndex;
+            }
+        }
+
+        return not_found;
+    }
+
+    // Loads both candidate buckets into cache. Call this a few packets ahead of find().
+    void prefetch(uint64_t hash) const
+    {
+        auto bucket_index = get_bucket_index(hash);
+        __builtin_prefetch(&mBuckets[bucket_index], 0, 0);
+        __builtin_prefetch(&mBuckets[get_alternate_bucket_index(bucket_index, get_fingerprint(hash))], 0, 0);
+    }
+
+    uint32_t size() const { return mEntries.size(); }
+
+    uint32_t num_buckets() const { return mMask + 1; }
+
+    uint32_t stash_size() const { return mStash.size(); }
+
+    double load_factor() const { return 1.0 * size() / (num_buckets() * slots_per_bucket); }
+
+private:
+    enum : uint32_t { slots_per_bucket = 8 };
+
+    struct alignas(64) Bucket
+    {
+        uint16_t mFingerprints[slots_per_bucket]; // zero means empty slot
+        uint32_t mFlowIndexes[slots_per_bucket];
+        uint8_t mPadding[16];
+    };
+
+    static_assert(sizeof(Bucket) == 64, "");
+
+    // An entry that found no slot in either of its buckets.
+    struct StashEntry
+    {
+        uint16_t mFingerprint;
+        uint32_t mBucketIndex; // one of the two candidate buckets
+        uint32_t mFlowIndex;
+    };
+
+    template<typename Verify>
+    static uint32_t find(const Bucket& bucket, uint16_t fingerprint, Verify& verify)
+    {
+        auto eq = vec::Vec8us().load_a(bucket.mFingerprints) == vec::Vec8us(fingerprint);
+
+        for (auto bits = to_bits(eq); bits; bits &= bits - 1)
+        {
+            auto flow_index = bucket.mFlowIndexes[__builtin_ctz(bits)];
+            if (verify(flow_index))
+            {
+                return flow_index;
+            }
+        }
+
+        return not_found;
+    }
+
+    static uint16_t get_fingerprint(uint64_t hash)
+    {
+        auto result = static_cast<uint16_t>(hash >> 48);
+        return result == 0 ? 1 : result;
+    }
+
+    uint32_t get_bucket_index(uint64_t hash) const
+    {
+        return hash & mMask;
+    }
+
+    uint32_t get_alternate_bucket_index(uint32_t bucket_index, uint16_t fingerprint) const
+    {
+        return (bucket_index ^ (fingerprint * 0x5bd1e995u)) & mMask;
+    }
+
+    bool try_insert(uint32_t bucket_index, uint16_t fingerprint, uint32_t flow_index);
+
+    bool insert_impl(uint64_t hash, uint32_t flow_index);
+
+    void rehash(uint32_t num_buckets);
+
+    struct Free
+    {
+        void operator()(void* p) const { free(p); }
+    };
+
+    std::unique_ptr<Bucket[], Free> mBuckets;
+    uint32_t mMask = 0;
+    uint32_t mRandom = 1;
+    std::vector<StashEntry> mStash;
+
+    // Needed to rehash when the table grows.
+    std::vector<std::pair<uint64_t, uint32_t>> mEntries;
+};
+
+
+#endif // CUCKOOFLOWTABLE_H
@@ -0,0 +1,342 @@
+#include "DecisionDAG.h"
+#include <algorithm>
+#include <cassert>
+#include <iterator>
+
+
+namespace {
+
+
+uint32_t ethertype_value(EtherType ethertype)
+{
+    return Net16(static_cast<uint16_t>(ethertype)).mValue;
+}
+
+
+// A term that requires two different L3 or L4 types, or two values of a field, can never match.
+bool is_satisfiable(const BPFCompositeExpression& bpf)
+{
+    auto both = [&](int a, int b) { return (bpf.mPacketFlags & a) && (bpf.mPacketFlags & b); };
+    return !both(PacketFlags_IPv4, PacketFlags_IPv6) && !both(PacketFlags_UDP, PacketFlags_TCP) && !bpf.has_flag(FilterFlags_Conflict);
+}
+
+
+} // namespace
+
+
+void DecisionDAG::add_filter(uint32_t filter_id, const Expression& expression)
+{
+    for (BPFCompositeExpression& bpf : flatten(expression))
+    {
+        if (is_satisfiable(bpf))
+        {
+            mTerms.push_back(Term{filter_id, std::move(bpf)});
+        }
+    }
+}
+
+
+std::vector<BPFCompositeExpression> DecisionDAG::flatten(const Expression& expression)
+{
+    switch (expression.mType)
+    {
+        case Expression::Type::BPF:
+        {
+            return { *expression.mBPF };
+        }
+        case Expression::Type::Or:
+        {
+            std::vector<BPFCompositeExpression> result;
+            for (const Expression& child : expression.mChildren)
+            {
+                auto terms = flatten(child);
+                result.insert(result.end(), std::make_move_iterator(terms.begin()), std::make_move_iterator(terms.end()));
+            }
+            return result;
+        }
+        case Expression::Type::And:
+        {
+            std::vector<BPFCompositeExpression> result(1, expression.mBPF ? *expression.mBPF : BPFCompositeExpression());
+
+            // Distribute the AND over the ORs of the children.
+            for (const Expression& child : expression.mChildren)
+            {
+                auto child_terms = flatten(child);
+
+                std::vector<BPFCompositeExpression> product;
+                product.reserve(result.size() * child_terms.size());
+                for (const BPFCompositeExpression& lhs : result)
+                {
+                    for (BPFCompositeExpression& rhs : child_terms)
+                    {
+                        product.push_back(lhs);
+                        product.back().merge_and(rhs);
+                    }
+                }
+                result = std::move(product);
+            }
+            return result;
+        }
+    }
+
+    throw std::runtime_error("Invalid expression type");
+}
+
+
+std::vector<uint32_t> DecisionDAG::get_values(const BPFCompositeExpression& bpf, Field field)
+{
+    switch (field)
+    {
+        case Field_EtherType:
+        {
+            if (bpf.mPacketFlags & PacketFlags_IPv6)
+            {
+                return { ethertype_value(EtherType::IPv6) };
+            }
+            if ((bpf.mPacketFlags & PacketFlags_IPv4) || (bpf.mFilterFlags & (FilterFlags_SrcIPv4 | FilterFlags_DstIPv4)))
+            {
+                return { ethertype_value(EtherType::IPv4) };
+            }
+            return {};
+        }
+        case Field_Protocol:
+        {
+            if (bpf.mPacketFlags & PacketFlags_UDP)
+            {
+                return { static_cast<uint32_t>(ProtocolId::UDP) };
+            }
+            if (bpf.mPacketFlags & PacketFlags_TCP)
+            {
+                return { static_cast<uint32_t>(ProtocolId::TCP) };
+            }
+            return {};
+        }
+        case Field_DstPort:
+        {
+            return bpf.has_flag(FilterFlags_DstPort) ? std::vector<uint32_t>{ bpf.mDestinationPort.mValue } : std::vector<uint32_t>();
+        }
+        case Field_SrcIP:
+        {
+            return bpf.has_flag(FilterFlags_SrcIPv4) ? std::vector<uint32_t>{ bpf.mSourceIP.mValue.mValue } : std::vector<uint32_t>();
+        }
+        case Field_SrcPort:
+        {
+            return bpf.has_flag(FilterFlags_SrcPort) ? std::vector<uint32_t>{ bpf.mSourcePort.mValue } : std::vector<uint32_t>();
+        }
+        case Field_DstIP:
+        {
+            return bpf.has_flag(FilterFlags_DstIPv4) ? std::vector<uint32_t>{ bpf.mDestinationIP.mValue.mValue } : std::vector<uint32_t>();
+        }
+        case Field_Count:
+        {
+            break;
+        }
+    }
+
+    throw std::runtime_error("Invalid field");
+}
+
+
+bool DecisionDAG::get_value(const uint8_t* data, const PacketInfo& info, Field field, uint32_t& value)
+{
+    switch (field)
+    {
+        case Field_EtherType:
+        {
+            value = info.mEtherType.mValue;
+            return (info.mPacketFlags & (PacketFlags_IPv4 | PacketFlags_IPv6)) != 0;
+        }
+        case Field_Protocol:
+        {
+            value = info.mProtocol;
+            return (info.mPacketFlags & (PacketFlags_UDP | PacketFlags_TCP)) != 0;
+        }
+        case Field_DstPort:
+        {
+            if (!(info.mPacketFlags & (PacketFlags_UDP | PacketFlags_TCP)))
+            {
+                return false;
+            }
+            value = Decode<TCPHeader>(data + info.mL4Offset).mDestinationPort.mValue;
+            return true;
+        }
+        case Field_SrcIP:
+        {
+            if (!info.has_flag(PacketFlags_IPv4))
+            {
+                return false;
+            }
+            value = Decode<IPv4Header>(data + info.mL3Offset).mSourceIP.mValue.mValue;
+            return true;
+        }
+        case Field_SrcPort:
+        {
+            if (!(info.mPacketFlags & (PacketFlags_UDP | PacketFlags_TCP)))
+            {
+                return false;
+            }
+            value = Decode<TCPHeader>(data + info.mL4Offset).mSourcePort.mValue;
+            return true;
+        }
+        case Field_DstIP:
+        {
+            if (!info.has_flag(PacketFlags_IPv4))
+            {
+                return false;
+            }
+            value = Decode<IPv4Header>(data + info.mL3Offset).mDestinationIP.mValue.mValue;
+            return true;
+        }
+        case Field_Count:
+        {
+            break;
+        }
+    }
+
+    throw std::runtime_error("Invalid field");
+}
+
+
+void DecisionDAG::compile()
+{
+    mNodes.clear();
+    mNodeIndexes.clear();
+
+    std::vector<uint32_t> terms(mTerms.size());
+    for (auto i = 0u; i != terms.size(); ++i)
+    {
+        terms[i] = i;
+    }
+
+    mRoot = build(Field_EtherType, terms);
+
+    // Only needed to share nodes while building.
+    mNodeIndexes.clear();
+}
+
+
+uint32_t DecisionDAG::build(uint32_t field, const std::vector<uint32_t>& terms)
+{
+    // Skip the fields that none of the terms checks.
+    auto checks_field = [&](uint32_t term) { return !get_values(mTerms[term].mBPF, Field(field)).empty(); };
+    while (field != Field_Count && std::none_of(terms.begin(), terms.end(), checks_field))
+    {
+        field++;
+    }
+
+    auto key = std::make_pair(field, terms);
+    auto it = mNodeIndexes.find(key);
+    if (it != mNodeIndexes.end())
+    {
+        return it->second;
+    }
+
+    Node node;
+    node.mField = Field(field);
+
+    if (field == Field_Count)
+    {
+        auto needs_check = [&](uint32_t term)
+        {
+            return (mTerms[term].mBPF.mFilterFlags & (FilterFlags_Length | FilterFlags_UDPPayload)) != 0;
+        };
+
+        for (auto term : terms)
+        {
+            if (!needs_check(term))
+            {
+                node.mFilterIds.push_back(mTerms[term].mFilterId);
+            }
+        }
+
+        std::sort(node.mFilterIds.begin(), node.mFilterIds.end());
+        node.mFilterIds.erase(std::unique(node.mFilterIds.begin(), node.mFilterIds.end()), node.mFilterIds.end());
+
+        // A check is useless if the filter already matches.
+        for (auto term : terms)
+        {
+            if (needs_check(term) && !std::binary_search(node.mFilterIds.begin(), node.mFilterIds.end(), mTerms[term].mFilterId))
+            {
+                node.mResidualTerms.push_back(term);
+            }
+        }
+    }
+    else
+    {
+        std::map<uint32_t, std::vector<uint32_t>> cases;
+        std::vector<uint32_t> wildcards;
+
+        for (auto term : terms)
+        {
+            auto values = get_values(mTerms[term].mBPF, Field(field));
+            if (values.empty())
+            {
+                wildcards.push_back(term);
+            }
+            for (auto value : values)
+            {
+                cases[value].push_back(term);
+            }
+        }
+
+        // Terms that don't check the field are part of every case.
+        for (auto& c : cases)
+        {
+            std::vector<uint32_t> case_terms;
+            std::merge(c.second.begin(), c.second.end(), wildcards.begin(), wildcards.end(), std::back_inserter(case_terms));
+            node.mCases.emplace_back(c.first, build(field + 1, case_terms));
+        }
+
+        node.mDefault = build(field + 1, wildcards);
+    }
+
+    auto index = static_cast<uint32_t>(mNodes.size());
+    mNodes.push_back(std::move(node));
+    mNodeIndexes.emplace(std::move(key), index);
+    return index;
+}
+
+
+void DecisionDAG::match(const uint8_t* data, uint32_t size, const PacketInfo& info, std::vector<uint32_t>& result) const
+{
+    assert(!mNodes.empty());
+
+    auto index = mRoot;
+    for (;;)
+    {
+        const Node& node = mNodes[index];
+        if (node.mField == Field_Count)
+        {
+            break;
+        }
+
+        uint32_t value = 0;
+        if (!get_value(data, info, node.mField, value))
+        {
+            index = node.mDefault;
+            continue;
+        }
+
+        auto it = std::lower_bound(node.mCases.begin(), node.mCases.end(), std::make_pair(value, 0u));
+        index = (it != node.mCases.end() && it->first == value) ? it->second : node.mDefault;
+    }
+
+    const Node& leaf = mNodes[index];
+    result = leaf.mFilterIds;
+
+    if (leaf.mResidualTerms.empty())
+    {
+        return;
+    }
+
+    for (auto term : leaf.mResidualTerms)
+    {
+        if (mTerms[term].mBPF.match(data, size, info))
+        {
+            result.push_back(mTerms[term].mFilterId);
+        }
+    }
+
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+}
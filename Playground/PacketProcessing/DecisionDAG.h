@@ -0,0 +1,90 @@
+#ifndef DECISIONDAG_H
+#define DECISIONDAG_H
+
+
+#include "BPFCompositeExpression.h"
+#include "Expression.h"
+#include "PacketInfo.h"
+#include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
+
+
+/**
+ * Matches a packet against a set of filters by testing each header field once.
+ *
+ * Every filter expression is flattened into an OR of BPFCompositeExpression terms.
+ * compile() then builds a DAG of switch nodes over the header fields in a fixed
+ * order (ethertype, ip protocol, dst port, src ip, src port, dst ip).
+ * A term that does not check a field follows every branch of that field's switch.
+ * Identical sub-DAGs are shared, and fields that no remaining term checks are skipped.
+ * Each leaf holds the ids of the filters that match, plus the terms that still need
+ * a length or payload check. (Length sets and ranges are a single bit test, but
+ * would need one case per length in a switch.)
+ *
+ * The result is the same as calling Expression::match with the PacketInfo for each filter.
+ */
+struct DecisionDAG
+{
+    void add_filter(uint32_t filter_id, const Expression& expression);
+
+    // Builds the DAG. Must be called after the last add_filter and before match.
+    void compile();
+
+    // Stores the ids of the matching filters in result, sorted and without duplicates.
+    void match(const uint8_t* data, uint32_t size, const PacketInfo& info, std::vector<uint32_t>& result) const;
+
+    uint32_t num_terms() const { return mTerms.size(); }
+
+    uint32_t num_nodes() const { return mNodes.size(); }
+
+private:
+    enum Field : uint32_t
+    {
+        Field_EtherType,
+        Field_Protocol,
+        Field_DstPort,
+        Field_SrcIP,
+        Field_SrcPort,
+        Field_DstIP,
+        Field_Count // leaf
+    };
+
+    struct Term
+    {
+        uint32_t mFilterId;
+        BPFCompositeExpression mBPF;
+    };
+
+    struct Node
+    {
+        Field mField;
+
+        // Switch node: child for each value (sorted by value) and for all other values.
+        std::vector<std::pair<uint32_t, uint32_t>> mCases;
+        uint32_t mDefault = 0;
+
+        // Leaf node
+        std::vector<uint32_t> mFilterIds;
+        std::vector<uint32_t> mResidualTerms;
+    };
+
+    static std::vector<BPFCompositeExpression> flatten(const Expression& expression);
+
+    // Returns the values the term accepts for the field. Empty if the term does not check it.
+    static std::vector<uint32_t> get_values(const BPFCompositeExpression& bpf, Field field);
+
+    // Returns false if the packet doesn't have the field.
+    static bool get_value(const uint8_t* data, const PacketInfo& info, Field field, uint32_t& value);
+
+    uint32_t build(uint32_t field, const std::vector<uint32_t>& terms);
+
+    std::vector<Term> mTerms;
+    std::vector<Node> mNodes;
+    std::map<std::pair<uint32_t, std::vector<uint32_t>>, uint32_t> mNodeIndexes;
+    uint32_t mRoot = 0;
+};
+
+
+#endif // DECISIONDAG_H
@@ -1,5 +1,6 @@
 #include "Expression.h"
 #include "BPFCompositeExpression.h"
+#include "PacketBurst.h"
 #include <cassert>
 #include <iostream>
 
@@ -126,6 +127,16 @@ Expression Expression::bpf_length(int value)
 }
 
 
+Expression Expression::bpf_lengths(Lengths lengths)
+{
+    Expression result;
+    result.mType = Type::BPF;
+    result.mBPF = std::make_shared<BPFCompositeExpression>();
+    result.mBPF->add_impl(std::move(lengths));
+    return result;
+}
+
+
 Expression Expression::bpf_l3_type(EtherType ethertype)
 {
     Expression result;
@@ -259,6 +270,100 @@ bool Expression::match(const uint8_t* data, uint32_t size, uint32_t l3_offset, u
 }
 
 
+bool Expression::match(const uint8_t* data, uint32_t size, const PacketInfo& info) const
+{
+    switch (mType)
+    {
+        case Type::And:
+        {
+            if (mBPF && !mBPF->match(data, size, info))
+            {
+                return false;
+            }
+            for (const Expression& child : mChildren)
+            {
+                if (!child.match(data, size, info))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+        case Type::Or:
+        {
+            assert(!mBPF);
+            for (const Expression& child : mChildren)
+            {
+                if (child.match(data, size, info))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+        case Type::BPF:
+        {
+            return mBPF->match(data, size, info);
+        }
+    }
+
+    throw std::runtime_error("Invalid expression type");
+}
+
+
+void Expression::match_burst(const uint8_t* const* data, const uint16_t* sizes, const PacketInfo* infos, uint32_t n, uint64_t* result_mask) const
+{
+    PacketBurst burst(data, sizes, infos, n);
+    *result_mask = match_burst(burst, burst.all());
+}
+
+
+uint64_t Expression::match_burst(const PacketBurst& burst, uint64_t mask) const
+{
+    switch (mType)
+    {
+        case Type::And:
+        {
+            if (mBPF)
+            {
+                mask = mBPF->match_burst(burst, mask);
+            }
+            for (const Expression& child : mChildren)
+            {
+                if (!mask)
+                {
+                    break;
+                }
+                mask = child.match_burst(burst, mask);
+            }
+            return mask;
+        }
+        case Type::Or:
+        {
+            assert(!mBPF);
+            uint64_t result = 0;
+            for (const Expression& child : mChildren)
+            {
+                // Packets that already matched don't need to be checked again.
+                auto remaining = mask & ~result;
+                if (!remaining)
+                {
+                    break;
+                }
+                result |= child.match_burst(burst, remaining);
+            }
+            return result;
+        }
+        case Type::BPF:
+        {
+            return mBPF->match_burst(burst, mask);
+        }
+    }
+
+    throw std::runtime_error("Invalid expression type");
+}
+
+
 void Expression::print(int level) const
 {
     switch (mType)
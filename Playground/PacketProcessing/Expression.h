@@ -12,6 +12,8 @@
 
 
 struct BPFCompositeExpression;
+struct PacketInfo;
+struct PacketBurst;
 
 
 
@@ -21,6 +23,7 @@ struct Expression
     static Expression And(Expression lhs, Expression rhs);
     static Expression Or(Expression lhs, Expression rhs);
     static Expression bpf_length(int value);
+    static Expression bpf_lengths(Lengths lengths);
     static Expression bpf_l3_type(EtherType ethertype);
     static Expression bpf_l4_type(ProtocolId protocolId);
     static Expression bpf_src_ip(IPv4Address value);
@@ -33,6 +36,17 @@ struct Expression
 
     bool match(const uint8_t* data, uint32_t size, uint32_t l3_offset, uint32_t l4_offset) const;
 
+    // Uses the offsets of the pre-parsed headers and also checks the L3 and L4 types.
+    bool match(const uint8_t* data, uint32_t size, const PacketInfo& info) const;
+
+    // Matches a burst of up to PacketBurst::capacity packets, with the pre-parsed headers of each.
+    // Bit i of result_mask is set if packet i matches.
+    void match_burst(const uint8_t* const* data, const uint16_t* sizes, const PacketInfo* infos, uint32_t n, uint64_t* result_mask) const;
+
+    // Returns the subset of the packets in mask that match.
+    // Each node is evaluated for all packets before moving to the next node.
+    uint64_t match_burst(const PacketBurst& burst, uint64_t mask) const;
+
     enum class Type
     {
         And, Or, BPF
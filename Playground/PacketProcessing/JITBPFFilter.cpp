@@ -0,0 +1,673 @@
+#include "JITBPFFilter.h"
+#include "BPFFilter.h"
+#include <algorithm>
+#include <cstring>
+#include <initializer_list>
+#include <stdexcept>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+namespace {
+
+
+// Register usage of the generated code:
+//   rdi = packet data, esi = packet size (first and second argument)
+//   eax = A, ecx = X (so that "shl eax, cl" works for BPF_LSH|BPF_X)
+//   edx, r8, r9 = scratch
+//   mem[] lives in the red zone below rsp (the generated function never calls anything)
+
+
+enum Condition : uint8_t
+{
+    Condition_Below        = 0x82,
+    Condition_AboveOrEqual = 0x83,
+    Condition_Equal        = 0x84,
+    Condition_NotEqual     = 0x85,
+    Condition_BelowOrEqual = 0x86,
+    Condition_Above        = 0x87
+};
+
+
+Condition invert(Condition condition)
+{
+    switch (condition)
+    {
+        case Condition_Below: return Condition_AboveOrEqual;
+        case Condition_AboveOrEqual: return Condition_Below;
+        case Condition_Equal: return Condition_NotEqual;
+        case Condition_NotEqual: return Condition_Equal;
+        case Condition_BelowOrEqual: return Condition_Above;
+        case Condition_Above: return Condition_BelowOrEqual;
+    }
+    throw std::logic_error("Invalid condition");
+}
+
+
+struct Assembler
+{
+    void emit(std::initializer_list<uint8_t> bytes)
+    {
+        mCode.insert(mCode.end(), bytes.begin(), bytes.end());
+    }
+
+    void emit32(uint32_t value)
+    {
+        uint8_t bytes[sizeof(value)];
+        memcpy(bytes, &value, sizeof(value));
+        mCode.insert(mCode.end(), bytes, bytes + sizeof(bytes));
+    }
+
+    void emit64(uint64_t value)
+    {
+        uint8_t bytes[sizeof(value)];
+        memcpy(bytes, &value, sizeof(value));
+        mCode.insert(mCode.end(), bytes, bytes + sizeof(bytes));
+    }
+
+    uint32_t new_label()
+    {
+        mLabels.push_back(-1);
+        return mLabels.size() - 1;
+    }
+
+    void bind(uint32_t label)
+    {
+        mLabels[label] = mCode.size();
+    }
+
+    void jmp(uint32_t label)
+    {
+        emit({ 0xE9 });
+        emit_label_ref(label);
+    }
+
+    void jcc(Condition condition, uint32_t label)
+    {
+        emit({ 0x0F, condition });
+        emit_label_ref(label);
+    }
+
+    // Resolves all rel32 jump offsets.
+    std::vector<uint8_t>& finalize()
+    {
+        for (const Fixup& fixup : mFixups)
+        {
+            auto target = mLabels[fixup.mLabel];
+            if (target < 0)
+            {
+                throw std::logic_error("Unbound label");
+            }
+
+            int32_t rel = target - static_cast<int32_t>(fixup.mPosition + sizeof(int32_t));
+            memcpy(&mCode[fixup.mPosition], &rel, sizeof(rel));
+        }
+        mFixups.clear();
+        return mCode;
+    }
+
+private:
+    void emit_label_ref(uint32_t label)
+    {
+        mFixups.push_back(Fixup{ static_cast<uint32_t>(mCode.size()), label });
+        emit32(0);
+    }
+
+    struct Fixup
+    {
+        uint32_t mPosition;
+        uint32_t mLabel;
+    };
+
+    std::vector<uint8_t> mCode;
+    std::vector<int32_t> mLabels;
+    std::vector<Fixup> mFixups;
+};
+
+
+uint32_t get_load_size(const bpf_insn& insn)
+{
+    switch (BPF_SIZE(insn.code))
+    {
+        case BPF_W: return 4;
+        case BPF_H: return 2;
+        case BPF_B: return 1;
+    }
+    throw std::runtime_error("Invalid load size: " + std::to_string(insn.code));
+}
+
+
+bool is_abs_load(const bpf_insn& insn)
+{
+    return insn.code == (BPF_LD|BPF_W|BPF_ABS)
+        || insn.code == (BPF_LD|BPF_H|BPF_ABS)
+        || insn.code == (BPF_LD|BPF_B|BPF_ABS)
+        || insn.code == (BPF_LDX|BPF_MSH|BPF_B);
+}
+
+
+// Packet offsets are encoded as disp32. Loads beyond that always fail.
+const uint64_t max_encodable_offset = INT32_MAX;
+
+
+// Returns the number of bytes that must be present for every constant-offset load to succeed.
+uint32_t get_required_length(const bpf_insn* insns, uint32_t count)
+{
+    uint64_t result = 0;
+    for (auto i = 0u; i != count; ++i)
+    {
+        if (is_abs_load(insns[i]))
+        {
+            auto end = uint64_t(insns[i].k) + get_load_size(insns[i]);
+            if (end <= max_encodable_offset)
+            {
+                result = std::max(result, end);
+            }
+        }
+    }
+    return result;
+}
+
+
+void validate(const bpf_insn* insns, uint32_t count)
+{
+    if (count == 0)
+    {
+        throw std::runtime_error("Empty BPF program");
+    }
+
+    if (BPF_CLASS(insns[count - 1].code) != BPF_RET)
+    {
+        throw std::runtime_error("BPF program does not end with a return instruction");
+    }
+
+    for (auto i = 0u; i != count; ++i)
+    {
+        const bpf_insn& insn = insns[i];
+
+        switch (BPF_CLASS(insn.code))
+        {
+            case BPF_JMP:
+            {
+                if (BPF_OP(insn.code) == BPF_JA)
+                {
+                    int64_t target = int64_t(i) + 1 + static_cast<int32_t>(insn.k);
+                    if (target < 0 || target >= count)
+                    {
+                        throw std::runtime_error("BPF jump out of range at " + std::to_string(i));
+                    }
+                }
+                else if (i + 1 + insn.jt >= count || i + 1 + insn.jf >= count)
+                {
+                    throw std::runtime_error("BPF jump out of range at " + std::to_string(i));
+                }
+                break;
+            }
+            case BPF_LD:
+            case BPF_LDX:
+            case BPF_ST:
+            case BPF_STX:
+            {
+                bool uses_mem = BPF_CLASS(insn.code) == BPF_ST
+                             || BPF_CLASS(insn.code) == BPF_STX
+                             || BPF_MODE(insn.code) == BPF_MEM;
+                if (uses_mem && insn.k >= BPF_MEMWORDS)
+                {
+                    throw std::runtime_error("BPF memory index out of range at " + std::to_string(i));
+                }
+                break;
+            }
+            case BPF_ALU:
+            {
+                if (insn.code == (BPF_ALU|BPF_DIV|BPF_K) && insn.k == 0)
+                {
+                    throw std::runtime_error("BPF division by zero at " + std::to_string(i));
+                }
+                break;
+            }
+        }
+    }
+}
+
+
+struct Translator
+{
+    Translator(Assembler& a, const bpf_insn* insns, uint32_t count, uint32_t reject) :
+        a(a),
+        mInstructions(insns),
+        mCount(count),
+        mReject(reject)
+    {
+    }
+
+    // Emits one copy of the program. If checked is false then constant-offset
+    // loads are emitted without bounds check, which is only valid if the caller
+    // verified the packet length against get_required_length().
+    void translate(bool checked)
+    {
+        std::vector<uint32_t> labels(mCount);
+        for (auto& label : labels)
+        {
+            label = a.new_label();
+        }
+
+        for (auto i = 0u; i != mCount; ++i)
+        {
+            a.bind(labels[i]);
+            translate(i, labels, checked);
+        }
+    }
+
+private:
+    void translate(uint32_t i, const std::vector<uint32_t>& labels, bool checked)
+    {
+        const bpf_insn& insn = mInstructions[i];
+        const uint32_t k = insn.k;
+
+        switch (insn.code)
+        {
+            case BPF_RET|BPF_K:
+                a.emit({ 0xB8 }); a.emit32(k); // mov eax, k
+                a.emit({ 0xC3 });              // ret
+                return;
+
+            case BPF_RET|BPF_A:
+                a.emit({ 0xC3 }); // ret
+                return;
+
+            case BPF_LD|BPF_W|BPF_ABS:
+            case BPF_LD|BPF_H|BPF_ABS:
+            case BPF_LD|BPF_B|BPF_ABS:
+            {
+                if (!emit_abs_check(insn, checked))
+                {
+                    return;
+                }
+                switch (BPF_SIZE(insn.code))
+                {
+                    case BPF_W:
+                        a.emit({ 0x8B, 0x87 }); a.emit32(k); // mov eax, [rdi + k]
+                        a.emit({ 0x0F, 0xC8 });              // bswap eax
+                        return;
+                    case BPF_H:
+                        a.emit({ 0x0F, 0xB7, 0x87 }); a.emit32(k); // movzx eax, word [rdi + k]
+                        a.emit({ 0x66, 0xC1, 0xC0, 0x08 });        // rol ax, 8
+                        return;
+                    default:
+                        a.emit({ 0x0F, 0xB6, 0x87 }); a.emit32(k); // movzx eax, byte [rdi + k]
+                        return;
+                }
+            }
+
+            case BPF_LD|BPF_W|BPF_IND:
+            case BPF_LD|BPF_H|BPF_IND:
+            case BPF_LD|BPF_B|BPF_IND:
+            {
+                // r8 = X + k + size (64-bit, can't overflow)
+                auto end = uint64_t(k) + get_load_size(insn);
+                a.emit({ 0x41, 0x89, 0xC8 }); // mov r8d, ecx
+                if (end <= max_encodable_offset)
+                {
+                    a.emit({ 0x49, 0x81, 0xC0 }); a.emit32(end); // add r8, end
+                }
+                else
+                {
+                    a.emit({ 0x49, 0xB9 }); a.emit64(end); // mov r9, end
+                    a.emit({ 0x4D, 0x01, 0xC8 });          // add r8, r9
+                }
+                a.emit({ 0x49, 0x39, 0xF0 });  // cmp r8, rsi
+                a.jcc(Condition_Above, mReject);
+
+                switch (BPF_SIZE(insn.code))
+                {
+                    case BPF_W:
+                        a.emit({ 0x42, 0x8B, 0x44, 0x07, 0xFC }); // mov eax, [rdi + r8 - 4]
+                        a.emit({ 0x0F, 0xC8 });                   // bswap eax
+                        return;
+                    case BPF_H:
+                        a.emit({ 0x42, 0x0F, 0xB7, 0x44, 0x07, 0xFE }); // movzx eax, word [rdi + r8 - 2]
+                        a.emit({ 0x66, 0xC1, 0xC0, 0x08 });             // rol ax, 8
+                        return;
+                    default:
+                        a.emit({ 0x42, 0x0F, 0xB6, 0x44, 0x07, 0xFF }); // movzx eax, byte [rdi + r8 - 1]
+                        return;
+                }
+            }
+
+            case BPF_LDX|BPF_MSH|BPF_B:
+                if (!emit_abs_check(insn, checked))
+                {
+                    return;
+                }
+                a.emit({ 0x0F, 0xB6, 0x8F }); a.emit32(k); // movzx ecx, byte [rdi + k]
+                a.emit({ 0x83, 0xE1, 0x0F });              // and ecx, 0xf
+                a.emit({ 0xC1, 0xE1, 0x02 });              // shl ecx, 2
+                return;
+
+            case BPF_LD|BPF_W|BPF_LEN:
+                a.emit({ 0x89, 0xF0 }); // mov eax, esi
+                return;
+
+            case BPF_LDX|BPF_W|BPF_LEN:
+                a.emit({ 0x89, 0xF1 }); // mov ecx, esi
+                return;
+
+            case BPF_LD|BPF_IMM:
+                a.emit({ 0xB8 }); a.emit32(k); // mov eax, k
+                return;
+
+            case BPF_LDX|BPF_IMM:
+                a.emit({ 0xB9 }); a.emit32(k); // mov ecx, k
+                return;
+
+            case BPF_LD|BPF_MEM:
+                a.emit({ 0x8B, 0x44, 0x24, mem_offset(k) }); // mov eax, [rsp + offset]
+                return;
+
+            case BPF_LDX|BPF_MEM:
+                a.emit({ 0x8B, 0x4C, 0x24, mem_offset(k) }); // mov ecx, [rsp + offset]
+                return;
+
+            case BPF_ST:
+                a.emit({ 0x89, 0x44, 0x24, mem_offset(k) }); // mov [rsp + offset], eax
+                return;
+
+            case BPF_STX:
+                a.emit({ 0x89, 0x4C, 0x24, mem_offset(k) }); // mov [rsp + offset], ecx
+                return;
+
+            case BPF_JMP|BPF_JA:
+                a.jmp(labels[i + 1 + static_cast<int32_t>(k)]);
+                return;
+
+            case BPF_JMP|BPF_JGT|BPF_K:
+            case BPF_JMP|BPF_JGE|BPF_K:
+            case BPF_JMP|BPF_JEQ|BPF_K:
+            case BPF_JMP|BPF_JSET|BPF_K:
+            case BPF_JMP|BPF_JGT|BPF_X:
+            case BPF_JMP|BPF_JGE|BPF_X:
+            case BPF_JMP|BPF_JEQ|BPF_X:
+            case BPF_JMP|BPF_JSET|BPF_X:
+                emit_conditional_jump(i, labels);
+                return;
+
+            case BPF_ALU|BPF_ADD|BPF_X:
+                a.emit({ 0x01, 0xC8 }); // add eax, ecx
+                return;
+
+            case BPF_ALU|BPF_SUB|BPF_X:
+                a.emit({ 0x29, 0xC8 }); // sub eax, ecx
+                return;
+
+            case BPF_ALU|BPF_MUL|BPF_X:
+                a.emit({ 0x0F, 0xAF, 0xC1 }); // imul eax, ecx
+                return;
+
+            case BPF_ALU|BPF_DIV|BPF_X:
+                a.emit({ 0x85, 0xC9 }); // test ecx, ecx
+                a.jcc(Condition_Equal, mReject);
+                a.emit({ 0x31, 0xD2 }); // xor edx, edx
+                a.emit({ 0xF7, 0xF1 }); // div ecx
+                return;
+
+            case BPF_ALU|BPF_AND|BPF_X:
+                a.emit({ 0x21, 0xC8 }); // and eax, ecx
+                return;
+
+            case BPF_ALU|BPF_OR|BPF_X:
+                a.emit({ 0x09, 0xC8 }); // or eax, ecx
+                return;
+
+            case BPF_ALU|BPF_LSH|BPF_X:
+                a.emit({ 0xD3, 0xE0 }); // shl eax, cl
+                return;
+
+            case BPF_ALU|BPF_RSH|BPF_X:
+                a.emit({ 0xD3, 0xE8 }); // shr eax, cl
+                return;
+
+            case BPF_ALU|BPF_ADD|BPF_K:
+                a.emit({ 0x05 }); a.emit32(k); // add eax, k
+                return;
+
+            case BPF_ALU|BPF_SUB|BPF_K:
+                a.emit({ 0x2D }); a.emit32(k); // sub eax, k
+                return;
+
+            case BPF_ALU|BPF_MUL|BPF_K:
+                a.emit({ 0x69, 0xC0 }); a.emit32(k); // imul eax, eax, k
+                return;
+
+            case BPF_ALU|BPF_DIV|BPF_K:
+                a.emit({ 0x41, 0xB8 }); a.emit32(k); // mov r8d, k
+                a.emit({ 0x31, 0xD2 });              // xor edx, edx
+                a.emit({ 0x41, 0xF7, 0xF0 });        // div r8d
+                return;
+
+            case BPF_ALU|BPF_AND|BPF_K:
+                a.emit({ 0x25 }); a.emit32(k); // and eax, k
+                return;
+
+            case BPF_ALU|BPF_OR|BPF_K:
+                a.emit({ 0x0D }); a.emit32(k); // or eax, k
+                return;
+
+            case BPF_ALU|BPF_LSH|BPF_K:
+                a.emit({ 0xC1, 0xE0, static_cast<uint8_t>(k) }); // shl eax, k
+                return;
+
+            case BPF_ALU|BPF_RSH|BPF_K:
+                a.emit({ 0xC1, 0xE8, static_cast<uint8_t>(k) }); // shr eax, k
+                return;
+
+            case BPF_ALU|BPF_NEG:
+                a.emit({ 0xF7, 0xD8 }); // neg eax
+                return;
+
+            case BPF_MISC|BPF_TAX:
+                a.emit({ 0x89, 0xC1 }); // mov ecx, eax
+                return;
+
+            case BPF_MISC|BPF_TXA:
+                a.emit({ 0x89, 0xC8 }); // mov eax, ecx
+                return;
+        }
+
+        // Same set of instructions as BPFFilter::match_bpf.
+        throw std::runtime_error("Unsupported BPF instruction: " + std::to_string(insn.code));
+    }
+
+    // Returns false if the load can never succeed (the jump to reject has been emitted).
+    bool emit_abs_check(const bpf_insn& insn, bool checked)
+    {
+        auto end = uint64_t(insn.k) + get_load_size(insn);
+        if (end > max_encodable_offset)
+        {
+            a.jmp(mReject);
+            return false;
+        }
+
+        if (checked)
+        {
+            a.emit({ 0x81, 0xFE }); a.emit32(end); // cmp esi, end
+            a.jcc(Condition_Below, mReject);
+        }
+        return true;
+    }
+
+    void emit_conditional_jump(uint32_t i, const std::vector<uint32_t>& labels)
+    {
+        const bpf_insn& insn = mInstructions[i];
+
+        if (insn.jt == insn.jf)
+        {
+            if (insn.jt != 0)
+            {
+                a.jmp(labels[i + 1 + insn.jt]);
+            }
+            return;
+        }
+
+        const bool is_x = BPF_SRC(insn.code) == BPF_X;
+
+        Condition condition = Condition_NotEqual;
+        switch (BPF_OP(insn.code))
+        {
+            case BPF_JGT: condition = Condition_Above; break;
+            case BPF_JGE: condition = Condition_AboveOrEqual; break;
+            case BPF_JEQ: condition = Condition_Equal; break;
+            default: condition = Condition_NotEqual; break;
+        }
+
+        if (BPF_OP(insn.code) == BPF_JSET)
+        {
+            if (is_x)
+            {
+                a.emit({ 0x85, 0xC8 }); // test eax, ecx
+            }
+            else
+            {
+                a.emit({ 0xA9 }); a.emit32(insn.k); // test eax, k
+            }
+        }
+        else
+        {
+            if (is_x)
+            {
+                a.emit({ 0x39, 0xC8 }); // cmp eax, ecx
+            }
+            else
+            {
+                a.emit({ 0x3D }); a.emit32(insn.k); // cmp eax, k
+            }
+        }
+
+        if (insn.jf == 0)
+        {
+            a.jcc(condition, labels[i + 1 + insn.jt]);
+        }
+        else if (insn.jt == 0)
+        {
+            a.jcc(invert(condition), labels[i + 1 + insn.jf]);
+        }
+        else
+        {
+            a.jcc(condition, labels[i + 1 + insn.jt]);
+            a.jmp(labels[i + 1 + insn.jf]);
+        }
+    }
+
+    static uint8_t mem_offset(uint32_t k)
+    {
+        // mem[BPF_MEMWORDS] is stored in the red zone.
+        return static_cast<uint8_t>(-4 * BPF_MEMWORDS + 4 * static_cast<int>(k));
+    }
+
+    Assembler& a;
+    const bpf_insn* mInstructions;
+    uint32_t mCount;
+    uint32_t mReject;
+};
+
+
+std::vector<uint8_t> generate(const bpf_insn* insns, uint32_t count)
+{
+    Assembler a;
+
+    if (insns == nullptr)
+    {
+        // No filter means accept all.
+        a.emit({ 0xB8 }); a.emit32(uint32_t(-1)); // mov eax, -1
+        a.emit({ 0xC3 });                         // ret
+        return a.finalize();
+    }
+
+    validate(insns, count);
+
+    auto reject = a.new_label();
+    auto checked_entry = a.new_label();
+
+    a.emit({ 0x89, 0xF6 }); // mov esi, esi (clear upper half of rsi)
+    a.emit({ 0x31, 0xC0 }); // xor eax, eax
+    a.emit({ 0x31, 0xC9 }); // xor ecx, ecx
+
+    Translator translator(a, insns, count, reject);
+
+    auto required_length = get_required_length(insns, count);
+    if (required_length > 0)
+    {
+        // Hoisted bounds check: if the packet covers all constant offsets
+        // then run the copy that doesn't check them individually.
+        a.emit({ 0x81, 0xFE }); a.emit32(required_length); // cmp esi, required_length
+        a.jcc(Condition_Below, checked_entry);
+        translator.translate(false);
+    }
+
+    a.bind(checked_entry);
+    translator.translate(true);
+
+    a.bind(reject);
+    a.emit({ 0x31, 0xC0 }); // xor eax, eax
+    a.emit({ 0xC3 });       // ret
+
+    return a.finalize();
+}
+
+
+} // namespace
+
+
+JITBPFFilter::JITBPFFilter(std::string bpf_filter) :
+    mCode(),
+    mFunction(),
+    mCodeSize()
+{
+    auto program = BPFFilter::compile(bpf_filter);
+    try
+    {
+        *this = JITBPFFilter(program);
+    }
+    catch (...)
+    {
+        pcap_freecode(&program);
+        throw;
+    }
+    pcap_freecode(&program);
+}
+
+
+JITBPFFilter::JITBPFFilter(ProtocolId protocol, IPv4Address src_ip, IPv4Address dst_ip, uint16_t src_port, uint16_t dst_port) :
+    JITBPFFilter(BPFFilter::generate_bpf_filter_string(protocol, src_ip, dst_ip, src_port, dst_port))
+{
+}
+
+
+JITBPFFilter::JITBPFFilter(const bpf_program& program) :
+    mCode(),
+    mFunction(),
+    mCodeSize()
+{
+    auto code = generate(program.bf_insns, program.bf_len);
+
+    const auto page_size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    const auto mapping_size = (code.size() + page_size - 1) / page_size * page_size;
+
+    auto mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+    {
+        throw std::runtime_error("JITBPFFilter: mmap failed");
+    }
+
+    mCode.reset(mapping, [mapping_size](void* p) { munmap(p, mapping_size); });
+
+    memcpy(mapping, code.data(), code.size());
+
+    if (mprotect(mapping, mapping_size, PROT_READ | PROT_EXEC) != 0)
+    {
+        throw std::runtime_error("JITBPFFilter: mprotect failed");
+    }
+
+    mFunction = reinterpret_cast<Function>(mapping);
+    mCodeSize = code.size();
+}
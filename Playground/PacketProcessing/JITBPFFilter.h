@@ -0,0 +1,56 @@
+#ifndef JITBPFFILTER_H
+#define JITBPFFILTER_H
+
+
+#include "Networking.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "pcap.h"
+
+
+/**
+ * Translates the pcap_compile output into native x86-64 code at construction time.
+ *
+ * The generated function has the signature uint32_t(const uint8_t* data, uint32_t size)
+ * and returns the same value as BPFFilter::match_bpf. Bounds checks for constant
+ * offsets are hoisted into a single length check at the function entry. Packets that
+ * are too short for it fall back to a second copy of the code that checks every load.
+ */
+struct JITBPFFilter
+{
+    JITBPFFilter(std::string bpf_filter);
+
+    JITBPFFilter(ProtocolId protocol, IPv4Address src_ip, IPv4Address dst_ip, uint16_t src_port, uint16_t dst_port);
+
+    explicit JITBPFFilter(const bpf_program& program);
+
+    // l3_offset is PacketInfo::mL3Offset, 0 for a runt frame without an Ethernet header.
+    bool match(const uint8_t* data, uint32_t size, uint32_t l3_offset, uint32_t /*l4_offset*/) const
+    {
+        if (l3_offset == 0 || l3_offset > size)
+        {
+            return false;
+        }
+        return execute(data + l3_offset, size - l3_offset) != 0;
+    }
+
+    // Runs the program on a packet that starts at the IP header.
+    uint32_t execute(const uint8_t* ip_data, uint32_t ip_size) const
+    {
+        return mFunction(ip_data, ip_size);
+    }
+
+    uint32_t code_size() const { return mCodeSize; }
+
+private:
+    using Function = uint32_t (*)(const uint8_t* data, uint32_t size);
+
+    // Executable mapping. Shared so that copies of the filter reuse the same code.
+    std::shared_ptr<void> mCode;
+    Function mFunction;
+    uint32_t mCodeSize;
+};
+
+
+#endif // JITBPFFILTER_H
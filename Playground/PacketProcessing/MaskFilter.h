@@ -11,10 +11,9 @@ struct MaskFilter
 {
     MaskFilter(ProtocolId protocol, IPv4Address src_ip, IPv4Address dst_ip, uint16_t src_port, uint16_t dst_port);
 
-    bool match(const uint8_t* packet_data, uint32_t /*len*/, uint32_t /*l3_offset*/, uint32_t l4_offset) const
+    bool match(const uint8_t* packet_data, uint32_t /*len*/, uint32_t l3_offset, uint32_t l4_offset) const
     {
-        auto offset = l4_offset + sizeof(uint16_t) + sizeof(uint16_t) - sizeof(std::array<uint64_t, 2>);
-        auto u64_data = Decode<std::array<uint64_t, 2>>(packet_data + offset);
+        auto u64_data = DecodeFiveTuple<std::array<uint64_t, 2>>(packet_data, l3_offset, l4_offset);
 
         return (mFields[1] == (static_mask[1] & u64_data[1]))
             && (mFields[0] == (static_mask[0] & u64_data[0]));
@@ -2,9 +2,12 @@
 #define NETWORKING_H
 
 
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <array>
+#include <iosfwd>
+#include <string>
 #include <arpa/inet.h>
 
 
@@ -140,6 +143,23 @@ struct EthernetHeader
 };
 
 
+// 802.1Q tag. The TPID is in the ethertype field before the tag, the ethertype
+// of the payload follows the tag. QinQ frames have two tags.
+struct VLANTag
+{
+    enum : uint16_t
+    {
+        TPID        = 0x8100, // 802.1Q
+        ServiceTPID = 0x88A8  // 802.1ad (outer tag of QinQ)
+    };
+
+    uint16_t vlan_id() const { return mTCI.hostValue() & 0xFFF; }
+
+    Net16 mTCI;
+    Net16 mEtherType;
+};
+
+
 enum class ProtocolId : uint8_t
 {
     TCP  = 6,
@@ -171,6 +191,17 @@ struct IPv4Header
 };
 
 
+struct IPv6Header
+{
+    Net32 mVersionClassAndFlowLabel;
+    Net16 mPayloadLength;
+    uint8_t mNextHeader;
+    uint8_t mHopLimit;
+    std::array<uint8_t, 16> mSourceIP;
+    std::array<uint8_t, 16> mDestinationIP;
+};
+
+
 struct UDPHeader
 {
     static UDPHeader Create(uint16_t src_port, uint16_t dst_port)
@@ -211,4 +242,28 @@ struct TCPHeader
 };
 
 
+// Decodes the 16 bytes from the IPv4 TTL to the TCP/UDP destination port that the mask
+// filters compare. Without IPv4 options that is one load at l4_offset - 12, with options
+// the addresses and the ports are copied together.
+template<typename T>
+inline T DecodeFiveTuple(const uint8_t* data, uint32_t l3_offset, uint32_t l4_offset)
+{
+    enum : uint32_t { ports_size = 2 * sizeof(Net16) };
+    static_assert(sizeof(T) == sizeof(IPv4Header) - offsetof(IPv4Header, mTTL) + ports_size, "");
+
+    T result;
+    auto bytes = reinterpret_cast<uint8_t*>(&result);
+    if (l4_offset == l3_offset + sizeof(IPv4Header))
+    {
+        memcpy(bytes, data + l4_offset + ports_size - sizeof(T), sizeof(T));
+    }
+    else
+    {
+        memcpy(bytes, data + l3_offset + offsetof(IPv4Header, mTTL), sizeof(T) - ports_size);
+        memcpy(bytes + sizeof(T) - ports_size, data + l4_offset, ports_size);
+    }
+    return result;
+}
+
+
 #endif // NETWORKING_H
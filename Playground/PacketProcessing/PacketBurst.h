@@ -0,0 +1,91 @@
+#ifndef PACKETBURST_H
+#define PACKETBURST_H
+
+
+#include "Networking.h"
+#include "PacketInfo.h"
+#include <cassert>
+#include <cstdint>
+
+
+/**
+ * Header fields of a burst of up to 32 packets in structure-of-arrays layout.
+ *
+ * The fields are gathered once per burst, at the offsets of each packet's PacketInfo,
+ * so the packets may have different VLAN tags, IPv4 options or IP versions.
+ * Expression::match_burst then evaluates each node of the expression tree for all
+ * packets of the burst at once, using vector compares over these lanes.
+ *
+ * Fields are stored in network byte order, like in the packet. The addresses are 0
+ * if the packet is not IPv4 and the ports are 0 without a TCP or UDP header, the
+ * filters check mPacketFlags before they look at them.
+ */
+struct PacketBurst
+{
+    enum : uint32_t { capacity = 32 };
+
+    PacketBurst(const uint8_t* const* data, const uint16_t* sizes, const PacketInfo* infos, uint32_t size) :
+        mSize(size)
+    {
+        assert(size <= capacity);
+
+        for (auto i = 0u; i != size; ++i)
+        {
+            const PacketInfo& info = infos[i];
+
+            mData[i] = data[i];
+            mLengths[i] = sizes[i];
+            mPacketFlags[i] = info.mPacketFlags;
+            mL4Offsets[i] = info.mL4Offset;
+            mSourceIPs[i] = 0;
+            mDestinationIPs[i] = 0;
+            mSourcePorts[i] = 0;
+            mDestinationPorts[i] = 0;
+
+            if (info.has_flag(PacketFlags_IPv4))
+            {
+                const auto& ip4_header = Decode<IPv4Header>(data[i] + info.mL3Offset);
+                mSourceIPs[i] = ip4_header.mSourceIP.mValue.mValue;
+                mDestinationIPs[i] = ip4_header.mDestinationIP.mValue.mValue;
+            }
+
+            if (info.mPacketFlags & (PacketFlags_UDP | PacketFlags_TCP))
+            {
+                const auto& tcp_header = Decode<TCPHeader>(data[i] + info.mL4Offset);
+                mSourcePorts[i] = tcp_header.mSourcePort.mValue;
+                mDestinationPorts[i] = tcp_header.mDestinationPort.mValue;
+            }
+        }
+
+        // Unused lanes are compared too. Their result is masked out by all().
+        for (auto i = size; i != capacity; ++i)
+        {
+            mData[i] = nullptr;
+            mLengths[i] = 0;
+            mPacketFlags[i] = 0;
+            mL4Offsets[i] = 0;
+            mSourceIPs[i] = 0;
+            mDestinationIPs[i] = 0;
+            mSourcePorts[i] = 0;
+            mDestinationPorts[i] = 0;
+        }
+    }
+
+    uint32_t size() const { return mSize; }
+
+    // Bitmask with one bit for each packet of the burst.
+    uint64_t all() const { return (uint64_t(1) << mSize) - 1; }
+
+    alignas(64) uint32_t mSourceIPs[capacity];
+    alignas(64) uint32_t mDestinationIPs[capacity];
+    alignas(64) uint16_t mLengths[capacity];
+    alignas(64) uint16_t mSourcePorts[capacity];
+    alignas(64) uint16_t mDestinationPorts[capacity];
+    alignas(64) uint16_t mPacketFlags[capacity]; // PacketFlags, widened to the lanes of the ports
+    uint16_t mL4Offsets[capacity];
+    const uint8_t* mData[capacity];
+    uint32_t mSize;
+};
+
+
+#endif // PACKETBURST_H
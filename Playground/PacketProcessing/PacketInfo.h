@@ -0,0 +1,219 @@
+#ifndef PACKETINFO_H
+#define PACKETINFO_H
+
+
+#include "Networking.h"
+#include <cstdint>
+
+
+enum PacketFlags
+{
+    PacketFlags_IPv4 = (1 << 0),
+    PacketFlags_IPv6 = (1 << 1),
+    PacketFlags_UDP  = (1 << 2),
+    PacketFlags_TCP  = (1 << 3),
+    PacketFlags_VLAN = (1 << 4),
+    PacketFlags_QinQ = (1 << 5)
+};
+
+
+/**
+ * Header offsets and packet type of an Ethernet frame.
+ *
+ * Parses the headers once so that the filters can use the offsets without
+ * decoding the headers again. Handles up to two VLAN tags (802.1Q and QinQ),
+ * IPv4 with options and IPv6 with up to max_extension_headers extension headers.
+ *
+ * mL4Offset is only valid if the UDP or TCP flag is set. It is not set for
+ * fragments other than the first one or if the headers don't fit in the frame.
+ */
+struct PacketInfo
+{
+    enum : uint32_t { max_vlan_tags = 2, max_extension_headers = 4 };
+
+    PacketInfo() = default;
+
+    PacketInfo(const uint8_t* data, uint32_t size)
+    {
+        if (size < sizeof(EthernetHeader))
+        {
+            return;
+        }
+
+        auto offset = static_cast<uint32_t>(sizeof(EthernetHeader));
+        auto ethertype = Decode<EthernetHeader>(data).mEtherType.hostValue();
+
+        for (auto i = 0u; i != max_vlan_tags && (ethertype == VLANTag::TPID || ethertype == VLANTag::ServiceTPID); ++i)
+        {
+            if (offset + sizeof(VLANTag) > size)
+            {
+                return;
+            }
+
+            const auto& tag = Decode<VLANTag>(data + offset);
+            if (i == 0)
+            {
+                mVLAN = tag.vlan_id();
+                mPacketFlags |= PacketFlags_VLAN;
+            }
+            else
+            {
+                mPacketFlags |= PacketFlags_QinQ;
+            }
+
+            ethertype = tag.mEtherType.hostValue();
+            offset += sizeof(VLANTag);
+        }
+
+        mEtherType = Net16(ethertype);
+        mL3Offset = offset;
+
+        switch (static_cast<EtherType>(ethertype))
+        {
+            case EtherType::IPv4:
+            {
+                parse_ipv4(data, size);
+                return;
+            }
+            case EtherType::IPv6:
+            {
+                parse_ipv6(data, size);
+                return;
+            }
+        }
+    }
+
+    bool has_flag(int flag) const
+    {
+        return (mPacketFlags & flag) == flag;
+    }
+
+    // True for IPv4 with a TCP or UDP header in the frame, the packets that the
+    // five-tuple filters can look at.
+    bool is_ipv4_tcp_or_udp() const
+    {
+        return has_flag(PacketFlags_IPv4) && (mPacketFlags & (PacketFlags_UDP | PacketFlags_TCP)) != 0;
+    }
+
+    uint16_t mL3Offset = 0;
+    uint16_t mL4Offset = 0;
+    Net16 mEtherType{0};    // ethertype of the L3 header (after the VLAN tags)
+    uint16_t mVLAN = 0;     // VLAN id of the outer tag
+    uint8_t mProtocol = 0;  // IPv4 protocol or IPv6 next header of the L4 header
+    uint8_t mPacketFlags = 0;
+
+private:
+    static bool is_extension_header(uint8_t next_header)
+    {
+        return next_header == 0   // Hop-by-hop options
+            || next_header == 43  // Routing
+            || next_header == 44  // Fragment
+            || next_header == 51  // Authentication header
+            || next_header == 60; // Destination options
+    }
+
+    void parse_ipv4(const uint8_t* data, uint32_t size)
+    {
+        if (mL3Offset + sizeof(IPv4Header) > size)
+        {
+            return;
+        }
+
+        const auto& ip4_header = Decode<IPv4Header>(data + mL3Offset);
+        const auto header_length = 4u * (ip4_header.mVersionAndIHL & 0xF);
+        if (header_length < sizeof(IPv4Header))
+        {
+            return;
+        }
+
+        mPacketFlags |= PacketFlags_IPv4;
+        mProtocol = static_cast<uint8_t>(ip4_header.mProtocol);
+
+        // Only the first fragment has the L4 header.
+        if ((ip4_header.mFlagsAndFragmentOffset.hostValue() & 0x1FFF) != 0)
+        {
+            return;
+        }
+
+        set_l4(mL3Offset + header_length, size);
+    }
+
+    void parse_ipv6(const uint8_t* data, uint32_t size)
+    {
+        if (mL3Offset + sizeof(IPv6Header) > size)
+        {
+            return;
+        }
+
+        mPacketFlags |= PacketFlags_IPv6;
+
+        auto next_header = Decode<IPv6Header>(data + mL3Offset).mNextHeader;
+        auto offset = mL3Offset + static_cast<uint32_t>(sizeof(IPv6Header));
+
+        for (auto i = 0u; i != max_extension_headers && is_extension_header(next_header); ++i)
+        {
+            // All extension headers start with the next header and a length field.
+            if (offset + 8 > size)
+            {
+                return;
+            }
+
+            auto header = next_header;
+            next_header = data[offset];
+
+            if (header == 44) // Fragment
+            {
+                // Only the first fragment has the L4 header.
+                if ((Decode<Net16>(data + offset + 2).hostValue() & 0xFFF8) != 0)
+                {
+                    mProtocol = next_header;
+                    return;
+                }
+                offset += 8u;
+            }
+            else if (header == 51) // Authentication header
+            {
+                offset += 4u * (data[offset + 1] + 2u);
+            }
+            else
+            {
+                offset += 8u * (data[offset + 1] + 1u);
+            }
+        }
+
+        mProtocol = next_header;
+        set_l4(offset, size);
+    }
+
+    void set_l4(uint32_t offset, uint32_t size)
+    {
+        switch (static_cast<ProtocolId>(mProtocol))
+        {
+            case ProtocolId::UDP:
+            {
+                if (offset + sizeof(UDPHeader) <= size)
+                {
+                    mL4Offset = offset;
+                    mPacketFlags |= PacketFlags_UDP;
+                }
+                return;
+            }
+            case ProtocolId::TCP:
+            {
+                // The ports are enough, the filters don't look at the rest of the TCP header.
+                if (offset + 2 * sizeof(Net16) <= size)
+                {
+                    mL4Offset = offset;
+                    mPacketFlags |= PacketFlags_TCP;
+                }
+                return;
+            }
+        }
+    }
+};
+
+
+static_assert(sizeof(PacketInfo) == 10, "");
+
+
+#endif // PACKETINFO_H
@@ -1,7 +1,24 @@
+#include "BPFFilter.h"
+#include "CuckooFlowTable.h"
+#include "DecisionDAG.h"
+#include "JITBPFFilter.h"
+#include "MaskFilter.h"
 #include "ParsedFilter.h"
 #include "Packet.h"
+#include "PacketBurst.h"
+#include "PacketInfo.h"
+#include "StaticBPF.h"
+#include "VectorFilter.h"
+#include "VectorFlowTable.h"
+#include <algorithm>
 #include <cassert>
+#include <cstddef>
 #include <iostream>
+#include <iterator>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 
 void test_udp_payload(const char* bpf_text, uint32_t payload_value)
@@ -56,6 +73,674 @@ void test_length_or(const char* bpf_text, int length, bool pass)
     }
 }
 
+// Appends an Ethernet header with the given TPIDs (outer first) and VLAN ids.
+void push_ethernet(std::vector<uint8_t>& frame, std::vector<std::pair<uint16_t, uint16_t>> tags, EtherType ethertype)
+{
+    auto push16 = [&](uint16_t value) { frame.push_back(value >> 8); frame.push_back(value & 0xFF); };
+
+    frame.resize(frame.size() + 2 * sizeof(MACAddress));
+    for (auto tag : tags)
+    {
+        push16(tag.first);
+        push16(tag.second);
+    }
+    push16(static_cast<uint16_t>(ethertype));
+}
+
+
+// Frames of all kinds that PacketInfo parses, for the burst filters: untagged, VLAN and
+// QinQ; IPv4 with and without options, IPv6, a later IPv4 fragment and ARP; UDP and TCP.
+std::vector<std::vector<uint8_t>> make_mixed_frames(uint32_t count)
+{
+    static const uint16_t lengths[] = { 60, 200, 1000, 1536 };
+
+    std::vector<std::vector<uint8_t>> frames;
+    for (auto i = 0u; i != count; ++i)
+    {
+        auto kind = i % 8;
+        auto protocol = kind == 3 || kind == 5 ? ProtocolId::TCP : ProtocolId::UDP;
+
+        std::vector<std::pair<uint16_t, uint16_t>> tags;
+        if (kind == 1 || kind == 5)
+        {
+            tags.emplace_back(VLANTag::TPID, 100);
+        }
+        else if (kind == 4)
+        {
+            tags.emplace_back(VLANTag::ServiceTPID, 200);
+            tags.emplace_back(VLANTag::TPID, 300);
+        }
+
+        std::vector<uint8_t> frame;
+        if (kind == 6)
+        {
+            push_ethernet(frame, tags, static_cast<EtherType>(0x0806)); // ARP
+        }
+        else if (kind == 2 || kind == 5)
+        {
+            push_ethernet(frame, tags, EtherType::IPv6);
+            auto ip6_header = IPv6Header();
+            ip6_header.mNextHeader = static_cast<uint8_t>(protocol);
+            auto p = reinterpret_cast<const uint8_t*>(&ip6_header);
+            frame.insert(frame.end(), p, p + sizeof(ip6_header));
+        }
+        else
+        {
+            push_ethernet(frame, tags, EtherType::IPv4);
+            auto ip4_header = IPv4Header::Create(protocol, IPv4Address(1, 1, 1, 1 + i % 2), IPv4Address(1, 1, 1, 2 + i / 8 % 2));
+            if (kind == 4)
+            {
+                ip4_header.mVersionAndIHL = (4u << 4) | 6u;
+            }
+            if (kind == 7)
+            {
+                ip4_header.mFlagsAndFragmentOffset = Net16(uint16_t(0x0010));
+            }
+            auto p = reinterpret_cast<const uint8_t*>(&ip4_header);
+            frame.insert(frame.end(), p, p + sizeof(ip4_header));
+            frame.resize(frame.size() + (kind == 4 ? 4 : 0));
+        }
+
+        auto l4_offset = frame.size();
+        auto udp_header = UDPHeader::Create(1024 + i % 3, 1024 + i % 5);
+        auto p = reinterpret_cast<const uint8_t*>(&udp_header);
+        frame.insert(frame.end(), p, p + sizeof(udp_header));
+        frame.resize(lengths[i / 2 % 4]);
+        frame[l4_offset + sizeof(UDPHeader)] = i % 3;
+
+        frames.push_back(std::move(frame));
+    }
+    return frames;
+}
+
+
+void test_burst(const char* bpf_text)
+{
+    try
+    {
+        Parser p(bpf_text);
+        std::cerr << p.mText << std::endl;
+        Expression e = p.parse();
+
+        auto frames = make_mixed_frames(PacketBurst::capacity);
+
+        std::vector<const uint8_t*> data;
+        std::vector<uint16_t> sizes;
+        std::vector<PacketInfo> infos;
+        for (const auto& frame : frames)
+        {
+            data.push_back(frame.data());
+            sizes.push_back(frame.size());
+            infos.emplace_back(frame.data(), frame.size());
+        }
+
+        // Every burst size must give the same result as matching the packets one by one.
+        uint64_t expected = 0;
+        for (auto n = 0u; n <= frames.size(); ++n)
+        {
+            expected = 0;
+            for (auto i = 0u; i != n; ++i)
+            {
+                if (e.match(data[i], sizes[i], infos[i]))
+                {
+                    expected |= uint64_t(1) << i;
+                }
+            }
+
+            uint64_t result = 0;
+            e.match_burst(data.data(), sizes.data(), infos.data(), n, &result);
+            assert(result == expected);
+        }
+
+        // The filters are chosen so that some packets of the burst match and some don't.
+        auto matches = __builtin_popcountll(expected);
+        assert(matches != 0 && matches != int(frames.size()));
+        std::cout << "BURST MATCHES => " << matches << std::endl;
+    }
+    catch (const std::runtime_error& e)
+    {
+        std::cerr << e.what() << std::endl;
+    }
+}
+
+
+void test_decision_dag(const std::vector<const char*>& bpf_texts)
+{
+    try
+    {
+        std::vector<Expression> expressions;
+        DecisionDAG dag;
+        for (auto i = 0u; i != bpf_texts.size(); ++i)
+        {
+            expressions.push_back(Parser(bpf_texts[i]).parse());
+            dag.add_filter(i, expressions.back());
+        }
+        dag.compile();
+
+        std::vector<Packet> packets;
+        for (auto i = 0u; i != 64; ++i)
+        {
+            auto protocol = i % 7 == 0 ? ProtocolId::TCP : ProtocolId::UDP;
+            packets.emplace_back(protocol, IPv4Address(1, 1, 1, 1 + i % 3), IPv4Address(1, 1, 1, 2), 1024 + i % 4, 1024 + i % 5);
+            packets.back().data()[sizeof(EthernetHeader) + sizeof(IPv4Header) + sizeof(UDPHeader)] = i % 2;
+        }
+        packets.emplace_back(ProtocolId::UDP, IPv4Address(1, 1, 1, 2), IPv4Address(1, 1, 1, 3), 1024, 1025);
+
+        // Also VLAN, QinQ, IPv6 and non-IP frames, at other offsets than the Packets.
+        auto frames = make_mixed_frames(64);
+        for (const Packet& packet : packets)
+        {
+            frames.emplace_back(packet.data(), packet.data() + packet.size());
+        }
+
+        uint32_t total_matches = 0;
+        std::vector<uint32_t> result;
+        for (const auto& frame : frames)
+        {
+            auto info = PacketInfo(frame.data(), frame.size());
+
+            // The DAG must give the same result as matching the filters one by one.
+            std::vector<uint32_t> expected;
+            for (auto f = 0u; f != expressions.size(); ++f)
+            {
+                if (expressions[f].match(frame.data(), frame.size(), info))
+                {
+                    expected.push_back(f);
+                }
+            }
+
+            dag.match(frame.data(), frame.size(), info, result);
+            assert(result == expected);
+            total_matches += result.size();
+        }
+
+        std::cout << "DAG terms=" << dag.num_terms() << " nodes=" << dag.num_nodes() << " matches=" << total_matches << std::endl;
+    }
+    catch (const std::runtime_error& e)
+    {
+        std::cerr << e.what() << std::endl;
+    }
+}
+
+
+void test_packet_info()
+{
+    auto push_udp = [](std::vector<uint8_t>& frame, uint16_t dst_port)
+    {
+        auto udp_header = UDPHeader::Create(1024, dst_port);
+        auto p = reinterpret_cast<const uint8_t*>(&udp_header);
+        frame.insert(frame.end(), p, p + sizeof(udp_header));
+        frame.resize(frame.size() + 32);
+    };
+
+    auto filter = Parser("udp dst port 53").parse();
+    auto ip4_filter = Parser("ip and udp and udp dst port 53").parse();
+
+    // Untagged IPv4
+    {
+        auto packet = Packet(ProtocolId::UDP, IPv4Address(1, 1, 1, 1), IPv4Address(1, 1, 1, 2), 1024, 53);
+        PacketInfo info(packet.data(), packet.size());
+        assert(info.mL3Offset == sizeof(EthernetHeader));
+        assert(info.mL4Offset == sizeof(EthernetHeader) + sizeof(IPv4Header));
+        assert(info.mPacketFlags == (PacketFlags_IPv4 | PacketFlags_UDP));
+        assert(ip4_filter.match(packet.data(), packet.size(), info));
+    }
+
+    // 802.1Q tagged IPv4 with 4 bytes of options
+    {
+        std::vector<uint8_t> frame;
+        push_ethernet(frame, {{VLANTag::TPID, 100}}, EtherType::IPv4);
+        auto ip4_header = IPv4Header::Create(ProtocolId::UDP, IPv4Address(1, 1, 1, 1), IPv4Address(1, 1, 1, 2));
+        ip4_header.mVersionAndIHL = (4u << 4) | 6u;
+        auto p = reinterpret_cast<const uint8_t*>(&ip4_header);
+        frame.insert(frame.end(), p, p + sizeof(ip4_header));
+        frame.resize(frame.size() + 4);
+        push_udp(frame, 53);
+
+        PacketInfo info(frame.data(), frame.size());
+        assert(info.mL3Offset == 18);
+        assert(info.mL4Offset == 18 + 24);
+        assert(info.mVLAN == 100);
+        assert(info.mPacketFlags == (PacketFlags_VLAN | PacketFlags_IPv4 | PacketFlags_UDP));
+        assert(ip4_filter.match(frame.data(), frame.size(), info));
+
+        // The mask filters skip the options between the addresses and the ports.
+        assert(info.is_ipv4_tcp_or_udp());
+        assert(MaskFilter(ProtocolId::UDP, IPv4Address(1, 1, 1, 1), IPv4Address(1, 1, 1, 2), 1024, 53).match(frame.data(), frame.size(), info.mL3Offset, info.mL4Offset));
+        assert(VectorFilter(ProtocolId::UDP, IPv4Address(1, 1, 1, 1), IPv4Address(1, 1, 1, 2), 1024, 53).match(frame.data(), frame.size(), info.mL3Offset, info.mL4Offset));
+        assert(!MaskFilter(ProtocolId::UDP, IPv4Address(1, 1, 1, 1), IPv4Address(1, 1, 1, 3), 1024, 53).match(frame.data(), frame.size(), info.mL3Offset, info.mL4Offset));
+    }
+
+    // QinQ tagged IPv6 with a hop-by-hop options header
+    {
+        std::vector<uint8_t> frame;
+        push_ethernet(frame, {{VLANTag::ServiceTPID, 200}, {VLANTag::TPID, 300}}, EtherType::IPv6);
+        auto ip6_header = IPv6Header();
+        ip6_header.mNextHeader = 0;
+        auto p = reinterpret_cast<const uint8_t*>(&ip6_header);
+        frame.insert(frame.end(), p, p + sizeof(ip6_header));
+        frame.push_back(static_cast<uint8_t>(ProtocolId::UDP));
+        frame.resize(frame.size() + 7);
+        push_udp(frame, 53);
+
+        PacketInfo info(frame.data(), frame.size());
+        assert(info.mL3Offset == 22);
+        assert(info.mL4Offset == 22 + 40 + 8);
+        assert(info.mVLAN == 200);
+        assert(info.mPacketFlags == (PacketFlags_VLAN | PacketFlags_QinQ | PacketFlags_IPv6 | PacketFlags_UDP));
+        assert(filter.match(frame.data(), frame.size(), info));
+        assert(!ip4_filter.match(frame.data(), frame.size(), info));
+        assert(!info.is_ipv4_tcp_or_udp());
+    }
+
+    // IPv6 fragment other than the first one has no UDP header
+    {
+        std::vector<uint8_t> frame;
+        push_ethernet(frame, {}, EtherType::IPv6);
+        auto ip6_header = IPv6Header();
+        ip6_header.mNextHeader = 44;
+        auto p = reinterpret_cast<const uint8_t*>(&ip6_header);
+        frame.insert(frame.end(), p, p + sizeof(ip6_header));
+        frame.push_back(static_cast<uint8_t>(ProtocolId::UDP));
+        frame.push_back(0);
+        frame.push_back(0x05); // fragment offset
+        frame.push_back(0x00);
+        frame.resize(frame.size() + 4);
+        push_udp(frame, 53);
+
+        PacketInfo info(frame.data(), frame.size());
+        assert(info.mPacketFlags == PacketFlags_IPv6);
+        assert(!filter.match(frame.data(), frame.size(), info));
+    }
+
+    std::cout << "PacketInfo OK" << std::endl;
+}
+
+
+struct StaticFiveTuple
+{
+    static constexpr StaticBPF::Program program = StaticBPF::parse("ip src 1.1.1.1 && ip dst 1.1.1.2 && udp src port 1024 && udp dst port 1025");
+};
+
+struct StaticMixed
+{
+    static constexpr StaticBPF::Program program = StaticBPF::parse("(tcp port 1024 or ip host 1.1.1.3) and ip src net 1.1.1.0/31");
+};
+
+struct StaticNot
+{
+    static constexpr StaticBPF::Program program = StaticBPF::parse("!(ip src 1.1.1.1 && ip dst 1.1.1.2 && udp src port 1024 && udp dst port 1025)");
+};
+
+struct StaticAddresses
+{
+    static constexpr StaticBPF::Program program = StaticBPF::parse("ip src 1.1.1.1 or ip dst 1.1.1.2 or ip host 1.1.1.2");
+};
+
+struct StaticUDP
+{
+    static constexpr StaticBPF::Program program = StaticBPF::parse("udp");
+};
+
+struct StaticEmpty
+{
+    static constexpr StaticBPF::Program program = StaticBPF::parse("");
+};
+
+// Parsed at compile time.
+static_assert(StaticFiveTuple::program.mSize == 19, "");
+static_assert(StaticFiveTuple::program.mNodes[0].mOffset == 0 && StaticFiveTuple::program.mNodes[0].mValue == 0x40, "");
+static_assert(StaticFiveTuple::program.mNodes[1].mOffset == 12 && StaticFiveTuple::program.mNodes[1].mValue == 0x01010101, "");
+static_assert(StaticFiveTuple::program.mNodes[StaticFiveTuple::program.mRoot].mType == StaticBPF::Node::Type::And, "");
+static_assert(StaticMixed::program.mNodes[StaticMixed::program.mRoot].mType == StaticBPF::Node::Type::And, "");
+static_assert(StaticEmpty::program.mNodes[StaticEmpty::program.mRoot].mType == StaticBPF::Node::Type::True, "");
+
+
+// The compile-time filter must give the same result as the runtime parser on IPv4
+// packets. bpf_text has the protocol checks of the port primitives explicitly.
+template<typename P>
+void test_static_bpf(const char* bpf_text)
+{
+    auto e = Parser(bpf_text).parse();
+
+    auto matches = 0u;
+    for (auto i = 0u; i != 64; ++i)
+    {
+        auto protocol = i % 3 == 0 ? ProtocolId::TCP : ProtocolId::UDP;
+        auto packet = Packet(protocol, IPv4Address(1, 1, 1, 1 + i % 4), IPv4Address(1, 1, 1, 2 + i % 5 / 4), 1024 + i % 2, 1024 + i % 7 / 5);
+        auto info = PacketInfo(packet.data(), packet.size());
+
+        auto result = StaticBPF::Filter<P>::match(packet.data(), packet.size(), info.mL3Offset, info.mL4Offset);
+        assert(result == e.match(packet.data(), packet.size(), info));
+        matches += result;
+    }
+
+    std::cout << "STATIC " << bpf_text << " => " << matches << " matches" << std::endl;
+}
+
+
+// IPv6 and ARP frames with 1.1.1.1 and 1.1.1.2 at the offsets of the IPv4 addresses
+// and 17 at the offset of the IPv4 protocol. The address primitives check the IP
+// version, so they agree with the runtime parser. tcp and udp are IPv4-only in
+// StaticBPF, so udp doesn't match UDP over IPv6, unlike in the runtime parser.
+void test_static_bpf_non_ipv4()
+{
+    auto addresses = Parser("ip src 1.1.1.1 or ip dst 1.1.1.2 or (ip src 1.1.1.2 or ip dst 1.1.1.2)").parse();
+    auto udp = Parser("udp").parse();
+
+    for (auto ethertype : { EtherType::IPv6, static_cast<EtherType>(0x0806) })
+    {
+        std::vector<uint8_t> frame;
+        push_ethernet(frame, {}, ethertype);
+        auto l3_offset = frame.size();
+        frame.resize(l3_offset + 64);
+
+        const uint8_t ip_bytes[] = { 1, 1, 1, 1, 1, 1, 1, 2 };
+        std::copy(std::begin(ip_bytes), std::end(ip_bytes), frame.begin() + l3_offset + 12);
+        frame[l3_offset + 9] = static_cast<uint8_t>(ProtocolId::UDP);
+
+        if (ethertype == EtherType::IPv6)
+        {
+            frame[l3_offset] = 0x60;
+            frame[l3_offset + offsetof(IPv6Header, mNextHeader)] = static_cast<uint8_t>(ProtocolId::UDP);
+        }
+        else
+        {
+            frame[l3_offset + 1] = 0x01; // Ethernet hardware type
+        }
+
+        PacketInfo info(frame.data(), frame.size());
+        assert(info.mL3Offset == l3_offset);
+
+        auto result = StaticBPF::Filter<StaticAddresses>::match(frame.data(), frame.size(), info.mL3Offset, info.mL4Offset);
+        assert(!result);
+        assert(result == addresses.match(frame.data(), frame.size(), info));
+
+        assert(!StaticBPF::Filter<StaticUDP>::match(frame.data(), frame.size(), info.mL3Offset, info.mL4Offset));
+        assert(udp.match(frame.data(), frame.size(), info) == (ethertype == EtherType::IPv6));
+    }
+
+    std::cout << "STATIC non-IPv4 OK" << std::endl;
+}
+
+
+void test_static_bpf()
+{
+    test_static_bpf<StaticFiveTuple>("ip src 1.1.1.1 && ip dst 1.1.1.2 && udp && udp src port 1024 && udp dst port 1025");
+    test_static_bpf<StaticMixed>("((tcp and (tcp src port 1024 or tcp dst port 1024)) or (ip src 1.1.1.3 or ip dst 1.1.1.3)) and (ip src 1.1.1.0 or ip src 1.1.1.1)");
+    test_static_bpf<StaticEmpty>("");
+    test_static_bpf_non_ipv4();
+
+    for (auto i = 0u; i != 4; ++i)
+    {
+        auto packet = Packet(ProtocolId::UDP, IPv4Address(1, 1, 1, 1), IPv4Address(1, 1, 1, 2), 1024 + i / 2, 1024 + i % 2);
+        auto info = PacketInfo(packet.data(), packet.size());
+        assert(StaticBPF::Filter<StaticNot>::match(packet.data(), packet.size(), info.mL3Offset, info.mL4Offset)
+            != StaticBPF::Filter<StaticFiveTuple>::match(packet.data(), packet.size(), info.mL3Offset, info.mL4Offset));
+    }
+
+    // Outside of a constant expression, a syntax error throws.
+    for (auto bpf_text : { "tcp src port 65536", "ip src 1.1.1", "ip src net 1.1.1.1/24", "udp and", "(udp" })
+    {
+        try
+        {
+            StaticBPF::parse(bpf_text);
+            assert(false);
+        }
+        catch (const std::invalid_argument& e)
+        {
+            std::cerr << e.what() << std::endl;
+        }
+    }
+}
+
+
+// The JIT must return the same as the interpreter, also for packets that are too short
+// for the hoisted length check and for loads past the end. The programs are written by
+// hand to cover all instruction classes, like pcap_compile output for DLT_RAW.
+void test_jit_bpf(std::vector<bpf_insn> instructions)
+{
+    bpf_program program{static_cast<u_int>(instructions.size()), instructions.data()};
+    JITBPFFilter jit(program);
+
+    std::vector<Packet> packets;
+    packets.emplace_back(ProtocolId::UDP, IPv4Address(1, 1, 1, 1), IPv4Address(1, 1, 1, 2), 1024, 1025);
+    packets.emplace_back(ProtocolId::UDP, IPv4Address(1, 1, 1, 1), IPv4Address(1, 1, 1, 2), 1024, 1026);
+    packets.emplace_back(ProtocolId::TCP, IPv4Address(1, 1, 1, 1), IPv4Address(1, 1, 1, 2), 1024, 1025);
+    packets.emplace_back(ProtocolId::UDP, IPv4Address(1, 1, 1, 3), IPv4Address(1, 1, 1, 2), 1024, 1025);
+
+    auto matches = 0u;
+    for (auto& packet : packets)
+    {
+        // Every truncation of the frame, down to runt frames without an Ethernet header.
+        // The copy has the exact size, so that a load past the end is a read past the buffer.
+        for (auto size = 0u; size <= packet.size(); ++size)
+        {
+            std::vector<uint8_t> frame(packet.data(), packet.data() + size);
+            PacketInfo info(frame.data(), frame.size());
+
+            auto expected = 0u;
+            if (info.mL3Offset != 0)
+            {
+                auto ip_data = frame.data() + info.mL3Offset;
+                auto ip_size = size - info.mL3Offset;
+                expected = BPFFilter::match_bpf(instructions.data(), ip_data, ip_size, ip_size);
+                assert(jit.execute(ip_data, ip_size) == expected);
+            }
+
+            assert(jit.match(frame.data(), size, info.mL3Offset, info.mL4Offset) == (expected != 0));
+            matches += expected != 0;
+        }
+    }
+
+    std::cout << "JIT " << instructions.size() << " instructions => " << matches << " matches" << std::endl;
+}
+
+
+void test_jit_bpf()
+{
+    // ip src 1.1.1.1 and ip dst 1.1.1.2 and udp dst port 1025
+    test_jit_bpf({
+        BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 12),
+        BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x01010101, 0, 8),
+        BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 16),
+        BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x01010102, 0, 6),
+        BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 9),
+        BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 17, 0, 4),
+        BPF_STMT(BPF_LDX|BPF_MSH|BPF_B, 0),
+        BPF_STMT(BPF_LD|BPF_H|BPF_IND, 2),
+        BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 1025, 0, 1),
+        BPF_STMT(BPF_RET|BPF_K, 0xffff),
+        BPF_STMT(BPF_RET|BPF_K, 0)
+    });
+
+    // Arithmetic on the length and a header byte, with the scratch memory.
+    test_jit_bpf({
+        BPF_STMT(BPF_LD|BPF_W|BPF_LEN, 0),
+        BPF_STMT(BPF_ST, 1),
+        BPF_STMT(BPF_LDX|BPF_IMM, 3),
+        BPF_STMT(BPF_ALU|BPF_MUL|BPF_X, 0),
+        BPF_STMT(BPF_ALU|BPF_ADD|BPF_K, 7),
+        BPF_STMT(BPF_ALU|BPF_NEG, 0),
+        BPF_STMT(BPF_ALU|BPF_RSH|BPF_K, 3),
+        BPF_STMT(BPF_ALU|BPF_AND|BPF_K, 0xffff),
+        BPF_STMT(BPF_ALU|BPF_OR|BPF_K, 0x10000),
+        BPF_STMT(BPF_MISC|BPF_TAX, 0),
+        BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 8),
+        BPF_STMT(BPF_ALU|BPF_DIV|BPF_X, 0),
+        BPF_STMT(BPF_ALU|BPF_LSH|BPF_K, 4),
+        BPF_STMT(BPF_STX, 2),
+        BPF_STMT(BPF_LDX|BPF_MEM, 1),
+        BPF_STMT(BPF_ALU|BPF_SUB|BPF_X, 0),
+        BPF_JUMP(BPF_JMP|BPF_JSET|BPF_K, 0x8, 0, 1),
+        BPF_STMT(BPF_RET|BPF_A, 0),
+        BPF_STMT(BPF_LD|BPF_MEM, 2),
+        BPF_STMT(BPF_RET|BPF_A, 0)
+    });
+
+    // Compares with X, a division by zero and an indirect load that wraps around.
+    test_jit_bpf({
+        BPF_STMT(BPF_LDX|BPF_W|BPF_LEN, 0),
+        BPF_STMT(BPF_LD|BPF_IMM, 28),
+        BPF_JUMP(BPF_JMP|BPF_JGE|BPF_X, 0, 3, 0),
+        BPF_STMT(BPF_LDX|BPF_IMM, 0),
+        BPF_STMT(BPF_ALU|BPF_DIV|BPF_X, 0),
+        BPF_STMT(BPF_RET|BPF_K, 1),
+        BPF_JUMP(BPF_JMP|BPF_JA, 1, 0, 0),
+        BPF_STMT(BPF_RET|BPF_K, 2),
+        BPF_JUMP(BPF_JMP|BPF_JGT|BPF_X, 0, 2, 0),
+        BPF_STMT(BPF_LD|BPF_W|BPF_IND, 0xfffffffc),
+        BPF_STMT(BPF_RET|BPF_A, 0),
+        BPF_STMT(BPF_MISC|BPF_TXA, 0),
+        BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_X, 0, 0, 1),
+        BPF_STMT(BPF_RET|BPF_K, 3),
+        BPF_STMT(BPF_RET|BPF_K, 4)
+    });
+
+    // Loads past the end, with constant and with indirect offsets.
+    test_jit_bpf({
+        BPF_STMT(BPF_LDX|BPF_MSH|BPF_B, 40),
+        BPF_STMT(BPF_LD|BPF_B|BPF_IND, 20),
+        BPF_JUMP(BPF_JMP|BPF_JSET|BPF_X, 0, 0, 1),
+        BPF_STMT(BPF_RET|BPF_K, 3),
+        BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 0xfffffffe),
+        BPF_STMT(BPF_RET|BPF_K, 4)
+    });
+}
+
+
+
+void test_cuckoo_flow_table()
+{
+    CuckooFlowTable table;
+    auto is = [](uint32_t flow_index) { return [=](uint32_t candidate) { return candidate == flow_index; }; };
+
+    for (auto i = 0u; i != 10000; ++i)
+    {
+        table.insert(FlowKey::Create(ProtocolId::UDP, IPv4Address(1, 1, i / 256, i % 256), IPv4Address(1, 1, 1, 2), 1024, 1025).hash(), i);
+    }
+    for (auto i = 0u; i != 10000; ++i)
+    {
+        auto hash = FlowKey::Create(ProtocolId::UDP, IPv4Address(1, 1, i / 256, i % 256), IPv4Address(1, 1, 1, 2), 1024, 1025).hash();
+        assert(table.find(hash, is(i)) == i);
+        assert(!table.insert(hash, 10000 + i, is(i)));
+    }
+    assert(table.size() == 10000);
+
+    // Entries with the same hash have the same two buckets of 8 slots, the rest go to
+    // the stash. When that is full too, insert throws instead of growing forever.
+    CuckooFlowTable collisions;
+    auto num_inserted = 0u;
+    try
+    {
+        for (;;)
+        {
+            collisions.insert(0x123456789abcdefull, num_inserted);
+            ++num_inserted;
+        }
+    }
+    catch (const std::length_error& e)
+    {
+        std::cerr << e.what() << std::endl;
+    }
+
+    assert(num_inserted == collisions.size() && num_inserted > 16);
+    assert(collisions.stash_size() == num_inserted - 16);
+    for (auto i = 0u; i != num_inserted; ++i)
+    {
+        assert(collisions.find(0x123456789abcdefull, is(i)) == i);
+    }
+
+    std::cout << "CuckooFlowTable OK, " << num_inserted << " entries with the same hash" << std::endl;
+}
+
+
+// Random flows and packets: VectorFlowTable must count the same flows as matching
+// the BPF filter of each flow one by one. The values are drawn from small ranges so
+// that flows match, and the flow counts include partial and several blocks.
+void test_vector_flow_table()
+{
+    std::mt19937 random(1234);
+    auto pick = [&](uint32_t n) { return static_cast<uint32_t>(random() % n); };
+
+    auto total_matches = 0u;
+    for (auto round = 0; round != 50; ++round)
+    {
+        VectorFlowTable table;
+        std::vector<Expression> expressions;
+
+        auto num_flows = 1 + pick(3 * VectorFlowTable::block_size);
+        table.reserve(num_flows);
+        for (auto i = 0u; i != num_flows; ++i)
+        {
+            auto tcp = pick(2) == 1;
+            auto src = 1 + pick(3);
+            auto dst = 1 + pick(3);
+            auto src_port = 1024 + pick(3);
+            auto dst_port = 1024 + pick(3);
+
+            table.add_flow(tcp ? ProtocolId::TCP : ProtocolId::UDP, IPv4Address(1, 1, 1, src), IPv4Address(1, 1, 1, dst), src_port, dst_port);
+
+            auto text = std::string(tcp ? "tcp" : "udp")
+                + " and ip src 1.1.1." + std::to_string(src) + " and ip dst 1.1.1." + std::to_string(dst)
+                + " and udp src port " + std::to_string(src_port) + " and udp dst port " + std::to_string(dst_port);
+            expressions.push_back(Parser(text.c_str()).parse());
+        }
+
+        for (auto n = 0; n != 100; ++n)
+        {
+            // Untagged or VLAN, with or without IPv4 options.
+            auto tcp = pick(2) == 1;
+            auto vlan = pick(2) == 1;
+            auto options = pick(2) == 1;
+
+            std::vector<uint8_t> frame;
+            push_ethernet(frame, vlan ? std::vector<std::pair<uint16_t, uint16_t>>{ { VLANTag::TPID, 100 } } : std::vector<std::pair<uint16_t, uint16_t>>(), EtherType::IPv4);
+            auto ip4_header = IPv4Header::Create(tcp ? ProtocolId::TCP : ProtocolId::UDP, IPv4Address(1, 1, 1, 1 + pick(3)), IPv4Address(1, 1, 1, 1 + pick(3)));
+            if (options)
+            {
+                ip4_header.mVersionAndIHL = (4u << 4) | 6u;
+            }
+            auto p = reinterpret_cast<const uint8_t*>(&ip4_header);
+            frame.insert(frame.end(), p, p + sizeof(ip4_header));
+            frame.resize(frame.size() + (options ? 4 : 0));
+
+            auto src_port = 1024 + pick(3);
+            auto dst_port = 1024 + pick(3);
+            if (tcp)
+            {
+                auto tcp_header = TCPHeader::Create(src_port, dst_port);
+                p = reinterpret_cast<const uint8_t*>(&tcp_header);
+                frame.insert(frame.end(), p, p + sizeof(tcp_header));
+            }
+            else
+            {
+                auto udp_header = UDPHeader::Create(src_port, dst_port);
+                p = reinterpret_cast<const uint8_t*>(&udp_header);
+                frame.insert(frame.end(), p, p + sizeof(udp_header));
+            }
+            frame.resize(std::max<std::size_t>(frame.size(), 60));
+
+            auto info = PacketInfo(frame.data(), frame.size());
+            assert(info.is_ipv4_tcp_or_udp());
+
+            std::vector<uint64_t> matches(num_flows);
+            table.match(frame.data(), frame.size(), info.mL3Offset, info.mL4Offset, matches.data());
+
+            for (auto i = 0u; i != num_flows; ++i)
+            {
+                assert(matches[i] == (expressions[i].match(frame.data(), frame.size(), info) ? 1u : 0u));
+                total_matches += matches[i];
+            }
+        }
+    }
+
+    assert(total_matches != 0);
+    std::cout << "VectorFlowTable OK, " << total_matches << " matches" << std::endl;
+}
+
+
+
 
 
 int main()
@@ -97,6 +782,35 @@ int main()
                    "|| (ip src 1.1.1.1 and ip dst 1.1.1.2 and udp src port 1024 and udp dst port 1024 and len=124) \n"
                    "|| (ip src 1.1.1.1 and ip dst 1.1.1.2 and udp src port 1024 and udp dst port 1024 and len=252) \n"
                    "|| (ip src 1.1.1.1 and ip dst 1.1.1.2 and udp src port 1024 and udp dst port 1024 and len=508) ", 64, false);
+
+    test_length_or("ip and udp and len in {60, 124, 252, 508, 1020, 1514}", 1020, true);
+    test_length_or("ip and udp and len in {60, 124, 252, 508, 1020, 1514}", 1021, false);
+    test_length_or("ip and udp and len >= 100 and len <= 200", 100, true);
+    test_length_or("ip and udp and len >= 100 and len <= 200", 200, true);
+    test_length_or("ip and udp and len >= 100 and len <= 200", 99, false);
+    test_length_or("ip and udp and len >= 100 and len <= 200", 201, false);
+    test_length_or("ip and udp and len > 9000", 9216, true);
+    test_length_or("len < 64 or len in {128, 256}", 63, true);
+    test_length_or("len < 64 or len in {128, 256}", 64, false);
+    test_length_or("len < 64 or len in {128, 256}", 256, true);
+    test_length_or("len=60 or len >= 1000", 60, true);
+    test_length_or("len=60 or len >= 1000", 61, false);
+    test_length_or("len=60 or len >= 1000", 1500, true);
+    test_length_or("len in {64, 9216} and len >= 100", 9216, true);
+    test_length_or("len in {64, 9216} and len >= 100", 64, false);
+
+    // Dozens of lengths in one filter
+    {
+        std::string text = "ip and udp and udp dst port 1024 and len in {64";
+        for (auto len = 100; len <= 9100; len += 200)
+        {
+            text += ", " + std::to_string(len);
+        }
+        text += "}";
+        test_length_or(text.c_str(), 4900, true);
+        test_length_or(text.c_str(), 4901, false);
+    }
+
     std::cout << std::endl;
     std::cout << std::endl;
     std::cout << std::endl;
@@ -109,4 +823,50 @@ int main()
 
 
     test_udp_payload("(ip src 1.1.1.1 and ip dst 1.1.1.2 and udp src port 1024 and udp dst port 1024 and udp[8:1]=0x1) or (ip src 1.1.1.1 and ip dst 1.1.1.2 and udp src port 1024 and udp dst port 1024 and udp[8:1]=0x11)", 0x1);
+
+    std::cout << std::endl;
+    test_burst("ip src 1.1.1.1 and udp src port 1025");
+    test_burst("(ip src 1.1.1.2 and udp[8:1]=0x1) or (udp src port 1024 and udp dst port 1024) or ip dst 1.1.1.3");
+    test_burst("(udp src port 1024 or udp src port 1026) and udp[8:1]=0x2");
+    test_burst("(len >= 1000 and udp src port 1024) or (len in {60, 1536} and udp src port 1025)");
+    test_burst("udp dst port 1024 or tcp dst port 1025");
+    test_burst("tcp src port 1024 or (udp and len <= 200)");
+    test_burst("ip and udp and udp[8:1]=0x0");
+
+    std::cout << std::endl;
+    test_packet_info();
+
+    std::cout << std::endl;
+    test_decision_dag({
+        "ip and udp dst port 1024",
+        "ip and udp dst port 1024 and ip src 1.1.1.1",
+        "ip and udp dst port 1024 and ip src 1.1.1.2 and udp src port 1025",
+        "ip and udp dst port 1025 and (ip src 1.1.1.1 or ip src 1.1.1.3)",
+        "ip and udp dst port 1026 and udp[8:1]=0x1",
+        "(ip src 1.1.1.2 and udp src port 1027) or (udp dst port 1028 and udp[8:1]=0x0)",
+        "ip and udp src port 1026 and (len=1536 or len=60)",
+        "ip dst 1.1.1.2",
+        "ip and udp dst port 1025 and len in {60, 1536}",
+        "ip and tcp and tcp dst port 1024"
+    });
+
+    // AND over OR gives terms that check a field twice, those with different values never match.
+    test_decision_dag({
+        "ip src 1.1.1.1 and (ip src 1.1.1.2 or tcp)",
+        "udp dst port 1024 and (udp dst port 1025 or ip dst 9.9.9.9)",
+        "udp dst port 1025 and (udp dst port 1025 or ip dst 9.9.9.9)",
+        "ip src 1.1.1.2 and (ip dst 1.1.1.3 or ip dst 1.1.1.2) and (udp src port 1024 or udp src port 1025)"
+    });
+
+    std::cout << std::endl;
+    test_static_bpf();
+
+    std::cout << std::endl;
+    test_jit_bpf();
+
+    std::cout << std::endl;
+    test_cuckoo_flow_table();
+
+    std::cout << std::endl;
+    test_vector_flow_table();
 }
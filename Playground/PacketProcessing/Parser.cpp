@@ -55,6 +55,69 @@ Expression Parser::parse()
     return result;
 }
 
+Expression Parser::parse_length()
+{
+    if (consume_token("in"))
+    {
+        if (!consume_text("{"))
+        {
+            return error("'{'");
+        }
+
+        Lengths lengths = Lengths::Range(1, 0); // empty
+        do
+        {
+            int len = 0;
+            if (!consume_length(len))
+            {
+                return error("length value");
+            }
+            if (!lengths.unite(Lengths(len)))
+            {
+                return error("length value <= " + std::to_string(Lengths::max_bitmap_length));
+            }
+        }
+        while (consume_text(","));
+
+        if (!consume_text("}"))
+        {
+            return error("',' or '}'");
+        }
+
+        return Expression::bpf_lengths(std::move(lengths));
+    }
+
+    // Two-character operators first.
+    if (consume_text(">="))
+    {
+        int len = 0;
+        return consume_length(len) ? Expression::bpf_lengths(Lengths::Range(len, 0xFFFF)) : error("length value");
+    }
+    else if (consume_text("<="))
+    {
+        int len = 0;
+        return consume_length(len) ? Expression::bpf_lengths(Lengths::Range(0, len)) : error("length value");
+    }
+    else if (consume_text(">"))
+    {
+        int len = 0;
+        return consume_length(len) && len < 0xFFFF ? Expression::bpf_lengths(Lengths::Range(len + 1, 0xFFFF)) : error("length value");
+    }
+    else if (consume_text("<"))
+    {
+        int len = 0;
+        return consume_length(len) && len > 0 ? Expression::bpf_lengths(Lengths::Range(0, len - 1)) : error("length value");
+    }
+    else if (consume_text("==") || consume_text("="))
+    {
+        int len = 0;
+        return consume_length(len) ? Expression::bpf_length(len) : error("length value");
+    }
+
+    return error("comparison operator or 'in'");
+}
+
+
 Expression Parser::parse_bpf_expression()
 {
     if (consume_token("ip"))
@@ -237,6 +300,21 @@ bool Parser::consume_int(int& result)
 }
 
 
+bool Parser::consume_length(int& result)
+{
+    consume_whitespace();
+
+    auto backup = mText;
+    if (consume_int(result) && result >= 0 && result <= 0xFFFF)
+    {
+        return true;
+    }
+
+    mText = backup;
+    return false;
+}
+
+
 bool Parser::consume_uint8(uint8_t& result)
 {
     int n = 0;
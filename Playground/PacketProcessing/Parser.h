@@ -4,6 +4,7 @@
 #include "Expression.h"
 #include "Networking.h"
 #include <cstring>
+#include <stdexcept>
 #include <string>
 
 
@@ -52,17 +53,7 @@ struct Parser
     {
         if (consume_token("len"))
         {
-            if (!consume_text("==") && !consume_text("="))
-            {
-                return error("equal sign ('=')");
-            }
-
-            int len = 0;
-            if (!consume_int(len))
-            {
-                return error("length value");
-            }
-            return Expression::bpf_length(len);
+            return parse_length();
         }
         else
         {
@@ -70,6 +61,8 @@ struct Parser
         }
     }
 
+    Expression parse_length();
+
     Expression parse_bpf_expression();
 
     bool consume_eof()
@@ -144,6 +137,8 @@ struct Parser
 
     bool consume_int(int& result);
 
+    bool consume_length(int& result);
+
     bool consume_uint8(uint8_t& result);
 
     bool consume_ip4(IPv4Address& ip);
@@ -0,0 +1,588 @@
+#ifndef STATICBPF_H
+#define STATICBPF_H
+
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+
+/**
+ * BPF filters that are parsed at compile time.
+ *
+ * parse() is a constexpr parser for the part of the BPF syntax that our fixed
+ * filters use. Filter<T> turns the parsed program T::program into a type like
+ *
+ *   And<Compare<Header::L3, 12, uint32_t, 0xffffffff, 0x0101a8c0>, ...>
+ *
+ * so the header offsets, masks and values are template parameters and match()
+ * inlines to a few loads and compares, without a tree to walk per packet:
+ *
+ *   struct DNS { static constexpr StaticBPF::Program program = StaticBPF::parse("udp dst port 53"); };
+ *   bool is_dns = StaticBPF::Filter<DNS>::match(data, size, l3_offset, l4_offset);
+ *
+ * A syntax error in a constant expression is a compile error (it calls the
+ * non-constexpr fail()). At runtime, parse() throws std::invalid_argument.
+ *
+ * Syntax: ip, tcp, udp, ip src|dst|host A.B.C.D, ip src|dst net A.B.C.D/len,
+ * tcp|udp src|dst port N, tcp|udp port N, not/!, and/&&, or/|| and parentheses.
+ * As in pcap, and and or have the same precedence and group from the left.
+ *
+ * The l3 and l4 offsets come from PacketInfo, like for the other filters. All
+ * primitives are for IPv4: the address and protocol compares are ANDed with a check
+ * of the IP version, so IPv6 and ARP frames don't match them. Unlike in pcap and in
+ * the runtime parser, tcp and udp don't match TCP and UDP over IPv6.
+ */
+namespace StaticBPF {
+
+
+enum class Header : uint8_t
+{
+    L3,
+    L4
+};
+
+
+struct Node
+{
+    enum class Type : uint8_t
+    {
+        True,
+        Compare,
+        And,
+        Or,
+        Not
+    };
+
+    Type mType = Type::True;
+
+    // Compare: (field & mask) == value
+    Header mHeader = Header::L3;
+    uint8_t mSize = 0;      // 1, 2 or 4 bytes
+    uint16_t mOffset = 0;   // from the start of the header
+    uint32_t mMask = 0;     // host byte order
+    uint32_t mValue = 0;    // host byte order, masked
+
+    // And, Or and Not (mLeft only)
+    uint32_t mLeft = 0;
+    uint32_t mRight = 0;
+};
+
+
+struct Program
+{
+    enum : uint32_t { max_nodes = 32 };
+
+    Node mNodes[max_nodes] = {};
+    uint32_t mSize = 0;
+    uint32_t mRoot = 0;
+};
+
+
+[[noreturn]] inline void fail(const char* text, const char* position, const char* expected)
+{
+    throw std::invalid_argument("Invalid BPF filter:\n" + std::string(text) + "\n"
+                                + std::string(position - text, ' ') + "^--- Expected: " + expected);
+}
+
+
+// Filter text built in a constant expression, for a family of similar filters.
+struct Text
+{
+    enum : uint32_t { capacity = 255 };
+
+    constexpr Text& append(const char* text)
+    {
+        while (*text)
+        {
+            push_back(*text++);
+        }
+        return *this;
+    }
+
+    constexpr Text& append_number(uint32_t value)
+    {
+        char digits[10] = {};
+        uint32_t count = 0;
+        do
+        {
+            digits[count++] = '0' + value % 10;
+            value /= 10;
+        }
+        while (value != 0);
+
+        while (count != 0)
+        {
+            push_back(digits[--count]);
+        }
+        return *this;
+    }
+
+    constexpr void push_back(char c)
+    {
+        if (mSize == capacity)
+        {
+            fail(mData, mData + mSize, "shorter filter text");
+        }
+        mData[mSize++] = c;
+    }
+
+    char mData[capacity + 1] = {}; // null terminated
+    uint32_t mSize = 0;
+};
+
+
+class ProgramParser
+{
+public:
+    constexpr ProgramParser(const char* text, uint32_t size) :
+        mOriginal(text),
+        mText(text),
+        mEnd(text + size)
+    {
+    }
+
+    constexpr Program parse()
+    {
+        if (consume_end())
+        {
+            // An empty filter matches everything.
+            mProgram.mRoot = add(Node());
+            return mProgram;
+        }
+
+        mProgram.mRoot = parse_expression();
+
+        if (!consume_end())
+        {
+            fail(mOriginal, mText, "'and', 'or' or end of filter");
+        }
+
+        return mProgram;
+    }
+
+private:
+    constexpr uint32_t parse_expression()
+    {
+        auto result = parse_unary_expression();
+        for (;;)
+        {
+            if (consume_token("and") || consume_text("&&"))
+            {
+                result = add_operator(Node::Type::And, result, parse_unary_expression());
+            }
+            else if (consume_token("or") || consume_text("||"))
+            {
+                result = add_operator(Node::Type::Or, result, parse_unary_expression());
+            }
+            else
+            {
+                return result;
+            }
+        }
+    }
+
+    constexpr uint32_t parse_unary_expression()
+    {
+        if (consume_token("not") || consume_text("!"))
+        {
+            return add_operator(Node::Type::Not, parse_unary_expression(), 0);
+        }
+
+        if (consume_text("("))
+        {
+            auto result = parse_expression();
+            if (!consume_text(")"))
+            {
+                fail(mOriginal, mText, "')'");
+            }
+            return result;
+        }
+
+        return parse_primitive();
+    }
+
+    constexpr uint32_t parse_primitive()
+    {
+        // Offsets in the IPv4 header
+        const uint16_t protocol_offset = 9;
+        const uint16_t src_ip_offset = 12;
+        const uint16_t dst_ip_offset = 16;
+
+        // Offsets in the TCP and UDP headers
+        const uint16_t src_port_offset = 0;
+        const uint16_t dst_port_offset = 2;
+
+        if (consume_token("ip"))
+        {
+            if (consume_token("src"))
+            {
+                return add_operator(Node::Type::And, add_ipv4_check(), parse_ip(src_ip_offset));
+            }
+            else if (consume_token("dst"))
+            {
+                return add_operator(Node::Type::And, add_ipv4_check(), parse_ip(dst_ip_offset));
+            }
+            else if (consume_token("host"))
+            {
+                auto position = mText;
+                auto src = parse_ip(src_ip_offset);
+                mText = position;
+                return add_operator(Node::Type::And, add_ipv4_check(), add_operator(Node::Type::Or, src, parse_ip(dst_ip_offset)));
+            }
+
+            return add_ipv4_check();
+        }
+
+        uint32_t protocol = 0;
+        if (consume_token("tcp"))
+        {
+            protocol = 6;
+        }
+        else if (consume_token("udp"))
+        {
+            protocol = 17;
+        }
+        else
+        {
+            fail(mOriginal, mText, "'ip', 'tcp' or 'udp'");
+        }
+
+        auto protocol_node = add_operator(Node::Type::And, add_ipv4_check(), add_compare(Header::L3, protocol_offset, 1, 0xFF, protocol));
+
+        if (consume_token("src"))
+        {
+            expect_token("port");
+            return add_operator(Node::Type::And, protocol_node, add_compare(Header::L4, src_port_offset, 2, 0xFFFF, parse_number(0xFFFF)));
+        }
+        else if (consume_token("dst"))
+        {
+            expect_token("port");
+            return add_operator(Node::Type::And, protocol_node, add_compare(Header::L4, dst_port_offset, 2, 0xFFFF, parse_number(0xFFFF)));
+        }
+        else if (consume_token("port"))
+        {
+            auto port = parse_number(0xFFFF);
+            auto either = add_operator(Node::Type::Or,
+                                       add_compare(Header::L4, src_port_offset, 2, 0xFFFF, port),
+                                       add_compare(Header::L4, dst_port_offset, 2, 0xFFFF, port));
+            return add_operator(Node::Type::And, protocol_node, either);
+        }
+
+        return protocol_node;
+    }
+
+    // The version is in the upper 4 bits of the first byte.
+    constexpr uint32_t add_ipv4_check()
+    {
+        const uint16_t version_offset = 0;
+        return add_compare(Header::L3, version_offset, 1, 0xF0, 0x40);
+    }
+
+    // A.B.C.D or net A.B.C.D/len
+    constexpr uint32_t parse_ip(uint16_t offset)
+    {
+        auto net = consume_token("net");
+
+        consume_whitespace();
+        uint32_t ip = 0;
+        for (auto i = 0; i != 4; ++i)
+        {
+            if (i != 0 && !consume_text_here("."))
+            {
+                fail(mOriginal, mText, "IPv4 address");
+            }
+            ip = (ip << 8) | parse_number_here(255);
+        }
+
+        uint32_t mask = 0xFFFFFFFF;
+        if (net)
+        {
+            if (!consume_text_here("/"))
+            {
+                fail(mOriginal, mText, "'/' and prefix length");
+            }
+            auto length = parse_number_here(32);
+            mask = length == 0 ? 0 : 0xFFFFFFFF << (32 - length);
+            if ((ip & mask) != ip)
+            {
+                fail(mOriginal, mText, "network address without host bits");
+            }
+        }
+
+        return add_compare(Header::L3, offset, 4, mask, ip);
+    }
+
+    constexpr uint32_t parse_number(uint32_t max)
+    {
+        consume_whitespace();
+        return parse_number_here(max);
+    }
+
+    constexpr uint32_t parse_number_here(uint32_t max)
+    {
+        if (mText == mEnd || !is_digit(*mText))
+        {
+            fail(mOriginal, mText, "number");
+        }
+
+        auto start = mText;
+        uint32_t result = 0;
+        while (mText != mEnd && is_digit(*mText))
+        {
+            result = 10 * result + (*mText++ - '0');
+            if (result > max)
+            {
+                fail(mOriginal, start, "smaller number");
+            }
+        }
+
+        if (mText != mEnd && is_alpha(*mText))
+        {
+            fail(mOriginal, mText, "number");
+        }
+
+        return result;
+    }
+
+    constexpr uint32_t add_compare(Header header, uint16_t offset, uint8_t size, uint32_t mask, uint32_t value)
+    {
+        Node node;
+        node.mType = Node::Type::Compare;
+        node.mHeader = header;
+        node.mOffset = offset;
+        node.mSize = size;
+        node.mMask = mask;
+        node.mValue = value & mask;
+        return add(node);
+    }
+
+    constexpr uint32_t add_operator(Node::Type type, uint32_t left, uint32_t right)
+    {
+        Node node;
+        node.mType = type;
+        node.mLeft = left;
+        node.mRight = right;
+        return add(node);
+    }
+
+    constexpr uint32_t add(const Node& node)
+    {
+        if (mProgram.mSize == Program::max_nodes)
+        {
+            fail(mOriginal, mText, "fewer terms");
+        }
+        mProgram.mNodes[mProgram.mSize] = node;
+        return mProgram.mSize++;
+    }
+
+    constexpr void expect_token(const char* token)
+    {
+        if (!consume_token(token))
+        {
+            fail(mOriginal, mText, token);
+        }
+    }
+
+    constexpr bool consume_end()
+    {
+        consume_whitespace();
+        return mText == mEnd;
+    }
+
+    constexpr void consume_whitespace()
+    {
+        while (mText != mEnd && (*mText == ' ' || *mText == '\t' || *mText == '\n' || *mText == '\r'))
+        {
+            ++mText;
+        }
+    }
+
+    // A word that is not followed by a letter or digit.
+    constexpr bool consume_token(const char* token)
+    {
+        auto backup = mText;
+        if (consume_text(token) && (mText == mEnd || !is_alnum(*mText)))
+        {
+            return true;
+        }
+        mText = backup;
+        return false;
+    }
+
+    constexpr bool consume_text(const char* text)
+    {
+        consume_whitespace();
+        return consume_text_here(text);
+    }
+
+    constexpr bool consume_text_here(const char* text)
+    {
+        auto position = mText;
+        while (*text)
+        {
+            if (position == mEnd || *position != *text)
+            {
+                return false;
+            }
+            ++position;
+            ++text;
+        }
+        mText = position;
+        return true;
+    }
+
+    static constexpr bool is_digit(char c) { return c >= '0' && c <= '9'; }
+    static constexpr bool is_alpha(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+    static constexpr bool is_alnum(char c) { return is_digit(c) || is_alpha(c); }
+
+    const char* mOriginal;
+    const char* mText;
+    const char* mEnd;
+    Program mProgram;
+};
+
+
+constexpr Program parse(const char* text)
+{
+    uint32_t size = 0;
+    while (text[size])
+    {
+        ++size;
+    }
+    return ProgramParser(text, size).parse();
+}
+
+
+constexpr Program parse(const Text& text)
+{
+    return ProgramParser(text.mData, text.mSize).parse();
+}
+
+
+// The value that a load of the field from the packet gives on this machine.
+constexpr uint32_t to_network(uint32_t value, uint32_t size)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return size == 1 ? value
+         : size == 2 ? ((value & 0xFF) << 8) | (value >> 8)
+         : ((value & 0xFF) << 24) | ((value & 0xFF00) << 8) | ((value >> 8) & 0xFF00) | (value >> 24);
+#else
+    return static_cast<void>(size), value;
+#endif
+}
+
+
+template<Header header, uint16_t offset, typename T, T mask, T value>
+struct Compare
+{
+    static bool match(const uint8_t* data, uint32_t /*size*/, uint32_t l3_offset, uint32_t l4_offset)
+    {
+        T field;
+        memcpy(&field, data + (header == Header::L3 ? l3_offset : l4_offset) + offset, sizeof(field));
+        return (field & mask) == value;
+    }
+};
+
+
+template<typename Left, typename Right>
+struct And
+{
+    static bool match(const uint8_t* data, uint32_t size, uint32_t l3_offset, uint32_t l4_offset)
+    {
+        return Left::match(data, size, l3_offset, l4_offset) && Right::match(data, size, l3_offset, l4_offset);
+    }
+};
+
+
+template<typename Left, typename Right>
+struct Or
+{
+    static bool match(const uint8_t* data, uint32_t size, uint32_t l3_offset, uint32_t l4_offset)
+    {
+        return Left::match(data, size, l3_offset, l4_offset) || Right::match(data, size, l3_offset, l4_offset);
+    }
+};
+
+
+template<typename Operand>
+struct Not
+{
+    static bool match(const uint8_t* data, uint32_t size, uint32_t l3_offset, uint32_t l4_offset)
+    {
+        return !Operand::match(data, size, l3_offset, l4_offset);
+    }
+};
+
+
+struct True
+{
+    static bool match(const uint8_t*, uint32_t, uint32_t, uint32_t)
+    {
+        return true;
+    }
+};
+
+
+template<uint32_t size> struct FieldType;
+template<> struct FieldType<1> { using type = uint8_t; };
+template<> struct FieldType<2> { using type = uint16_t; };
+template<> struct FieldType<4> { using type = uint32_t; };
+
+
+// Builds the type of node P::program.mNodes[index].
+template<typename P, uint32_t index, Node::Type = P::program.mNodes[index].mType>
+struct Build;
+
+
+template<typename P, uint32_t index>
+struct Build<P, index, Node::Type::True>
+{
+    using type = True;
+};
+
+
+template<typename P, uint32_t index>
+struct Build<P, index, Node::Type::Compare>
+{
+    using T = typename FieldType<P::program.mNodes[index].mSize>::type;
+
+    using type = Compare<P::program.mNodes[index].mHeader,
+                         P::program.mNodes[index].mOffset,
+                         T,
+                         static_cast<T>(to_network(P::program.mNodes[index].mMask, P::program.mNodes[index].mSize)),
+                         static_cast<T>(to_network(P::program.mNodes[index].mValue, P::program.mNodes[index].mSize))>;
+};
+
+
+template<typename P, uint32_t index>
+struct Build<P, index, Node::Type::And>
+{
+    using type = And<typename Build<P, P::program.mNodes[index].mLeft>::type, typename Build<P, P::program.mNodes[index].mRight>::type>;
+};
+
+
+template<typename P, uint32_t index>
+struct Build<P, index, Node::Type::Or>
+{
+    using type = Or<typename Build<P, P::program.mNodes[index].mLeft>::type, typename Build<P, P::program.mNodes[index].mRight>::type>;
+};
+
+
+template<typename P, uint32_t index>
+struct Build<P, index, Node::Type::Not>
+{
+    using type = Not<typename Build<P, P::program.mNodes[index].mLeft>::type>;
+};
+
+
+// P has a static constexpr Program member named program.
+template<typename P>
+using Filter = typename Build<P, P::program.mRoot>::type;
+
+
+} // namespace StaticBPF
+
+
+#endif // STATICBPF_H
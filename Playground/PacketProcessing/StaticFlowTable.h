@@ -0,0 +1,177 @@
+#ifndef STATICFLOWTABLE_H
+#define STATICFLOWTABLE_H
+
+
+#include "BPFFilter.h"
+#include "Networking.h"
+#include "StaticBPF.h"
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+
+/**
+ * Flow table of compile-time filters (StaticBPF), for the simple.cpp benchmark.
+ *
+ * The filters must exist when the program is compiled, so they can't come from
+ * add_flow. The table has the filters of the flows that the benchmark creates:
+ * flow i has the text of generate_bpf_filter_string for TCP from 192.168.1.1 to
+ * 192.168.1.2 with the ports 1001 + i and 2001 + i, built and parsed at compile
+ * time. add_flow only looks up the filter of the flow and checks that its text is
+ * the one that the runtime parsers get.
+ *
+ * For 1, 2, 4, ... 256 flows, match is one function with the filters of all flows
+ * inlined. Other flow counts call the filter of each flow through a function pointer.
+ */
+struct StaticFlowTable
+{
+    enum : uint32_t
+    {
+        max_flows = 256,
+        first_src_port = 1001,
+        first_dst_port = 2001,
+        no_flow = 0xFFFF
+    };
+
+    static constexpr StaticBPF::Text get_filter_text(uint32_t program)
+    {
+        StaticBPF::Text text;
+        text.append("ip src 192.168.1.1 && ip dst 192.168.1.2 && tcp src port ").append_number(first_src_port + program)
+            .append(" && tcp dst port ").append_number(first_dst_port + program);
+        return text;
+    }
+
+    template<uint32_t index>
+    struct FlowProgram
+    {
+        static constexpr StaticBPF::Program program = StaticBPF::parse(get_filter_text(index));
+    };
+
+    template<uint32_t index>
+    using FlowFilter = StaticBPF::Filter<FlowProgram<index>>;
+
+    StaticFlowTable()
+    {
+        mFlowIndexes.fill(no_flow);
+    }
+
+    void reserve(uint32_t num_flows)
+    {
+        mPrograms.reserve(num_flows);
+    }
+
+    void add_flow(ProtocolId protocol, IPv4Address src_ip, IPv4Address dst_ip, uint16_t src_port, uint16_t dst_port)
+    {
+        auto text = BPFFilter::generate_bpf_filter_string(protocol, src_ip, dst_ip, src_port, dst_port);
+
+        uint32_t program = src_port - first_src_port;
+        if (program >= max_flows || text != get_filter_text(program).mData || mFlowIndexes[program] != no_flow)
+        {
+            throw std::invalid_argument("StaticFlowTable has no compiled filter for: " + text);
+        }
+
+        mFlowIndexes[program] = mPrograms.size();
+        mPrograms.push_back(program);
+        mMatchAll = get_match_all();
+    }
+
+    uint32_t size() const
+    {
+        return mPrograms.size();
+    }
+
+    // Increments matches[flow_index] for every matching flow.
+    void match(const uint8_t* data, uint32_t len, uint32_t l3_offset, uint32_t l4_offset, uint64_t* matches) const
+    {
+        if (mMatchAll)
+        {
+            mMatchAll(data, len, l3_offset, l4_offset, mFlowIndexes.data(), matches);
+            return;
+        }
+
+        const auto& filters = get_filters();
+        for (auto flow_index = 0u; flow_index != mPrograms.size(); ++flow_index)
+        {
+            if (filters[mPrograms[flow_index]](data, len, l3_offset, l4_offset))
+            {
+                matches[flow_index]++;
+            }
+        }
+    }
+
+private:
+    using MatchFunction = bool (*)(const uint8_t*, uint32_t, uint32_t, uint32_t);
+    using MatchAllFunction = void (*)(const uint8_t*, uint32_t, uint32_t, uint32_t, const uint16_t*, uint64_t*);
+
+    template<std::size_t... programs>
+    static std::array<MatchFunction, sizeof...(programs)> get_filters(std::index_sequence<programs...>)
+    {
+        return {{ &FlowFilter<programs>::match... }};
+    }
+
+    static const std::array<MatchFunction, max_flows>& get_filters()
+    {
+        static const auto result = get_filters(std::make_index_sequence<max_flows>());
+        return result;
+    }
+
+    // Only stores on a match: a store through matches could change the packet data
+    // for the compiler, so the header fields would be loaded again for each flow.
+    template<uint32_t program>
+    static void count(const uint8_t* data, uint32_t len, uint32_t l3_offset, uint32_t l4_offset, const uint16_t* flow_indexes, uint64_t* matches)
+    {
+        if (FlowFilter<program>::match(data, len, l3_offset, l4_offset))
+        {
+            matches[flow_indexes[program]]++;
+        }
+    }
+
+    // The programs [0, num_programs), flow_indexes maps them to the flows.
+    // flatten: GCC stops inlining the filters after about 100 flows otherwise.
+    template<std::size_t... programs>
+    __attribute__((flatten)) static void match_all(const uint8_t* data, uint32_t len, uint32_t l3_offset, uint32_t l4_offset, const uint16_t* flow_indexes, uint64_t* matches, std::index_sequence<programs...>)
+    {
+        using expand = int[];
+        (void)expand{ 0, (count<programs>(data, len, l3_offset, l4_offset, flow_indexes, matches), 0)... };
+    }
+
+    template<uint32_t num_programs>
+    static void match_all(const uint8_t* data, uint32_t len, uint32_t l3_offset, uint32_t l4_offset, const uint16_t* flow_indexes, uint64_t* matches)
+    {
+        match_all(data, len, l3_offset, l4_offset, flow_indexes, matches, std::make_index_sequence<num_programs>());
+    }
+
+    MatchAllFunction get_match_all() const
+    {
+        for (auto program : mPrograms)
+        {
+            if (program >= mPrograms.size())
+            {
+                return nullptr;
+            }
+        }
+
+        switch (mPrograms.size())
+        {
+            case 1: return &match_all<1>;
+            case 2: return &match_all<2>;
+            case 4: return &match_all<4>;
+            case 8: return &match_all<8>;
+            case 16: return &match_all<16>;
+            case 32: return &match_all<32>;
+            case 64: return &match_all<64>;
+            case 128: return &match_all<128>;
+            case 256: return &match_all<256>;
+            default: return nullptr;
+        }
+    }
+
+    std::vector<uint16_t> mPrograms; // by flow index
+    std::array<uint16_t, max_flows> mFlowIndexes; // by program
+    MatchAllFunction mMatchAll = nullptr;
+};
+
+
+#endif // STATICFLOWTABLE_H
@@ -16,11 +16,10 @@ struct VectorFilter
 {
     VectorFilter(ProtocolId protocol, IPv4Address src_ip, IPv4Address dst_ip, uint16_t src_port, uint16_t dst_port);
 
-    bool match(const uint8_t* packet_data, uint32_t /*len*/, uint32_t /*l3_offset*/, uint32_t l4_offset) const
+    bool match(const uint8_t* packet_data, uint32_t /*len*/, uint32_t l3_offset, uint32_t l4_offset) const
     {
-        const auto offset = l4_offset + sizeof(uint16_t) + sizeof(uint16_t) - sizeof(std::array<uint64_t, 2>);
         Vec4ui item;
-        item.load(packet_data + offset);
+        item.load(DecodeFiveTuple<std::array<uint32_t, 4>>(packet_data, l3_offset, l4_offset).data());
 
         return !vec::horizontal_or(field_ ^ (item & static_mask_));
 
@@ -0,0 +1,136 @@
+#include "VectorFlowTable.h"
+#include "vectorclass/instrset.h"
+#if INSTRSET >= 9 && MAX_VECTOR_SIZE < 512
+#error "VectorFlowTable needs MAX_VECTOR_SIZE 512, include its header before the vectorclass headers."
+#endif
+#if INSTRSET >= 9
+#include "vectorclass/vectori512.h"
+#elif INSTRSET >= 8
+#include "vectorclass/vectori256.h"
+#else
+#include "vectorclass/vectori256e.h"
+#endif
+
+
+using namespace vec;
+
+
+namespace {
+
+
+// Value for the unused lanes of the last block. It has bits set outside
+// of the mask so it never equals the masked header word of a packet.
+const uint32_t padding_value = 0xFFFFFFFF;
+
+
+} // namespace
+
+
+void VectorFlowTable::reserve(uint32_t num_flows)
+{
+    for (auto& field : mFields)
+    {
+        field.reserve(num_flows + block_size);
+    }
+}
+
+
+void VectorFlowTable::add_flow(ProtocolId protocol, IPv4Address src_ip, IPv4Address dst_ip, uint16_t src_port, uint16_t dst_port)
+{
+    // Composite of IPv4 + TCP/UDP header fields from TTL to DestinationPort.
+    struct TransportHeader
+    {
+        uint8_t ttl;
+        ProtocolId protocol;
+        uint16_t checksum;
+        IPv4Address src_ip;
+        IPv4Address dst_ip;
+        Net16 src_port;
+        Net16 dst_port;
+    };
+
+    auto h = TransportHeader();
+    h.protocol = protocol;
+    h.src_ip = src_ip;
+    h.dst_ip = dst_ip;
+    h.src_port = Net16(src_port);
+    h.dst_port = Net16(dst_port);
+
+    static_assert(sizeof(Words) == sizeof(h), "");
+
+    Words words;
+    memcpy(words.data(), &h, sizeof(words));
+
+    if (mSize % block_size == 0)
+    {
+        for (auto& field : mFields)
+        {
+            field.resize(field.size() + block_size, padding_value);
+        }
+    }
+
+    for (auto i = 0u; i != words.size(); ++i)
+    {
+        mFields[i][mSize] = words[i] & static_mask[i];
+    }
+
+    mSize++;
+}
+
+
+uint32_t VectorFlowTable::match_block(const Words& words, uint32_t block) const
+{
+    const auto i = block * block_size;
+
+#if INSTRSET >= 9
+    auto eq = (Vec16ui().load(&mFields[0][i]) == Vec16ui(words[0]))
+            & (Vec16ui().load(&mFields[1][i]) == Vec16ui(words[1]))
+            & (Vec16ui().load(&mFields[2][i]) == Vec16ui(words[2]))
+            & (Vec16ui().load(&mFields[3][i]) == Vec16ui(words[3]));
+    return to_bits(eq);
+#else
+    auto eq_lo = (Vec8ui().load(&mFields[0][i]) == Vec8ui(words[0]))
+               & (Vec8ui().load(&mFields[1][i]) == Vec8ui(words[1]))
+               & (Vec8ui().load(&mFields[2][i]) == Vec8ui(words[2]))
+               & (Vec8ui().load(&mFields[3][i]) == Vec8ui(words[3]));
+    auto eq_hi = (Vec8ui().load(&mFields[0][i + 8]) == Vec8ui(words[0]))
+               & (Vec8ui().load(&mFields[1][i + 8]) == Vec8ui(words[1]))
+               & (Vec8ui().load(&mFields[2][i + 8]) == Vec8ui(words[2]))
+               & (Vec8ui().load(&mFields[3][i + 8]) == Vec8ui(words[3]));
+    return to_bits(eq_lo) | (uint32_t(to_bits(eq_hi)) << 8);
+#endif
+}
+
+
+void VectorFlowTable::match(const uint8_t* packet_data, uint32_t /*len*/, uint32_t l3_offset, uint32_t l4_offset, uint64_t* matches) const
+{
+    const auto words = get_words(packet_data, l3_offset, l4_offset);
+
+    for (auto block = 0u, end = num_blocks(); block != end; ++block)
+    {
+        auto bits = match_block(words, block);
+        while (bits)
+        {
+            matches[block * block_size + __builtin_ctz(bits)]++;
+            bits &= bits - 1;
+        }
+    }
+}
+
+
+VectorFlowTable::Words VectorFlowTable::GetMask()
+{
+    static const uint8_t mask_bytes[16] = {
+        0x00, 0xff, 0x00, 0x00, // ttl, protocol and checksum
+        0xff, 0xff, 0xff, 0xff, // source ip
+        0xff, 0xff, 0xff, 0xff, // destination ip
+        0xff, 0xff, 0xff, 0xff  // source and destination ports
+    };
+
+    Words result;
+    memcpy(result.data(), &mask_bytes[0], sizeof(result));
+    return result;
+}
+
+
+VectorFlowTable::Words VectorFlowTable::static_mask = VectorFlowTable::GetMask();
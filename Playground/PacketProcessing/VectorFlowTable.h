@@ -0,0 +1,68 @@
+#ifndef VECTORFLOWTABLE_H
+#define VECTORFLOWTABLE_H
+
+
+#include "Networking.h"
+#include <array>
+#include <cstdint>
+#include <vector>
+
+
+// A block of flows is one 512-bit vector of 32-bit words, which the vectorclass
+// headers only provide if this is defined before they are included. So include
+// this header first; other translation units only use vectori128.h.
+#ifndef MAX_VECTOR_SIZE
+#define MAX_VECTOR_SIZE 512
+#endif
+
+
+/**
+ * Matches a packet against many flows at once.
+ *
+ * Each flow is stored as the same 16-byte masked IPv4 + TCP/UDP header fields
+ * that VectorFilter uses, but in structure-of-arrays layout: mFields[i] holds
+ * the i-th 32-bit word of all flows. A packet is compared against a block of 16
+ * flows with one Vec16ui compare per word (AVX-512) or two Vec8ui compares (AVX2).
+ */
+struct VectorFlowTable
+{
+    enum : uint32_t { block_size = 512 / 32 };
+
+    using Words = std::array<uint32_t, 4>;
+
+    void reserve(uint32_t num_flows);
+
+    void add_flow(ProtocolId protocol, IPv4Address src_ip, IPv4Address dst_ip, uint16_t src_port, uint16_t dst_port);
+
+    uint32_t size() const { return mSize; }
+
+    uint32_t num_blocks() const { return mFields[0].size() / block_size; }
+
+    // Extracts the masked header words from the packet.
+    static Words get_words(const uint8_t* packet_data, uint32_t l3_offset, uint32_t l4_offset)
+    {
+        auto result = DecodeFiveTuple<Words>(packet_data, l3_offset, l4_offset);
+        for (auto i = 0u; i != result.size(); ++i)
+        {
+            result[i] &= static_mask[i];
+        }
+        return result;
+    }
+
+    // Returns the match bitmask for the flows [block * block_size, (block + 1) * block_size).
+    uint32_t match_block(const Words& words, uint32_t block) const;
+
+    // Increments matches[flow_index] for every matching flow.
+    void match(const uint8_t* packet_data, uint32_t len, uint32_t l3_offset, uint32_t l4_offset, uint64_t* matches) const;
+
+private:
+    static Words GetMask();
+
+    static Words static_mask;
+
+    std::array<std::vector<uint32_t>, 4> mFields;
+    uint32_t mSize = 0;
+};
+
+
+#endif // VECTORFLOWTABLE_H
@@ -11,11 +11,15 @@
 #include "Networking.h"
 #include "NativeFilter.h"
 #include "Packet.h"
+#include "PacketInfo.h"
 #include "VectorFilter.h"
+#include "VectorFlowTable.h"
 #include "BPFFilter.h"
+#include "JITBPFFilter.h"
 #include "MaskFilter.h"
 #include "ParsedFilter.h"
 #include "PCAPWriter.h"
+#include "StaticFlowTable.h"
 #include <iomanip>
 #include <iostream>
 #include <vector>
@@ -40,8 +44,57 @@ private:
 };
 
 
+// Checks the packet against the filter of each flow one by one.
+template<typename FilterType>
+struct FlowTable
+{
+    void reserve(uint32_t num_flows)
+    {
+        mFlows.reserve(num_flows);
+    }
+
+    void add_flow(ProtocolId protocol, IPv4Address source_ip, IPv4Address target_ip, uint16_t src_port, uint16_t dst_port)
+    {
+        mFlows.push_back(Flow<FilterType>(protocol, source_ip, target_ip, src_port, dst_port));
+    }
+
+    uint32_t size() const
+    {
+        return mFlows.size();
+    }
+
+    void match(const uint8_t* frame_bytes, int len, uint32_t l3_offset, uint32_t l4_offset, uint64_t* matches) const
+    {
+        for (auto flow_index = 0ul; flow_index != mFlows.size(); ++flow_index)
+        {
+            if (mFlows[flow_index].match(frame_bytes, len, l3_offset, l4_offset))
+            {
+                matches[flow_index]++;
+            }
+        }
+    }
+
+private:
+    std::vector<Flow<FilterType>> mFlows;
+};
+
+
+// VectorFlowTable checks the packet against all flows at once.
+template<>
+struct FlowTable<VectorFlowTable> : VectorFlowTable
+{
+};
+
+
+// StaticFlowTable has the compile-time filters of the flows.
+template<>
+struct FlowTable<StaticFlowTable> : StaticFlowTable
+{
+};
+
+
 template<typename FilterType, uint32_t prefetch>
-void test(const std::vector<Packet>& packets, std::vector<Flow<FilterType>>& flows, uint32_t l3_offset, uint32_t l4_offset, uint64_t* const matches)
+void test(const std::vector<Packet>& packets, const FlowTable<FilterType>& flows, uint64_t* const matches)
 {
     const uint32_t num_flows = flows.size();
     const auto start_time = Clock::now();
@@ -54,17 +107,19 @@ void test(const std::vector<Packet>& packets, std::vector<Flow<FilterType>>& flo
 
         if (prefetch)
         {
-            __builtin_prefetch((&packet + prefetch)->data() + l4_offset, 0, 0);
+            __builtin_prefetch((&packet + prefetch)->data(), 0, 0);
         }
 
-        for (auto flow_index = 0ul; flow_index != num_flows; ++flow_index)
+        // Parse the headers once, all flows use the offsets. The filters read the L4
+        // header, so packets without one match no flow.
+        const PacketInfo info(packet.data(), packet.size());
+        if (!info.is_ipv4_tcp_or_udp())
         {
-            comparisons++;
-            if (flows[flow_index].match(packet.data(), packet.size(), l3_offset, l4_offset))
-            {
-                matches[flow_index]++;
-            }
+            continue;
         }
+
+        comparisons += num_flows;
+        flows.match(packet.data(), packet.size(), info.mL3Offset, info.mL4Offset, matches);
     }
 
     auto elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start_time).count();
@@ -104,12 +159,9 @@ void do_run(uint32_t num_packets, uint32_t num_flows)
     std::vector<Packet> packets;
     packets.reserve(num_packets);
 
-    std::vector<Flow<FilterType>> flows;
+    FlowTable<FilterType> flows;
     flows.reserve(num_flows);
 
-    auto l3_offset = sizeof(EthernetHeader);
-    auto l4_offset = l3_offset + sizeof(IPv4Header);
-
     for (auto i = 1ul; i <= num_packets; ++i)
     {
         IPv4Address src_ip(192, 168, 1, 1);
@@ -125,11 +177,11 @@ void do_run(uint32_t num_packets, uint32_t num_flows)
         IPv4Address dst_ip(192, 168, 1, 2);
         uint16_t src_port = 1001 + i % num_flows;
         uint16_t dst_port = 2001 + i % num_flows;
-        flows.push_back(Flow<FilterType>(ProtocolId::TCP, src_ip, dst_ip, src_port, dst_port));
+        flows.add_flow(ProtocolId::TCP, src_ip, dst_ip, src_port, dst_port);
     }
 
     std::vector<uint64_t> matches(num_flows);
-    test_udp_payload<FilterType, prefetch>(packets, flows, l3_offset, l4_offset, matches.data());
+    test<FilterType, prefetch>(packets, flows, matches.data());
     std::cout << std::endl;
 
 }
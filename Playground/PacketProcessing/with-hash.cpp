@@ -8,19 +8,23 @@
 #endif
 
 #include "Utils.h"
+#include "CuckooFlowTable.h"
 #include "Networking.h"
 #include "NativeFilter.h"
 #include "VectorFilter.h"
 #include "BPFFilter.h"
+#include "JITBPFFilter.h"
 #include "MaskFilter.h"
 #include "ParsedFilter.h"
 #include "Packet.h"
+#include "PacketInfo.h"
 #include "PCAPWriter.h"
 #include <boost/functional/hash.hpp>
 #include <algorithm>
 #include <iomanip>
 #include <iostream>
 #include <vector>
+#include <x86intrin.h>
 
 
 template<typename FilterType>
@@ -85,8 +89,18 @@ private:
 };
 
 
-struct Flows
+// Hash table with 2048 buckets that each hold a list of flow indexes.
+struct ChainedFlows
 {
+    // Flow indexes are stored as uint16_t.
+    static const uint32_t max_flows = 65536;
+
+    static const char* name() { return "chained"; }
+
+    explicit ChainedFlows(uint32_t /*expected_flows*/)
+    {
+    }
+
     bool empty()
     {
         return mFlows.empty();
@@ -121,7 +135,7 @@ struct Flows
 
     void print()
     {
-        std::cout << " " << mUsedBuckets << "/" << mSharedBuckets << "/" << mOverflowingBuckets << std::endl;
+        std::cout << " BUCKETS(perfect/shared/overflowing)=" << mUsedBuckets << "/" << mSharedBuckets << "/" << mOverflowingBuckets;
     }
 
     std::size_t size() const
@@ -131,10 +145,14 @@ struct Flows
 
     void match(const Packet& packet, uint64_t* matches)
     {
-		const auto l3_offset = sizeof(EthernetHeader);
-		const auto l4_offset = l3_offset + sizeof(IPv4Header);
-        auto ip4_header = Decode<IPv4Header>(packet.data() + sizeof(EthernetHeader));
-        auto tcp_header = Decode<TCPHeader>(packet.data() + sizeof(EthernetHeader) + sizeof(IPv4Header));
+        const PacketInfo info(packet.data(), packet.size());
+        if (!info.is_ipv4_tcp_or_udp())
+        {
+            return;
+        }
+
+        auto ip4_header = Decode<IPv4Header>(packet.data() + info.mL3Offset);
+        auto tcp_header = Decode<TCPHeader>(packet.data() + info.mL4Offset);
 
         std::size_t packet_hash = 0;
         boost::hash_combine(packet_hash, ip4_header.mProtocol);
@@ -146,9 +164,9 @@ struct Flows
         auto bucket_index = packet_hash % mHashTable.size();
 
         Bucket& flow_indexes = mHashTable[bucket_index];
-        for (const uint32_t& flow_index : flow_indexes)
+        for (uint32_t flow_index : flow_indexes)
         {
-            if (mFlows[flow_index].match(packet.data(), packet.size(), l3_offset, l4_offset))
+            if (mFlows[flow_index].match(packet.data(), packet.size(), info.mL3Offset, info.mL4Offset))
             {
                 matches[flow_index]++;
                 break;
@@ -156,6 +174,14 @@ struct Flows
         }
     }
 
+    void match_batch(const Packet* packets, uint32_t num_packets, uint64_t* matches)
+    {
+        for (auto i = 0u; i != num_packets; ++i)
+        {
+            match(packets[i], matches);
+        }
+    }
+
     std::vector<Flow> mFlows;
 
     static_assert(sizeof(Bucket) == 32, "");
@@ -167,36 +193,124 @@ struct Flows
 };
 
 
-template<uint32_t prefetch>
-void run3(std::vector<Packet>& packets, Flows& flows, uint64_t* const matches)
+// Flows are found through a CuckooFlowTable. The buckets of a whole batch of
+// packets are prefetched before the first lookup of the batch.
+struct CuckooFlows
+{
+    static const uint32_t max_flows = uint32_t(-1);
+
+    static const char* name() { return "cuckoo"; }
+
+    explicit CuckooFlows(uint32_t expected_flows) :
+        mTable(expected_flows)
+    {
+        mFlows.reserve(expected_flows);
+    }
+
+    void add_flow(ProtocolId protocol, IPv4Address source_ip, IPv4Address target_ip, uint16_t src_port, uint16_t dst_port)
+    {
+        auto flow_index = mFlows.size();
+        mFlows.emplace_back(protocol, source_ip, target_ip, src_port, dst_port);
+
+        // A duplicate flow keeps its index but never matches, like in a linear search
+        // where the first flow wins.
+        Packet packet(protocol, source_ip, target_ip, src_port, dst_port);
+        PacketInfo info(packet.data(), packet.size());
+        mTable.insert(FlowKey::Create(protocol, source_ip, target_ip, src_port, dst_port).hash(), flow_index, [&](uint32_t candidate) {
+            return mFlows[candidate].match(packet.data(), packet.size(), info.mL3Offset, info.mL4Offset);
+        });
+    }
+
+    void print()
+    {
+        std::cout << " BUCKETS=" << mTable.num_buckets() << " LOAD=" << int(0.5 + 100 * mTable.load_factor()) << "%";
+    }
+
+    std::size_t size() const
+    {
+        return mFlows.size();
+    }
+
+    void match_batch(const Packet* packets, uint32_t num_packets, uint64_t* matches)
+    {
+        PacketInfo infos[batch_size];
+        uint64_t hashes[batch_size];
+
+        for (auto i = 0u; i != num_packets; ++i)
+        {
+            infos[i] = PacketInfo(packets[i].data(), packets[i].size());
+            if (infos[i].is_ipv4_tcp_or_udp())
+            {
+                hashes[i] = FlowKey::Decode(packets[i].data(), infos[i].mL3Offset, infos[i].mL4Offset).hash();
+                mTable.prefetch(hashes[i]);
+            }
+        }
+
+        for (auto i = 0u; i != num_packets; ++i)
+        {
+            const Packet& packet = packets[i];
+            if (!infos[i].is_ipv4_tcp_or_udp())
+            {
+                continue;
+            }
+
+            auto flow_index = mTable.find(hashes[i], [&](uint32_t candidate) {
+                return mFlows[candidate].match(packet.data(), packet.size(), infos[i].mL3Offset, infos[i].mL4Offset);
+            });
+
+            if (flow_index != CuckooFlowTable::not_found)
+            {
+                matches[flow_index]++;
+            }
+        }
+    }
+
+    static const uint32_t batch_size = 16;
+
+    std::vector<Flow> mFlows;
+    CuckooFlowTable mTable;
+};
+
+
+template<uint32_t prefetch, typename FlowsType>
+void run3(std::vector<Packet>& packets, FlowsType& flows, uint64_t* const matches)
 {
     const uint32_t num_flows = flows.size();
     const uint32_t num_packets = packets.size();
+    const uint32_t batch_size = CuckooFlows::batch_size;
     const auto start_time = Clock::now();
+    const auto start_cycles = __rdtsc();
 
-    for (auto i = 0ul; i != num_packets; ++i)
+    for (auto i = 0ul; i < num_packets; i += batch_size)
     {
-        Packet& packet = packets[i];
+        const auto n = std::min(batch_size, num_packets - uint32_t(i));
 
         if (prefetch > 0)
         {
-            __builtin_prefetch(packets[i + prefetch].data() + sizeof(EthernetHeader) + sizeof(IPv4Header), 0, 0);
+            for (auto j = i + prefetch; j < std::min(i + prefetch + n, 1ul * num_packets); ++j)
+            {
+                __builtin_prefetch(packets[j].data() + sizeof(EthernetHeader) + sizeof(IPv4Header), 0, 0);
+            }
         }
 
-        flows.match(packet, matches);
+        flows.match_batch(&packets[i], n, matches);
     }
 
-
+    auto elapsed_cycles = __rdtsc() - start_cycles;
     auto elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start_time).count();
     auto ns_per_packet = 1.0 * elapsed_ns / num_packets;
     auto mpps = (1e9 / ns_per_packet) / 1e6;
     auto mpps_rounded = int(0.5 + 100 * mpps)/100.0;
+    auto cycles_per_lookup = int(0.5 + 10.0 * elapsed_cycles / num_packets) / 10.0;
 
     std::cout << std::setw(12) << std::left << GetTypeName<FILTERTYPE>()
+            << " " << std::setw(7) << std::left << flows.name()
             << " PREFETCH=" << prefetch
-            << " FLOWS=" << std::setw(5) << std::left << num_flows
+            << " FLOWS=" << std::setw(7) << std::left << num_flows
             << " MPPS=" << std::setw(9) << std::left << mpps_rounded
-            << " BUCKETS(perfect/shared/overflowing)=" << flows.mUsedBuckets << "/" << flows.mSharedBuckets << "/" << flows.mOverflowingBuckets;
+            << " CYCLES/LOOKUP=" << std::setw(7) << std::left << cycles_per_lookup;
+
+    flows.print();
 
     #if 1
     std::cout << " (verify-matches:";
@@ -216,35 +330,39 @@ void run3(std::vector<Packet>& packets, Flows& flows, uint64_t* const matches)
 
 
 
-template<int prefetch>
-void do_run(uint32_t num_packets, uint32_t num_flows)
+// Flow number i gets a unique 5-tuple for up to 16M flows.
+void get_flow(uint32_t i, IPv4Address& src_ip, IPv4Address& dst_ip, uint16_t& src_port, uint16_t& dst_port)
 {
-    std::vector<Packet> packets;
-    packets.reserve(num_packets);
-
-    Flows flows;
-    flows.mFlows.reserve(num_flows);
-
-    const IPv4Address src_ip(192, 168, 1, 1);
-    const IPv4Address dst_ip(192, 168, 1, 2);
+    src_ip = IPv4Address(10, (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+    dst_ip = IPv4Address(192, 168, 1, 2);
+    src_port = 1001 + i % 1024;
+    dst_port = 2001;
+}
 
 
-    for (auto i = 1ul; i <= num_packets; ++i)
+template<int prefetch, typename FlowsType>
+void do_run(std::vector<Packet>& packets, uint32_t num_flows)
+{
+    if (num_flows > FlowsType::max_flows)
     {
-        uint16_t src_port = 1001 + i % num_flows;
-        uint16_t dst_port = 2001 + i % num_flows;
-        packets.emplace_back(ProtocolId::TCP, src_ip, dst_ip, src_port, dst_port);
+        std::cout << std::setw(12) << std::left << GetTypeName<FILTERTYPE>()
+                  << " " << std::setw(7) << std::left << FlowsType::name()
+                  << " PREFETCH=" << prefetch
+                  << " FLOWS=" << std::setw(7) << std::left << num_flows
+                  << " (not supported)" << std::endl;
+        return;
     }
 
-    for (auto i = 1ul; i <= num_flows; ++i)
+    FlowsType flows(num_flows);
+
+    for (auto i = 0u; i != num_flows; ++i)
     {
-        uint16_t src_port = 1001 + i % num_flows;
-        uint16_t dst_port = 2001 + i % num_flows;
+        IPv4Address src_ip, dst_ip;
+        uint16_t src_port, dst_port;
+        get_flow(i, src_ip, dst_ip, src_port, dst_port);
         flows.add_flow(ProtocolId::TCP, src_ip, dst_ip, src_port, dst_port);
     }
 
-    std::random_shuffle(packets.begin(), packets.end());
-
     std::vector<uint64_t> matches(num_flows);
     run3<prefetch>(packets, flows, matches.data());
 
@@ -252,9 +370,30 @@ void do_run(uint32_t num_packets, uint32_t num_flows)
 }
 
 
+template<int prefetch>
+void do_run(uint32_t num_packets, uint32_t num_flows)
+{
+    std::vector<Packet> packets;
+    packets.reserve(num_packets);
+
+    for (auto i = 0u; i != num_packets; ++i)
+    {
+        IPv4Address src_ip, dst_ip;
+        uint16_t src_port, dst_port;
+        get_flow(i % num_flows, src_ip, dst_ip, src_port, dst_port);
+        packets.emplace_back(ProtocolId::TCP, src_ip, dst_ip, src_port, dst_port);
+    }
+
+    std::random_shuffle(packets.begin(), packets.end());
+
+    do_run<prefetch, ChainedFlows>(packets, num_flows);
+    do_run<prefetch, CuckooFlows>(packets, num_flows);
+}
+
+
 void run(uint32_t num_packets = 500 * 1000)
 {
-    int flow_counts[] = { 1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768 };
+    int flow_counts[] = { 1, 16, 256, 1024, 4096, 16384, 65536, 262144, 1048576 };
 
     for (auto flow_count : flow_counts)
     {